@@ -1,821 +1,4530 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <arpa/inet.h>
-#include <sys/stat.h>
-#include <libgen.h>
-#include <limits.h>
-#include <signal.h>
-#include <errno.h>
-#include <stdint.h>  // For uint64_t
-#include <endian.h>  // For htobe64 and be64toh
-#include <sys/time.h> // For timeout
-
-#define BUFFER_SIZE 8192
-
-// Global flag to control server shutdown
-static volatile sig_atomic_t keep_running = 1;
-// Server socket descriptor
-static int server_sock = -1;
-// Port numbers for S2, S3, S4 servers
-static int PORT_S2, PORT_S3, PORT_S4;
-
-// Signal handler for graceful shutdown
-void signal_handler(int sig) {
-    keep_running = 0;
-    if (server_sock != -1) close(server_sock);
-}
-
-// Function prototypes
-void prcclient(int client_sock);
-int connect_to_server(int port);
-void transfer_file_to_server(const char *filename, const char *dest_path, int server_port, int client_sock);
-void download_file_from_server(const char *filepath, int server_port, int client_sock);
-void create_directories(const char *path);
-int receive_full(int sock, char *buffer, size_t size);
-
-int main(int argc, char *argv[]) {
-    // Validate command-line arguments
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s <S1_port> <S2_port> <S3_port> <S4_port>\n", argv[0]);
-        return 1;
-    }
-
-    // Parse port numbers
-    int PORT_S1 = atoi(argv[1]);
-    PORT_S2 = atoi(argv[2]);
-    PORT_S3 = atoi(argv[3]);
-    PORT_S4 = atoi(argv[4]);
-
-    // Validate port range
-    if (PORT_S1 < 1024 || PORT_S1 > 65535 || 
-        PORT_S2 < 1024 || PORT_S2 > 65535 || 
-        PORT_S3 < 1024 || PORT_S3 > 65535 || 
-        PORT_S4 < 1024 || PORT_S4 > 65535) {
-        fprintf(stderr, "Error: Ports must be between 1024 and 65535\n");
-        return 1;
-    }
-
-    // Ensure unique ports
-    if (PORT_S1 == PORT_S2 || PORT_S1 == PORT_S3 || PORT_S1 == PORT_S4 ||
-        PORT_S2 == PORT_S3 || PORT_S2 == PORT_S4 || PORT_S3 == PORT_S4) {
-        fprintf(stderr, "Error: All ports must be unique\n");
-        return 1;
-    }
-
-    // Initialize server and client address structures
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    // Set up signal handler for SIGINT
-    struct sigaction sa = {.sa_handler = signal_handler, .sa_flags = SA_RESTART};
-    sigemptyset(&sa.sa_mask);
-    sigaction(SIGINT, &sa, NULL);
-
-    // Create server socket
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    int opt = 1;
-    // Allow socket reuse
-    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT_S1);
-
-    // Bind socket to address
-    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        close(server_sock);
-        return 1;
-    }
-    // Listen for incoming connections
-    listen(server_sock, 5);
-    printf("S1 listening on port %d...\n", PORT_S1);
-
-    // Main server loop
-    while (keep_running) {
-        // Accept client connection
-        int client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &addr_len);
-        if (client_sock < 0) {
-            if (!keep_running) break;
-            continue;
-        }
-        // Fork to handle client
-        pid_t pid = fork();
-        if (pid == 0) {
-            // Child process
-            close(server_sock);
-            prcclient(client_sock);
-            close(client_sock);
-            exit(0);
-        }
-        // Parent process
-        close(client_sock);
-        // Reap terminated children
-        while (waitpid(-1, NULL, WNOHANG) > 0);
-    }
-    close(server_sock);
-    return 0;
-}
-
-// Process client commands
-void prcclient(int client_sock) {
-    char buffer[BUFFER_SIZE];
-    while (1) {
-        // Receive client command
-        ssize_t received = recv(client_sock, buffer, BUFFER_SIZE - 1, 0);
-        if (received <= 0) return;
-        buffer[received] = '\0';
-
-        // Parse command and parameters
-        char command[20], param1[256] = {0};
-        sscanf(buffer, "%s %[^\n]", command, param1);
-
-        if (strcmp(command, "uploadf") == 0) {
-            printf("S1: Received uploadf command: %s\n", buffer);
-            char filename[256], dest_path[PATH_MAX];
-            sscanf(buffer, "%*s %s %s", filename, dest_path);
-
-            // Validate destination path
-            if (strncmp(dest_path, "~S1/", 4) != 0) {
-                send(client_sock, "Upload failed: Destination path must start with ~S1/", 51, 0);
-                continue;
-            }
-
-            // Get home directory
-            char *home = getenv("HOME");
-            if (!home) {
-                send(client_sock, "Upload failed: HOME environment variable not set", 48, 0);
-                continue;
-            }
-
-            // Construct full destination path
-            char full_dest_path[PATH_MAX];
-            snprintf(full_dest_path, PATH_MAX, "%s/S1/%s", home, dest_path + 4);
-            printf("S1: Full destination path: %s\n", full_dest_path);
-
-            // Determine temporary file path
-            char temp_path[PATH_MAX];
-            if (full_dest_path[strlen(full_dest_path) - 1] == '/')
-                snprintf(temp_path, PATH_MAX, "%s%s", full_dest_path, basename(filename));
-            else
-                snprintf(temp_path, PATH_MAX, "%s/%s", full_dest_path, basename(filename));
-            printf("S1: Temporary file path: %s\n", temp_path);
-
-            // Create necessary directories
-            create_directories(dirname(strdup(temp_path)));
-
-            // Remove existing file, if any
-            remove(temp_path);
-            // Open file for writing
-            FILE *fp = fopen(temp_path, "wb");
-            if (!fp) {
-                char error_msg[BUFFER_SIZE];
-                snprintf(error_msg, BUFFER_SIZE, "Upload failed: Cannot write file (%s)", strerror(errno));
-                send(client_sock, error_msg, strlen(error_msg), 0);
-                continue;
-            }
-            size_t bytes, total_bytes = 0;
-            // Receive and write file data
-            while ((bytes = recv(client_sock, buffer, BUFFER_SIZE, 0)) > 0) {
-                if (fwrite(buffer, 1, bytes, fp) != bytes) {
-                    fclose(fp);
-                    remove(temp_path);
-                    send(client_sock, "Upload failed: Error writing file", 33, 0);
-                    continue;
-                }
-                total_bytes += bytes;
-            }
-            fclose(fp);
-            if (total_bytes == 0) {
-                remove(temp_path);
-                send(client_sock, "Upload failed: No data received", 32, 0);
-                continue;
-            }
-            printf("S1: Wrote %zu bytes to %s\n", total_bytes, temp_path);
-
-            // Determine file extension
-            char *ext = strrchr(filename, '.');
-            if (ext && strcmp(ext, ".c") == 0) {
-                // Store .c files locally
-                send(client_sock, "Stored successfully", 20, 0);
-                printf("S1: Stored %s\n", temp_path);
-            } else {
-                // Route other file types to appropriate servers
-                int port = (ext && strcmp(ext, ".pdf") == 0) ? PORT_S2 :
-                          (ext && strcmp(ext, ".txt") == 0) ? PORT_S3 :
-                          (ext && strcmp(ext, ".zip") == 0) ? PORT_S4 : 0;
-                if (port) {
-                    transfer_file_to_server(temp_path, full_dest_path, port, client_sock);
-                } else {
-                    send(client_sock, "Upload failed: Unsupported file type", 37, 0);
-                    remove(temp_path);
-                }
-            }
-        } else if (strcmp(command, "downlf") == 0) {
-            printf("S1: Received downlf command: %s\n", buffer);
-            // Validate file path
-            if (strlen(param1) == 0) {
-                uint64_t zero = 0;
-                send(client_sock, (char*)&zero, sizeof(zero), 0);
-                send(client_sock, "No file path provided", 21, 0);
-                continue;
-            }
-
-            // Construct file path
-            char filepath[PATH_MAX];
-            char *home = getenv("HOME");
-            if (!home) {
-                uint64_t zero = 0;
-                send(client_sock, (char*)&zero, sizeof(zero), 0);
-                send(client_sock, "HOME environment variable not set", 33, 0);
-                continue;
-            }
-            if (strncmp(param1, "~S1/", 4) == 0) {
-                snprintf(filepath, PATH_MAX, "%s/S1/%s", home, param1 + 4);
-            } else {
-                snprintf(filepath, PATH_MAX, "%s/S1/%s", home, param1);
-            }
-            printf("S1: Processing download request for %s\n", filepath);
-
-            // Validate file extension
-            char *ext = strrchr(filepath, '.');
-            if (!ext || (strcmp(ext, ".c") != 0 && strcmp(ext, ".pdf") != 0 && 
-                        strcmp(ext, ".txt") != 0 && strcmp(ext, ".zip") != 0)) {
-                uint64_t zero = 0;
-                send(client_sock, (char*)&zero, sizeof(zero), 0);
-                send(client_sock, "Only .c, .pdf, .txt, .zip supported", 35, 0);
-                continue;
-            }
-
-            if (strcmp(ext, ".c") == 0) {
-                // Handle .c files locally
-                struct stat statbuf;
-                if (stat(filepath, &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
-                    uint64_t file_size = statbuf.st_size;
-                    uint64_t net_size = htobe64(file_size);
-                    printf("S1: Sending file size for %s: %lu bytes\n", filepath, file_size);
-                    if (send(client_sock, (char*)&net_size, sizeof(net_size), 0) < 0) {
-                        printf("S1: Failed to send file size to client\n");
-                        continue;
-                    }
-                    // Open and send file
-                    FILE *fp = fopen(filepath, "rb");
-                    if (fp) {
-                        size_t bytes, total_sent = 0;
-                        while ((bytes = fread(buffer, 1, BUFFER_SIZE, fp)) > 0) {
-                            if (send(client_sock, buffer, bytes, 0) < 0) {
-                                printf("S1: Send error after %zu bytes\n", total_sent);
-                                break;
-                            }
-                            total_sent += bytes;
-                            printf("S1: Sent %zu bytes, total %zu/%lu\n", bytes, total_sent, file_size);
-                        }
-                        fclose(fp);
-                        printf("S1: Sent %s to client (%zu bytes)\n", filepath, total_sent);
-                    } else {
-                        uint64_t zero = 0;
-                        send(client_sock, (char*)&zero, sizeof(zero), 0);
-                        send(client_sock, "Error opening file", 18, 0);
-                    }
-                } else {
-                    uint64_t zero = 0;
-                    send(client_sock, (char*)&zero, sizeof(zero), 0);
-                    send(client_sock, "File not found", 14, 0);
-                }
-            } else {
-                // Route download to other servers
-                int port = (strcmp(ext, ".pdf") == 0) ? PORT_S2 :
-                          (strcmp(ext, ".txt") == 0) ? PORT_S3 :
-                          (strcmp(ext, ".zip") == 0) ? PORT_S4 : 0;
-                download_file_from_server(filepath, port, client_sock);
-            }
-        } else if (strcmp(command, "removef") == 0) {
-            printf("S1: Received removef command: %s\n", buffer);
-            // Construct file path
-            char filepath[PATH_MAX];
-            char *home = getenv("HOME");
-            if (!home) {
-                send(client_sock, "Remove failed: HOME environment variable not set", 48, 0);
-                continue;
-            }
-            if (strncmp(param1, "~S1/", 4) == 0) {
-                snprintf(filepath, PATH_MAX, "%s/S1/%s", home, param1 + 4);
-            } else {
-                snprintf(filepath, PATH_MAX, "%s/S1/%s", home, param1);
-            }
-
-            // Get file extension
-            char *ext = strrchr(filepath, '.');
-            if (!ext) {
-                send(client_sock, "Remove failed: No file extension", 32, 0);
-                continue;
-            }
-            ext++;
-
-            if (strcmp(ext, "c") == 0) {
-                // Remove .c files locally
-                struct stat statbuf;
-                if (stat(filepath, &statbuf) == 0) {
-                    if (S_ISREG(statbuf.st_mode)) {
-                        if (remove(filepath) == 0) {
-                            send(client_sock, "File removed successfully", 25, 0);
-                            printf("S1: Removed %s\n", filepath);
-                        } else {
-                            send(client_sock, "Remove failed: Permission denied", 32, 0);
-                        }
-                    } else {
-                        send(client_sock, "Remove failed: Not a regular file", 33, 0);
-                    }
-                } else {
-                    send(client_sock, "Remove failed: File not found", 29, 0);
-                }
-            } else if (strcmp(ext, "pdf") == 0 || strcmp(ext, "txt") == 0) {
-                // Forward remove request to S2 or S3
-                int port = (strcmp(ext, "pdf") == 0) ? PORT_S2 : PORT_S3;
-                int sock = connect_to_server(port);
-                if (sock < 0) {
-                    send(client_sock, "Remove failed: Cannot connect to server", 39, 0);
-                    continue;
-                }
-
-                // Adjust path for target server
-                char server_dir[4];
-                snprintf(server_dir, 4, "S%d", (port == PORT_S2) ? 2 : 3);
-                char adjusted_path[PATH_MAX];
-                snprintf(adjusted_path, PATH_MAX, "%s/%s/%s", home, server_dir, param1 + 4);
-
-                char remove_cmd[BUFFER_SIZE];
-                snprintf(remove_cmd, BUFFER_SIZE, "removef %s", adjusted_path);
-                send(sock, remove_cmd, strlen(remove_cmd), 0);
-
-                // Receive and forward server response
-                memset(buffer, 0, BUFFER_SIZE);
-                ssize_t recv_bytes = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-                close(sock);
-                if (recv_bytes > 0) {
-                    buffer[recv_bytes] = '\0';
-                    send(client_sock, buffer, strlen(buffer), 0);
-                } else {
-                    send(client_sock, "Remove failed: No response from server", 38, 0);
-                }
-            } else {
-                send(client_sock, "Remove failed: Unsupported file type", 36, 0);
-            }
-        } else if (strcmp(command, "downltar") == 0) {
-            printf("S1: Received downltar command: %s\n", buffer);
-            // Validate file type
-            if (strlen(param1) == 0) {
-                uint64_t zero = 0;
-                send(client_sock, (char*)&zero, sizeof(zero), 0);
-                send(client_sock, "Download failed: No file type provided", 38, 0);
-                continue;
-            }
-            if (strcmp(param1, ".c") != 0 && strcmp(param1, ".pdf") != 0 && strcmp(param1, ".txt") != 0) {
-                uint64_t zero = 0;
-                send(client_sock, (char*)&zero, sizeof(zero), 0);
-                send(client_sock, "Download failed: Invalid file type", 34, 0);
-                continue;
-            }
-
-            // Construct tar file path
-            char tar_path[PATH_MAX];
-            char *home = getenv("HOME");
-            if (!home) {
-                uint64_t zero = 0;
-                send(client_sock, (char*)&zero, sizeof(zero), 0);
-                send(client_sock, "Download failed: HOME environment variable not set", 50, 0);
-                continue;
-            }
-            snprintf(tar_path, PATH_MAX, "%s/S1/temp/%s.tar", home,
-                     strcmp(param1, ".c") == 0 ? "cfiles" :
-                     strcmp(param1, ".pdf") == 0 ? "pdffiles" : "textfiles");
-            create_directories(dirname(strdup(tar_path)));
-
-            if (strcmp(param1, ".c") == 0) {
-                // Create tar of local .c files
-                char cmd[BUFFER_SIZE];
-                snprintf(cmd, BUFFER_SIZE, "cd %s/S1 && find * -type f -name '*.c' | tar -cf %s -T -", home, tar_path);
-                int ret = system(cmd);
-                if (ret != 0) {
-                    uint64_t zero = 0;
-                    send(client_sock, (char*)&zero, sizeof(zero), 0);
-                    send(client_sock, "Download failed: No .c files found or tar creation failed", 56, 0);
-                    remove(tar_path);
-                    continue;
-                }
-            } else {
-                // Request tar from S2 or S3
-                int port = strcmp(param1, ".pdf") == 0 ? PORT_S2 : PORT_S3;
-                int sock = connect_to_server(port);
-                if (sock < 0) {
-                    uint64_t zero = 0;
-                    send(client_sock, (char*)&zero, sizeof(zero), 0);
-                    send(client_sock, "Download failed: Cannot connect to server", 41, 0);
-                    continue;
-                }
-
-                char downltar_cmd[BUFFER_SIZE];
-                snprintf(downltar_cmd, BUFFER_SIZE, "downltar %s", param1);
-                send(sock, downltar_cmd, strlen(downltar_cmd), 0);
-
-                // Receive tar file size
-                uint64_t net_file_size;
-                if (receive_full(sock, (char*)&net_file_size, sizeof(net_file_size)) < 0) {
-                    uint64_t zero = 0;
-                    send(client_sock, (char*)&zero, sizeof(zero), 0);
-                    send(client_sock, "Download failed: Error receiving file size", 42, 0);
-                    close(sock);
-                    continue;
-                }
-                uint64_t file_size = be64toh(net_file_size);
-
-                if (file_size == 0) {
-                    // Handle error response
-                    memset(buffer, 0, BUFFER_SIZE);
-                    ssize_t recv_bytes = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-                    close(sock);
-                    if (recv_bytes > 0) {
-                        buffer[recv_bytes] = '\0';
-                        uint64_t zero = 0;
-                        send(client_sock, (char*)&zero, sizeof(zero), 0);
-                        send(client_sock, buffer, strlen(buffer), 0);
-                    } else {
-                        uint64_t zero = 0;
-                        send(client_sock, (char*)&zero, sizeof(zero), 0);
-                        send(client_sock, "Download failed: No response from server", 39, 0);
-                    }
-                    continue;
-                }
-
-                // Save tar file locally
-                FILE *fp = fopen(tar_path, "wb");
-                if (!fp) {
-                    uint64_t zero = 0;
-                    send(client_sock, (char*)&zero, sizeof(zero), 0);
-                    send(client_sock, "Download failed: Cannot create temp file on S1", 46, 0);
-                    close(sock);
-                    continue;
-                }
-
-                size_t total_received = 0;
-                while (total_received < file_size) {
-                    size_t to_receive = file_size - total_received;
-                    if (to_receive > BUFFER_SIZE) to_receive = BUFFER_SIZE;
-                    ssize_t recv_bytes = recv(sock, buffer, to_receive, 0);
-                    if (recv_bytes <= 0) break;
-                    fwrite(buffer, 1, recv_bytes, fp);
-                    total_received += recv_bytes;
-                }
-                fclose(fp);
-                close(sock);
-                if (total_received != file_size) {
-                    uint64_t zero = 0;
-                    send(client_sock, (char*)&zero, sizeof(zero), 0);
-                    send(client_sock, "Download failed: Transfer interrupted", 37, 0);
-                    remove(tar_path);
-                    continue;
-                }
-            }
-
-            // Send tar file to client
-            struct stat statbuf;
-            if (stat(tar_path, &statbuf) != 0) {
-                uint64_t zero = 0;
-                send(client_sock, (char*)&zero, sizeof(zero), 0);
-                send(client_sock, "Download failed: Tar file not found on S1", 41, 0);
-                remove(tar_path);
-                continue;
-            }
-            uint64_t file_size = statbuf.st_size;
-            uint64_t net_size = htobe64(file_size);
-            send(client_sock, (char*)&net_size, sizeof(net_size), 0);
-
-            FILE *fp = fopen(tar_path, "rb");
-            if (!fp) {
-                uint64_t zero = 0;
-                send(client_sock, (char*)&zero, sizeof(zero), 0);
-                send(client_sock, "Download failed: Cannot open tar file on S1", 43, 0);
-                remove(tar_path);
-                continue;
-            }
-            size_t bytes;
-            while ((bytes = fread(buffer, 1, BUFFER_SIZE, fp)) > 0) {
-                send(client_sock, buffer, bytes, 0);
-            }
-            fclose(fp);
-            printf("S1: Sent %s to client\n", tar_path);
-            remove(tar_path);
-        } else if (strcmp(command, "dispfnames") == 0) {
-            printf("S1: Received dispfnames command: %s\n", buffer);
-            // Validate path
-            if (strlen(param1) == 0) {
-                send(client_sock, "No files found", 14, 0);
-                continue;
-            }
-
-            // Construct directory path
-            char pathname[PATH_MAX];
-            char *home = getenv("HOME");
-            if (!home) {
-                send(client_sock, "No files found: HOME environment variable not set", 49, 0);
-                continue;
-            }
-            if (strncmp(param1, "~S1/", 4) == 0) {
-                snprintf(pathname, PATH_MAX, "%s/S1/%s", home, param1 + 4);
-            } else {
-                snprintf(pathname, PATH_MAX, "%s/S1/%s", home, param1);
-            }
-
-            // Verify directory exists
-            struct stat statbuf;
-            if (stat(pathname, &statbuf) != 0 || !S_ISDIR(statbuf.st_mode)) {
-                send(client_sock, "No files found", 14, 0);
-                continue;
-            }
-
-            char file_list[BUFFER_SIZE] = {0};
-            char temp_list[BUFFER_SIZE] = {0};
-            char *types[] = {".c", ".pdf", ".txt", ".zip"};
-            int ports[] = {0, PORT_S2, PORT_S3, PORT_S4};
-
-            // Collect file names for each type
-            for (int i = 0; i < 4; i++) {
-                char current_list[BUFFER_SIZE] = {0};
-                if (i == 0) {
-                    // Local .c files
-                    char cmd[BUFFER_SIZE];
-                    snprintf(cmd, BUFFER_SIZE, "find %s -type f -name '*%s' | sort", pathname, types[i]);
-                    FILE *fp = popen(cmd, "r");
-                    if (fp) {
-                        size_t pos = 0;
-                        char line[256];
-                        while (fgets(line, sizeof(line), fp) && pos < BUFFER_SIZE - 256) {
-                            line[strcspn(line, "\n")] = 0;
-                            char *filename = basename(line);
-                            pos += snprintf(current_list + pos, BUFFER_SIZE - pos, "%s\n", filename);
-                        }
-                        pclose(fp);
-                    }
-                } else {
-                    // Request file names from other servers
-                    int sock = connect_to_server(ports[i]);
-                    if (sock >= 0) {
-                        char adjusted_path[PATH_MAX];
-                        snprintf(adjusted_path, PATH_MAX, "%s/S%d/%s", home, i + 1, param1 + 4);
-                        char disp_cmd[BUFFER_SIZE];
-                        snprintf(disp_cmd, BUFFER_SIZE, "dispfnames %s %s", adjusted_path, types[i]);
-                        send(sock, disp_cmd, strlen(disp_cmd), 0);
-
-                        memset(temp_list, 0, BUFFER_SIZE);
-                        ssize_t recv_bytes = recv(sock, temp_list, BUFFER_SIZE - 1, 0);
-                        if (recv_bytes > 0) {
-                            temp_list[recv_bytes] = '\0';
-                            if (strcmp(temp_list, "No files found") != 0) {
-                                strncpy(current_list, temp_list, BUFFER_SIZE - 1);
-                            }
-                        }
-                        close(sock);
-                    }
-                }
-                if (strlen(current_list) > 0) {
-                    strncat(file_list, current_list, BUFFER_SIZE - strlen(file_list) - 1);
-                }
-            }
-
-            // Send file list to client
-            if (strlen(file_list) == 0) {
-                send(client_sock, "No files found", 14, 0);
-            } else {
-                send(client_sock, file_list, strlen(file_list), 0);
-            }
-        }
-    }
-}
-
-// Connect to another server
-int connect_to_server(int port) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in server_addr = {AF_INET, htons(port), inet_addr("127.0.0.1")};
-    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        close(sock);
-        return -1;
-    }
-    return sock;
-}
-
-// Transfer file to another server
-void transfer_file_to_server(const char *filename, const char *dest_path, int server_port, int client_sock) {
-    // Connect to target server
-    int sock = connect_to_server(server_port);
-    if (sock < 0) {
-        send(client_sock, "Upload failed: Server connection error", 38, 0);
-        remove(filename);
-        return;
-    }
-
-    char buffer[BUFFER_SIZE];
-    char adjusted_path[PATH_MAX];
-    char *home = getenv("HOME");
-    if (!home) {
-        send(client_sock, "Upload failed: HOME environment variable not set", 48, 0);
-        close(sock);
-        remove(filename);
-        return;
-    }
-
-    // Determine server directory
-    const char *server_dir = (server_port == PORT_S2) ? "S2" :
-                            (server_port == PORT_S3) ? "S3" :
-                            (server_port == PORT_S4) ? "S4" : NULL;
-    const char *suffix = dest_path + strlen(home) + 3;
-    if (suffix[0] == '/' || dest_path[strlen(dest_path) - 1] == '/')
-        snprintf(adjusted_path, PATH_MAX, "%s/%s%s", home, server_dir, suffix);
-    else
-        snprintf(adjusted_path, PATH_MAX, "%s/%s/%s", home, server_dir, suffix);
-    printf("S1: Transferring to %s on port %d\n", adjusted_path, server_port);
-
-    // Send upload command
-    char *filename_copy = strdup(filename);
-    snprintf(buffer, BUFFER_SIZE, "uploadf %s %s", basename(filename_copy), adjusted_path);
-    free(filename_copy);
-    ssize_t sent = send(sock, buffer, strlen(buffer), 0);
-    if (sent < 0) {
-        send(client_sock, "Upload failed: Failed to send command to server", 47, 0);
-        close(sock);
-        remove(filename);
-        return;
-    }
-    printf("S1: Sent command to server on port %d: %s\n", server_port, buffer);
-
-    // Open and send file
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        send(client_sock, "Upload failed: File not accessible", 35, 0);
-        close(sock);
-        remove(filename);
-        return;
-    }
-
-    size_t bytes, total_bytes = 0;
-    while ((bytes = fread(buffer, 1, BUFFER_SIZE, fp)) > 0) {
-        ssize_t sent_bytes = send(sock, buffer, bytes, 0);
-        if (sent_bytes != bytes) {
-            fclose(fp);
-            close(sock);
-            send(client_sock, "Upload failed: Error sending file to server", 43, 0);
-            remove(filename);
-            return;
-        }
-        total_bytes += sent_bytes;
-    }
-    fclose(fp);
-    printf("S1: Sent %zu bytes to server on port %d\n", total_bytes, server_port);
-
-    // Brief delay to ensure server processes data
-    usleep(100000); // 100ms delay
-    shutdown(sock, SHUT_WR);
-
-    // Receive server response
-    memset(buffer, 0, BUFFER_SIZE);
-    ssize_t recv_bytes = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-    if (recv_bytes > 0) {
-        buffer[recv_bytes] = '\0';
-        send(client_sock, buffer, strlen(buffer), 0);
-        printf("S1: Transfer to server on port %d completed: %s\n", server_port, buffer);
-    } else {
-        send(client_sock, "Upload failed: No response from server", 38, 0);
-    }
-    remove(filename);
-    close(sock);
-}
-
-// Download file from another server and forward to client
-void download_file_from_server(const char *filepath, int server_port, int client_sock) {
-    // Connect to target server
-    int sock = connect_to_server(server_port);
-    if (sock < 0) {
-        uint64_t zero = 0;
-        send(client_sock, (char*)&zero, sizeof(zero), 0);
-        send(client_sock, "Server connection error", 23, 0);
-        printf("S1: Failed to connect to server on port %d\n", server_port);
-        return;
-    }
-
-    // Set receive timeout (5 seconds)
-    struct timeval tv;
-    tv.tv_sec = 5;
-    tv.tv_usec = 0;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-
-    char buffer[BUFFER_SIZE];
-    char adjusted_path[PATH_MAX];
-    char *home = getenv("HOME");
-    // Adjust path for target server
-    const char *server_dir = (server_port == PORT_S2) ? "S2" :
-                            (server_port == PORT_S3) ? "S3" :
-                            (server_port == PORT_S4) ? "S4" : NULL;
-    snprintf(adjusted_path, PATH_MAX, "%s/%s%s", home, server_dir, filepath + strlen(home) + 3);
-    snprintf(buffer, BUFFER_SIZE, "downlf %s", adjusted_path);
-    if (send(sock, buffer, strlen(buffer), 0) < 0) {
-        uint64_t zero = 0;
-        send(client_sock, (char*)&zero, sizeof(zero), 0);
-        send(client_sock, "Failed to send command to server", 31, 0);
-        printf("S1: Failed to send command to port %d\n", server_port);
-        close(sock);
-        return;
-    }
-    printf("S1: Sent command to server on port %d: %s\n", server_port, buffer);
-
-    // Receive file size
-    uint64_t net_file_size;
-    if (receive_full(sock, (char*)&net_file_size, sizeof(net_file_size)) < 0) {
-        uint64_t zero = 0;
-        send(client_sock, (char*)&zero, sizeof(zero), 0);
-        send(client_sock, "Error receiving file size", 25, 0);
-        printf("S1: Failed to receive file size from port %d\n", server_port);
-        close(sock);
-        return;
-    }
-    uint64_t file_size = be64toh(net_file_size);
-    printf("S1: Received file size from port %d: %lu bytes\n", server_port, file_size);
-
-    // Reset timeout for data transfer
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-
-    // Send file size to client
-    if (send(client_sock, (char*)&net_file_size, sizeof(net_file_size), 0) < 0) {
-        printf("S1: Failed to send file size to client\n");
-        close(sock);
-        return;
-    }
-    printf("S1: Sent file size to client: %lu bytes\n", file_size);
-
-    if (file_size > 0) {
-        // Transfer file data
-        size_t total_received = 0;
-        while (total_received < file_size) {
-            size_t to_receive = file_size - total_received;
-            if (to_receive > BUFFER_SIZE) to_receive = BUFFER_SIZE;
-            ssize_t bytes = recv(sock, buffer, to_receive, 0);
-            if (bytes <= 0) {
-                printf("S1: Receive error from port %d after %zu bytes\n", server_port, total_received);
-                break;
-            }
-            if (send(client_sock, buffer, bytes, 0) < 0) {
-                printf("S1: Send error to client after %zu bytes\n", total_received);
-                break;
-            }
-            total_received += bytes;
-            printf("S1: Transferred %zd bytes from port %d, total %zu/%lu\n", bytes, server_port, total_received, file_size);
-        }
-        if (total_received == file_size) {
-            printf("S1: Successfully received %s from port %d and sent to client\n", adjusted_path, server_port);
-        } else {
-            printf("S1: Incomplete transfer from port %d, %zu/%lu bytes\n", server_port, total_received, file_size);
-        }
-    } else {
-        // Handle error response
-        ssize_t bytes = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes > 0) {
-            buffer[bytes] = '\0';
-            send(client_sock, buffer, bytes, 0);
-            printf("S1: Received error from port %d: %s\n", server_port, buffer);
-        } else {
-            send(client_sock, "No response from server", 23, 0);
-            printf("S1: No response from port %d\n", server_port);
-        }
-    }
-    close(sock);
-}
-
-// Create directories recursively
-void create_directories(const char *path) {
-    char tmp[PATH_MAX];
-    snprintf(tmp, PATH_MAX, "%s", path);
-    char *p;
-    for (p = tmp + 1; *p; p++) {
-        if (*p == '/') {
-            *p = 0;
-            mkdir(tmp, S_IRWXU);
-            *p = '/';
-        }
-    }
-    mkdir(tmp, S_IRWXU);
-}
-
-// Receive exact number of bytes
-int receive_full(int sock, char *buffer, size_t size) {
-    size_t received = 0;
-    while (received < size) {
-        ssize_t bytes = recv(sock, buffer + received, size - received, 0);
-        if (bytes <= 0) return -1;  // Error or connection closed
-        received += bytes;
-    }
-    return 0;  // Success
-}
\ No newline at end of file
+#define _GNU_SOURCE  // For accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <libgen.h>
+#include <limits.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdint.h>  // For uint64_t
+#include <endian.h>  // For htobe64 and be64toh
+#include <sys/time.h> // For timeout
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <dirent.h>  // For the DT_* entry types
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/random.h>  // For getrandom
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <sys/ioctl.h>  // For FIONREAD
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // For the SHA extensions
+#endif
+
+#define BUFFER_SIZE 8192
+// Default number of command worker threads in epoll mode
+#define DEFAULT_WORKERS 16
+// Seconds an epoll worker waits on a client that stops sending or reading mid-request
+// before closing its session
+#define CLIENT_STALL_TIMEOUT 30
+// Maximum events handled per epoll_wait call
+#define MAX_EVENTS 256
+// Seconds dispfnames waits for the local scan and each storage server
+#define LISTING_DEADLINE 3
+// Largest dispfnames page, and the largest batch of entries sent in one DATA frame
+#define LISTING_MAX_PAGE 10000
+#define LISTING_FRAME 16384
+// Largest chunk moved per splice() call when relaying downloads
+#define RELAY_CHUNK 65536
+// Idle persistent connections kept per storage server, and how long they may sit unused
+#define POOL_MAX_IDLE 8
+#define POOL_IDLE_TIMEOUT 30
+
+// Wire protocol spoken with clients and with S2-S4: every message starts with a frame header
+#define PROTO_MAGIC 0x5732
+#define PROTO_VERSION 1
+// Request opcodes; the payload carries the space-separated arguments
+#define OP_UPLOADF 1
+#define OP_DOWNLF 2
+#define OP_REMOVEF 3
+#define OP_DOWNLTAR 4
+#define OP_DISPFNAMES 5
+// Multipart upload: start an upload, send its parts in any order over any number of
+// connections, then complete or abort it
+#define OP_UPLOAD_INIT 6
+#define OP_UPLOAD_PART 7
+#define OP_UPLOAD_COMPLETE 8
+#define OP_UPLOAD_ABORT 9
+#define OP_UPLOAD_BATCH 10
+// Upload-skip probe: the arguments of an uploadf followed by the file's size and SHA-256.
+// An OK reply means the file is stored without its content being sent.
+#define OP_UPLOAD_PROBE 11
+// Every request gets one REPLY; file content follows it in DATA frames
+#define OP_REPLY 16
+#define OP_DATA 17
+// Frame flags
+#define FL_MORE 0x0001  // Another DATA frame follows this one
+// On a download request: the requester accepts a deflated body. On its reply and on
+// DATA frames: the body is deflated.
+#define FL_DEFLATE 0x0002
+// Reply status codes
+#define ST_OK 0
+#define ST_ERROR 1
+
+// Frame header, all fields in network byte order on the wire
+struct frame_hdr {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint16_t status;
+    uint32_t request_id;
+    uint64_t length;  // Payload bytes following the header
+} __attribute__((packed));
+
+// Multipart uploads are staged in a directory of their own: <id>.data is assembled in
+// place from the parts, <id>.parts lists the parts received, and <id>.dest names the
+// file it becomes. Uploads whose parts list has not changed for a day are removed.
+#define UPLOAD_ID_LEN 16
+#define UPLOAD_EXPIRY (24 * 60 * 60)
+static char upload_dir[PATH_MAX];
+
+// Small uploads S1 coalesces into one OP_UPLOAD_BATCH: the request carries the file
+// count, then a single DATA frame holds a record per file, each a batch_record followed
+// by the file's uploadf arguments and body. The reply holds one "<status> <message>"
+// line per file, in order.
+#define BATCH_MAX_FILES 64
+#define BATCH_MAX_BYTES (1024 * 1024)  // Body bytes gathered into one batch
+#define BATCH_FILE_MAX 65536           // Largest body that is coalesced
+#define BATCH_REPLY_LINE 160
+struct batch_record {
+    uint32_t args_len;
+    uint16_t flags;  // Of the body's DATA frame
+    uint16_t reserved;
+    uint64_t body_len;
+} __attribute__((packed));  // Network byte order
+
+// Durable uploads: a file is written under a temporary name in its destination directory,
+// flushed to disk together with the other uploads finishing at the same time, and only
+// then renamed into place, so a crash leaves either the old file or the new one
+struct staged_file {
+    FILE *fp;
+    char temp_path[PATH_MAX];
+    char path[PATH_MAX];  // Where it is published
+    int failed;           // Not written, or could not be published
+    int received;         // Counted in commit.received, see staged_file_received()
+};
+
+// Waiting to be flushed in the next commit group
+struct sync_request {
+    const int *fds;
+    int count;
+    int done, result;
+    struct sync_request *next;
+};
+
+// Group commit: the first thread to need a flush leads the next group, waiting up to the
+// commit window for uploads already received to join it, then flushes the whole group
+// with fdatasync() per file and one fsync() per directory
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct sync_request *queue;
+    int received;  // Staged files fully received that have not joined a group yet
+    int flushing;  // A leader owns the group being gathered or flushed
+} commit = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0};
+// Longest a flush waits for others to join, in milliseconds (-g); -1 flushes nothing
+static int commit_window_ms = 5;
+
+// io_uring upload engine: upload bodies are received into a thread's registered buffers
+// and each full buffer is written at its file offset by the kernel while the next one
+// fills, so the network and the disk stay busy at once
+#define RING_ENTRIES 32
+#define RING_BUFFERS 8
+#define RING_BUFFER_SIZE (128 * 1024)
+#define RING_INPUT 16384  // Deflated input inflated into the buffers per recv()
+#define RING_RECV UINT64_MAX  // user_data of a receive; writes carry their buffer index
+#define RING_RECV_TIMEOUT (UINT64_MAX - 1)  // user_data of the timeout linked to a receive
+
+// One thread's ring, mapped from the kernel, and the buffers its writes are made from
+struct io_ring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+    char *buffers;
+    int registered;    // Buffers are registered, so writes use IORING_OP_WRITE_FIXED
+    unsigned pending;  // Queued submissions not yet passed to the kernel
+    unsigned inflight; // Queued operations whose completion has not been taken
+};
+
+// Upload body being written through a ring
+struct ring_writer {
+    struct io_ring *ring;
+    int fd;
+    uint64_t offset;     // File offset the buffer being filled goes to
+    int current;         // Buffer being filled, -1 for none
+    size_t fill;
+    unsigned idle;       // Bit mask of buffers neither filling nor being written
+    int error;           // A write failed; the rest of the body is only drained
+    struct __kernel_timespec recv_timeout;  // The socket's SO_RCVTIMEO, zero for none
+    int timeout_pending; // The timeout linked to a receive has not completed yet
+    int timed_out;       // It expired, cutting the receive short
+    struct {
+        uint64_t offset;
+        size_t length, done;
+    } writes[RING_BUFFERS];
+};
+
+// Write uploads through io_uring (-d uring) rather than stdio (-d stdio, the default)
+static int use_uring = 0;
+// Set once io_uring proved unavailable, so no thread tries it again
+static int ring_unavailable = 0;
+// The calling thread's ring, once set up
+static __thread struct io_ring *thread_ring = NULL;
+
+// One small upload waiting to go out in a batch
+struct batch_entry {
+    char args[PATH_MAX + 256];  // "<filename> <dir>" for the storage server
+    char *body;
+    uint64_t length;
+    uint16_t flags;
+    uint32_t request_id;  // Of the client's request
+    int port;
+    uint16_t status;
+    char message[BATCH_REPLY_LINE];
+    int done;
+    struct batch_entry *next;
+};
+
+// Small uploads queued for one storage server. Whichever session finds no batch in
+// flight sends everything queued so far, so uploads arriving while a batch is out go
+// together in the next one.
+struct upload_batcher {
+    pthread_mutex_t lock;
+    pthread_cond_t sent;
+    struct batch_entry *head, *last;
+    int sending;
+};
+static struct upload_batcher batchers[3] = {
+    {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0},
+    {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0},
+    {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0},
+};
+
+// Reply to a ranged downlf: the bytes that follow, the offset they start at, and the
+// size, mtime and version of the whole file
+#define RANGE_REPLY_SIZE (5 * sizeof(uint64_t))
+
+// Part of a file asked for by downlf; a length of 0 runs to the end of the file. With
+// if_version set, the range applies only while the file still has that version (see
+// file_version()), and the whole file is sent otherwise.
+struct byte_range {
+    int ranged;  // The request named a range, so its reply describes the range
+    uint64_t offset, length;
+    int has_version;  // if= was given
+    uint64_t if_version;
+};
+
+// Transfer compression: a compressible file travels as one raw deflate stream split
+// across DATA frames, at the fastest level so it never slows the link it saves
+#define TRANSFER_LEVEL 1
+#define TRANSFER_CHUNK 65536
+
+// ustar archive layout: 512-byte blocks, written in 10 KB records
+#define TAR_BLOCK 512
+#define TAR_RECORD 10240
+// Largest size the 11-digit octal header field holds; larger files need a pax header
+#define TAR_MAX_OCTAL 077777777777ULL
+// Room for a pax header, its records and the ustar header of one entry
+#define TAR_HEADER_MAX (PATH_MAX + 4 * TAR_BLOCK)
+
+// Regular file to archive, with its path relative to the archive root
+struct tar_entry {
+    char *path;
+    uint64_t size;
+    time_t mtime;
+    mode_t mode;
+};
+
+// Most file types whose archives are cached at once
+#define TAR_CACHE_TYPES 4
+
+// Cached archive of one file type, valid while the catalog generation it was built at
+// is current
+struct tar_cache_entry {
+    char ext[16];
+    uint64_t generation;
+    char path[PATH_MAX];  // "" until first built
+    uint64_t size;
+    int building;
+};
+static struct tar_cache_entry tar_cache[TAR_CACHE_TYPES];
+static char tar_cache_dir[PATH_MAX];
+static pthread_mutex_t tar_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tar_cache_cond = PTHREAD_COND_INITIALIZER;
+
+// Parallel gzip: input is cut into blocks compressed independently on several threads,
+// each primed with the previous block's last 32 KB to keep the ratio of a single stream
+#define GZIP_BLOCK (128 * 1024)
+#define GZIP_WINDOW 32768
+#define GZIP_LEVEL 6
+// Room for a compressed block: zlib's worst case plus its flush marker
+#define GZIP_OUT_MAX (GZIP_BLOCK + GZIP_BLOCK / 1000 + 64)
+
+// One block of a parallel gzip stream
+struct gzip_block {
+    unsigned char *in, *out;
+    size_t in_len, out_len;
+    unsigned char dict[GZIP_WINDOW];
+    size_t dict_len;
+    uLong crc;
+    int done;
+};
+
+// Blocks of one stream in a ring: the sending thread reads them in, workers compress
+// them, and the sending thread sends them out in order
+struct gzip_job {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct gzip_block *blocks;
+    int slots;
+    uint64_t next_read, next_compress;
+    int stop;
+};
+
+// Compression threads per gzip stream; 0 uses one per core
+static int gzip_threads = 0;
+
+// Files collected for one archive
+struct tar_list {
+    struct tar_entry *entries;
+    size_t count, capacity;
+};
+
+// Size of the buffer each directory level reads entries into
+#define WALK_BUFFER 32768
+
+// Record returned by getdents64()
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Called for each file found by walk_files(), with its path relative to the walk root
+// and the directory descriptor and name to stat it by
+typedef void (*walk_fn)(const char *path, int dir_fd, const char *name, void *ctx);
+
+// One file of a listing page; size and mtime are only filled for long listings
+struct page_entry {
+    char *path;
+    uint64_t size;
+    time_t mtime;
+};
+
+// The first limit files after a cursor, held as a max-heap while the tree is walked
+struct listing_page {
+    const char *after;
+    int limit, want_long;
+    struct page_entry *entries;  // limit + 1 slots
+    int count;
+    int more;                    // Files remain beyond this page
+};
+
+// Snapshot file tag; snapshots without it are ignored and the tree is rescanned
+#define CATALOG_MAGIC 0x57324331
+// Least number of seconds between snapshot writes while the catalog changes
+#define CATALOG_SAVE_INTERVAL 60
+// Changes watched in every catalogued directory
+#define CATALOG_EVENTS (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | \
+                        IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+// Stored file, with its path relative to the server root
+struct catalog_entry {
+    char *path;
+    const char *ext;  // Extension within path, "" if it has none
+    uint64_t size;
+    time_t mtime;
+};
+
+// Directory below the server root and its inotify watch
+struct catalog_dir {
+    char *path;             // "" for the root itself
+    int wd;
+    struct timespec mtime;  // As of the last change applied, to validate a snapshot
+};
+
+// Every file stored under the server root, sorted by path, kept current by inotify.
+// Listings and archive lists are answered from it while ready is set.
+struct catalog {
+    pthread_rwlock_t lock;
+    char root[PATH_MAX];
+    char snapshot[PATH_MAX];
+    struct catalog_entry *entries;
+    size_t count, capacity;
+    struct catalog_dir *dirs;
+    size_t dir_count, dir_capacity;
+    int inotify_fd;
+    int ready;   // Cleared if a directory could not be watched
+    int dirty;   // Changed since the snapshot was written; accessed atomically, as catalog_save()
+                 // clears it under the read lock
+    uint64_t generation;  // Bumped on every change, to tag cached archives
+    time_t last_save;
+};
+static struct catalog catalog = {.lock = PTHREAD_RWLOCK_INITIALIZER, .inotify_fd = -1};
+
+// Global flag to control server shutdown
+static volatile sig_atomic_t keep_running = 1;
+// Server socket descriptor
+static int server_sock = -1;
+// Port numbers for S2, S3, S4 servers
+static int PORT_S2, PORT_S3, PORT_S4;
+
+// Request arguments are a file name and a path at most
+#define MAX_ARGS_SIZE (PATH_MAX + 256)
+
+// Client session owned by the event loop while it reads a request header and
+// arguments, or by one worker while the request runs
+struct session {
+    int fd;
+    struct frame_hdr hdr;
+    size_t hdr_got;
+    char *args;
+    size_t args_got;
+    struct session *next;
+};
+
+// epoll instance and ready-session queue used in epoll mode
+static int epoll_fd = -1;
+static struct session *ready_head = NULL, *ready_tail = NULL;
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+
+// Idle connections to S2, S3 and S4, most recently used last
+struct backend_pool {
+    int socks[POOL_MAX_IDLE];
+    time_t idle_since[POOL_MAX_IDLE];
+    int count;
+};
+static struct backend_pool pools[3];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+// One part of a dispfnames listing, gathered by its own thread
+struct listing_part {
+    struct listing_job *job;
+    int port;                      // 0 for the local .c scan
+    char args[2 * PATH_MAX + 64];  // Directory, file type and paging options
+    char *entries;                 // "path[<TAB>size<TAB>mtime]" lines, paths relative to the directory
+    size_t len;
+    int more;                      // Entries remain beyond this page
+    int done;
+};
+
+// A dispfnames request fanned out to its parts. The request handler and every part
+// thread hold a reference, so a part that misses the deadline can still finish safely.
+struct listing_job {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending, refs;
+    struct listing_part parts[4];
+};
+
+// Upload-skip probes compare a client's digest with the stored file's. Digests of .c files
+// are cached by inode until the file changes, so probing a file again is free.
+#define SHA256_LEN 32
+#define DIGEST_CACHE_SLOTS 1024
+#define DIGEST_READ (1024 * 1024)  // Bytes read at a time while hashing a stored file
+
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t fill;
+};
+
+struct digest_cache_entry {
+    dev_t dev;
+    ino_t ino;  // 0 while the slot is empty
+    off_t size;
+    struct timespec mtime, ctime;
+    unsigned char digest[SHA256_LEN];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct digest_cache_entry slots[DIGEST_CACHE_SLOTS];
+} digest_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Relay proxied downloads with splice() (default) rather than a user-space copy loop
+static int relay_splice = 1;
+// Source of request ids for frames sent to the storage servers
+static uint32_t last_request_id = 0;
+
+// Signal handler for graceful shutdown
+void signal_handler(int sig) {
+    keep_running = 0;
+    if (server_sock != -1) close(server_sock);
+}
+
+// Function prototypes
+void prcclient(int client_sock);
+int handle_request(int client_sock, const struct frame_hdr *req, char *args);
+void run_event_loop(int workers);
+void *session_worker(void *arg);
+int session_read(struct session *s);
+void *listing_worker(void *arg);
+void release_listing_job(struct listing_job *job);
+void parse_listing_options(char *opts, char *after, size_t after_size, int *limit, int *want_long, int *want_paths);
+int queue_listing_line(int sock, uint32_t request_id, char *buf, size_t *len, const char *line, size_t line_len);
+int connect_to_server(int port);
+int pool_acquire(int port, int *reused);
+void pool_release(int port, int sock);
+int connection_healthy(int sock);
+int backend_request(int port, uint8_t opcode, uint16_t flags, const char *args, int timeout_sec, struct frame_hdr *reply);
+int send_all(int sock, const void *buffer, size_t size);
+int send_frame(int sock, uint8_t opcode, uint16_t flags, uint16_t status, uint32_t request_id, const void *payload, uint64_t length);
+int decode_frame(struct frame_hdr *hdr);
+int recv_frame(int sock, struct frame_hdr *hdr);
+int send_reply(int sock, uint32_t request_id, uint16_t status, const char *msg);
+int send_size_reply(int sock, uint32_t request_id, uint64_t size, uint16_t flags);
+long long send_file_body(int sock, int fd, uint64_t offset, uint64_t size);
+int send_file_frame(int sock, int fd, uint64_t offset, uint64_t size, uint32_t request_id);
+// Multipart uploads
+int upload_prepare(void);
+int upload_path(const char *upload_id, const char *suffix, char *path);
+int upload_start(const char *dest, char *upload_id);
+FILE *upload_open_part(const char *upload_id, uint64_t offset);
+int upload_record_part(const char *upload_id, uint64_t offset, uint64_t length);
+const char *upload_finish(const char *upload_id, uint64_t size, char *dest);
+int upload_abort(const char *upload_id);
+// Ranged downloads
+char *split_range_options(char *args);
+void parse_range_options(char *opts, struct byte_range *range);
+uint64_t file_version(const struct stat *statbuf);
+int resolve_range(struct byte_range *range, const struct stat *statbuf);
+int send_range_reply(int sock, uint32_t request_id, const struct byte_range *range, const struct stat *statbuf, uint16_t flags);
+// Transfer compression
+int compressible_type(const char *name);
+long long send_deflated_body(int sock, int fd, uint64_t offset, uint64_t size, uint32_t request_id);
+// Directory walking
+void walk_files(int dir_fd, const char *rel, const char *ext, int skip_hidden, walk_fn fn, void *ctx);
+void collect_listing_page(const char *dir, const char *ext, const char *after, int limit, int want_long, struct listing_page *page);
+void free_listing_page(struct listing_page *page);
+// In-memory file catalog
+void catalog_init(const char *root, const char *snapshot);
+size_t catalog_sweep_staged(void);
+void catalog_note(const char *path);
+int catalog_list_page(const char *dir, const char *ext, const char *after, int limit, int want_long, struct listing_page *page);
+int catalog_save(void);
+uint64_t catalog_generation(void);
+void *catalog_watcher(void *arg);
+void catalog_apply_event(const struct inotify_event *ev);
+int catalog_load(void);
+void catalog_rebuild(void);
+void catalog_scan(int dir_fd, const char *rel, int recursive);
+void catalog_refresh(const char *rel);
+void catalog_remove_tree(const char *rel);
+void catalog_drop_files(const char *rel);
+void catalog_append(const char *rel, const struct stat *statbuf);
+void catalog_sort(void);
+size_t catalog_find(const char *path, int *found);
+struct catalog_dir *catalog_add_dir(const char *rel);
+void catalog_remove_dir(struct catalog_dir *d);
+struct catalog_dir *catalog_dir_by_path(const char *rel);
+struct catalog_dir *catalog_dir_by_wd(int wd);
+int catalog_abspath(const char *rel, char *path);
+int catalog_relpath(const char *path, char *rel);
+// Streaming tar writer
+int catalog_tar_list(const char *root, const char *ext, struct tar_list *list);
+void build_tar_list(const char *root, const char *ext, struct tar_list *list);
+void free_tar_list(struct tar_list *list);
+size_t tar_entry_header(char *out, const struct tar_entry *entry);
+uint64_t tar_archive_size(const struct tar_list *list);
+int tar_cache_open(const char *root, const char *ext, uint64_t *size);
+int tar_cache_prepare(void);
+int write_tar_archive(int sock, const char *root, const struct tar_list *list, uint64_t archive_size);
+int send_tar_gzip(int sock, const char *root, const char *ext, uint32_t request_id);
+int send_gzip_stream(int sock, int src_fd, uint32_t request_id);
+void *gzip_worker(void *arg);
+int send_tar_frame(int sock, const char *root, const struct tar_list *list, uint64_t archive_size, uint32_t request_id);
+int recv_payload(int sock, const struct frame_hdr *hdr, char *buffer, size_t size);
+long long recv_body(int sock, FILE *fp, int *write_error);
+int resolve_upload(const char *args, char *filename, char *full_dest_path, char *temp_path, const char **error);
+int route_upload(const char *args, char *filename, char *full_dest_path, char *temp_path, const char **error);
+int stream_file_to_server(const char *filename, const char *dest_path, int server_port, int client_sock, uint32_t client_id);
+// Durable uploads
+int stage_file(struct staged_file *file, const char *path, const char *existing);
+int staged_name(const char *name);
+void sweep_staged(const char *path, int dir_fd, const char *name, void *ctx);
+size_t sweep_staged_tree(const char *root);
+void staged_file_received(struct staged_file *file);
+void discard_file(struct staged_file *file);
+int publish_files(struct staged_file *files, int count);
+int durable_sync(const int *fds, int count, int received);
+int flush_group(struct sync_request *group);
+// Upload-skip probes
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t length);
+void sha256_final(struct sha256_ctx *ctx, unsigned char *digest);
+void sha256_blocks(uint32_t *state, const unsigned char *data, size_t count);
+void sha256_blocks_portable(uint32_t *state, const unsigned char *data, size_t count);
+void sha256_blocks_shani(uint32_t *state, const unsigned char *data, size_t count);
+int parse_digest(const char *hex, unsigned char *digest);
+int content_matches(const char *path, uint64_t size, const unsigned char *digest);
+int digest_file(int fd, uint64_t offset, uint64_t size, unsigned char *digest);
+// io_uring upload engine
+struct io_ring *ring_get(void);
+int ring_setup(struct io_ring *ring);
+void ring_close(struct io_ring *ring);
+void ring_discard(struct io_ring *ring);
+struct io_uring_sqe *ring_queue(struct io_ring *ring, uint8_t opcode, int fd, void *addr, uint32_t len, uint64_t offset, uint32_t msg_flags, uint64_t user_data);
+int ring_wait(struct io_ring *ring, struct io_uring_cqe *cqe);
+int ring_writer_start(struct ring_writer *w, FILE *fp);
+char *ring_writer_space(struct ring_writer *w, size_t *space);
+void ring_writer_commit(struct ring_writer *w, size_t length);
+void ring_writer_flush(struct ring_writer *w);
+int ring_writer_reap(struct ring_writer *w, long long *recv_result);
+ssize_t ring_writer_recv(struct ring_writer *w, int sock, uint64_t max);
+int ring_writer_finish(struct ring_writer *w, FILE *fp);
+long long ring_recv_body(int sock, FILE *fp, int *write_error);
+// Coalesced small uploads
+int small_upload_pending(int client_sock);
+int coalesce_uploads(int client_sock, uint32_t client_id, const char *filename, const char *dest_path, int server_port);
+int next_queued_upload(int client_sock, struct batch_entry *entry);
+int read_batch_body(int client_sock, struct batch_entry *entry);
+void submit_batch(int server_port, struct batch_entry **entries, int count);
+void send_upload_batch(int server_port, struct batch_entry *first, int count);
+void backend_dest_path(const char *dest_path, int server_port, char *adjusted_path);
+int relay_upload(int server_port, uint8_t opcode, const char *args, int client_sock, uint32_t client_id);
+int relay_reply(int server_port, uint8_t opcode, const char *args, int timeout_sec, int client_sock, uint32_t client_id, const char *failure);
+int upload_route(const char *upload_id, const char **backend_id);
+int download_file_from_server(const char *filepath, const char *range_opts, int server_port, uint16_t flags, int client_sock, uint32_t client_id);
+int relay_from_server(int server_port, uint8_t opcode, uint16_t flags, const char *args, int timeout_sec, int client_sock, uint32_t client_id);
+int relay_bytes(int from_sock, int to_sock, uint64_t len);
+void create_directories(const char *path);
+int receive_full(int sock, char *buffer, size_t size);
+
+int main(int argc, char *argv[]) {
+    // Parse options: -m selects fork-per-client (default) or epoll mode, -w sets epoll worker count,
+    // -r selects how proxied downloads are relayed, -z sets the threads compressing each gzip archive,
+    // -d selects how uploaded .c files are written, -g sets their group-commit window in ms
+    int use_epoll = 0, workers = DEFAULT_WORKERS, bad_opts = 0, opt_ch;
+    while ((opt_ch = getopt(argc, argv, "m:w:r:z:d:g:")) != -1) {
+        if (opt_ch == 'm' && strcmp(optarg, "epoll") == 0) use_epoll = 1;
+        else if (opt_ch == 'm' && strcmp(optarg, "fork") == 0) use_epoll = 0;
+        else if (opt_ch == 'w' && atoi(optarg) > 0) workers = atoi(optarg);
+        else if (opt_ch == 'r' && strcmp(optarg, "splice") == 0) relay_splice = 1;
+        else if (opt_ch == 'r' && strcmp(optarg, "copy") == 0) relay_splice = 0;
+        else if (opt_ch == 'z' && atoi(optarg) > 0) gzip_threads = atoi(optarg);
+        else if (opt_ch == 'd' && strcmp(optarg, "uring") == 0) use_uring = 1;
+        else if (opt_ch == 'd' && strcmp(optarg, "stdio") == 0) use_uring = 0;
+        else if (opt_ch == 'g' && strcmp(optarg, "off") == 0) commit_window_ms = -1;
+        else if (opt_ch == 'g' && strspn(optarg, "0123456789") == strlen(optarg) && *optarg) commit_window_ms = atoi(optarg);
+        else bad_opts = 1;
+    }
+
+    // Validate command-line arguments
+    if (bad_opts || argc - optind != 4) {
+        fprintf(stderr, "Usage: %s [-m fork|epoll] [-w workers] [-r splice|copy] [-z threads] [-d uring|stdio] [-g ms|off] <S1_port> <S2_port> <S3_port> <S4_port>\n", argv[0]);
+        return 1;
+    }
+
+    // Parse port numbers
+    int PORT_S1 = atoi(argv[optind]);
+    PORT_S2 = atoi(argv[optind + 1]);
+    PORT_S3 = atoi(argv[optind + 2]);
+    PORT_S4 = atoi(argv[optind + 3]);
+
+    // Validate port range
+    if (PORT_S1 < 1024 || PORT_S1 > 65535 || 
+        PORT_S2 < 1024 || PORT_S2 > 65535 || 
+        PORT_S3 < 1024 || PORT_S3 > 65535 || 
+        PORT_S4 < 1024 || PORT_S4 > 65535) {
+        fprintf(stderr, "Error: Ports must be between 1024 and 65535\n");
+        return 1;
+    }
+
+    // Ensure unique ports
+    if (PORT_S1 == PORT_S2 || PORT_S1 == PORT_S3 || PORT_S1 == PORT_S4 ||
+        PORT_S2 == PORT_S3 || PORT_S2 == PORT_S4 || PORT_S3 == PORT_S4) {
+        fprintf(stderr, "Error: All ports must be unique\n");
+        return 1;
+    }
+
+    // Initialize server and client address structures
+    struct sockaddr_in server_addr, client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+    // Set up signal handler for SIGINT
+    struct sigaction sa = {.sa_handler = signal_handler, .sa_flags = SA_RESTART};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+
+    // Create server socket
+    server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+    // Allow socket reuse
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(PORT_S1);
+
+    // Bind socket to address
+    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind failed");
+        close(server_sock);
+        return 1;
+    }
+    // Listen for incoming connections; a deep backlog absorbs connection storms
+    listen(server_sock, SOMAXCONN);
+    printf("S1 listening on port %d (%s mode)...\n", PORT_S1, use_epoll ? "epoll" : "fork");
+
+    // Stage multipart uploads of .c files, dropping those abandoned while S1 was down
+    upload_prepare();
+
+    if (use_epoll) {
+        // Catalog the stored .c files for listings and archives. Fork mode walks the tree
+        // instead, since each child would only hold a copy that is never updated.
+        char *home = getenv("HOME");
+        if (home) {
+            char root[PATH_MAX], snapshot[PATH_MAX];
+            snprintf(root, PATH_MAX, "%s/S1", home);
+            snprintf(snapshot, PATH_MAX, "%s/.S1.catalog", home);
+            catalog_init(root, snapshot);
+        }
+        // Multiplex all sessions in this process instead of forking per client
+        run_event_loop(workers);
+        close(server_sock);
+        if (catalog.inotify_fd >= 0) catalog_save();
+        return 0;
+    }
+
+    // Fork mode keeps no catalog, so staged files of uploads a crash interrupted are
+    // found by walking the tree
+    char *home = getenv("HOME");
+    if (home) {
+        char root[PATH_MAX];
+        snprintf(root, PATH_MAX, "%s/S1", home);
+        size_t swept = sweep_staged_tree(root);
+        if (swept > 0) printf("S1: Removed %zu staged files of interrupted uploads\n", swept);
+    }
+
+    // Main server loop
+    while (keep_running) {
+        // Accept client connection
+        int client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &addr_len);
+        if (client_sock < 0) {
+            if (!keep_running) break;
+            continue;
+        }
+        // Listing pages end in small frames that must not wait for a delayed ACK
+        setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        // Fork to handle client
+        pid_t pid = fork();
+        if (pid == 0) {
+            // Child process
+            close(server_sock);
+            prcclient(client_sock);
+            close(client_sock);
+            exit(0);
+        }
+        // Parent process
+        close(client_sock);
+        // Reap terminated children
+        while (waitpid(-1, NULL, WNOHANG) > 0);
+    }
+    close(server_sock);
+    return 0;
+}
+
+// Process client requests
+void prcclient(int client_sock) {
+    char args[MAX_ARGS_SIZE];
+    while (1) {
+        // Receive the next request header and its arguments
+        struct frame_hdr req;
+        int rc = recv_frame(client_sock, &req);
+        if (rc == -2) send_reply(client_sock, req.request_id, ST_ERROR, "Unsupported protocol version");
+        if (rc < 0 || recv_payload(client_sock, &req, args, sizeof(args)) < 0) return;
+        if (handle_request(client_sock, &req, args) < 0) return;
+    }
+}
+
+// Event-driven front end: one epoll loop owns every idle session and hands
+// sessions with a pending command to a fixed pool of worker threads
+void run_event_loop(int workers) {
+    // A dead client must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Idle sessions only cost a descriptor, so allow as many as the hard limit
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        return;
+    }
+
+    // Start workers with SIGINT blocked so shutdown always interrupts epoll_wait
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    for (int i = 0; i < workers; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, session_worker, NULL) == 0) pthread_detach(tid);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    // The listening socket is registered with a NULL session pointer
+    fcntl(server_sock, F_SETFL, fcntl(server_sock, F_GETFL) | O_NONBLOCK);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sock, &ev);
+    printf("S1: Event loop started with %d workers\n", workers);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (keep_running) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct session *s = events[i].data.ptr;
+            if (!s) {
+                // Accept every pending connection
+                while (1) {
+                    int client_sock = accept4(server_sock, NULL, NULL, SOCK_CLOEXEC);
+                    if (client_sock < 0) break;
+                    int nodelay = 1;
+                    setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+                    // Workers block on a request's file data, so a stalled client must not
+                    // hold one forever; the event loop itself never blocks on the socket
+                    struct timeval tv = {.tv_sec = CLIENT_STALL_TIMEOUT, .tv_usec = 0};
+                    setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                    setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+                    s = calloc(1, sizeof(*s));
+                    s->fd = client_sock;
+                    // One-shot: a session is never reported again until a worker re-arms it
+                    struct epoll_event cev = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = s};
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &cev) < 0) {
+                        close(client_sock);
+                        free(s);
+                    }
+                }
+                continue;
+            }
+            // Read what has arrived of the next request; only complete requests reach a worker
+            int rc = session_read(s);
+            if (rc < 0) {
+                // Closing also removes the session from the epoll set
+                close(s->fd);
+                free(s->args);
+                free(s);
+                continue;
+            }
+            if (rc == 0) {
+                struct epoll_event rev = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = s};
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->fd, &rev);
+                continue;
+            }
+            // Queue the session for a worker
+            pthread_mutex_lock(&ready_lock);
+            if (ready_tail) ready_tail->next = s;
+            else ready_head = s;
+            ready_tail = s;
+            pthread_cond_signal(&ready_cond);
+            pthread_mutex_unlock(&ready_lock);
+        }
+    }
+    close(epoll_fd);
+}
+
+// Read the header and arguments of the next request without blocking. Returns 1 once
+// the request is complete, 0 if more input is needed, or -1 if the session must be closed.
+int session_read(struct session *s) {
+    while (s->hdr_got < sizeof(s->hdr)) {
+        ssize_t n = recv(s->fd, (char*)&s->hdr + s->hdr_got, sizeof(s->hdr) - s->hdr_got, MSG_DONTWAIT);
+        if (n == 0) return -1;
+        if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        s->hdr_got += n;
+        if (s->hdr_got < sizeof(s->hdr)) continue;
+        int rc = decode_frame(&s->hdr);
+        if (rc == -2) send_reply(s->fd, s->hdr.request_id, ST_ERROR, "Unsupported protocol version");
+        if (rc < 0 || s->hdr.length >= MAX_ARGS_SIZE) return -1;
+        s->args = malloc(s->hdr.length + 1);
+        s->args_got = 0;
+    }
+    while (s->args_got < s->hdr.length) {
+        ssize_t n = recv(s->fd, s->args + s->args_got, s->hdr.length - s->args_got, MSG_DONTWAIT);
+        if (n == 0) return -1;
+        if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        s->args_got += n;
+    }
+    s->args[s->hdr.length] = '\0';
+    return 1;
+}
+
+// Worker thread: run each queued request, then return the session to the event loop
+void *session_worker(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&ready_lock);
+        while (!ready_head) pthread_cond_wait(&ready_cond, &ready_lock);
+        struct session *s = ready_head;
+        ready_head = s->next;
+        if (!ready_head) ready_tail = NULL;
+        s->next = NULL;
+        pthread_mutex_unlock(&ready_lock);
+
+        // Any file data is read here, so a large upload only occupies this worker
+        int rc = handle_request(s->fd, &s->hdr, s->args);
+        free(s->args);
+        s->args = NULL;
+        s->hdr_got = 0;
+
+        // Wait for the next request from this client
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = s};
+        if (rc < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->fd, &ev) < 0) {
+            close(s->fd);
+            free(s);
+        }
+    }
+    return NULL;
+}
+
+// Execute one client request; returns 0 to keep the session open, -1 to close it
+int handle_request(int client_sock, const struct frame_hdr *req, char *args) {
+    char buffer[BUFFER_SIZE];
+    uint32_t id = req->request_id;
+    // Single-path requests take the whole argument string
+    char *param1 = args;
+
+    if (req->opcode == OP_UPLOADF) {
+        printf("S1: Received uploadf command: %s\n", args);
+        char filename[256], full_dest_path[PATH_MAX], temp_path[PATH_MAX];
+        const char *error;
+        int ignored = 0;
+        int port = route_upload(args, filename, full_dest_path, temp_path, &error);
+        if (port < 0) {
+            // Drain the file data so the session stays in sync
+            if (recv_body(client_sock, NULL, &ignored) < 0) return -1;
+            send_reply(client_sock, id, ST_ERROR, error);
+            return 0;
+        }
+        printf("S1: Local file path: %s\n", temp_path);
+
+        if (port) {
+            // Small files go out in batches with other small uploads to the same server;
+            // others are routed without touching S1's disk
+            if (small_upload_pending(client_sock))
+                return coalesce_uploads(client_sock, id, filename, full_dest_path, port);
+            return stream_file_to_server(filename, full_dest_path, port, client_sock, id);
+        }
+
+        // Store .c files locally, replacing any existing file only once stored
+        struct staged_file file;
+        if (stage_file(&file, temp_path, NULL) < 0) {
+            char error_msg[BUFFER_SIZE];
+            snprintf(error_msg, BUFFER_SIZE, "Upload failed: Cannot write file (%s)", strerror(errno));
+            if (recv_body(client_sock, NULL, &ignored) < 0) return -1;
+            send_reply(client_sock, id, ST_ERROR, error_msg);
+            return 0;
+        }
+        // Receive and write file data
+        int write_error = 0;
+        long long total_bytes = recv_body(client_sock, file.fp, &write_error);
+        if (total_bytes < 0) {
+            discard_file(&file);
+            return -1;
+        }
+        if (write_error) {
+            discard_file(&file);
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: Error writing file");
+            return 0;
+        }
+        if (total_bytes == 0) {
+            discard_file(&file);
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: No data received");
+            return 0;
+        }
+        staged_file_received(&file);
+        if (publish_files(&file, 1) == 0) {
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: Error writing file");
+            return 0;
+        }
+        send_reply(client_sock, id, ST_OK, "Stored successfully");
+        printf("S1: Stored %s (%lld bytes)\n", temp_path, total_bytes);
+        catalog_note(temp_path);
+    } else if (req->opcode == OP_DOWNLF) {
+        printf("S1: Received downlf command: %s\n", args);
+        // The path may be followed by range options, which are passed on to S2-S4 as they are
+        char *range_opts = split_range_options(param1);
+        // Validate file path
+        if (strlen(param1) == 0) {
+            send_reply(client_sock, id, ST_ERROR, "No file path provided");
+            return 0;
+        }
+
+        // Construct file path
+        char filepath[PATH_MAX];
+        char *home = getenv("HOME");
+        if (!home) {
+            send_reply(client_sock, id, ST_ERROR, "HOME environment variable not set");
+            return 0;
+        }
+        if (strncmp(param1, "~S1/", 4) == 0) {
+            snprintf(filepath, PATH_MAX, "%s/S1/%s", home, param1 + 4);
+        } else {
+            snprintf(filepath, PATH_MAX, "%s/S1/%s", home, param1);
+        }
+        printf("S1: Processing download request for %s\n", filepath);
+
+        // Validate file extension
+        char *ext = strrchr(filepath, '.');
+        if (!ext || (strcmp(ext, ".c") != 0 && strcmp(ext, ".pdf") != 0 && 
+                    strcmp(ext, ".txt") != 0 && strcmp(ext, ".zip") != 0)) {
+            send_reply(client_sock, id, ST_ERROR, "Only .c, .pdf, .txt, .zip supported");
+            return 0;
+        }
+
+        if (strcmp(ext, ".c") == 0) {
+            // Handle .c files locally
+            struct byte_range range;
+            parse_range_options(range_opts, &range);
+            struct stat statbuf;
+            int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+            if (fd < 0 || fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode)) {
+                if (fd >= 0) close(fd);
+                send_reply(client_sock, id, ST_ERROR, "File not found");
+                return 0;
+            }
+            if (resolve_range(&range, &statbuf) < 0) {
+                close(fd);
+                send_reply(client_sock, id, ST_ERROR, "Offset beyond end of file");
+                return 0;
+            }
+            // Deflate the body if the client accepts it
+            int deflated = (req->flags & FL_DEFLATE) && compressible_type(filepath);
+            uint16_t flags = deflated ? FL_DEFLATE : 0;
+            printf("S1: Sending file size for %s: %lu bytes from %lu\n", filepath, range.length, range.offset);
+            if ((range.ranged ? send_range_reply(client_sock, id, &range, &statbuf, flags) :
+                                send_size_reply(client_sock, id, range.length, flags)) < 0) {
+                printf("S1: Failed to send file size to client\n");
+                close(fd);
+                return -1;
+            }
+            if (deflated) {
+                long long sent = send_deflated_body(client_sock, fd, range.offset, range.length, id);
+                close(fd);
+                if (sent < 0) {
+                    printf("S1: Send error for %s\n", filepath);
+                    return -1;
+                }
+                printf("S1: Sent %s to client (%lu bytes, %lld deflated)\n", filepath, range.length, sent);
+                return 0;
+            }
+            // Send file as one DATA frame; a short transfer leaves the frame incomplete,
+            // so the session cannot continue
+            int rc = send_file_frame(client_sock, fd, range.offset, range.length, id);
+            close(fd);
+            if (rc < 0) {
+                printf("S1: Send error for %s\n", filepath);
+                return -1;
+            }
+            printf("S1: Sent %s to client (%lu bytes)\n", filepath, range.length);
+        } else {
+            // Route download to other servers. The storage server compresses the body and
+            // S1 relays it as it is, so it is deflated once however many hops it takes.
+            int port = (strcmp(ext, ".pdf") == 0) ? PORT_S2 :
+                      (strcmp(ext, ".txt") == 0) ? PORT_S3 :
+                      (strcmp(ext, ".zip") == 0) ? PORT_S4 : 0;
+            uint16_t flags = (req->flags & FL_DEFLATE) && compressible_type(filepath) ? FL_DEFLATE : 0;
+            return download_file_from_server(filepath, range_opts, port, flags, client_sock, id);
+        }
+    } else if (req->opcode == OP_REMOVEF) {
+        printf("S1: Received removef command: %s\n", args);
+        // Construct file path
+        char filepath[PATH_MAX];
+        char *home = getenv("HOME");
+        if (!home) {
+            send_reply(client_sock, id, ST_ERROR, "Remove failed: HOME environment variable not set");
+            return 0;
+        }
+        if (strncmp(param1, "~S1/", 4) == 0) {
+            snprintf(filepath, PATH_MAX, "%s/S1/%s", home, param1 + 4);
+        } else {
+            snprintf(filepath, PATH_MAX, "%s/S1/%s", home, param1);
+        }
+
+        // Get file extension
+        char *ext = strrchr(filepath, '.');
+        if (!ext) {
+            send_reply(client_sock, id, ST_ERROR, "Remove failed: No file extension");
+            return 0;
+        }
+        ext++;
+
+        if (strcmp(ext, "c") == 0) {
+            // Remove .c files locally
+            struct stat statbuf;
+            if (stat(filepath, &statbuf) == 0) {
+                if (S_ISREG(statbuf.st_mode)) {
+                    if (remove(filepath) == 0) {
+                        send_reply(client_sock, id, ST_OK, "File removed successfully");
+                        printf("S1: Removed %s\n", filepath);
+                        catalog_note(filepath);
+                    } else {
+                        send_reply(client_sock, id, ST_ERROR, "Remove failed: Permission denied");
+                    }
+                } else {
+                    send_reply(client_sock, id, ST_ERROR, "Remove failed: Not a regular file");
+                }
+            } else {
+                send_reply(client_sock, id, ST_ERROR, "Remove failed: File not found");
+            }
+        } else if (strcmp(ext, "pdf") == 0 || strcmp(ext, "txt") == 0) {
+            // Forward remove request to S2 or S3
+            int port = (strcmp(ext, "pdf") == 0) ? PORT_S2 : PORT_S3;
+
+            // Adjust path for target server
+            char server_dir[4];
+            snprintf(server_dir, 4, "S%d", (port == PORT_S2) ? 2 : 3);
+            char adjusted_path[PATH_MAX];
+            snprintf(adjusted_path, PATH_MAX, "%s/%s/%s", home, server_dir, param1 + 4);
+
+            struct frame_hdr reply;
+            int sock = backend_request(port, OP_REMOVEF, 0, adjusted_path, 5, &reply);
+            if (sock == -1) {
+                send_reply(client_sock, id, ST_ERROR, "Remove failed: Cannot connect to server");
+                return 0;
+            }
+
+            // Receive and forward server response
+            if (sock >= 0 && recv_payload(sock, &reply, buffer, BUFFER_SIZE) == 0) {
+                pool_release(port, sock);
+                send_reply(client_sock, id, reply.status, buffer);
+            } else {
+                if (sock >= 0) close(sock);
+                send_reply(client_sock, id, ST_ERROR, "Remove failed: No response from server");
+            }
+        } else {
+            send_reply(client_sock, id, ST_ERROR, "Remove failed: Unsupported file type");
+        }
+    } else if (req->opcode == OP_DOWNLTAR) {
+        printf("S1: Received downltar command: %s\n", args);
+        // Arguments are the file type, then "gzip" for a compressed archive
+        char filetype[16] = {0}, option[16] = {0};
+        sscanf(args, "%15s %15s", filetype, option);
+        // Validate file type
+        if (strlen(filetype) == 0) {
+            send_reply(client_sock, id, ST_ERROR, "Download failed: No file type provided");
+            return 0;
+        }
+        if (strcmp(filetype, ".c") != 0 && strcmp(filetype, ".pdf") != 0 && strcmp(filetype, ".txt") != 0) {
+            send_reply(client_sock, id, ST_ERROR, "Download failed: Invalid file type");
+            return 0;
+        }
+        if (option[0] && strcmp(option, "gzip") != 0) {
+            send_reply(client_sock, id, ST_ERROR, "Download failed: Unknown archive format");
+            return 0;
+        }
+
+        if (strcmp(filetype, ".c") != 0) {
+            // Relay the archive S2 or S3 streams, without staging it on S1; compressed
+            // archives are compressed there, once
+            int port = strcmp(filetype, ".pdf") == 0 ? PORT_S2 : PORT_S3;
+            return relay_from_server(port, OP_DOWNLTAR, 0, args, 0, client_sock, id);
+        }
+
+        char root[PATH_MAX];
+        char *home = getenv("HOME");
+        if (!home) {
+            send_reply(client_sock, id, ST_ERROR, "Download failed: HOME environment variable not set");
+            return 0;
+        }
+        snprintf(root, PATH_MAX, "%s/S1", home);
+
+        if (option[0]) {
+            int rc = send_tar_gzip(client_sock, root, ".c", id);
+            if (rc == -2) send_reply(client_sock, id, ST_ERROR, "Download failed: No .c files found");
+            else printf("S1: Sent gzip archive of .c files to client\n");
+            return rc == -1 ? -1 : 0;
+        }
+
+        // Serve the cached archive while the stored files are unchanged
+        uint64_t archive_size;
+        int cache_fd = tar_cache_open(root, ".c", &archive_size);
+        if (cache_fd == -2) {
+            send_reply(client_sock, id, ST_ERROR, "Download failed: No .c files found");
+            return 0;
+        }
+        if (cache_fd >= 0) {
+            int rc = send_size_reply(client_sock, id, archive_size, 0) < 0 ? -1 :
+                     send_file_frame(client_sock, cache_fd, 0, archive_size, id);
+            close(cache_fd);
+            printf("S1: Sent cached archive (%lu bytes) to client\n", archive_size);
+            return rc;
+        }
+
+        // Otherwise list local .c files; the archive is generated while it is sent
+        struct tar_list list;
+        build_tar_list(root, ".c", &list);
+        if (list.count == 0) {
+            send_reply(client_sock, id, ST_ERROR, "Download failed: No .c files found");
+            free_tar_list(&list);
+            return 0;
+        }
+
+        // Send archive size, then the archive as one DATA frame
+        archive_size = tar_archive_size(&list);
+        int rc = send_size_reply(client_sock, id, archive_size, 0) < 0 ? -1 :
+                 send_tar_frame(client_sock, root, &list, archive_size, id);
+        printf("S1: Sent archive of %zu .c files (%lu bytes) to client\n", list.count, archive_size);
+        free_tar_list(&list);
+        if (rc < 0) return -1;
+    } else if (req->opcode == OP_DISPFNAMES) {
+        printf("S1: Received dispfnames command: %s\n", args);
+        // Arguments are the directory followed by paging options
+        char dir[PATH_MAX] = {0}, after[PATH_MAX];
+        int consumed = 0, limit, want_long, want_paths;
+        sscanf(args, "%4095s %n", dir, &consumed);
+        parse_listing_options(args + consumed, after, sizeof(after), &limit, &want_long, &want_paths);
+        if (limit == 0 || limit > LISTING_MAX_PAGE) limit = LISTING_MAX_PAGE;
+
+        // The cursor "<part>:<path>" names the last entry of the previous page
+        int start = 0;
+        const char *after_path = "";
+        if (after[0] && strchr(after, ':')) {
+            start = atoi(after);
+            after_path = strchr(after, ':') + 1;
+        }
+
+        // Construct directory path
+        char pathname[PATH_MAX];
+        char *home = getenv("HOME");
+        if (!home) {
+            send_reply(client_sock, id, ST_ERROR, "No files found: HOME environment variable not set");
+            return 0;
+        }
+        if (strncmp(dir, "~S1/", 4) == 0) {
+            snprintf(pathname, PATH_MAX, "%s/S1/%s", home, dir + 4);
+        } else {
+            snprintf(pathname, PATH_MAX, "%s/S1/%s", home, dir);
+        }
+
+        // A listing is the OK reply, DATA frames of entries, and a final DATA frame holding
+        // the cursor for the next page; an empty listing means no files were found
+        if (send_reply(client_sock, id, ST_OK, "") < 0) return -1;
+        struct stat statbuf;
+        if (strlen(dir) == 0 || stat(pathname, &statbuf) != 0 || !S_ISDIR(statbuf.st_mode) || start < 0 || start > 3)
+            return send_frame(client_sock, OP_DATA, 0, 0, id, NULL, 0);
+
+        // Scan locally and query S2, S3 and S4 at the same time, each for at most one page
+        char *types[] = {".c", ".pdf", ".txt", ".zip"};
+        int ports[] = {0, PORT_S2, PORT_S3, PORT_S4};
+        struct listing_job *job = calloc(1, sizeof(*job));
+        pthread_mutex_init(&job->lock, NULL);
+        pthread_cond_init(&job->cond, NULL);
+        job->refs = 1;
+        for (int i = start; i < 4; i++) {
+            struct listing_part *part = &job->parts[i];
+            part->job = job;
+            part->port = ports[i];
+            int n;
+            if (i == 0)
+                n = snprintf(part->args, sizeof(part->args), "%s %s", pathname, types[i]);
+            else
+                n = snprintf(part->args, sizeof(part->args), "%s/S%d/%s %s", home, i + 1, dir + 4, types[i]);
+            snprintf(part->args + n, sizeof(part->args) - n, " limit=%d%s%s%s", limit, want_long ? " long" : "",
+                     i == start && after_path[0] ? " after=" : "", i == start ? after_path : "");
+            pthread_mutex_lock(&job->lock);
+            job->pending++;
+            job->refs++;
+            pthread_mutex_unlock(&job->lock);
+            pthread_t tid;
+            if (pthread_create(&tid, NULL, listing_worker, part) == 0) pthread_detach(tid);
+            else listing_worker(part);
+        }
+
+        // Stream the parts in type order as they complete, until the page is full. Parts
+        // still missing at the deadline are left out of the answer.
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += LISTING_DEADLINE;
+        char frame[LISTING_FRAME], entry[PATH_MAX + 64];
+        char cursor[PATH_MAX + 16] = "", last[PATH_MAX + 16] = "";
+        size_t frame_len = 0;
+        int emitted = 0, rc = 0;
+        for (int i = start; i < 4 && rc == 0 && !cursor[0]; i++) {
+            struct listing_part *part = &job->parts[i];
+            pthread_mutex_lock(&job->lock);
+            while (!part->done && pthread_cond_timedwait(&job->cond, &job->lock, &deadline) != ETIMEDOUT);
+            int done = part->done;
+            pthread_mutex_unlock(&job->lock);
+            if (!done) {
+                printf("S1: dispfnames: no %s listing from port %d within %d s\n", types[i], ports[i], LISTING_DEADLINE);
+                continue;
+            }
+            // A finished part is no longer written, so it can be read without the lock
+            for (char *line = part->entries; rc == 0 && line && line < part->entries + part->len; ) {
+                char *end = memchr(line, '\n', part->entries + part->len - line);
+                if (!end) break;
+                if (emitted == limit) {
+                    snprintf(cursor, sizeof(cursor), "%s", last);
+                    break;
+                }
+                // Clients see the file name unless they asked for paths; the cursor keeps
+                // the full relative path
+                size_t path_len = strcspn(line, "\t\n");
+                char *name = want_paths ? NULL : memrchr(line, '/', path_len);
+                name = name ? name + 1 : line;
+                int entry_len = snprintf(entry, sizeof(entry), "%.*s", (int)(end - name + 1), name);
+                if (entry_len < (int)sizeof(entry))
+                    rc = queue_listing_line(client_sock, id, frame, &frame_len, entry, entry_len);
+                snprintf(last, sizeof(last), "%d:%.*s", i, (int)path_len, line);
+                emitted++;
+                line = end + 1;
+            }
+            if (!cursor[0] && emitted == limit && part->more) snprintf(cursor, sizeof(cursor), "%s", last);
+        }
+        release_listing_job(job);
+        if (rc < 0 || (frame_len > 0 && send_frame(client_sock, OP_DATA, FL_MORE, 0, id, frame, frame_len) < 0) ||
+            send_frame(client_sock, OP_DATA, 0, 0, id, cursor, strlen(cursor)) < 0) return -1;
+        printf("S1: Listed %d entries of %s\n", emitted, pathname);
+    } else if (req->opcode == OP_UPLOAD_INIT) {
+        printf("S1: Received upload init command: %s\n", args);
+        // Parts are staged by the server that will store the file, exactly as for uploadf
+        char filename[256], full_dest_path[PATH_MAX], temp_path[PATH_MAX];
+        const char *error;
+        int port = route_upload(args, filename, full_dest_path, temp_path, &error);
+        if (port < 0) {
+            send_reply(client_sock, id, ST_ERROR, error);
+            return 0;
+        }
+
+        // The id handed to the client is prefixed with the server staging the upload
+        if (!port) {
+            char upload_id[UPLOAD_ID_LEN + 1];
+            if (upload_start(temp_path, upload_id) < 0) {
+                send_reply(client_sock, id, ST_ERROR, "Upload failed: Cannot stage upload");
+                return 0;
+            }
+            snprintf(buffer, BUFFER_SIZE, "S1-%s", upload_id);
+            send_reply(client_sock, id, ST_OK, buffer);
+            printf("S1: Started upload %s of %s\n", buffer, temp_path);
+            return 0;
+        }
+        char adjusted_path[PATH_MAX], request[PATH_MAX + 256], server_reply[BUFFER_SIZE];
+        backend_dest_path(full_dest_path, port, adjusted_path);
+        snprintf(request, sizeof(request), "%s %s", filename, adjusted_path);
+        struct frame_hdr reply;
+        int sock = backend_request(port, OP_UPLOAD_INIT, 0, request, 5, &reply);
+        if (sock == -1) {
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: Server connection error");
+            return 0;
+        }
+        if (sock >= 0 && recv_payload(sock, &reply, server_reply, BUFFER_SIZE) == 0) {
+            pool_release(port, sock);
+            if (reply.status == ST_OK) {
+                snprintf(buffer, BUFFER_SIZE, "S%d-%s", port == PORT_S2 ? 2 : port == PORT_S3 ? 3 : 4, server_reply);
+                send_reply(client_sock, id, ST_OK, buffer);
+                printf("S1: Started upload %s of %s\n", buffer, adjusted_path);
+            } else {
+                send_reply(client_sock, id, reply.status, server_reply);
+            }
+        } else {
+            if (sock >= 0) close(sock);
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: No response from server");
+        }
+    } else if (req->opcode == OP_UPLOAD_PART) {
+        // Arguments are the upload id and the offset of the part
+        char upload_id[32] = {0};
+        const char *backend_id = NULL;
+        unsigned long offset = 0;
+        int port = -1;
+        if (sscanf(args, "%31s %lu", upload_id, &offset) == 2) port = upload_route(upload_id, &backend_id);
+        if (port > 0) {
+            // Stream the part straight to the server staging the upload
+            snprintf(buffer, BUFFER_SIZE, "%s %lu", backend_id, offset);
+            return relay_upload(port, OP_UPLOAD_PART, buffer, client_sock, id);
+        }
+        // An unknown upload still has its data drained to keep the session in sync
+        FILE *fp = port == 0 ? upload_open_part(backend_id, offset) : NULL;
+        int write_error = 0;
+        long long total_bytes = recv_body(client_sock, fp, &write_error);
+        if (fp && fclose(fp) != 0) write_error = 1;
+        if (total_bytes < 0) return -1;
+        if (!fp) {
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: Unknown upload");
+        } else if (write_error || upload_record_part(backend_id, offset, total_bytes) < 0) {
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: Error writing file");
+        } else {
+            send_reply(client_sock, id, ST_OK, "Part stored");
+        }
+    } else if (req->opcode == OP_UPLOAD_COMPLETE) {
+        printf("S1: Received upload complete command: %s\n", args);
+        char upload_id[32] = {0}, temp_path[PATH_MAX];
+        const char *backend_id = NULL;
+        unsigned long size = 0;
+        int port = -1;
+        if (sscanf(args, "%31s %lu", upload_id, &size) == 2) port = upload_route(upload_id, &backend_id);
+        if (port > 0) {
+            snprintf(buffer, BUFFER_SIZE, "%s %lu", backend_id, size);
+            // The server flushes the whole assembled file before it replies, so no limit is set
+            relay_reply(port, OP_UPLOAD_COMPLETE, buffer, 0, client_sock, id, "Upload failed: No response from server");
+            return 0;
+        }
+        const char *error = port == 0 ? upload_finish(backend_id, size, temp_path) : "Upload failed: Unknown upload";
+        if (error) {
+            send_reply(client_sock, id, ST_ERROR, error);
+            return 0;
+        }
+        send_reply(client_sock, id, ST_OK, "Stored successfully");
+        printf("S1: Stored %s (%lu bytes)\n", temp_path, size);
+        catalog_note(temp_path);
+    } else if (req->opcode == OP_UPLOAD_ABORT) {
+        printf("S1: Received upload abort command: %s\n", args);
+        const char *backend_id = NULL;
+        int port = upload_route(args, &backend_id);
+        if (port > 0)
+            relay_reply(port, OP_UPLOAD_ABORT, backend_id, 5, client_sock, id, "Abort failed: No response from server");
+        else if (port == 0 && upload_abort(backend_id) == 0)
+            send_reply(client_sock, id, ST_OK, "Upload aborted");
+        else
+            send_reply(client_sock, id, ST_ERROR, "Abort failed: Unknown upload");
+    } else if (req->opcode == OP_UPLOAD_PROBE) {
+        printf("S1: Received upload probe: %s\n", args);
+        char filename[256], full_dest_path[PATH_MAX], temp_path[PATH_MAX], hex[2 * SHA256_LEN + 1];
+        unsigned char digest[SHA256_LEN];
+        unsigned long size;
+        const char *error;
+        if (sscanf(args, "%*s %*s %lu %64s", &size, hex) != 2 || parse_digest(hex, digest) < 0) {
+            send_reply(client_sock, id, ST_ERROR, "Probe failed: Malformed request");
+            return 0;
+        }
+        // Directories are created only once a copy is published, so a miss leaves the tree as it was
+        int port = resolve_upload(args, filename, full_dest_path, temp_path, &error);
+        if (port < 0) {
+            send_reply(client_sock, id, ST_ERROR, error);
+            return 0;
+        }
+        // The server that would store the file decides whether it already holds the content
+        if (port) {
+            char adjusted_path[PATH_MAX];
+            backend_dest_path(full_dest_path, port, adjusted_path);
+            snprintf(buffer, BUFFER_SIZE, "%s %s %lu %s", filename, adjusted_path, size, hex);
+            // The server hashes the whole stored file to answer, so no limit is set. If it
+            // published a copy of the file, S1 keeps its directory for dispfnames.
+            if (relay_reply(port, OP_UPLOAD_PROBE, buffer, 0, client_sock, id, "Content not held") == ST_OK) {
+                char *dir_path = strdup(temp_path);
+                create_directories(dirname(dir_path));
+                free(dir_path);
+            }
+            return 0;
+        }
+        if (size > 0 && content_matches(temp_path, size, digest)) {
+            send_reply(client_sock, id, ST_OK, "Stored successfully (content already held, nothing sent)");
+            printf("S1: %s already holds the probed content (%lu bytes)\n", temp_path, size);
+        } else {
+            send_reply(client_sock, id, ST_ERROR, "Content not held");
+        }
+    } else {
+        send_reply(client_sock, id, ST_ERROR, "Unknown command");
+    }
+    return 0;
+}
+
+// Gather one part of a dispfnames listing: the local .c scan, or one server's reply
+void *listing_worker(void *arg) {
+    struct listing_part *part = arg;
+    char *entries = NULL;
+    size_t len = 0, cap = 0;
+    int more = 0;
+    if (part->port == 0) {
+        // Local .c files, as "path<TAB>size<TAB>mtime" sorted bytewise to match the cursor
+        char pathname[PATH_MAX], type[16], after[PATH_MAX];
+        int consumed = 0, limit, want_long, want_paths;
+        sscanf(part->args, "%4095s %15s %n", pathname, type, &consumed);
+        parse_listing_options(part->args + consumed, after, sizeof(after), &limit, &want_long, &want_paths);
+        struct listing_page page;
+        collect_listing_page(pathname, type, after, limit, want_long, &page);
+        cap = (size_t)page.count * 48 + 1;
+        for (int i = 0; i < page.count; i++) cap += strlen(page.entries[i].path);
+        entries = malloc(cap);
+        for (int i = 0; i < page.count; i++) {
+            struct page_entry *e = &page.entries[i];
+            len += want_long ? sprintf(entries + len, "%s\t%lu\t%lld\n", e->path, e->size, (long long)e->mtime)
+                             : sprintf(entries + len, "%s\n", e->path);
+        }
+        more = page.more;
+        free_listing_page(&page);
+    } else {
+        // Request a page from the storage server: entry DATA frames, then the cursor frame
+        struct frame_hdr reply, data;
+        char status[BUFFER_SIZE];
+        int sock = backend_request(part->port, OP_DISPFNAMES, 0, part->args, LISTING_DEADLINE, &reply);
+        int ok = sock >= 0 && recv_payload(sock, &reply, status, BUFFER_SIZE) == 0 && reply.status == ST_OK;
+        while (ok) {
+            if (recv_frame(sock, &data) < 0 || data.opcode != OP_DATA || data.length > LISTING_FRAME + 2 * PATH_MAX) {
+                ok = 0;
+                break;
+            }
+            if (len + data.length + 1 > cap) {
+                cap = (len + data.length + 1) * 2;
+                entries = realloc(entries, cap);
+            }
+            if (receive_full(sock, entries + len, data.length) < 0) {
+                ok = 0;
+                break;
+            }
+            if (!(data.flags & FL_MORE)) {
+                more = data.length > 0;
+                break;
+            }
+            len += data.length;
+        }
+        if (ok) pool_release(part->port, sock);
+        else if (sock >= 0) close(sock);
+        if (!ok) len = 0;
+    }
+
+    // Publish the result; whoever drops the last reference frees the job
+    struct listing_job *job = part->job;
+    pthread_mutex_lock(&job->lock);
+    part->entries = entries;
+    part->len = len;
+    part->more = more;
+    part->done = 1;
+    job->pending--;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    release_listing_job(job);
+    return NULL;
+}
+
+// Drop one reference to a listing job, freeing it with the last one
+void release_listing_job(struct listing_job *job) {
+    pthread_mutex_lock(&job->lock);
+    int last = --job->refs == 0;
+    pthread_mutex_unlock(&job->lock);
+    if (!last) return;
+    for (int i = 0; i < 4; i++) free(job->parts[i].entries);
+    free(job);
+}
+
+// Connect to another server
+int connect_to_server(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in server_addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = inet_addr("127.0.0.1")};
+    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    // Requests and replies are small frames on a long-lived connection
+    int opt = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    return sock;
+}
+
+// Map a storage server port to its connection pool
+static struct backend_pool *pool_for(int port) {
+    return &pools[port == PORT_S2 ? 0 : port == PORT_S3 ? 1 : 2];
+}
+
+// An idle connection is healthy if the server has neither closed it nor sent unsolicited data
+int connection_healthy(int sock) {
+    char byte;
+    ssize_t n = recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// Get a connection to a storage server, reusing a healthy idle one when possible
+int pool_acquire(int port, int *reused) {
+    struct backend_pool *pool = pool_for(port);
+    time_t now = time(NULL);
+    while (1) {
+        pthread_mutex_lock(&pool_lock);
+        if (pool->count == 0) {
+            pthread_mutex_unlock(&pool_lock);
+            break;
+        }
+        pool->count--;
+        int sock = pool->socks[pool->count];
+        time_t idle_since = pool->idle_since[pool->count];
+        pthread_mutex_unlock(&pool_lock);
+        if (now - idle_since < POOL_IDLE_TIMEOUT && connection_healthy(sock)) {
+            *reused = 1;
+            return sock;
+        }
+        close(sock);
+    }
+    *reused = 0;
+    return connect_to_server(port);
+}
+
+// Return a connection after a complete request/reply exchange, dropping expired ones
+void pool_release(int port, int sock) {
+    struct backend_pool *pool = pool_for(port);
+    time_t now = time(NULL);
+    int expired[POOL_MAX_IDLE], n_expired = 0;
+    pthread_mutex_lock(&pool_lock);
+    int kept = 0;
+    for (int i = 0; i < pool->count; i++) {
+        if (now - pool->idle_since[i] >= POOL_IDLE_TIMEOUT) {
+            expired[n_expired++] = pool->socks[i];
+        } else {
+            pool->socks[kept] = pool->socks[i];
+            pool->idle_since[kept++] = pool->idle_since[i];
+        }
+    }
+    pool->count = kept;
+    if (pool->count < POOL_MAX_IDLE) {
+        pool->socks[pool->count] = sock;
+        pool->idle_since[pool->count++] = now;
+        sock = -1;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    for (int i = 0; i < n_expired; i++) close(expired[i]);
+    if (sock >= 0) close(sock);
+}
+
+// Send a request frame to a storage server and wait for its REPLY header. If a pooled
+// connection turns out to be closed, the request is retried once on a fresh connection.
+// Returns the socket with the reply payload still unread, -1 if the server cannot be
+// reached, or -2 if it did not answer (within timeout_sec seconds, when non-zero).
+int backend_request(int port, uint8_t opcode, uint16_t flags, const char *args, int timeout_sec, struct frame_hdr *reply) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int reused;
+        int sock = pool_acquire(port, &reused);
+        if (sock < 0) return -1;
+
+        struct timeval tv = {.tv_sec = timeout_sec, .tv_usec = 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        uint32_t id = __atomic_add_fetch(&last_request_id, 1, __ATOMIC_RELAXED);
+        errno = 0;
+        if (send_frame(sock, opcode, flags, 0, id, args, strlen(args)) == 0 && recv_frame(sock, reply) == 0) {
+            if (reply->opcode != OP_REPLY || reply->request_id != id) {
+                close(sock);
+                return -2;
+            }
+            // Clear the timeout for any file data that follows
+            tv.tv_sec = 0;
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            return sock;
+        }
+        int timed_out = (errno == EAGAIN || errno == EWOULDBLOCK);
+        close(sock);
+        if (!reused || timed_out) break;
+    }
+    return -2;
+}
+
+// Resolve where an uploadf request stores its file: the file name, the destination
+// directory below ~/S1 and the file's path there. Nothing is created. Returns the port of
+// the server storing the file, 0 for a .c file kept by S1, or -1 with the reason in *error.
+int resolve_upload(const char *args, char *filename, char *full_dest_path, char *temp_path, const char **error) {
+    char name[256] = {0}, dest_path[PATH_MAX] = {0};
+    sscanf(args, "%255s %4095s", name, dest_path);
+
+    // Validate destination path
+    if (strncmp(dest_path, "~S1/", 4) != 0) {
+        *error = "Upload failed: Destination path must start with ~S1/";
+        return -1;
+    }
+
+    // Get home directory
+    char *home = getenv("HOME");
+    if (!home) {
+        *error = "Upload failed: HOME environment variable not set";
+        return -1;
+    }
+
+    // Construct full destination path
+    snprintf(full_dest_path, PATH_MAX, "%s/S1/%s", home, dest_path + 4);
+
+    // Route on the extension before any file data is read
+    char *ext = strrchr(name, '.');
+    int port = (ext && strcmp(ext, ".pdf") == 0) ? PORT_S2 :
+              (ext && strcmp(ext, ".txt") == 0) ? PORT_S3 :
+              (ext && strcmp(ext, ".zip") == 0) ? PORT_S4 : 0;
+    if (!port && !(ext && strcmp(ext, ".c") == 0)) {
+        *error = "Upload failed: Unsupported file type";
+        return -1;
+    }
+
+    // Determine local file path
+    snprintf(filename, 256, "%s", basename(name));
+    if (full_dest_path[strlen(full_dest_path) - 1] == '/')
+        snprintf(temp_path, PATH_MAX, "%s%s", full_dest_path, filename);
+    else
+        snprintf(temp_path, PATH_MAX, "%s/%s", full_dest_path, filename);
+    return port;
+}
+
+// Resolve an uploadf request as resolve_upload() does and create the file's directories.
+// S1 keeps the tree even for files stored elsewhere, since dispfnames looks the directory
+// up here first.
+int route_upload(const char *args, char *filename, char *full_dest_path, char *temp_path, const char **error) {
+    int port = resolve_upload(args, filename, full_dest_path, temp_path, error);
+    if (port < 0) return port;
+    char *dir_path = strdup(temp_path);
+    create_directories(dirname(dir_path));
+    free(dir_path);
+    return port;
+}
+
+// Whether the body of the uploadf being handled is one DATA frame small enough to batch
+int small_upload_pending(int client_sock) {
+    struct frame_hdr data;
+    if (recv(client_sock, &data, sizeof(data), MSG_PEEK | MSG_WAITALL) != sizeof(data) || decode_frame(&data) < 0) return 0;
+    return data.opcode == OP_DATA && !(data.flags & FL_MORE) && data.length <= BATCH_FILE_MAX;
+}
+
+// Store a small upload through a batch, together with any further small uploads for
+// S2-S4 the client has already queued on this session, then answer each in order.
+// Returns -1 if the client connection failed.
+int coalesce_uploads(int client_sock, uint32_t client_id, const char *filename, const char *dest_path, int server_port) {
+    struct batch_entry *entries = calloc(BATCH_MAX_FILES, sizeof(*entries));
+    struct batch_entry *by_port[BATCH_MAX_FILES];
+    if (!entries) {
+        int ignored = 0;
+        if (recv_body(client_sock, NULL, &ignored) < 0) return -1;
+        send_reply(client_sock, client_id, ST_ERROR, "Upload failed: Out of memory");
+        return 0;
+    }
+    char adjusted_path[PATH_MAX];
+    backend_dest_path(dest_path, server_port, adjusted_path);
+    snprintf(entries[0].args, sizeof(entries[0].args), "%s %s", filename, adjusted_path);
+    entries[0].request_id = client_id;
+    entries[0].port = server_port;
+    int count = 0, rc = read_batch_body(client_sock, &entries[0]);
+    if (rc == 0) {
+        uint64_t bytes = entries[0].length;
+        for (count = 1; count < BATCH_MAX_FILES && bytes < BATCH_MAX_BYTES; count++) {
+            rc = next_queued_upload(client_sock, &entries[count]);
+            if (rc != 1) break;
+            bytes += entries[count].length;
+        }
+    }
+
+    // Send each server its files, then answer the requests in the order they came
+    int servers[] = {PORT_S2, PORT_S3, PORT_S4};
+    for (int s = 0; s < 3; s++) {
+        int n = 0;
+        for (int i = 0; i < count; i++)
+            if (entries[i].port == servers[s]) by_port[n++] = &entries[i];
+        if (n > 0) submit_batch(servers[s], by_port, n);
+    }
+    for (int i = 0; i < count; i++) {
+        if (send_reply(client_sock, entries[i].request_id, entries[i].status, entries[i].message) < 0) rc = -1;
+        free(entries[i].body);
+    }
+    if (count > 1) printf("S1: Coalesced %d uploads from one session\n", count);
+    free(entries);
+    return rc < 0 ? -1 : 0;
+}
+
+// Take the next request queued on the session if it is an uploadf of a small file for
+// S2-S4 that has fully arrived; anything else is left for the session to handle.
+// Returns 1 if it was taken, 0 if not, or -1 if the client connection failed.
+int next_queued_upload(int client_sock, struct batch_entry *entry) {
+    char peek[2 * sizeof(struct frame_hdr) + MAX_ARGS_SIZE];
+    struct frame_hdr req, data;
+    int avail = 0;
+    ssize_t got = recv(client_sock, peek, sizeof(req), MSG_PEEK | MSG_DONTWAIT);
+    if (got != sizeof(req)) return 0;
+    memcpy(&req, peek, sizeof(req));
+    if (decode_frame(&req) < 0 || req.opcode != OP_UPLOADF || req.length >= MAX_ARGS_SIZE) return 0;
+    size_t head_len = 2 * sizeof(req) + req.length;
+    got = recv(client_sock, peek, head_len, MSG_PEEK | MSG_DONTWAIT);
+    if (got != (ssize_t)head_len) return 0;
+    memcpy(&data, peek + sizeof(req) + req.length, sizeof(data));
+    if (decode_frame(&data) < 0 || data.opcode != OP_DATA || (data.flags & FL_MORE) || data.length > BATCH_FILE_MAX) return 0;
+    if (ioctl(client_sock, FIONREAD, &avail) < 0 || (uint64_t)avail < head_len + data.length) return 0;
+
+    char args[MAX_ARGS_SIZE], filename[256], full_dest_path[PATH_MAX], temp_path[PATH_MAX];
+    const char *error;
+    memcpy(args, peek + sizeof(req), req.length);
+    args[req.length] = '\0';
+    int port = route_upload(args, filename, full_dest_path, temp_path, &error);
+    if (port <= 0) return 0;
+
+    // Consume the request; its body follows
+    if (recv_frame(client_sock, &req) < 0 || recv_payload(client_sock, &req, args, sizeof(args)) < 0) return -1;
+    printf("S1: Coalescing uploadf command: %s\n", args);
+    char adjusted_path[PATH_MAX];
+    backend_dest_path(full_dest_path, port, adjusted_path);
+    snprintf(entry->args, sizeof(entry->args), "%s %s", filename, adjusted_path);
+    entry->request_id = req.request_id;
+    entry->port = port;
+    return read_batch_body(client_sock, entry) < 0 ? -1 : 1;
+}
+
+// Read the single DATA frame of a small upload into memory. On failure entry holds no
+// body, as the entry is not part of the batch.
+int read_batch_body(int client_sock, struct batch_entry *entry) {
+    struct frame_hdr data;
+    if (recv_frame(client_sock, &data) < 0 || data.opcode != OP_DATA || data.length > BATCH_FILE_MAX) return -1;
+    entry->body = malloc(data.length + 1);
+    entry->length = data.length;
+    entry->flags = data.flags;
+    if (!entry->body || receive_full(client_sock, entry->body, data.length) < 0) {
+        free(entry->body);
+        entry->body = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Queue small uploads for a server and return once they are stored or have failed. The
+// caller sends the batch itself if none is in flight; otherwise the session sending one
+// takes these along in the next.
+void submit_batch(int server_port, struct batch_entry **entries, int count) {
+    struct upload_batcher *b = &batchers[server_port == PORT_S2 ? 0 : server_port == PORT_S3 ? 1 : 2];
+    pthread_mutex_lock(&b->lock);
+    for (int i = 0; i < count; i++) {
+        entries[i]->next = NULL;
+        if (b->last) b->last->next = entries[i];
+        else b->head = entries[i];
+        b->last = entries[i];
+    }
+    // Batches leave in queue order, so the last entry is done only once all of them are
+    struct batch_entry *mine = entries[count - 1];
+    while (!mine->done) {
+        if (b->sending) {
+            pthread_cond_wait(&b->sent, &b->lock);
+            continue;
+        }
+        // Send everything queued so far, up to a batch's limits
+        b->sending = 1;
+        struct batch_entry *first = b->head, *end = NULL, *e = first;
+        int n = 0;
+        uint64_t bytes = 0;
+        while (e && n < BATCH_MAX_FILES && bytes < BATCH_MAX_BYTES) {
+            bytes += e->length;
+            n++;
+            end = e;
+            e = e->next;
+        }
+        b->head = e;
+        if (!e) b->last = NULL;
+        end->next = NULL;
+        pthread_mutex_unlock(&b->lock);
+        send_upload_batch(server_port, first, n);
+        pthread_mutex_lock(&b->lock);
+        for (e = first; e; e = e->next) e->done = 1;
+        b->sending = 0;
+        pthread_cond_broadcast(&b->sent);
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+// Send a batch of small uploads to a server as one request, recording each file's status
+// and message from the reply. A pooled connection found closed is replaced once.
+void send_upload_batch(int server_port, struct batch_entry *first, int count) {
+    size_t size = 0, pos = 0;
+    for (struct batch_entry *e = first; e; e = e->next) size += sizeof(struct batch_record) + strlen(e->args) + e->length;
+    char *packed = malloc(size), *results = malloc(BATCH_MAX_FILES * BATCH_REPLY_LINE + 1);
+    const char *failure = "Upload failed: Server connection error";
+    for (struct batch_entry *e = first; packed && e; e = e->next) {
+        size_t args_len = strlen(e->args);
+        struct batch_record rec = {htonl(args_len), htons(e->flags), 0, htobe64(e->length)};
+        memcpy(packed + pos, &rec, sizeof(rec));
+        memcpy(packed + pos + sizeof(rec), e->args, args_len);
+        memcpy(packed + pos + sizeof(rec) + args_len, e->body, e->length);
+        pos += sizeof(rec) + args_len + e->length;
+    }
+
+    int answered = 0;
+    uint16_t status = ST_ERROR;
+    for (int attempt = 0; packed && results && attempt < 2 && !answered; attempt++) {
+        int reused;
+        int sock = pool_acquire(server_port, &reused);
+        if (sock < 0) break;
+        char count_arg[16];
+        snprintf(count_arg, sizeof(count_arg), "%d", count);
+        uint32_t id = __atomic_add_fetch(&last_request_id, 1, __ATOMIC_RELAXED);
+        struct frame_hdr reply;
+        if (send_frame(sock, OP_UPLOAD_BATCH, 0, 0, id, count_arg, strlen(count_arg)) == 0 &&
+            send_frame(sock, OP_DATA, 0, 0, id, packed, size) == 0 &&
+            recv_frame(sock, &reply) == 0 && reply.opcode == OP_REPLY && reply.request_id == id &&
+            recv_payload(sock, &reply, results, BATCH_MAX_FILES * BATCH_REPLY_LINE + 1) == 0) {
+            pool_release(server_port, sock);
+            answered = 1;
+            status = reply.status;
+        } else {
+            close(sock);
+            failure = "Upload failed: No response from server";
+            if (!reused) break;
+        }
+    }
+
+    // Each file's line is its status, then its message; a refused batch fails every file
+    char *line = answered && status == ST_OK ? results : NULL;
+    for (struct batch_entry *e = first; e; e = e->next) {
+        char *end = line ? strchr(line, '\n') : NULL;
+        if (end && end - line > 2) {
+            *end = '\0';
+            e->status = atoi(line) == ST_OK ? ST_OK : ST_ERROR;
+            snprintf(e->message, sizeof(e->message), "%s", line + 2);
+            line = end + 1;
+        } else {
+            e->status = ST_ERROR;
+            snprintf(e->message, sizeof(e->message), "%s", answered && status != ST_OK ? results : failure);
+        }
+    }
+    printf("S1: Sent a batch of %d uploads (%zu bytes) to server on port %d\n", count, size, server_port);
+    free(packed);
+    free(results);
+}
+
+// Stream an upload straight from the client to another server, storing it below the
+// server's own tree. Returns -1 if the client connection failed mid-upload.
+int stream_file_to_server(const char *filename, const char *dest_path, int server_port, int client_sock, uint32_t client_id) {
+    char args[PATH_MAX + 256], adjusted_path[PATH_MAX];
+    backend_dest_path(dest_path, server_port, adjusted_path);
+    printf("S1: Streaming to %s on port %d\n", adjusted_path, server_port);
+    snprintf(args, sizeof(args), "%s %s", filename, adjusted_path);
+    return relay_upload(server_port, OP_UPLOADF, args, client_sock, client_id);
+}
+
+// Map a destination directory below ~/S1 to the same directory in another server's tree
+void backend_dest_path(const char *dest_path, int server_port, char *adjusted_path) {
+    char *home = getenv("HOME");
+    // Determine server directory
+    const char *server_dir = (server_port == PORT_S2) ? "S2" :
+                            (server_port == PORT_S3) ? "S3" :
+                            (server_port == PORT_S4) ? "S4" : NULL;
+    const char *suffix = dest_path + strlen(home) + 3;
+    if (suffix[0] == '/' || dest_path[strlen(dest_path) - 1] == '/')
+        snprintf(adjusted_path, PATH_MAX, "%s/%s%s", home, server_dir, suffix);
+    else
+        snprintf(adjusted_path, PATH_MAX, "%s/%s/%s", home, server_dir, suffix);
+}
+
+// Send a request carrying file data to another server, forwarding the client's DATA frames
+// as they arrive and holding at most one buffer of them in memory, then relay the server's
+// reply to the client. Returns -1 if the client connection failed mid-upload and the
+// session must be closed.
+int relay_upload(int server_port, uint8_t opcode, const char *args, int client_sock, uint32_t client_id) {
+    char buffer[BUFFER_SIZE];
+    int ignored = 0;
+
+    // Connect to target server
+    int reused;
+    int sock = pool_acquire(server_port, &reused);
+    if (sock < 0) {
+        if (recv_body(client_sock, NULL, &ignored) < 0) return -1;
+        send_reply(client_sock, client_id, ST_ERROR, "Upload failed: Server connection error");
+        return 0;
+    }
+
+    // Send the command; the client's DATA frames are then forwarded one by one
+    uint32_t id = __atomic_add_fetch(&last_request_id, 1, __ATOMIC_RELAXED);
+    int server_ok = send_frame(sock, opcode, 0, 0, id, args, strlen(args)) == 0;
+    printf("S1: Sent command to server on port %d: %s\n", server_port, args);
+
+    uint64_t total_bytes = 0;
+    struct frame_hdr data;
+    do {
+        if (recv_frame(client_sock, &data) < 0 || data.opcode != OP_DATA) {
+            // The server sees a truncated frame and discards the partial file
+            close(sock);
+            return -1;
+        }
+        if (server_ok && send_frame(sock, OP_DATA, data.flags, 0, id, NULL, data.length) < 0) server_ok = 0;
+        uint64_t remaining = data.length;
+        while (remaining > 0) {
+            size_t to_receive = remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE;
+            ssize_t bytes = recv(client_sock, buffer, to_receive, 0);
+            if (bytes <= 0) {
+                close(sock);
+                return -1;
+            }
+            // After a server failure the rest of the upload is drained to keep the session in sync
+            if (server_ok && send_all(sock, buffer, bytes) < 0) server_ok = 0;
+            remaining -= bytes;
+            total_bytes += bytes;
+        }
+    } while (data.flags & FL_MORE);
+
+    if (!server_ok) {
+        close(sock);
+        send_reply(client_sock, client_id, ST_ERROR, "Upload failed: Error sending file to server");
+        return 0;
+    }
+    printf("S1: Streamed %lu bytes to server on port %d\n", total_bytes, server_port);
+
+    // Receive server response
+    struct frame_hdr reply;
+    if (recv_frame(sock, &reply) == 0 && reply.opcode == OP_REPLY && reply.request_id == id &&
+        recv_payload(sock, &reply, buffer, BUFFER_SIZE) == 0) {
+        pool_release(server_port, sock);
+        send_reply(client_sock, client_id, reply.status, buffer);
+        printf("S1: Transfer to server on port %d completed: %s\n", server_port, buffer);
+    } else {
+        close(sock);
+        send_reply(client_sock, client_id, ST_ERROR, "Upload failed: No response from server");
+    }
+    return 0;
+}
+
+// Send a request to another server and relay its text reply to the client request,
+// waiting up to timeout_sec for it (0 waits as long as it takes). Returns the status relayed.
+int relay_reply(int server_port, uint8_t opcode, const char *args, int timeout_sec, int client_sock, uint32_t client_id, const char *failure) {
+    char buffer[BUFFER_SIZE];
+    struct frame_hdr reply;
+    int sock = backend_request(server_port, opcode, 0, args, timeout_sec, &reply);
+    if (sock >= 0 && recv_payload(sock, &reply, buffer, BUFFER_SIZE) == 0) {
+        pool_release(server_port, sock);
+        send_reply(client_sock, client_id, reply.status, buffer);
+        return reply.status;
+    }
+    if (sock >= 0) close(sock);
+    send_reply(client_sock, client_id, ST_ERROR, failure);
+    return ST_ERROR;
+}
+
+// Find the server staging a multipart upload from the prefix S1 gave its id, pointing
+// backend_id at that server's own id. Returns the server's port, 0 for an upload staged
+// by S1 itself, or -1 for an id S1 never handed out.
+int upload_route(const char *upload_id, const char **backend_id) {
+    if (upload_id[0] != 'S' || upload_id[1] < '1' || upload_id[1] > '4' || upload_id[2] != '-') return -1;
+    *backend_id = upload_id + 3;
+    int ports[] = {0, PORT_S2, PORT_S3, PORT_S4};
+    return ports[upload_id[1] - '1'];
+}
+
+// Download file from another server and forward it to the client request.
+// Returns -1 if the client session was left mid-frame and must be closed.
+int download_file_from_server(const char *filepath, const char *range_opts, int server_port, uint16_t flags, int client_sock, uint32_t client_id) {
+    char adjusted_path[PATH_MAX], args[PATH_MAX + 128];
+    char *home = getenv("HOME");
+    // Adjust path for target server
+    const char *server_dir = (server_port == PORT_S2) ? "S2" :
+                            (server_port == PORT_S3) ? "S3" :
+                            (server_port == PORT_S4) ? "S4" : NULL;
+    snprintf(adjusted_path, PATH_MAX, "%s/%s%s", home, server_dir, filepath + strlen(home) + 3);
+
+    // Send download request with any range options and wait (up to 5 seconds) for the reply
+    snprintf(args, sizeof(args), "%s%s%s", adjusted_path, range_opts[0] ? " " : "", range_opts);
+    return relay_from_server(server_port, OP_DOWNLF, flags, args, 5, client_sock, client_id);
+}
+
+// Send a download or archive request to another server and relay its reply and DATA
+// frames to the client request. Returns -1 if the client session was left mid-frame.
+int relay_from_server(int server_port, uint8_t opcode, uint16_t flags, const char *args, int timeout_sec, int client_sock, uint32_t client_id) {
+    char buffer[BUFFER_SIZE];
+    struct frame_hdr reply;
+    int sock = backend_request(server_port, opcode, flags, args, timeout_sec, &reply);
+    if (sock < 0) {
+        if (sock == -1) {
+            send_reply(client_sock, client_id, ST_ERROR, "Server connection error");
+            printf("S1: Failed to connect to server on port %d\n", server_port);
+        } else {
+            send_reply(client_sock, client_id, ST_ERROR, "Error receiving file size");
+            printf("S1: Failed to receive file size from port %d\n", server_port);
+        }
+        return 0;
+    }
+    printf("S1: Sent request to server on port %d: %s\n", server_port, args);
+
+    // Receive file size, or the server's error message
+    if (recv_payload(sock, &reply, buffer, BUFFER_SIZE) < 0) {
+        send_reply(client_sock, client_id, ST_ERROR, "No response from server");
+        printf("S1: No response from port %d\n", server_port);
+        close(sock);
+        return 0;
+    }
+    if (reply.status != ST_OK || (reply.length != sizeof(uint64_t) && reply.length != RANGE_REPLY_SIZE)) {
+        send_reply(client_sock, client_id, ST_ERROR, buffer);
+        printf("S1: Received error from port %d: %s\n", server_port, buffer);
+        pool_release(server_port, sock);
+        return 0;
+    }
+    uint64_t net_file_size;
+    memcpy(&net_file_size, buffer, sizeof(net_file_size));
+    uint64_t file_size = be64toh(net_file_size);
+    printf("S1: Received file size from port %d: %lu bytes\n", server_port, file_size);
+
+    // Pass the reply on to the client: the size, or for a ranged download the range, and
+    // whether the body is deflated
+    if (send_frame(client_sock, OP_REPLY, reply.flags & FL_DEFLATE, ST_OK, client_id, buffer, reply.length) < 0) {
+        printf("S1: Failed to send file size to client\n");
+        close(sock);
+        return -1;
+    }
+    printf("S1: Sent file size to client: %lu bytes\n", file_size);
+
+    // Relay DATA frames to the client under the client's request id, timing the
+    // transfer and the CPU this thread spends on it
+    struct timespec wall_start, wall_end, cpu_start, cpu_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+    uint64_t total_received = 0;
+    struct frame_hdr data;
+    int ok = 1;
+    do {
+        if (recv_frame(sock, &data) < 0 || data.opcode != OP_DATA ||
+            send_frame(client_sock, OP_DATA, data.flags, 0, client_id, NULL, data.length) < 0 ||
+            relay_bytes(sock, client_sock, data.length) < 0) {
+            ok = 0;
+            break;
+        }
+        total_received += data.length;
+    } while (data.flags & FL_MORE);
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+
+    // A compressed archive arrives in several frames that add up to less than its size
+    if (ok) {
+        double wall = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
+        double cpu = (cpu_end.tv_sec - cpu_start.tv_sec) + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e9;
+        printf("S1: Relayed %s from port %d (%lu bytes, %s): %.3f s, %.1f MB/s, %.3f s CPU\n",
+               args, server_port, total_received, relay_splice ? "splice" : "copy",
+               wall, wall > 0 ? total_received / wall / 1e6 : 0.0, cpu);
+        pool_release(server_port, sock);
+        return 0;
+    }
+    printf("S1: Incomplete transfer from port %d, %lu/%lu bytes\n", server_port, total_received, file_size);
+    close(sock);
+    return -1;
+}
+
+// Relay len bytes from one socket to another. In splice mode they move through a
+// per-thread pipe without entering user space; the copy loop is used otherwise, or
+// when the kernel cannot splice these descriptors. Returns -1 if the relay failed.
+int relay_bytes(int from_sock, int to_sock, uint64_t len) {
+    static __thread int relay_pipe[2] = {-1, -1};
+    if (relay_splice && relay_pipe[0] < 0 && pipe2(relay_pipe, O_CLOEXEC) < 0) relay_pipe[0] = -1;
+
+    while (relay_splice && relay_pipe[0] >= 0 && len > 0) {
+        size_t chunk = len < RELAY_CHUNK ? len : RELAY_CHUNK;
+        ssize_t in = splice(from_sock, NULL, relay_pipe[1], NULL, chunk, SPLICE_F_MOVE);
+        if (in < 0 && errno == EINTR) continue;
+        // Nothing is in the pipe yet, so the copy loop can take over
+        if (in < 0 && (errno == EINVAL || errno == ENOSYS)) break;
+        if (in <= 0) return -1;
+        ssize_t left = in;
+        while (left > 0) {
+            ssize_t out = splice(relay_pipe[0], NULL, to_sock, NULL, left, SPLICE_F_MOVE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out <= 0) {
+                // Bytes stranded in the pipe would corrupt the next relay
+                close(relay_pipe[0]);
+                close(relay_pipe[1]);
+                relay_pipe[0] = relay_pipe[1] = -1;
+                return -1;
+            }
+            left -= out;
+        }
+        len -= in;
+    }
+
+    char buffer[BUFFER_SIZE];
+    while (len > 0) {
+        size_t to_receive = len < BUFFER_SIZE ? len : BUFFER_SIZE;
+        ssize_t bytes = recv(from_sock, buffer, to_receive, 0);
+        if (bytes <= 0 || send_all(to_sock, buffer, bytes) < 0) return -1;
+        len -= bytes;
+    }
+    return 0;
+}
+
+// Create directories recursively
+void create_directories(const char *path) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, PATH_MAX, "%s", path);
+    char *p;
+    for (p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = 0;
+            mkdir(tmp, S_IRWXU);
+            *p = '/';
+        }
+    }
+    mkdir(tmp, S_IRWXU);
+}
+
+// Receive exact number of bytes
+int receive_full(int sock, char *buffer, size_t size) {
+    size_t received = 0;
+    while (received < size) {
+        ssize_t bytes = recv(sock, buffer + received, size - received, 0);
+        // A socket with a receive timeout reports signals rather than restarting
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return -1;  // Error or connection closed
+        received += bytes;
+    }
+    return 0;  // Success
+}
+// Send an entire buffer, retrying short writes
+int send_all(int sock, const void *buffer, size_t size) {
+    const char *p = buffer;
+    while (size > 0) {
+        ssize_t bytes = send(sock, p, size, MSG_NOSIGNAL);
+        // Archives are also written to cache files
+        if (bytes < 0 && errno == ENOTSOCK) bytes = write(sock, p, size);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += bytes;
+        size -= bytes;
+    }
+    return 0;
+}
+
+// Send a frame header and, if given, its in-memory payload. With no payload the caller
+// streams the length bytes itself, so the header is corked until they follow.
+int send_frame(int sock, uint8_t opcode, uint16_t flags, uint16_t status, uint32_t request_id, const void *payload, uint64_t length) {
+    struct frame_hdr hdr = {htons(PROTO_MAGIC), PROTO_VERSION, opcode, htons(flags), htons(status), htonl(request_id), htobe64(length)};
+    if (payload && length > 0) {
+        char frame[sizeof(hdr) + BUFFER_SIZE];
+        if (length <= BUFFER_SIZE) {
+            // Small payloads go out in the same segment as their header
+            memcpy(frame, &hdr, sizeof(hdr));
+            memcpy(frame + sizeof(hdr), payload, length);
+            return send_all(sock, frame, sizeof(hdr) + length);
+        }
+        if (send(sock, &hdr, sizeof(hdr), MSG_NOSIGNAL | MSG_MORE) != sizeof(hdr)) return -1;
+        return send_all(sock, payload, length);
+    }
+    if (send(sock, &hdr, sizeof(hdr), MSG_NOSIGNAL | (length > 0 ? MSG_MORE : 0)) != sizeof(hdr)) return -1;
+    return 0;
+}
+
+// Convert a received frame header to host byte order. Returns -1 for a header that is
+// not ours, or -2 for a frame from an unsupported protocol version.
+int decode_frame(struct frame_hdr *hdr) {
+    if (ntohs(hdr->magic) != PROTO_MAGIC) return -1;
+    hdr->magic = PROTO_MAGIC;
+    hdr->flags = ntohs(hdr->flags);
+    hdr->status = ntohs(hdr->status);
+    hdr->request_id = ntohl(hdr->request_id);
+    hdr->length = be64toh(hdr->length);
+    return hdr->version == PROTO_VERSION ? 0 : -2;
+}
+
+// Receive a frame header and convert it to host byte order
+int recv_frame(int sock, struct frame_hdr *hdr) {
+    if (receive_full(sock, (char*)hdr, sizeof(*hdr)) < 0) return -1;
+    return decode_frame(hdr);
+}
+
+// Send a REPLY frame carrying a text message
+int send_reply(int sock, uint32_t request_id, uint16_t status, const char *msg) {
+    return send_frame(sock, OP_REPLY, 0, status, request_id, msg, strlen(msg));
+}
+
+// Send the OK reply that precedes file content, carrying the content size; FL_DEFLATE
+// in flags announces a deflated body
+int send_size_reply(int sock, uint32_t request_id, uint64_t size, uint16_t flags) {
+    uint64_t net_size = htobe64(size);
+    return send_frame(sock, OP_REPLY, flags, ST_OK, request_id, &net_size, sizeof(net_size));
+}
+
+// Send up to size bytes of fd from offset. sendfile() moves the file to the socket
+// inside the kernel; if it is not supported for fd, a read/send loop takes over.
+// Returns the bytes sent, short only if the file shrank, or -1 on a socket error.
+long long send_file_body(int sock, int fd, uint64_t offset, uint64_t size) {
+    off_t pos = offset;
+    uint64_t end = offset + size;
+    while ((uint64_t)pos < end) {
+        ssize_t sent = sendfile(sock, fd, &pos, end - pos);
+        if (sent > 0 || (sent < 0 && errno == EINTR)) continue;
+        if (sent == 0) return pos - offset;
+        if (errno == EINVAL || errno == ENOSYS) break;
+        return -1;
+    }
+    char buffer[BUFFER_SIZE];
+    while ((uint64_t)pos < end) {
+        size_t to_read = end - pos < BUFFER_SIZE ? end - pos : BUFFER_SIZE;
+        ssize_t bytes = pread(fd, buffer, to_read, pos);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return pos - offset;
+        if (send_all(sock, buffer, bytes) < 0) return -1;
+        pos += bytes;
+    }
+    return pos - offset;
+}
+
+// Send size bytes of fd from offset as one DATA frame. Returns -1 if the frame could not
+// be completed and the connection is unusable.
+int send_file_frame(int sock, int fd, uint64_t offset, uint64_t size, uint32_t request_id) {
+    if (send_frame(sock, OP_DATA, 0, 0, request_id, NULL, size) < 0) return -1;
+    return send_file_body(sock, fd, offset, size) == (long long)size ? 0 : -1;
+}
+
+// Split the range options ("offset=<n>", "length=<n>", "if=<mtime>") off the end of a
+// downlf request, leaving the path in args. Returns the options, "" if there are none.
+char *split_range_options(char *args) {
+    char *opts = NULL, *space;
+    while ((space = strrchr(args, ' ')) != NULL &&
+           (strncmp(space + 1, "offset=", 7) == 0 || strncmp(space + 1, "length=", 7) == 0 ||
+            strncmp(space + 1, "if=", 3) == 0)) {
+        // Rejoin the options split off so far
+        if (opts) opts[-1] = ' ';
+        *space = '\0';
+        opts = space + 1;
+    }
+    return opts ? opts : args + strlen(args);
+}
+
+// Parse the range options of a downlf request. Unknown tokens are ignored.
+void parse_range_options(char *opts, struct byte_range *range) {
+    range->ranged = 0;
+    range->offset = range->length = 0;
+    range->has_version = 0;
+    range->if_version = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(opts, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+        if (strncmp(tok, "offset=", 7) == 0) range->offset = strtoull(tok + 7, NULL, 10);
+        else if (strncmp(tok, "length=", 7) == 0) range->length = strtoull(tok + 7, NULL, 10);
+        else if (strncmp(tok, "if=", 3) == 0) {
+            range->has_version = 1;
+            range->if_version = strtoull(tok + 3, NULL, 10);
+        }
+        else continue;
+        range->ranged = 1;
+    }
+}
+
+// Version of a file for validating resumed ranges: a mix of its inode, size and
+// nanosecond mtime, so a rewrite within the same second or a replacement by rename
+// still changes it
+uint64_t file_version(const struct stat *statbuf) {
+    uint64_t v = (uint64_t)statbuf->st_ino;
+    v = v * 0x9e3779b97f4a7c15ULL ^ (uint64_t)statbuf->st_size;
+    v = v * 0x9e3779b97f4a7c15ULL ^ ((uint64_t)statbuf->st_mtim.tv_sec * 1000000000ULL + (uint64_t)statbuf->st_mtim.tv_nsec);
+    return v * 0x9e3779b97f4a7c15ULL;
+}
+
+// Fit a requested range to the file. Returns -1 if it starts past the end of the file.
+int resolve_range(struct byte_range *range, const struct stat *statbuf) {
+    uint64_t size = statbuf->st_size;
+    if (range->has_version && range->if_version != file_version(statbuf)) {
+        // The file changed since the part the requester holds was sent
+        range->offset = 0;
+        range->length = 0;
+    }
+    if (range->offset > size) return -1;
+    if (range->length == 0 || range->length > size - range->offset) range->length = size - range->offset;
+    return 0;
+}
+
+// Send the OK reply to a ranged download, describing the range and the whole file so
+// the requester can resume it later; FL_DEFLATE in flags announces a deflated body
+int send_range_reply(int sock, uint32_t request_id, const struct byte_range *range, const struct stat *statbuf, uint16_t flags) {
+    uint64_t fields[5] = {htobe64(range->length), htobe64(range->offset),
+                          htobe64(statbuf->st_size), htobe64(statbuf->st_mtime), htobe64(file_version(statbuf))};
+    return send_frame(sock, OP_REPLY, flags, ST_OK, request_id, fields, RANGE_REPLY_SIZE);
+}
+
+// walk_files() callback removing the files of an upload whose parts list has not
+// changed since the cutoff in ctx
+static void upload_expire(const char *path, int dir_fd, const char *name, void *ctx) {
+    struct stat statbuf;
+    if (fstatat(dir_fd, name, &statbuf, 0) != 0 || statbuf.st_mtime >= *(time_t *)ctx) return;
+    char sibling[NAME_MAX + 1];
+    size_t id_len = strlen(name) - strlen(".parts");
+    snprintf(sibling, sizeof(sibling), "%.*s.data", (int)id_len, name);
+    unlinkat(dir_fd, sibling, 0);
+    snprintf(sibling, sizeof(sibling), "%.*s.dest", (int)id_len, name);
+    unlinkat(dir_fd, sibling, 0);
+    unlinkat(dir_fd, name, 0);
+    printf("S1: Expired unfinished upload %.*s\n", (int)id_len, name);
+}
+
+// Create the staging directory for multipart uploads and remove uploads abandoned
+// for UPLOAD_EXPIRY seconds. Returns -1 if uploads cannot be staged.
+int upload_prepare(void) {
+    char *home = getenv("HOME");
+    if (!home) return -1;
+    if (!upload_dir[0]) {
+        snprintf(upload_dir, PATH_MAX, "%s/.S1.uploads", home);
+        create_directories(upload_dir);
+    }
+    int dir_fd = open(upload_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return -1;
+    time_t cutoff = time(NULL) - UPLOAD_EXPIRY;
+    walk_files(dir_fd, "", ".parts", 0, upload_expire, &cutoff);
+    close(dir_fd);
+    return 0;
+}
+
+// Build the path of one of an upload's staging files. Returns -1 for a malformed id,
+// so no request can reach outside the staging directory, or for a path too long to build.
+int upload_path(const char *upload_id, const char *suffix, char *path) {
+    if (strlen(upload_id) != UPLOAD_ID_LEN || strspn(upload_id, "0123456789abcdef") != UPLOAD_ID_LEN) return -1;
+    int len = snprintf(path, PATH_MAX, "%s/%.*s%s", upload_dir, UPLOAD_ID_LEN, upload_id, suffix);
+    return len < 0 || len >= PATH_MAX ? -1 : 0;
+}
+
+// Start a multipart upload that will become dest, writing its id to upload_id
+int upload_start(const char *dest, char *upload_id) {
+    if (upload_prepare() < 0) return -1;
+    unsigned char raw[UPLOAD_ID_LEN / 2];
+    if (getrandom(raw, sizeof(raw), 0) != (ssize_t)sizeof(raw)) return -1;
+    for (size_t i = 0; i < sizeof(raw); i++) sprintf(upload_id + 2 * i, "%02x", raw[i]);
+
+    char path[PATH_MAX];
+    if (upload_path(upload_id, ".dest", path) < 0) return -1;
+    FILE *fp = fopen(path, "w");
+    if (!fp) return -1;
+    int ok = fprintf(fp, "%s\n", dest) > 0;
+    if (fclose(fp) != 0 || !ok) return -1;
+    const char *suffixes[] = {".data", ".parts"};
+    for (int i = 0; i < 2; i++) {
+        if (upload_path(upload_id, suffixes[i], path) < 0) return -1;
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return -1;
+        close(fd);
+    }
+    return 0;
+}
+
+// Open an upload's data file to write a part at offset, or NULL for an unknown upload
+FILE *upload_open_part(const char *upload_id, uint64_t offset) {
+    char path[PATH_MAX];
+    if (upload_path(upload_id, ".data", path) < 0) return NULL;
+    FILE *fp = fopen(path, "r+b");
+    if (fp && fseeko(fp, offset, SEEK_SET) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+// Record a part once all of it is written; a part cut short is never listed, so it
+// has to be sent again
+int upload_record_part(const char *upload_id, uint64_t offset, uint64_t length) {
+    char path[PATH_MAX], line[64];
+    if (upload_path(upload_id, ".parts", path) < 0) return -1;
+    int fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0) return -1;
+    // One short append per part, so parts recorded concurrently never interleave
+    int len = snprintf(line, sizeof(line), "%lu %lu\n", offset, length);
+    int rc = write(fd, line, len) == len ? 0 : -1;
+    close(fd);
+    return rc;
+}
+
+static int compare_upload_parts(const void *a, const void *b) {
+    const uint64_t *pa = a, *pb = b;
+    return pa[0] < pb[0] ? -1 : pa[0] > pb[0];
+}
+
+// Complete an upload of size bytes: check its parts cover the file exactly, then move
+// the assembled data file into place, writing its path to dest. Returns NULL on
+// success, or the message to reply with.
+const char *upload_finish(const char *upload_id, uint64_t size, char *dest) {
+    char data[PATH_MAX], parts[PATH_MAX], dest_file[PATH_MAX];
+    if (upload_path(upload_id, ".dest", dest_file) < 0 || upload_path(upload_id, ".data", data) < 0 ||
+        upload_path(upload_id, ".parts", parts) < 0) return "Upload failed: Unknown upload";
+    FILE *fp = fopen(dest_file, "r");
+    if (!fp) return "Upload failed: Unknown upload";
+    int have_dest = fgets(dest, PATH_MAX, fp) != NULL;
+    fclose(fp);
+    if (!have_dest) return "Upload failed: Unknown upload";
+    dest[strcspn(dest, "\n")] = '\0';
+    if (size == 0) return "Upload failed: No data received";
+
+    // Load the recorded parts as offset/length pairs, sorted by offset
+    fp = fopen(parts, "r");
+    if (!fp) return "Upload failed: Unknown upload";
+    uint64_t *ranges = NULL, offset, length;
+    size_t count = 0, capacity = 0;
+    while (fscanf(fp, "%lu %lu", &offset, &length) == 2) {
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            uint64_t *grown = realloc(ranges, capacity * 2 * sizeof(uint64_t));
+            if (!grown) break;
+            ranges = grown;
+        }
+        ranges[2 * count] = offset;
+        ranges[2 * count + 1] = length;
+        count++;
+    }
+    fclose(fp);
+    if (count > 0) qsort(ranges, count, 2 * sizeof(uint64_t), compare_upload_parts);
+    // Parts may overlap when one was sent again, but must leave no gap
+    uint64_t covered = 0;
+    for (size_t i = 0; i < count && ranges[2 * i] <= covered; i++)
+        if (ranges[2 * i] + ranges[2 * i + 1] > covered) covered = ranges[2 * i] + ranges[2 * i + 1];
+    free(ranges);
+    if (covered < size) return "Upload failed: Missing parts";
+    if (covered > size) return "Upload failed: Parts beyond the end of the file";
+
+    char *dir_path = strdup(dest);
+    create_directories(dirname(dir_path));
+    free(dir_path);
+    struct staged_file file;
+    if (stage_file(&file, dest, data) < 0) return "Upload failed: Cannot move file into place";
+    if (ftruncate(fileno(file.fp), size) != 0) {
+        discard_file(&file);
+        return "Upload failed: Cannot move file into place";
+    }
+    staged_file_received(&file);
+    if (publish_files(&file, 1) == 0) return "Upload failed: Cannot move file into place";
+    unlink(parts);
+    unlink(dest_file);
+    return NULL;
+}
+
+// Abort an upload, removing everything staged for it. Returns -1 for an unknown upload.
+int upload_abort(const char *upload_id) {
+    char path[PATH_MAX];
+    if (upload_path(upload_id, ".dest", path) < 0 || unlink(path) != 0) return -1;
+    if (upload_path(upload_id, ".data", path) == 0) unlink(path);
+    if (upload_path(upload_id, ".parts", path) == 0) unlink(path);
+    return 0;
+}
+
+// Stage an upload that will replace path. A new temporary file is opened next to path,
+// or with existing given, the file already holding the content is staged instead.
+// Returns -1, with the file marked failed, if it cannot be opened.
+int stage_file(struct staged_file *file, const char *path, const char *existing) {
+    memset(file, 0, sizeof(*file));
+    snprintf(file->path, PATH_MAX, "%s", path);
+    if (existing) {
+        snprintf(file->temp_path, PATH_MAX, "%s", existing);
+        file->fp = fopen(existing, "r+b");
+    } else {
+        // A hidden name with a random suffix, so listings never match it
+        char *copy = strdup(path);
+        const char *name = copy ? basename(copy) : "";
+        for (int tries = 0; copy && tries < 8; tries++) {
+            uint32_t suffix = 0;
+            if (getrandom(&suffix, sizeof(suffix), 0) != sizeof(suffix)) suffix ^= (uint32_t)time(NULL) + tries;
+            int len = snprintf(file->temp_path, PATH_MAX, "%.*s.%s.%08x", (int)(name - copy), path, name, suffix);
+            if (len >= PATH_MAX) {
+                errno = ENAMETOOLONG;
+                break;
+            }
+            int fd = open(file->temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (fd < 0 && errno == EEXIST) continue;
+            if (fd >= 0 && !(file->fp = fdopen(fd, "wb"))) {
+                close(fd);
+                unlink(file->temp_path);
+            }
+            break;
+        }
+        free(copy);
+    }
+    if (!file->fp) {
+        file->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Whether name is that of a file stage_file() opened: ".<name>.<8 hex digits>". No
+// upload is stored under such a name, as it does not end in an accepted extension.
+int staged_name(const char *name) {
+    size_t len = strlen(name);
+    return len >= 11 && name[0] == '.' && name[len - 9] == '.' && strspn(name + len - 8, "0123456789abcdef") == 8;
+}
+
+// walk_files() callback removing a staged file an interrupted upload left behind,
+// counting it in ctx
+void sweep_staged(const char *path, int dir_fd, const char *name, void *ctx) {
+    if (staged_name(name) && unlinkat(dir_fd, name, 0) == 0) (*(size_t *)ctx)++;
+}
+
+// Remove the staged files of uploads a crash interrupted from the tree below root, when
+// there is no catalog to find them in. Called at startup, before any upload is staged.
+// Returns how many were removed.
+size_t sweep_staged_tree(const char *root) {
+    size_t swept = 0;
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    walk_files(fd, "", "", 0, sweep_staged, &swept);
+    close(fd);
+    return swept;
+}
+
+// Note that a staged file holds its whole content and is about to be published, so a
+// commit group being gathered waits for it. Uploads still arriving are not waited for.
+void staged_file_received(struct staged_file *file) {
+    if (commit_window_ms < 0 || !file->fp || file->received) return;
+    file->received = 1;
+    pthread_mutex_lock(&commit.lock);
+    commit.received++;
+    pthread_mutex_unlock(&commit.lock);
+}
+
+// Give up on a staged file, removing it
+void discard_file(struct staged_file *file) {
+    if (!file->fp) return;
+    fclose(file->fp);
+    file->fp = NULL;
+    unlink(file->temp_path);
+    file->failed = 1;
+    if (!file->received) return;
+    file->received = 0;
+    pthread_mutex_lock(&commit.lock);
+    commit.received--;
+    pthread_cond_broadcast(&commit.cond);
+    pthread_mutex_unlock(&commit.lock);
+}
+
+// Publish staged files: flush their content with one group commit, rename each over
+// its path, then flush the renames with another. Files already failed are skipped, and
+// any that fail now are removed and marked. Returns the number published.
+int publish_files(struct staged_file *files, int count) {
+    int *fds = malloc(2 * count * sizeof(int)), n = 0, received = 0, published = 0;
+    for (int i = 0; i < count; i++) {
+        if (!files[i].fp) continue;
+        if (!fds || fflush(files[i].fp) != 0 || ferror(files[i].fp)) {
+            discard_file(&files[i]);
+            continue;
+        }
+        fds[n++] = fileno(files[i].fp);
+        received += files[i].received;
+        files[i].received = 0;
+    }
+    int synced = fds ? durable_sync(fds, n, received) : -1;
+    if (!fds && received > 0) {
+        pthread_mutex_lock(&commit.lock);
+        commit.received -= received;
+        pthread_cond_broadcast(&commit.cond);
+        pthread_mutex_unlock(&commit.lock);
+    }
+
+    // Only content known to be on disk replaces the old file
+    int dirs = 0;
+    for (int i = 0; i < count; i++) {
+        if (!files[i].fp) continue;
+        int ok = fclose(files[i].fp) == 0 && synced == 0 && rename(files[i].temp_path, files[i].path) == 0;
+        files[i].fp = NULL;
+        if (!ok) {
+            unlink(files[i].temp_path);
+            files[i].failed = 1;
+            continue;
+        }
+        published++;
+        if (commit_window_ms < 0) continue;
+        // The renames are durable once each destination directory is flushed
+        char *copy = strdup(files[i].path);
+        int dir_fd = copy ? open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+        free(copy);
+        if (dir_fd >= 0) fds[n + dirs++] = dir_fd;
+    }
+    if (dirs > 0 && durable_sync(fds + n, dirs, 0) < 0) printf("S1: Cannot flush published uploads: %s\n", strerror(errno));
+    for (int i = 0; i < dirs; i++) close(fds[n + i]);
+    free(fds);
+    return published;
+}
+
+// Bring the files behind fds to disk as part of a commit group. received is how many of
+// them staged_file_received() counted; they stop being waited for once queued. Returns
+// -1 if the flush failed, which fails every file of the group.
+int durable_sync(const int *fds, int count, int received) {
+    if (commit_window_ms < 0 || count == 0) return 0;
+    struct sync_request request = {fds, count, 0, 0, NULL};
+    pthread_mutex_lock(&commit.lock);
+    request.next = commit.queue;
+    commit.queue = &request;
+    commit.received -= received;
+    pthread_cond_broadcast(&commit.cond);
+    while (!request.done) {
+        if (commit.flushing) {
+            pthread_cond_wait(&commit.cond, &commit.lock);
+            continue;
+        }
+        // Lead the next group: wait for received uploads to join, up to the window
+        commit.flushing = 1;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += commit_window_ms / 1000;
+        deadline.tv_nsec += (commit_window_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (commit.received > 0)
+            if (pthread_cond_timedwait(&commit.cond, &commit.lock, &deadline) == ETIMEDOUT) break;
+        struct sync_request *group = commit.queue;
+        commit.queue = NULL;
+        pthread_mutex_unlock(&commit.lock);
+        int result = flush_group(group);
+        pthread_mutex_lock(&commit.lock);
+        for (struct sync_request *r = group; r; r = r->next) {
+            r->result = result;
+            r->done = 1;
+        }
+        commit.flushing = 0;
+        pthread_cond_broadcast(&commit.cond);
+    }
+    pthread_mutex_unlock(&commit.lock);
+    return request.result;
+}
+
+// Flush a commit group: fdatasync() for each file and fsync() for each directory,
+// flushing a file or directory named by several requests only once
+int flush_group(struct sync_request *group) {
+    struct {
+        dev_t dev;
+        ino_t ino;
+    } synced[64];
+    int nsynced = 0, result = 0;
+    for (struct sync_request *r = group; r; r = r->next) {
+        for (int i = 0; i < r->count; i++) {
+            struct stat statbuf;
+            if (fstat(r->fds[i], &statbuf) != 0) {
+                result = -1;
+                continue;
+            }
+            int seen = 0;
+            for (int j = 0; j < nsynced && !seen; j++) seen = synced[j].dev == statbuf.st_dev && synced[j].ino == statbuf.st_ino;
+            if (seen) continue;
+            if (nsynced < 64) {
+                synced[nsynced].dev = statbuf.st_dev;
+                synced[nsynced++].ino = statbuf.st_ino;
+            }
+            if ((S_ISDIR(statbuf.st_mode) ? fsync(r->fds[i]) : fdatasync(r->fds[i])) != 0) result = -1;
+        }
+    }
+    return result;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+void sha256_init(struct sha256_ctx *ctx) {
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->fill = 0;
+}
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// Run the SHA-256 compression function over count 64-byte blocks, with the SHA extensions
+// where the CPU has them
+void sha256_blocks(uint32_t *state, const unsigned char *data, size_t count) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+        sha256_blocks_shani(state, data, count);
+        return;
+    }
+#endif
+    sha256_blocks_portable(state, data, count);
+}
+
+void sha256_blocks_portable(uint32_t *state, const unsigned char *data, size_t count) {
+    for (; count > 0; count--, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 | (uint32_t)data[4 * i + 2] << 8 | data[4 * i + 3];
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// SHA-256 compression with the x86 SHA extensions: each sha256rnds2 runs two rounds, and
+// sha256msg1/sha256msg2 extend the message schedule four words at a time. The state is
+// held as the ABEF and CDGH halves the instructions work on.
+__attribute__((target("sha,sse4.1")))
+void sha256_blocks_shani(uint32_t *state, const unsigned char *data, size_t count) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);  // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);  // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);  // CDGH
+    for (; count > 0; count--, data += 64) {
+        __m128i abef = state0, cdgh = state1, msg[4];
+        // Unrolled, so that msg stays in registers
+#pragma GCC unroll 16
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), byte_swap);
+            __m128i words = _mm_add_epi32(msg[i % 4], _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, words);
+            // The words four groups ahead are due once this group's are known
+            if (i >= 3 && i < 15) {
+                __m128i next = _mm_add_epi32(msg[(i + 1) % 4], _mm_alignr_epi8(msg[i % 4], msg[(i + 3) % 4], 4));
+                msg[(i + 1) % 4] = _mm_sha256msg2_epu32(next, msg[i % 4]);
+            }
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(words, 0x0e));
+            if (i >= 1 && i < 13) msg[(i + 3) % 4] = _mm_sha256msg1_epu32(msg[(i + 3) % 4], msg[i % 4]);
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+    tmp = _mm_shuffle_epi32(state0, 0x1b);  // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1);  // DCHG
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));  // DCBA
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));  // HGFE
+}
+#endif
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t length) {
+    const unsigned char *p = data;
+    ctx->length += length;
+    if (ctx->fill > 0) {
+        size_t take = 64 - ctx->fill < length ? 64 - ctx->fill : length;
+        memcpy(ctx->block + ctx->fill, p, take);
+        ctx->fill += take;
+        p += take;
+        length -= take;
+        if (ctx->fill < 64) return;
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->fill = 0;
+    }
+    if (length >= 64) {
+        sha256_blocks(ctx->state, p, length / 64);
+        p += length / 64 * 64;
+        length %= 64;
+    }
+    memcpy(ctx->block, p, length);
+    ctx->fill = length;
+}
+
+void sha256_final(struct sha256_ctx *ctx, unsigned char *digest) {
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad[64] = {0x80};
+    sha256_update(ctx, pad, (ctx->fill < 56 ? 56 : 120) - ctx->fill);
+    for (int i = 0; i < 8; i++) pad[i] = bits >> (56 - 8 * i);
+    sha256_update(ctx, pad, 8);
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = ctx->state[i] >> 24;
+        digest[4 * i + 1] = ctx->state[i] >> 16;
+        digest[4 * i + 2] = ctx->state[i] >> 8;
+        digest[4 * i + 3] = ctx->state[i];
+    }
+}
+
+// Parse a digest written as lowercase hex. Returns -1 if hex is not one.
+int parse_digest(const char *hex, unsigned char *digest) {
+    if (strlen(hex) != 2 * SHA256_LEN || strspn(hex, "0123456789abcdef") != 2 * SHA256_LEN) return -1;
+    for (int i = 0; i < SHA256_LEN; i++) sscanf(hex + 2 * i, "%2hhx", &digest[i]);
+    return 0;
+}
+
+// Whether the .c file at path has size bytes with the SHA-256 digest
+int content_matches(const char *path, uint64_t size, const unsigned char *digest) {
+    unsigned char stored[SHA256_LEN];
+    struct stat statbuf;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    if (fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode) || (uint64_t)statbuf.st_size != size) {
+        close(fd);
+        return 0;
+    }
+    // Uploads replace files by renaming over them, so a new copy has a new inode
+    struct digest_cache_entry *slot = &digest_cache.slots[statbuf.st_ino % DIGEST_CACHE_SLOTS];
+    pthread_mutex_lock(&digest_cache.lock);
+    int cached = slot->ino == statbuf.st_ino && slot->dev == statbuf.st_dev && slot->size == statbuf.st_size &&
+                 slot->mtime.tv_sec == statbuf.st_mtim.tv_sec && slot->mtime.tv_nsec == statbuf.st_mtim.tv_nsec &&
+                 slot->ctime.tv_sec == statbuf.st_ctim.tv_sec && slot->ctime.tv_nsec == statbuf.st_ctim.tv_nsec;
+    if (cached) memcpy(stored, slot->digest, SHA256_LEN);
+    pthread_mutex_unlock(&digest_cache.lock);
+    if (!cached) {
+        if (digest_file(fd, 0, size, stored) < 0) {
+            close(fd);
+            return 0;
+        }
+        pthread_mutex_lock(&digest_cache.lock);
+        *slot = (struct digest_cache_entry){statbuf.st_dev, statbuf.st_ino, statbuf.st_size, statbuf.st_mtim, statbuf.st_ctim, {0}};
+        memcpy(slot->digest, stored, SHA256_LEN);
+        pthread_mutex_unlock(&digest_cache.lock);
+    }
+    close(fd);
+    return memcmp(stored, digest, SHA256_LEN) == 0;
+}
+
+// SHA-256 of size bytes of fd from offset. Returns -1 if they cannot all be read.
+int digest_file(int fd, uint64_t offset, uint64_t size, unsigned char *digest) {
+    struct sha256_ctx ctx;
+    unsigned char *buf = malloc(DIGEST_READ);
+    uint64_t done = 0;
+    if (!buf) return -1;
+    sha256_init(&ctx);
+    while (done < size) {
+        size_t want = size - done < DIGEST_READ ? size - done : DIGEST_READ;
+        ssize_t bytes = pread(fd, buf, want, offset + done);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) break;
+        sha256_update(&ctx, buf, bytes);
+        done += bytes;
+    }
+    free(buf);
+    if (done < size) return -1;
+    sha256_final(&ctx, digest);
+    return 0;
+}
+
+// Whether a file is worth compressing in transit; types stored compressed would
+// only cost CPU on both ends
+int compressible_type(const char *name) {
+    static const char *const stored_compressed[] = {".zip", ".pdf", ".gz", ".tgz", ".bz2", ".xz", ".7z", ".jpg", ".png", NULL};
+    const char *ext = strrchr(name, '.');
+    if (!ext) return 1;
+    for (int i = 0; stored_compressed[i]; i++)
+        if (strcmp(ext, stored_compressed[i]) == 0) return 0;
+    return 1;
+}
+
+// Send size bytes of fd from offset as a deflated body: one raw deflate stream, sent in
+// DATA frames as each TRANSFER_CHUNK of output fills, so neither side holds more than a
+// chunk of it. Returns the compressed bytes sent, or -1 if the file or the connection
+// failed mid-stream and the connection is unusable.
+long long send_deflated_body(int sock, int fd, uint64_t offset, uint64_t size, uint32_t request_id) {
+    unsigned char *in = malloc(TRANSFER_CHUNK), *out = malloc(TRANSFER_CHUNK);
+    z_stream strm = {0};
+    if (!in || !out || deflateInit2(&strm, TRANSFER_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(in);
+        free(out);
+        return -1;
+    }
+    long long sent = 0;
+    int flush = Z_NO_FLUSH;
+    strm.next_out = out;
+    strm.avail_out = TRANSFER_CHUNK;
+    uint64_t end = offset + size;
+    while (sent >= 0 && flush != Z_FINISH) {
+        size_t to_read = end - offset < TRANSFER_CHUNK ? end - offset : TRANSFER_CHUNK;
+        ssize_t bytes = to_read > 0 ? pread(fd, in, to_read, offset) : 0;
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes < 0) {
+            sent = -1;
+            break;
+        }
+        offset += bytes;
+        // A file that shrank ends the stream early; the receiver sees a short body
+        flush = bytes == 0 ? Z_FINISH : Z_NO_FLUSH;
+        strm.next_in = in;
+        strm.avail_in = bytes;
+        int ret;
+        do {
+            ret = deflate(&strm, flush);
+            // A full buffer goes out with more to follow; the stream's end goes out last
+            if (strm.avail_out == 0 || ret == Z_STREAM_END) {
+                size_t len = TRANSFER_CHUNK - strm.avail_out;
+                uint16_t flags = FL_DEFLATE | (ret == Z_STREAM_END ? 0 : FL_MORE);
+                if (send_frame(sock, OP_DATA, flags, 0, request_id, out, len) < 0) {
+                    sent = -1;
+                    break;
+                }
+                sent += len;
+                strm.next_out = out;
+                strm.avail_out = TRANSFER_CHUNK;
+            }
+        } while (strm.avail_in > 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+    }
+    deflateEnd(&strm);
+    free(in);
+    free(out);
+    return sent;
+}
+
+// Walk the tree below dir_fd with getdents64(), calling fn for every regular file whose
+// name ends in ext. Directory entry types come from the kernel, so only entries of
+// unknown type are stat'ed. Symlinks are not followed; with skip_hidden, hidden entries
+// at the top level are ignored. dir_fd stays open.
+void walk_files(int dir_fd, const char *rel, const char *ext, int skip_hidden, walk_fn fn, void *ctx) {
+    char *buf = malloc(WALK_BUFFER);
+    size_t ext_len = strlen(ext);
+    long n;
+    while (buf && (n = syscall(SYS_getdents64, dir_fd, buf, WALK_BUFFER)) > 0) {
+        for (long pos = 0; pos < n; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + pos);
+            pos += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            if (skip_hidden && rel[0] == '\0' && name[0] == '.') continue;
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat statbuf;
+                if (fstatat(dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                type = S_ISDIR(statbuf.st_mode) ? DT_DIR : S_ISREG(statbuf.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type == DT_REG) {
+                size_t name_len = strlen(name);
+                if (name_len < ext_len || memcmp(name + name_len - ext_len, ext, ext_len) != 0) continue;
+            } else if (type != DT_DIR) {
+                continue;
+            }
+            char path[PATH_MAX];
+            if (snprintf(path, PATH_MAX, "%s%s%s", rel, rel[0] ? "/" : "", name) >= PATH_MAX) continue;
+            if (type == DT_REG) {
+                fn(path, dir_fd, name, ctx);
+                continue;
+            }
+            int sub_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (sub_fd < 0) continue;
+            walk_files(sub_fd, path, ext, skip_hidden, fn, ctx);
+            close(sub_fd);
+        }
+    }
+    free(buf);
+}
+
+// Restore the max-heap order of a listing page after slot i grew or shrank
+static void page_sift_down(struct listing_page *page, int i) {
+    while (1) {
+        int largest = i, left = 2 * i + 1, right = left + 1;
+        if (left < page->count && strcmp(page->entries[left].path, page->entries[largest].path) > 0) largest = left;
+        if (right < page->count && strcmp(page->entries[right].path, page->entries[largest].path) > 0) largest = right;
+        if (largest == i) return;
+        struct page_entry tmp = page->entries[i];
+        page->entries[i] = page->entries[largest];
+        page->entries[largest] = tmp;
+        i = largest;
+    }
+}
+
+// walk_files() callback: keep the limit + 1 smallest paths after the cursor. The
+// heap's root is the largest path kept, so a later file either replaces it or is dropped.
+static void page_add_file(const char *path, int dir_fd, const char *name, void *ctx) {
+    struct listing_page *page = ctx;
+    if (page->after[0] && strcmp(path, page->after) <= 0) return;
+    int full = page->count == page->limit + 1;
+    if (full && strcmp(path, page->entries[0].path) >= 0) return;
+    struct page_entry entry = {NULL, 0, 0};
+    if (page->want_long) {
+        struct stat statbuf;
+        if (fstatat(dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) return;
+        entry.size = statbuf.st_size;
+        entry.mtime = statbuf.st_mtime;
+    }
+    entry.path = strdup(path);
+    if (full) {
+        free(page->entries[0].path);
+        page->entries[0] = entry;
+        page_sift_down(page, 0);
+        return;
+    }
+    // Sift the new entry up from the bottom
+    int i = page->count++;
+    while (i > 0 && strcmp(page->entries[(i - 1) / 2].path, entry.path) < 0) {
+        page->entries[i] = page->entries[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    page->entries[i] = entry;
+}
+
+static int compare_page_entries(const void *a, const void *b) {
+    return strcmp(((const struct page_entry *)a)->path, ((const struct page_entry *)b)->path);
+}
+
+// Collect one page of a listing: the first limit files of type ext under dir whose
+// relative paths sort bytewise after the cursor. Memory stays bounded by the page size
+// however large the tree is; page->more tells whether files remain beyond it.
+void collect_listing_page(const char *dir, const char *ext, const char *after, int limit, int want_long, struct listing_page *page) {
+    // The catalog answers without walking the tree when it covers dir
+    if (catalog_list_page(dir, ext, after, limit, want_long, page) == 0) return;
+    memset(page, 0, sizeof(*page));
+    page->after = after;
+    page->limit = limit;
+    page->want_long = want_long;
+    page->entries = malloc((limit + 1) * sizeof(*page->entries));
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return;
+    walk_files(dir_fd, "", ext, 0, page_add_file, page);
+    close(dir_fd);
+    if (page->count == limit + 1) {
+        // The largest kept path only shows that the listing continues
+        free(page->entries[0].path);
+        page->entries[0] = page->entries[--page->count];
+        page->more = 1;
+    }
+    qsort(page->entries, page->count, sizeof(*page->entries), compare_page_entries);
+}
+
+void free_listing_page(struct listing_page *page) {
+    for (int i = 0; i < page->count; i++) free(page->entries[i].path);
+    free(page->entries);
+    memset(page, 0, sizeof(*page));
+}
+
+// Start the catalog of root: load its snapshot, or scan the tree if there is no usable
+// one, then keep it current from inotify events in a background thread
+void catalog_init(const char *root, const char *snapshot) {
+    snprintf(catalog.root, PATH_MAX, "%s", root);
+    snprintf(catalog.snapshot, PATH_MAX, "%s", snapshot);
+    create_directories(root);
+    catalog.inotify_fd = inotify_init1(IN_CLOEXEC);
+    size_t swept;
+    if (catalog.inotify_fd < 0) {
+        perror("inotify_init1 failed");
+        if ((swept = sweep_staged_tree(root)) > 0) printf("S1: Removed %zu staged files of interrupted uploads\n", swept);
+        return;
+    }
+    catalog.ready = 1;
+    int loaded = catalog_load();
+    if (!loaded) catalog_rebuild();
+    if ((swept = catalog_sweep_staged()) > 0) printf("S1: Removed %zu staged files of interrupted uploads\n", swept);
+    if (!loaded) catalog_save();
+    catalog.last_save = time(NULL);
+    printf("S1: Catalog of %s holds %zu files in %zu directories (%s)\n", root, catalog.count,
+           catalog.dir_count, loaded ? "from snapshot" : "scanned");
+
+    // The watcher must not take the shutdown signal meant for the main thread
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, catalog_watcher, NULL) == 0) pthread_detach(tid);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+// Remove the staged files of uploads a crash interrupted. Each is either in the snapshot
+// or in a directory rescanned since, so the catalog holds every one left on disk. Called
+// from catalog_init(), before any upload is staged. Returns how many were removed.
+size_t catalog_sweep_staged(void) {
+    char path[PATH_MAX];
+    size_t kept = 0, swept = 0;
+    for (size_t i = 0; i < catalog.count; i++) {
+        struct catalog_entry *e = &catalog.entries[i];
+        const char *slash = strrchr(e->path, '/');
+        if (staged_name(slash ? slash + 1 : e->path)) {
+            int removed = catalog_abspath(e->path, path) == 0 && unlink(path) == 0;
+            if (removed || errno == ENOENT) {
+                swept += removed;
+                free(e->path);
+                continue;
+            }
+        }
+        catalog.entries[kept++] = *e;
+    }
+    if (kept < catalog.count) __atomic_store_n(&catalog.dirty, 1, __ATOMIC_RELAXED);
+    catalog.count = kept;
+    return swept;
+}
+
+// Bring the entry for path up to date after this server changed the file, so the next
+// request sees the change without waiting for its inotify event
+void catalog_note(const char *path) {
+    char rel[PATH_MAX];
+    if (catalog.inotify_fd < 0 || catalog_relpath(path, rel) < 0 || rel[0] == '\0') return;
+    pthread_rwlock_wrlock(&catalog.lock);
+    catalog_refresh(rel);
+    __atomic_store_n(&catalog.dirty, 1, __ATOMIC_RELAXED);
+    catalog.generation++;
+    pthread_rwlock_unlock(&catalog.lock);
+}
+
+// Generation of the catalog, bumped on every change to the stored files
+uint64_t catalog_generation(void) {
+    pthread_rwlock_rdlock(&catalog.lock);
+    uint64_t generation = catalog.generation;
+    pthread_rwlock_unlock(&catalog.lock);
+    return generation;
+}
+
+// Answer a listing page from the catalog, as collect_listing_page() would by walking dir.
+// Returns -1 if the catalog cannot answer for dir, which must then be walked.
+int catalog_list_page(const char *dir, const char *ext, const char *after, int limit, int want_long, struct listing_page *page) {
+    char rel[PATH_MAX];
+    if (catalog.inotify_fd < 0 || catalog_relpath(dir, rel) < 0) return -1;
+    pthread_rwlock_rdlock(&catalog.lock);
+    if (!catalog.ready || !catalog_dir_by_path(rel)) {
+        pthread_rwlock_unlock(&catalog.lock);
+        return -1;
+    }
+    memset(page, 0, sizeof(*page));
+    page->after = after;
+    page->limit = limit;
+    page->want_long = want_long;
+    page->entries = malloc((limit + 1) * sizeof(*page->entries));
+
+    // Files below dir share the prefix "rel/", so they sit in one run of the sorted
+    // catalog, in the same order as their paths relative to dir
+    char key[2 * PATH_MAX];
+    size_t prefix_len = snprintf(key, sizeof(key), "%s%s", rel, rel[0] ? "/" : "");
+    snprintf(key + prefix_len, sizeof(key) - prefix_len, "%s", after);
+    int found;
+    size_t i = catalog_find(key, &found);
+    if (found && after[0]) i++;
+    for (; i < catalog.count && strncmp(catalog.entries[i].path, key, prefix_len) == 0; i++) {
+        const struct catalog_entry *e = &catalog.entries[i];
+        if (strcmp(e->ext, ext) != 0) continue;
+        if (page->count == limit) {
+            page->more = 1;
+            break;
+        }
+        struct page_entry *entry = &page->entries[page->count++];
+        entry->path = strdup(e->path + prefix_len);
+        entry->size = e->size;
+        entry->mtime = e->mtime;
+    }
+    pthread_rwlock_unlock(&catalog.lock);
+    return 0;
+}
+
+// Write the catalog to its snapshot file, replacing the previous snapshot atomically
+int catalog_save(void) {
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", catalog.snapshot);
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp) return -1;
+    pthread_rwlock_rdlock(&catalog.lock);
+    __atomic_store_n(&catalog.dirty, 0, __ATOMIC_RELAXED);
+    uint32_t header[2] = {CATALOG_MAGIC, strlen(catalog.root)};
+    uint64_t counts[2] = {catalog.dir_count, catalog.count};
+    fwrite(header, sizeof(header), 1, fp);
+    fwrite(catalog.root, 1, header[1], fp);
+    fwrite(counts, sizeof(counts), 1, fp);
+    for (size_t i = 0; i < catalog.dir_count; i++) {
+        const struct catalog_dir *d = &catalog.dirs[i];
+        uint16_t len = strlen(d->path);
+        int64_t mtime[2] = {d->mtime.tv_sec, d->mtime.tv_nsec};
+        fwrite(&len, sizeof(len), 1, fp);
+        fwrite(d->path, 1, len, fp);
+        fwrite(mtime, sizeof(mtime), 1, fp);
+    }
+    for (size_t i = 0; i < catalog.count; i++) {
+        const struct catalog_entry *e = &catalog.entries[i];
+        uint16_t len = strlen(e->path);
+        int64_t fields[2] = {e->size, e->mtime};
+        fwrite(&len, sizeof(len), 1, fp);
+        fwrite(e->path, 1, len, fp);
+        fwrite(fields, sizeof(fields), 1, fp);
+    }
+    pthread_rwlock_unlock(&catalog.lock);
+    int ok = !ferror(fp);
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok || rename(tmp_path, catalog.snapshot) != 0) {
+        remove(tmp_path);
+        __atomic_store_n(&catalog.dirty, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+// Apply inotify events to the catalog as they arrive and write the snapshot at most
+// every CATALOG_SAVE_INTERVAL seconds while it changes
+void *catalog_watcher(void *arg) {
+    char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = {.fd = catalog.inotify_fd, .events = POLLIN};
+    while (1) {
+        if (poll(&pfd, 1, CATALOG_SAVE_INTERVAL * 1000) > 0) {
+            ssize_t len = read(catalog.inotify_fd, buf, sizeof(buf));
+            pthread_rwlock_wrlock(&catalog.lock);
+            for (ssize_t pos = 0; pos < len; ) {
+                const struct inotify_event *ev = (const struct inotify_event *)(buf + pos);
+                catalog_apply_event(ev);
+                pos += sizeof(*ev) + ev->len;
+            }
+            if (len > 0) {
+                __atomic_store_n(&catalog.dirty, 1, __ATOMIC_RELAXED);
+                catalog.generation++;
+            }
+            pthread_rwlock_unlock(&catalog.lock);
+        }
+        if (__atomic_load_n(&catalog.dirty, __ATOMIC_RELAXED) && time(NULL) - catalog.last_save >= CATALOG_SAVE_INTERVAL) {
+            catalog_save();
+            catalog.last_save = time(NULL);
+        }
+    }
+    return NULL;
+}
+
+// Update the catalog for one event. Called with the catalog write-locked.
+void catalog_apply_event(const struct inotify_event *ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        printf("S1: Catalog missed events; rescanning %s\n", catalog.root);
+        catalog_rebuild();
+        return;
+    }
+    struct catalog_dir *dir = catalog_dir_by_wd(ev->wd);
+    if (!dir) return;
+    if (ev->mask & IN_IGNORED) {
+        // The directory is gone; its parent's event drops its files
+        dir->wd = -1;
+        return;
+    }
+    if (ev->len == 0) return;
+    char rel[PATH_MAX], path[PATH_MAX];
+    if (snprintf(rel, PATH_MAX, "%s%s%s", dir->path, dir->path[0] ? "/" : "", ev->name) >= PATH_MAX) return;
+    if (!(ev->mask & IN_ISDIR)) {
+        catalog_refresh(rel);
+    } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        catalog_remove_tree(rel);
+    } else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        // Files may have appeared in the new directory before its watch was added
+        int fd = catalog_abspath(rel, path) == 0 ? open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+        if (fd >= 0) {
+            catalog_scan(fd, rel, 1);
+            close(fd);
+            catalog_sort();
+        }
+    }
+    // Record the directory's new mtime, so a snapshot shows it needs no rescan
+    struct stat statbuf;
+    dir = catalog_dir_by_wd(ev->wd);
+    if (dir && catalog_abspath(dir->path, path) == 0 && stat(path, &statbuf) == 0) dir->mtime = statbuf.st_mtim;
+}
+
+// Load the snapshot and bring it up to date: directories whose mtime changed since it was
+// written are rescanned one level deep, vanished ones dropped and new ones scanned in full.
+// Files rewritten in place while the server was down keep their recorded size and mtime.
+// Returns 0 if there is no usable snapshot.
+int catalog_load(void) {
+    FILE *fp = fopen(catalog.snapshot, "rb");
+    if (!fp) return 0;
+    uint32_t header[2];
+    uint64_t counts[2] = {0, 0};
+    char path[PATH_MAX];
+    int ok = fread(header, sizeof(header), 1, fp) == 1 && header[0] == CATALOG_MAGIC && header[1] < PATH_MAX &&
+             fread(path, 1, header[1], fp) == header[1];
+    if (ok) {
+        path[header[1]] = '\0';
+        ok = strcmp(path, catalog.root) == 0 && fread(counts, sizeof(counts), 1, fp) == 1;
+    }
+    for (uint64_t i = 0; ok && i < counts[0]; i++) {
+        uint16_t len;
+        int64_t mtime[2];
+        ok = fread(&len, sizeof(len), 1, fp) == 1 && len < PATH_MAX && fread(path, 1, len, fp) == len &&
+             fread(mtime, sizeof(mtime), 1, fp) == 1;
+        if (!ok) break;
+        path[len] = '\0';
+        struct catalog_dir *d = catalog_add_dir(path);
+        d->mtime.tv_sec = mtime[0];
+        d->mtime.tv_nsec = mtime[1];
+    }
+    for (uint64_t i = 0; ok && i < counts[1]; i++) {
+        uint16_t len;
+        int64_t fields[2];
+        ok = fread(&len, sizeof(len), 1, fp) == 1 && len < PATH_MAX && fread(path, 1, len, fp) == len &&
+             fread(fields, sizeof(fields), 1, fp) == 1;
+        if (!ok) break;
+        path[len] = '\0';
+        struct stat statbuf = {.st_size = fields[0]};
+        statbuf.st_mtime = fields[1];
+        catalog_append(path, &statbuf);
+    }
+    fclose(fp);
+    if (!ok || !catalog_dir_by_path("")) return 0;
+    catalog_sort();
+
+    // Check every directory with one stat; drop what vanished before rescanning what changed,
+    // since dropping relies on the catalog being sorted
+    size_t dir_count = catalog.dir_count;
+    char **paths = malloc(dir_count * sizeof(*paths));
+    int *changed = calloc(dir_count, sizeof(*changed));
+    for (size_t i = 0; i < dir_count; i++) paths[i] = strdup(catalog.dirs[i].path);
+    for (size_t i = 0; i < dir_count; i++) {
+        struct catalog_dir *d = catalog_dir_by_path(paths[i]);
+        if (!d) continue;
+        struct stat statbuf;
+        if (catalog_abspath(paths[i], path) < 0 || lstat(path, &statbuf) != 0 || !S_ISDIR(statbuf.st_mode)) {
+            // A vanished root means the snapshot is of no use
+            if (paths[i][0] == '\0') ok = 0;
+            else catalog_remove_tree(paths[i]);
+        } else if (statbuf.st_mtim.tv_sec != d->mtime.tv_sec || statbuf.st_mtim.tv_nsec != d->mtime.tv_nsec) {
+            catalog_drop_files(paths[i]);
+            changed[i] = 1;
+        } else {
+            d->wd = inotify_add_watch(catalog.inotify_fd, path, CATALOG_EVENTS);
+            if (d->wd < 0) catalog.ready = 0;
+        }
+    }
+    for (size_t i = 0; i < dir_count; i++) {
+        if (changed[i]) {
+            int fd = catalog_abspath(paths[i], path) == 0 ? open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+            if (fd >= 0) {
+                catalog_scan(fd, paths[i], 0);
+                close(fd);
+            }
+        }
+        free(paths[i]);
+    }
+    free(paths);
+    free(changed);
+    catalog_sort();
+    return ok;
+}
+
+// Forget everything and scan the whole tree again. Called with the catalog write-locked
+// (or before it is shared).
+void catalog_rebuild(void) {
+    for (size_t i = 0; i < catalog.count; i++) free(catalog.entries[i].path);
+    for (size_t i = 0; i < catalog.dir_count; i++) free(catalog.dirs[i].path);
+    catalog.count = catalog.dir_count = 0;
+    int fd = open(catalog.root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        catalog_scan(fd, "", 1);
+        close(fd);
+    }
+    catalog_sort();
+}
+
+// Watch directory rel (open as dir_fd) and append its files to the catalog. Subdirectories
+// are scanned as well if recursive is set or they are not catalogued yet. Entries are
+// appended unsorted, so the caller must run catalog_sort() afterwards.
+void catalog_scan(int dir_fd, const char *rel, int recursive) {
+    char path[PATH_MAX];
+    if (catalog_abspath(rel, path) < 0) return;
+    struct catalog_dir *dir = catalog_dir_by_path(rel);
+    if (!dir) dir = catalog_add_dir(rel);
+    // Watch before reading, so files created meanwhile are reported rather than missed
+    dir->wd = inotify_add_watch(catalog.inotify_fd, path, CATALOG_EVENTS);
+    if (dir->wd < 0 && catalog.ready) {
+        fprintf(stderr, "S1: Cannot watch %s (%s); listings will walk the tree\n", path, strerror(errno));
+        catalog.ready = 0;
+    }
+    struct stat statbuf;
+    if (fstat(dir_fd, &statbuf) == 0) dir->mtime = statbuf.st_mtim;
+
+    char *buf = malloc(WALK_BUFFER);
+    long n;
+    while (buf && (n = syscall(SYS_getdents64, dir_fd, buf, WALK_BUFFER)) > 0) {
+        for (long pos = 0; pos < n; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + pos);
+            pos += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            char child[PATH_MAX];
+            if (snprintf(child, PATH_MAX, "%s%s%s", rel, rel[0] ? "/" : "", name) >= PATH_MAX) continue;
+            if (d->d_type == DT_DIR || d->d_type == DT_UNKNOWN) {
+                if (!recursive && catalog_dir_by_path(child)) continue;
+                int sub_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (sub_fd >= 0) {
+                    catalog_scan(sub_fd, child, 1);
+                    close(sub_fd);
+                    continue;
+                }
+            }
+            if ((d->d_type == DT_REG || d->d_type == DT_UNKNOWN) &&
+                fstatat(dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(statbuf.st_mode))
+                catalog_append(child, &statbuf);
+        }
+    }
+    free(buf);
+}
+
+// Re-read one file's status: update its entry, add it, or drop it if it is no longer a
+// regular file. Called with the catalog write-locked.
+void catalog_refresh(const char *rel) {
+    char path[PATH_MAX];
+    struct stat statbuf;
+    int found;
+    int exists = catalog_abspath(rel, path) == 0 && lstat(path, &statbuf) == 0 && S_ISREG(statbuf.st_mode);
+    size_t i = catalog_find(rel, &found);
+    if (found && !exists) {
+        free(catalog.entries[i].path);
+        memmove(&catalog.entries[i], &catalog.entries[i + 1], (catalog.count - i - 1) * sizeof(*catalog.entries));
+        catalog.count--;
+    } else if (found) {
+        catalog.entries[i].size = statbuf.st_size;
+        catalog.entries[i].mtime = statbuf.st_mtime;
+    } else if (exists) {
+        // Insert in place to keep the catalog sorted
+        catalog_append(rel, &statbuf);
+        struct catalog_entry entry = catalog.entries[catalog.count - 1];
+        memmove(&catalog.entries[i + 1], &catalog.entries[i], (catalog.count - 1 - i) * sizeof(*catalog.entries));
+        catalog.entries[i] = entry;
+    }
+}
+
+// Drop every file and directory below rel, and the directory itself
+void catalog_remove_tree(const char *rel) {
+    char prefix[PATH_MAX + 1];
+    size_t prefix_len = snprintf(prefix, sizeof(prefix), "%s/", rel);
+    int found;
+    size_t start = catalog_find(prefix, &found), end = start;
+    while (end < catalog.count && strncmp(catalog.entries[end].path, prefix, prefix_len) == 0) free(catalog.entries[end++].path);
+    memmove(&catalog.entries[start], &catalog.entries[end], (catalog.count - end) * sizeof(*catalog.entries));
+    catalog.count -= end - start;
+    for (size_t i = 0; i < catalog.dir_count; ) {
+        struct catalog_dir *d = &catalog.dirs[i];
+        if (strcmp(d->path, rel) == 0 || strncmp(d->path, prefix, prefix_len) == 0) {
+            // A directory moved elsewhere keeps its watch unless it is removed
+            if (d->wd >= 0) inotify_rm_watch(catalog.inotify_fd, d->wd);
+            catalog_remove_dir(d);
+        } else {
+            i++;
+        }
+    }
+}
+
+// Drop the files directly in directory rel, keeping those in its subdirectories
+void catalog_drop_files(const char *rel) {
+    char prefix[PATH_MAX + 1];
+    size_t prefix_len = snprintf(prefix, sizeof(prefix), "%s%s", rel, rel[0] ? "/" : "");
+    int found;
+    size_t start = catalog_find(prefix, &found), out = start, i = start;
+    for (; i < catalog.count && strncmp(catalog.entries[i].path, prefix, prefix_len) == 0; i++) {
+        if (strchr(catalog.entries[i].path + prefix_len, '/')) catalog.entries[out++] = catalog.entries[i];
+        else free(catalog.entries[i].path);
+    }
+    memmove(&catalog.entries[out], &catalog.entries[i], (catalog.count - i) * sizeof(*catalog.entries));
+    catalog.count -= i - out;
+}
+
+// Append an entry without keeping the catalog sorted
+void catalog_append(const char *rel, const struct stat *statbuf) {
+    if (catalog.count == catalog.capacity) {
+        catalog.capacity = catalog.capacity ? 2 * catalog.capacity : 1024;
+        catalog.entries = realloc(catalog.entries, catalog.capacity * sizeof(*catalog.entries));
+    }
+    struct catalog_entry *e = &catalog.entries[catalog.count++];
+    e->path = strdup(rel);
+    const char *base = strrchr(e->path, '/');
+    base = base ? base + 1 : e->path;
+    e->ext = strrchr(base, '.') ? strrchr(base, '.') : base + strlen(base);
+    e->size = statbuf->st_size;
+    e->mtime = statbuf->st_mtime;
+}
+
+static int compare_catalog_entries(const void *a, const void *b) {
+    return strcmp(((const struct catalog_entry *)a)->path, ((const struct catalog_entry *)b)->path);
+}
+
+// Sort appended entries into place, dropping duplicates a rescan may have added
+void catalog_sort(void) {
+    qsort(catalog.entries, catalog.count, sizeof(*catalog.entries), compare_catalog_entries);
+    size_t out = 0;
+    for (size_t i = 0; i < catalog.count; i++) {
+        if (out > 0 && strcmp(catalog.entries[out - 1].path, catalog.entries[i].path) == 0) {
+            free(catalog.entries[out - 1].path);
+            out--;
+        }
+        catalog.entries[out++] = catalog.entries[i];
+    }
+    catalog.count = out;
+}
+
+// Index of the first entry whose path is not less than path; found tells whether it matches
+size_t catalog_find(const char *path, int *found) {
+    size_t lo = 0, hi = catalog.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(catalog.entries[mid].path, path) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    *found = lo < catalog.count && strcmp(catalog.entries[lo].path, path) == 0;
+    return lo;
+}
+
+struct catalog_dir *catalog_add_dir(const char *rel) {
+    if (catalog.dir_count == catalog.dir_capacity) {
+        catalog.dir_capacity = catalog.dir_capacity ? 2 * catalog.dir_capacity : 64;
+        catalog.dirs = realloc(catalog.dirs, catalog.dir_capacity * sizeof(*catalog.dirs));
+    }
+    struct catalog_dir *d = &catalog.dirs[catalog.dir_count++];
+    d->path = strdup(rel);
+    d->wd = -1;
+    d->mtime.tv_sec = d->mtime.tv_nsec = 0;
+    return d;
+}
+
+void catalog_remove_dir(struct catalog_dir *d) {
+    free(d->path);
+    *d = catalog.dirs[--catalog.dir_count];
+}
+
+struct catalog_dir *catalog_dir_by_path(const char *rel) {
+    for (size_t i = 0; i < catalog.dir_count; i++)
+        if (strcmp(catalog.dirs[i].path, rel) == 0) return &catalog.dirs[i];
+    return NULL;
+}
+
+struct catalog_dir *catalog_dir_by_wd(int wd) {
+    for (size_t i = 0; i < catalog.dir_count; i++)
+        if (catalog.dirs[i].wd == wd) return &catalog.dirs[i];
+    return NULL;
+}
+
+// Absolute path of rel, which is relative to the catalog root. Returns -1 with errno
+// ENAMETOOLONG if it does not fit in PATH_MAX.
+int catalog_abspath(const char *rel, char *path) {
+    if (snprintf(path, PATH_MAX, "%s%s%s", catalog.root, rel[0] ? "/" : "", rel) < PATH_MAX) return 0;
+    errno = ENAMETOOLONG;
+    return -1;
+}
+
+// Path of path relative to the catalog root, with trailing slashes removed. Only paths in
+// canonical form (no empty, "." or ".." components) can be looked up; others return -1.
+int catalog_relpath(const char *path, char *rel) {
+    size_t root_len = strlen(catalog.root);
+    if (strncmp(path, catalog.root, root_len) != 0 || (path[root_len] != '\0' && path[root_len] != '/')) return -1;
+    const char *p = path + root_len;
+    while (*p == '/') p++;
+    if (snprintf(rel, PATH_MAX, "%s", p) >= PATH_MAX) return -1;
+    size_t len = strlen(rel);
+    while (len > 0 && rel[len - 1] == '/') rel[--len] = '\0';
+    for (char *c = rel; *c; ) {
+        size_t n = strcspn(c, "/");
+        if (n == 0 || (n == 1 && c[0] == '.') || (n == 2 && c[0] == '.' && c[1] == '.')) return -1;
+        c += n;
+        if (*c) c++;
+    }
+    return 0;
+}
+
+// walk_files() callback recording one archive member
+static void tar_add_file(const char *path, int dir_fd, const char *name, void *ctx) {
+    struct tar_list *list = ctx;
+    struct stat statbuf;
+    if (fstatat(dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(statbuf.st_mode)) return;
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 64;
+        list->entries = realloc(list->entries, list->capacity * sizeof(*list->entries));
+    }
+    struct tar_entry *entry = &list->entries[list->count++];
+    entry->path = strdup(path);
+    entry->size = statbuf.st_size;
+    entry->mtime = statbuf.st_mtime;
+    entry->mode = statbuf.st_mode;
+}
+
+static int compare_tar_entries(const void *a, const void *b) {
+    return strcmp(((const struct tar_entry *)a)->path, ((const struct tar_entry *)b)->path);
+}
+
+// Build the archive listing from the catalog rather than walking root. Sizes and modes
+// are read from the files themselves, since the archive must match their contents.
+// Returns -1 if the catalog cannot answer for root.
+int catalog_tar_list(const char *root, const char *ext, struct tar_list *list) {
+    if (catalog.inotify_fd < 0 || strcmp(root, catalog.root) != 0) return -1;
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) return -1;
+    pthread_rwlock_rdlock(&catalog.lock);
+    int ready = catalog.ready;
+    for (size_t i = 0; ready && i < catalog.count; i++) {
+        const struct catalog_entry *e = &catalog.entries[i];
+        // Hidden top-level entries are left out, as when walking
+        if (e->path[0] == '.' || strcmp(e->ext, ext) != 0) continue;
+        tar_add_file(e->path, root_fd, e->path, list);
+    }
+    pthread_rwlock_unlock(&catalog.lock);
+    close(root_fd);
+    return ready ? 0 : -1;
+}
+
+// Open the cached archive of the type ext files under root, building it first if the
+// catalog changed since it was cached; concurrent requests wait for a single build.
+// Returns a descriptor positioned at the start and sets *size, -2 if there are no such
+// files, or -1 if the archive cannot be cached and must be streamed.
+int tar_cache_open(const char *root, const char *ext, uint64_t *size) {
+    if (catalog.inotify_fd < 0 || !catalog.ready || strcmp(root, catalog.root) != 0) return -1;
+    pthread_mutex_lock(&tar_cache_lock);
+    if (!tar_cache_dir[0] && tar_cache_prepare() < 0) {
+        pthread_mutex_unlock(&tar_cache_lock);
+        return -1;
+    }
+    struct tar_cache_entry *c = NULL;
+    for (int i = 0; i < TAR_CACHE_TYPES && !c; i++) {
+        if (!tar_cache[i].ext[0]) snprintf(tar_cache[i].ext, sizeof(tar_cache[i].ext), "%s", ext);
+        if (strcmp(tar_cache[i].ext, ext) == 0) c = &tar_cache[i];
+    }
+    if (!c) {
+        pthread_mutex_unlock(&tar_cache_lock);
+        return -1;
+    }
+    while (1) {
+        if (c->path[0] && c->generation == catalog_generation()) {
+            int fd = open(c->path, O_RDONLY | O_CLOEXEC);
+            *size = c->size;
+            pthread_mutex_unlock(&tar_cache_lock);
+            return fd;
+        }
+        if (!c->building) break;
+        pthread_cond_wait(&tar_cache_cond, &tar_cache_lock);
+    }
+    c->building = 1;
+    pthread_mutex_unlock(&tar_cache_lock);
+
+    // Build outside the lock. The archive is tagged with the generation it started from,
+    // so a change made while it is written makes the next request rebuild it.
+    uint64_t generation = catalog_generation();
+    // An archive path too long for PATH_MAX is streamed instead
+    char path[PATH_MAX];
+    int path_ok = snprintf(path, PATH_MAX, "%s/%s.%lu.tar", tar_cache_dir, ext[0] == '.' ? ext + 1 : ext, generation) < PATH_MAX;
+    struct tar_list list;
+    build_tar_list(root, ext, &list);
+    uint64_t archive_size = tar_archive_size(&list);
+    int fd = path_ok && list.count > 0 ? open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+    if (fd >= 0 && write_tar_archive(fd, root, &list, archive_size) < 0) {
+        close(fd);
+        unlink(path);
+        fd = -1;
+    }
+    size_t count = list.count;
+    free_tar_list(&list);
+
+    pthread_mutex_lock(&tar_cache_lock);
+    c->building = 0;
+    if (fd >= 0) {
+        // Senders of the previous archive keep it open, so it can go at once
+        if (c->path[0] && strcmp(c->path, path) != 0) unlink(c->path);
+        snprintf(c->path, PATH_MAX, "%s", path);
+        c->generation = generation;
+        c->size = archive_size;
+        printf("S1: Cached %s archive of %zu files (%lu bytes) at generation %lu\n", ext, count, archive_size, generation);
+    }
+    pthread_cond_broadcast(&tar_cache_cond);
+    pthread_mutex_unlock(&tar_cache_lock);
+    if (fd < 0) return count == 0 ? -2 : -1;
+    *size = archive_size;
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+// walk_files() callback removing an archive left by a previous run
+static void tar_cache_unlink(const char *path, int dir_fd, const char *name, void *ctx) {
+    unlinkat(dir_fd, name, 0);
+}
+
+// Create the archive cache directory, emptied of archives from earlier runs since their
+// generations no longer mean anything. Called with tar_cache_lock held.
+int tar_cache_prepare(void) {
+    char *home = getenv("HOME");
+    if (!home) return -1;
+    char dir[PATH_MAX];
+    snprintf(dir, PATH_MAX, "%s/.S1.tarcache", home);
+    create_directories(dir);
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return -1;
+    walk_files(dir_fd, "", ".tar", 0, tar_cache_unlink, NULL);
+    close(dir_fd);
+    snprintf(tar_cache_dir, PATH_MAX, "%s", dir);
+    return 0;
+}
+
+// Compress one block as raw deflate ending on a byte boundary, primed with the tail of
+// the block before it, so concatenated blocks form a single deflate stream
+static void gzip_compress_block(z_stream *strm, struct gzip_block *b) {
+    deflateReset(strm);
+    if (b->dict_len > 0) deflateSetDictionary(strm, b->dict, b->dict_len);
+    strm->next_in = b->in;
+    strm->avail_in = b->in_len;
+    strm->next_out = b->out;
+    strm->avail_out = GZIP_OUT_MAX;
+    deflate(strm, Z_SYNC_FLUSH);
+    b->out_len = GZIP_OUT_MAX - strm->avail_out;
+    b->crc = crc32(0, b->in, b->in_len);
+}
+
+// Compression thread: take the oldest block waiting for compression until the job stops
+void *gzip_worker(void *arg) {
+    struct gzip_job *job = arg;
+    z_stream strm = {0};
+    if (deflateInit2(&strm, GZIP_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+    pthread_mutex_lock(&job->lock);
+    while (1) {
+        while (!job->stop && job->next_compress == job->next_read) pthread_cond_wait(&job->cond, &job->lock);
+        if (job->next_compress == job->next_read) break;
+        struct gzip_block *b = &job->blocks[job->next_compress++ % job->slots];
+        pthread_mutex_unlock(&job->lock);
+        gzip_compress_block(&strm, b);
+        pthread_mutex_lock(&job->lock);
+        b->done = 1;
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+    deflateEnd(&strm);
+    return NULL;
+}
+
+// Read up to size bytes, stopping short only at end of input. Returns -1 on error.
+static ssize_t read_full(int fd, unsigned char *buf, size_t size) {
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(fd, buf + got, size - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        got += n;
+    }
+    return got;
+}
+
+// Send everything read from src_fd as a gzip stream in DATA frames, the last without
+// FL_MORE. Blocks of GZIP_BLOCK bytes are compressed in parallel by gzip_threads threads
+// while earlier blocks are sent, so output starts long before the input is consumed.
+// Returns -1 if the stream could not be completed.
+int send_gzip_stream(int sock, int src_fd, uint32_t request_id) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = gzip_threads > 0 ? gzip_threads : ncpu > 0 ? ncpu : 1;
+    struct gzip_job job = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+    job.slots = 2 * threads + 2;
+    job.blocks = calloc(job.slots, sizeof(*job.blocks));
+    for (int i = 0; i < job.slots; i++) {
+        job.blocks[i].in = malloc(GZIP_BLOCK);
+        job.blocks[i].out = malloc(GZIP_OUT_MAX);
+    }
+    pthread_t *tids = malloc(threads * sizeof(*tids));
+    int started = 0;
+    while (started < threads && pthread_create(&tids[started], NULL, gzip_worker, &job) == 0) started++;
+
+    // gzip header: deflate, no name, unknown OS
+    static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255};
+    int ok = started > 0 && send_frame(sock, OP_DATA, FL_MORE, 0, request_id, header, sizeof(header)) == 0;
+    uint64_t next_send = 0, total = 0;
+    uLong crc = crc32(0, NULL, 0);
+    int eof = 0;
+    while (ok) {
+        // Keep every slot busy with input
+        while (!eof && job.next_read - next_send < (uint64_t)job.slots) {
+            struct gzip_block *b = &job.blocks[job.next_read % job.slots];
+            ssize_t n = read_full(src_fd, b->in, GZIP_BLOCK);
+            if (n < 0) ok = 0;
+            if (n <= 0) {
+                eof = 1;
+                break;
+            }
+            if (n < GZIP_BLOCK) eof = 1;
+            b->in_len = n;
+            b->dict_len = 0;
+            if (job.next_read > 0) {
+                // The previous block stays in its slot until this one has been sent
+                const struct gzip_block *prev = &job.blocks[(job.next_read - 1) % job.slots];
+                b->dict_len = prev->in_len < GZIP_WINDOW ? prev->in_len : GZIP_WINDOW;
+                memcpy(b->dict, prev->in + prev->in_len - b->dict_len, b->dict_len);
+            }
+            pthread_mutex_lock(&job.lock);
+            b->done = 0;
+            job.next_read++;
+            pthread_cond_broadcast(&job.cond);
+            pthread_mutex_unlock(&job.lock);
+        }
+        if (!ok || next_send == job.next_read) break;
+
+        // Send the oldest block once it is compressed
+        struct gzip_block *b = &job.blocks[next_send % job.slots];
+        pthread_mutex_lock(&job.lock);
+        while (!b->done) pthread_cond_wait(&job.cond, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+        if (send_frame(sock, OP_DATA, FL_MORE, 0, request_id, b->out, b->out_len) < 0) ok = 0;
+        crc = crc32_combine(crc, b->crc, b->in_len);
+        total += b->in_len;
+        next_send++;
+    }
+
+    pthread_mutex_lock(&job.lock);
+    job.stop = 1;
+    pthread_cond_broadcast(&job.cond);
+    pthread_mutex_unlock(&job.lock);
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    for (int i = 0; i < job.slots; i++) {
+        free(job.blocks[i].in);
+        free(job.blocks[i].out);
+    }
+    free(job.blocks);
+    free(tids);
+    if (!ok) return -1;
+
+    // An empty final deflate block, then the CRC and length of the input
+    unsigned char trailer[10] = {0x03, 0x00};
+    for (int i = 0; i < 4; i++) {
+        trailer[2 + i] = crc >> (8 * i);
+        trailer[6 + i] = total >> (8 * i);
+    }
+    return send_frame(sock, OP_DATA, 0, 0, request_id, trailer, sizeof(trailer));
+}
+
+// Archive writer thread feeding a pipe, for archives that are not cached
+struct tar_pipe {
+    int fd;
+    const char *root;
+    const struct tar_list *list;
+    uint64_t archive_size;
+};
+
+static void *tar_pipe_writer(void *arg) {
+    struct tar_pipe *tp = arg;
+    // A reader that gives up must only end the write, not raise SIGPIPE
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    write_tar_archive(tp->fd, tp->root, tp->list, tp->archive_size);
+    close(tp->fd);
+    return NULL;
+}
+
+// Send the archive of the type ext files under root gzip-compressed: an OK reply with the
+// uncompressed archive size, then the gzip stream. The cached archive is compressed when
+// there is one; otherwise the archive is generated into a pipe as it is compressed.
+// Returns -2 before sending anything if there are no such files, -1 if the stream broke.
+int send_tar_gzip(int sock, const char *root, const char *ext, uint32_t request_id) {
+    uint64_t archive_size;
+    int src_fd = tar_cache_open(root, ext, &archive_size);
+    if (src_fd == -2) return -2;
+    struct tar_list list = {0};
+    struct tar_pipe tp;
+    pthread_t writer;
+    int piped = 0;
+    if (src_fd < 0) {
+        int fds[2];
+        build_tar_list(root, ext, &list);
+        if (list.count == 0 || pipe2(fds, O_CLOEXEC) < 0) {
+            free_tar_list(&list);
+            return -2;
+        }
+        archive_size = tar_archive_size(&list);
+        tp = (struct tar_pipe){fds[1], root, &list, archive_size};
+        if (pthread_create(&writer, NULL, tar_pipe_writer, &tp) != 0) {
+            close(fds[0]);
+            close(fds[1]);
+            free_tar_list(&list);
+            return -2;
+        }
+        src_fd = fds[0];
+        piped = 1;
+    }
+    int rc = send_size_reply(sock, request_id, archive_size, 0) < 0 ? -1 : send_gzip_stream(sock, src_fd, request_id);
+    close(src_fd);
+    if (piped) pthread_join(writer, NULL);
+    free_tar_list(&list);
+    return rc;
+}
+
+// Build the archive listing for every file of type ext under root, sorted by path.
+// Hidden top-level entries are skipped, as the shell glob in the old "find * | tar"
+// pipeline did.
+void build_tar_list(const char *root, const char *ext, struct tar_list *list) {
+    memset(list, 0, sizeof(*list));
+    if (catalog_tar_list(root, ext, list) == 0) return;
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) return;
+    walk_files(root_fd, "", ext, 1, tar_add_file, list);
+    close(root_fd);
+    qsort(list->entries, list->count, sizeof(*list->entries), compare_tar_entries);
+}
+
+void free_tar_list(struct tar_list *list) {
+    for (size_t i = 0; i < list->count; i++) free(list->entries[i].path);
+    free(list->entries);
+    memset(list, 0, sizeof(*list));
+}
+
+// Fill one ustar header block, including its checksum
+static void tar_fill_block(char *block, const char *name, const char *prefix, uint64_t size, time_t mtime, mode_t mode, char type) {
+    memset(block, 0, TAR_BLOCK);
+    memcpy(block, name, strnlen(name, 100));
+    snprintf(block + 100, 8, "%07o", (unsigned)(mode & 07777));
+    snprintf(block + 108, 8, "%07o", 0);
+    snprintf(block + 116, 8, "%07o", 0);
+    snprintf(block + 124, 12, "%011llo", (unsigned long long)(size <= TAR_MAX_OCTAL ? size : 0));
+    // Times beyond the 11 octal digits of the field are clamped to its largest value
+    snprintf(block + 136, 12, "%011llo", (unsigned long long)(mtime <= 0 ? 0 : (uint64_t)mtime > TAR_MAX_OCTAL ? TAR_MAX_OCTAL : (uint64_t)mtime));
+    memset(block + 148, ' ', 8);
+    block[156] = type;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    memcpy(block + 345, prefix, strnlen(prefix, 155));
+    unsigned sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) sum += (unsigned char)block[i];
+    snprintf(block + 148, 8, "%06o", sum);
+    block[155] = ' ';
+}
+
+// Format one pax extended header record, "<len> <key>=<value>\n", where len counts itself
+static size_t pax_record(char *out, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3;
+    size_t len = body + 1;
+    while (len != body + snprintf(NULL, 0, "%zu", len)) len = body + snprintf(NULL, 0, "%zu", len);
+    return sprintf(out, "%zu %s=%s\n", len, key, value);
+}
+
+// Write the header blocks for one entry into out (at least TAR_HEADER_MAX bytes) and
+// return their length. Paths that fit neither the ustar name field nor a prefix/name
+// split, and sizes beyond the octal size field, are carried in a pax extended header.
+size_t tar_entry_header(char *out, const struct tar_entry *entry) {
+    const char *path = entry->path;
+    size_t len = strlen(path);
+    char prefix[156] = "";
+    const char *name = path;
+    int long_path = 0;
+    if (len > 100) {
+        long_path = 1;
+        for (const char *slash = strchr(path, '/'); slash && slash - path <= 155; slash = strchr(slash + 1, '/')) {
+            if (len - (slash - path) - 1 <= 100) {
+                memcpy(prefix, path, slash - path);
+                prefix[slash - path] = '\0';
+                name = slash + 1;
+                long_path = 0;
+                break;
+            }
+        }
+        // Readers without pax support still get the final path component
+        if (long_path) name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    }
+
+    size_t offset = 0;
+    if (long_path || entry->size > TAR_MAX_OCTAL) {
+        char records[PATH_MAX + 64];
+        size_t records_len = 0;
+        if (long_path) records_len += pax_record(records, "path", path);
+        if (entry->size > TAR_MAX_OCTAL) {
+            char size_str[24];
+            snprintf(size_str, sizeof(size_str), "%llu", (unsigned long long)entry->size);
+            records_len += pax_record(records + records_len, "size", size_str);
+        }
+        tar_fill_block(out, "PaxHeader", "", records_len, entry->mtime, 0644, 'x');
+        size_t padded = (records_len + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        memset(out + TAR_BLOCK, 0, padded);
+        memcpy(out + TAR_BLOCK, records, records_len);
+        offset = TAR_BLOCK + padded;
+    }
+    tar_fill_block(out + offset, name, prefix, entry->size, entry->mtime, entry->mode, '0');
+    return offset + TAR_BLOCK;
+}
+
+// Exact size of the archive for list: headers, padded contents, the two zero blocks
+// that end it, and padding to a whole 10 KB record as tar itself writes
+uint64_t tar_archive_size(const struct tar_list *list) {
+    char header[TAR_HEADER_MAX];
+    uint64_t size = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        size += tar_entry_header(header, &list->entries[i]);
+        size += (list->entries[i].size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    }
+    size += 2 * TAR_BLOCK;
+    return (size + TAR_RECORD - 1) / TAR_RECORD * TAR_RECORD;
+}
+
+// Send count zero bytes
+static int send_zeros(int sock, uint64_t count) {
+    static const char zeros[TAR_BLOCK];
+    while (count > 0) {
+        size_t chunk = count < TAR_BLOCK ? count : TAR_BLOCK;
+        if (send_all(sock, zeros, chunk) < 0) return -1;
+        count -= chunk;
+    }
+    return 0;
+}
+
+// Write the archive for list, archive_size bytes, to a socket or file, generating the
+// headers in memory and copying file contents with sendfile(). A file that shrank or
+// vanished since it was listed is padded with zeros so the archive keeps its size.
+int write_tar_archive(int sock, const char *root, const struct tar_list *list, uint64_t archive_size) {
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char header[TAR_HEADER_MAX];
+    uint64_t sent = 0;
+    int ok = 1;
+    for (size_t i = 0; ok && i < list->count; i++) {
+        const struct tar_entry *entry = &list->entries[i];
+        size_t header_len = tar_entry_header(header, entry);
+        if (send_all(sock, header, header_len) < 0) {
+            ok = 0;
+            break;
+        }
+        int fd = root_fd >= 0 ? openat(root_fd, entry->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC) : -1;
+        long long body = fd >= 0 ? send_file_body(sock, fd, 0, entry->size) : 0;
+        if (fd >= 0) close(fd);
+        uint64_t padded = (entry->size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        if (body < 0 || send_zeros(sock, padded - body) < 0) {
+            ok = 0;
+            break;
+        }
+        if ((uint64_t)body < entry->size) printf("Tar: %s changed while archiving, padded with zeros\n", entry->path);
+        sent += header_len + padded;
+    }
+    if (root_fd >= 0) close(root_fd);
+    // End-of-archive blocks and record padding; an incomplete frame makes the connection unusable
+    if (!ok || send_zeros(sock, archive_size - sent) < 0) return -1;
+    return 0;
+}
+
+// Stream the archive for list as one DATA frame of archive_size bytes
+int send_tar_frame(int sock, const char *root, const struct tar_list *list, uint64_t archive_size, uint32_t request_id) {
+    if (send_frame(sock, OP_DATA, 0, 0, request_id, NULL, archive_size) < 0) return -1;
+    return write_tar_archive(sock, root, list, archive_size);
+}
+
+// Receive a frame payload as a NUL-terminated string; oversized payloads are rejected
+int recv_payload(int sock, const struct frame_hdr *hdr, char *buffer, size_t size) {
+    if (hdr->length >= size) return -1;
+    if (receive_full(sock, buffer, hdr->length) < 0) return -1;
+    buffer[hdr->length] = '\0';
+    return 0;
+}
+
+// Receive DATA frames up to the last one, writing their content to fp (NULL discards it).
+// Deflated frames are inflated as they arrive. Returns the byte count of the content, or
+// -1 if the connection failed; write errors, like a deflate stream that does not inflate,
+// only set *write_error.
+long long recv_body(int sock, FILE *fp, int *write_error) {
+    // The io_uring engine, when enabled, takes bodies bound for a file
+    if (fp && !*write_error) {
+        long long total = ring_recv_body(sock, fp, write_error);
+        if (total != -2) return total;
+    }
+    char buffer[BUFFER_SIZE];
+    unsigned char plain[4 * BUFFER_SIZE];
+    long long total_bytes = 0;
+    z_stream strm = {0};
+    int inflating = 0;
+    struct frame_hdr hdr;
+    do {
+        if (recv_frame(sock, &hdr) < 0 || hdr.opcode != OP_DATA) {
+            if (inflating) inflateEnd(&strm);
+            return -1;
+        }
+        if ((hdr.flags & FL_DEFLATE) && !inflating) {
+            if (inflateInit2(&strm, -15) == Z_OK) inflating = 1;
+            else *write_error = 1;
+        }
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) {
+            size_t to_receive = remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE;
+            ssize_t bytes = recv(sock, buffer, to_receive, 0);
+            if (bytes <= 0) {
+                if (inflating) inflateEnd(&strm);
+                return -1;
+            }
+            remaining -= bytes;
+            if (!(hdr.flags & FL_DEFLATE)) {
+                if (fp && !*write_error && fwrite(buffer, 1, bytes, fp) != (size_t)bytes) *write_error = 1;
+                total_bytes += bytes;
+                continue;
+            }
+            // Discarded or failed bodies are only drained
+            if (!inflating || !fp || *write_error) continue;
+            strm.next_in = (unsigned char *)buffer;
+            strm.avail_in = bytes;
+            do {
+                strm.next_out = plain;
+                strm.avail_out = sizeof(plain);
+                int ret = inflate(&strm, Z_NO_FLUSH);
+                size_t len = sizeof(plain) - strm.avail_out;
+                if ((ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
+                    fwrite(plain, 1, len, fp) != len) {
+                    *write_error = 1;
+                    break;
+                }
+                total_bytes += len;
+            } while (strm.avail_out == 0);
+        }
+    } while (hdr.flags & FL_MORE);
+    if (inflating) {
+        // A deflated body must end with the end of its stream
+        strm.next_out = plain;
+        strm.avail_out = sizeof(plain);
+        if (fp && !*write_error && inflate(&strm, Z_FINISH) != Z_STREAM_END) *write_error = 1;
+        inflateEnd(&strm);
+    }
+    return total_bytes;
+}
+
+// The calling thread's ring, set up on first use; NULL once io_uring has proved
+// unavailable, so uploads fall back to stdio writes
+struct io_ring *ring_get(void) {
+    if (thread_ring || ring_unavailable) return thread_ring;
+    struct io_ring *ring = calloc(1, sizeof(*ring));
+    if (ring && ring_setup(ring) == 0) return thread_ring = ring;
+    int err = errno;
+    free(ring);
+    if (!__atomic_exchange_n(&ring_unavailable, 1, __ATOMIC_RELAXED))
+        printf("S1: io_uring unavailable (%s), using stdio writes\n", strerror(err));
+    return NULL;
+}
+
+// Create a ring with raw system calls and map its queues. Buffers that cannot be
+// registered, for instance past RLIMIT_MEMLOCK, are written with plain IORING_OP_WRITE.
+int ring_setup(struct io_ring *ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring->fd < 0) return -1;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    ring->buffers = mmap(NULL, RING_BUFFERS * RING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED || ring->buffers == MAP_FAILED) {
+        int err = errno;
+        ring_close(ring);
+        errno = err;
+        return -1;
+    }
+    char *sq = ring->sq_map, *cq = ring->cq_map;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    struct iovec iov[RING_BUFFERS];
+    for (int i = 0; i < RING_BUFFERS; i++) {
+        iov[i].iov_base = ring->buffers + (size_t)i * RING_BUFFER_SIZE;
+        iov[i].iov_len = RING_BUFFER_SIZE;
+    }
+    ring->registered = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, RING_BUFFERS) == 0;
+    return 0;
+}
+
+// Unmap and close a ring, which may be only partly set up
+void ring_close(struct io_ring *ring) {
+    if (ring->sq_map && ring->sq_map != MAP_FAILED) munmap(ring->sq_map, ring->sq_map_size);
+    if (ring->cq_map && ring->cq_map != MAP_FAILED) munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->buffers && ring->buffers != MAP_FAILED) munmap(ring->buffers, RING_BUFFERS * RING_BUFFER_SIZE);
+    close(ring->fd);
+}
+
+// Give up on a ring that failed: queued operations the kernel has not taken are
+// dropped, and those it has are waited for, as they use the ring's buffers, before the
+// ring is closed and freed. A ring whose completions cannot be waited for stays mapped.
+void ring_discard(struct io_ring *ring) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail - ring->pending, __ATOMIC_RELEASE);
+    ring->inflight -= ring->pending;
+    ring->pending = 0;
+    while (ring->inflight > 0) {
+        unsigned head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            ring->inflight--;
+            continue;
+        }
+        // EBUSY only asks for completions to be taken first
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR && errno != EBUSY) return;
+    }
+    ring_close(ring);
+    free(ring);
+}
+
+// Queue one operation; it reaches the kernel with the next ring_wait(). Callers keep
+// fewer than RING_ENTRIES operations outstanding, so the queue never overflows.
+// Returns the entry, for flags to be added before it is submitted.
+struct io_uring_sqe *ring_queue(struct io_ring *ring, uint8_t opcode, int fd, void *addr, uint32_t len, uint64_t offset, uint32_t msg_flags, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail, index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->msg_flags = msg_flags;
+    sqe->user_data = user_data;
+    // Writes from a registered buffer name it by index
+    if (opcode == IORING_OP_WRITE_FIXED) sqe->buf_index = ((char *)addr - ring->buffers) / RING_BUFFER_SIZE;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    ring->inflight++;
+    return sqe;
+}
+
+// Submit queued operations and take the next completion, waiting for one if needed
+int ring_wait(struct io_ring *ring, struct io_uring_cqe *cqe) {
+    for (;;) {
+        unsigned head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            *cqe = ring->cqes[head & *ring->cq_mask];
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            ring->inflight--;
+            return 0;
+        }
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        ring->pending -= submitted;
+    }
+}
+
+// Start writing an upload body to fp through the calling thread's ring, after whatever
+// fp already holds. Returns -1 if there is no ring to use.
+int ring_writer_start(struct ring_writer *w, FILE *fp) {
+    memset(w, 0, sizeof(*w));
+    w->ring = use_uring ? ring_get() : NULL;
+    if (!w->ring) return -1;
+    off_t offset;
+    if (fflush(fp) != 0 || (offset = ftello(fp)) < 0) return -1;
+    w->fd = fileno(fp);
+    w->offset = offset;
+    w->current = -1;
+    w->idle = (1u << RING_BUFFERS) - 1;
+    return 0;
+}
+
+// Free space in the buffer being filled, taking an idle buffer first if needed and
+// waiting for a write to finish while none is idle. Returns NULL if the ring failed.
+char *ring_writer_space(struct ring_writer *w, size_t *space) {
+    if (w->current < 0) {
+        while (!w->idle)
+            if (ring_writer_reap(w, NULL) < 0) return NULL;
+        w->current = __builtin_ctz(w->idle);
+        w->idle &= ~(1u << w->current);
+        w->fill = 0;
+    }
+    *space = RING_BUFFER_SIZE - w->fill;
+    return w->ring->buffers + (size_t)w->current * RING_BUFFER_SIZE + w->fill;
+}
+
+// Account for length bytes placed at ring_writer_space(), writing the buffer out once
+// it is full. After a write error the bytes are dropped.
+void ring_writer_commit(struct ring_writer *w, size_t length) {
+    if (w->error) {
+        w->fill = 0;
+        return;
+    }
+    w->fill += length;
+    if (w->fill == RING_BUFFER_SIZE) ring_writer_flush(w);
+}
+
+// Queue the write of the buffer being filled, or return it to the idle set if empty
+void ring_writer_flush(struct ring_writer *w) {
+    int b = w->current;
+    if (b < 0) return;
+    w->current = -1;
+    if (w->fill == 0 || w->error) {
+        w->idle |= 1u << b;
+        return;
+    }
+    w->writes[b].offset = w->offset;
+    w->writes[b].length = w->fill;
+    w->writes[b].done = 0;
+    w->offset += w->fill;
+    ring_queue(w->ring, w->ring->registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, w->fd,
+               w->ring->buffers + (size_t)b * RING_BUFFER_SIZE, w->fill, w->writes[b].offset, 0, b);
+}
+
+// Take one completion. A finished write frees its buffer; a short one is queued again
+// for the rest. A receive stores its result in *recv_result.
+int ring_writer_reap(struct ring_writer *w, long long *recv_result) {
+    struct io_uring_cqe cqe;
+    if (ring_wait(w->ring, &cqe) < 0) return -1;
+    if (cqe.user_data == RING_RECV) {
+        if (recv_result) *recv_result = cqe.res;
+        return 0;
+    }
+    if (cqe.user_data == RING_RECV_TIMEOUT) {
+        w->timeout_pending = 0;
+        w->timed_out = cqe.res == -ETIME;
+        return 0;
+    }
+    int b = cqe.user_data;
+    if (cqe.res <= 0) {
+        w->error = 1;
+    } else if ((w->writes[b].done += cqe.res) < w->writes[b].length) {
+        size_t done = w->writes[b].done;
+        ring_queue(w->ring, w->ring->registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, w->fd,
+                   w->ring->buffers + (size_t)b * RING_BUFFER_SIZE + done, w->writes[b].length - done,
+                   w->writes[b].offset + done, 0, b);
+        return 0;
+    }
+    w->idle |= 1u << b;
+    return 0;
+}
+
+// Receive up to max bytes of the body straight into the buffer being filled, reaping
+// write completions while the receive is outstanding. Returns what recv() would.
+ssize_t ring_writer_recv(struct ring_writer *w, int sock, uint64_t max) {
+    size_t space;
+    char *buf = ring_writer_space(w, &space);
+    if (!buf) return -1;
+    if (max < space) space = max;
+    // MSG_WAITALL fills the buffer in one receive rather than one per segment
+    struct io_uring_sqe *sqe = ring_queue(w->ring, IORING_OP_RECV, sock, buf, space, 0, MSG_WAITALL, RING_RECV);
+    // The ring ignores SO_RCVTIMEO, so the socket's timeout is linked to the receive
+    if (w->recv_timeout.tv_sec || w->recv_timeout.tv_nsec) {
+        sqe->flags |= IOSQE_IO_LINK;
+        ring_queue(w->ring, IORING_OP_LINK_TIMEOUT, -1, &w->recv_timeout, 1, 0, 0, RING_RECV_TIMEOUT);
+        w->timeout_pending = 1;
+    }
+    // The timeout completes too, and is waited for so that no completion of it interrupts
+    // a later blocking call on the socket
+    long long result = LLONG_MIN;
+    while (result == LLONG_MIN || w->timeout_pending)
+        if (ring_writer_reap(w, &result) < 0) return -1;
+    if (w->timed_out) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return result < 0 ? -1 : result;
+}
+
+// Write out the last buffer and wait for every write, then leave fp positioned after
+// the body. Returns -1 if any write failed.
+int ring_writer_finish(struct ring_writer *w, FILE *fp) {
+    ring_writer_flush(w);
+    while (w->idle != (1u << RING_BUFFERS) - 1)
+        if (ring_writer_reap(w, NULL) < 0) {
+            // The ring is unusable: stop using it for good, and release this thread's
+            ring_unavailable = 1;
+            thread_ring = NULL;
+            ring_discard(w->ring);
+            return -1;
+        }
+    if (fseeko(fp, w->offset, SEEK_SET) != 0) return -1;
+    return w->error ? -1 : 0;
+}
+
+// recv_body() through the io_uring engine. Plain content is received into the ring's
+// buffers; deflated content is received in small pieces and inflated into them.
+// Returns -2, having read nothing, if the engine is off or unavailable.
+long long ring_recv_body(int sock, FILE *fp, int *write_error) {
+    struct ring_writer w;
+    if (ring_writer_start(&w, fp) < 0) return -2;
+    struct timeval tv;
+    socklen_t tv_len = sizeof(tv);
+    if (getsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, &tv_len) == 0) {
+        w.recv_timeout.tv_sec = tv.tv_sec;
+        w.recv_timeout.tv_nsec = tv.tv_usec * 1000;
+    }
+    unsigned char input[RING_INPUT];
+    long long total_bytes = 0;
+    z_stream strm = {0};
+    int inflating = 0, failed = 0;
+    struct frame_hdr hdr;
+    do {
+        if (recv_frame(sock, &hdr) < 0 || hdr.opcode != OP_DATA) {
+            failed = 1;
+            break;
+        }
+        if ((hdr.flags & FL_DEFLATE) && !inflating) {
+            if (inflateInit2(&strm, -15) == Z_OK) inflating = 1;
+            else w.error = 1;
+        }
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) {
+            if (!(hdr.flags & FL_DEFLATE)) {
+                ssize_t bytes = ring_writer_recv(&w, sock, remaining);
+                if (bytes <= 0) {
+                    failed = 1;
+                    break;
+                }
+                remaining -= bytes;
+                total_bytes += bytes;
+                ring_writer_commit(&w, bytes);
+                continue;
+            }
+            size_t to_receive = remaining < sizeof(input) ? remaining : sizeof(input);
+            ssize_t bytes = recv(sock, input, to_receive, 0);
+            // Write completions interrupt the receive, which a socket timeout does not restart
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes <= 0) {
+                failed = 1;
+                break;
+            }
+            remaining -= bytes;
+            // Failed bodies are only drained
+            if (!inflating || w.error) continue;
+            strm.next_in = input;
+            strm.avail_in = bytes;
+            do {
+                size_t space;
+                char *out = ring_writer_space(&w, &space);
+                if (!out) {
+                    w.error = 1;
+                    break;
+                }
+                strm.next_out = (unsigned char *)out;
+                strm.avail_out = space;
+                int ret = inflate(&strm, Z_NO_FLUSH);
+                size_t len = space - strm.avail_out;
+                total_bytes += len;
+                ring_writer_commit(&w, len);
+                if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                    w.error = 1;
+                    break;
+                }
+            } while (strm.avail_out == 0);
+        }
+    } while (!failed && (hdr.flags & FL_MORE));
+    if (inflating) {
+        // A deflated body must end with the end of its stream
+        strm.next_out = input;
+        strm.avail_out = sizeof(input);
+        if (!failed && !w.error && inflate(&strm, Z_FINISH) != Z_STREAM_END) w.error = 1;
+        inflateEnd(&strm);
+    }
+    // Buffers still being written must come back before the thread uses them again
+    if (ring_writer_finish(&w, fp) < 0) *write_error = 1;
+    return failed ? -1 : total_bytes;
+}
+
+// Parse the paging options of a dispfnames request: "after=<cursor>", "limit=<n>",
+// "long" (include size and mtime) and "paths" (paths relative to the listed directory
+// instead of names). Unknown tokens are ignored.
+void parse_listing_options(char *opts, char *after, size_t after_size, int *limit, int *want_long, int *want_paths) {
+    after[0] = '\0';
+    *limit = 0;
+    *want_long = 0;
+    *want_paths = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(opts, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+        if (strncmp(tok, "after=", 6) == 0) snprintf(after, after_size, "%s", tok + 6);
+        else if (strncmp(tok, "limit=", 6) == 0) *limit = atoi(tok + 6);
+        else if (strcmp(tok, "long") == 0) *want_long = 1;
+        else if (strcmp(tok, "paths") == 0) *want_paths = 1;
+    }
+    if (*limit < 0) *limit = 0;
+}
+
+// Add one listing line to the pending DATA frame in buf, first sending the frame
+// if the line does not fit. Lines are never split across frames.
+int queue_listing_line(int sock, uint32_t request_id, char *buf, size_t *len, const char *line, size_t line_len) {
+    if (*len + line_len > LISTING_FRAME && *len > 0) {
+        if (send_frame(sock, OP_DATA, FL_MORE, 0, request_id, buf, *len) < 0) return -1;
+        *len = 0;
+    }
+    if (line_len > LISTING_FRAME) return send_frame(sock, OP_DATA, FL_MORE, 0, request_id, line, line_len);
+    memcpy(buf + *len, line, line_len);
+    *len += line_len;
+    return 0;
+}
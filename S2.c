@@ -1,312 +1,5208 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <sys/stat.h>
-#include <libgen.h>
-#include <signal.h>
-#include <limits.h>
-#include <errno.h>
-#include <stdint.h>
-#include <endian.h>
-#include <sys/stat.h>
-
-#define BUFFER_SIZE 1024
-
-// Global flag to control server shutdown
-static volatile sig_atomic_t keep_running = 1;
-// Server socket descriptor
-static int server_sock = -1;
-
-// Signal handler for graceful shutdown
-void signal_handler(int sig) {
-    keep_running = 0;
-    if (server_sock != -1) close(server_sock);
-}
-
-// Function to create directories recursively
-void create_directories(const char *path);
-
-int main(int argc, char *argv[]) {
-    // Validate command-line arguments
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <S2_port>\n", argv[0]);
-        return 1;
-    }
-
-    // Parse and validate port number
-    int PORT_S2 = atoi(argv[1]);
-    if (PORT_S2 < 1024 || PORT_S2 > 65535) {
-        fprintf(stderr, "Error: Port must be between 1024 and 65535\n");
-        return 1;
-    }
-
-    // Initialize server and client address structures
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    // Set up signal handler for SIGINT
-    struct sigaction sa = {.sa_handler = signal_handler, .sa_flags = SA_RESTART};
-    sigemptyset(&sa.sa_mask);
-    sigaction(SIGINT, &sa, NULL);
-
-    // Create server socket
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    int opt = 1;
-    // Allow socket reuse
-    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT_S2);
-
-    // Bind socket to address
-    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Bind failed");
-        close(server_sock);
-        return 1;
-    }
-    // Listen for incoming connections
-    listen(server_sock, 5);
-    printf("S2 listening on port %d...\n", PORT_S2);
-
-    // Main server loop
-    while (keep_running) {
-        // Accept client connection
-        int client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &addr_len);
-        if (client_sock < 0) {
-            if (!keep_running) break;
-            continue;
-        }
-
-        // Receive command from client
-        char buffer[BUFFER_SIZE];
-        ssize_t received = recv(client_sock, buffer, BUFFER_SIZE - 1, 0);
-        if (received <= 0) {
-            close(client_sock);
-            continue;
-        }
-        buffer[received] = '\0';
-
-        // Parse command and parameters
-        char command[20], param1[PATH_MAX] = {0};
-        sscanf(buffer, "%s %[^\n]", command, param1);
-
-        if (strcmp(command, "uploadf") == 0) {
-            printf("S2: Received uploadf command: %s\n", buffer);
-            char filename[256], dest_path[PATH_MAX];
-            sscanf(buffer, "%*s %s %s", filename, dest_path);
-            // Construct full file path
-            char full_path[PATH_MAX];
-            if (dest_path[strlen(dest_path) - 1] == '/')
-                snprintf(full_path, PATH_MAX, "%s%s", dest_path, filename);
-            else
-                snprintf(full_path, PATH_MAX, "%s/%s", dest_path, filename);
-            printf("S2: Attempting to write to %s\n", full_path);
-
-            // Create necessary directories
-            char *dir_path = strdup(full_path);
-            create_directories(dirname(dir_path));
-            free(dir_path);
-
-            // Open file for writing
-            FILE *fp = fopen(full_path, "wb");
-            if (!fp) {
-                char error_msg[BUFFER_SIZE];
-                snprintf(error_msg, BUFFER_SIZE, "Upload failed: Cannot write file (%s)", strerror(errno));
-                send(client_sock, error_msg, strlen(error_msg), 0);
-                close(client_sock);
-                continue;
-            }
-
-            // Receive and write file data
-            size_t bytes, total_bytes = 0;
-            while ((bytes = recv(client_sock, buffer, BUFFER_SIZE, 0)) > 0) {
-                total_bytes += bytes;
-                fwrite(buffer, 1, bytes, fp);
-            }
-            fclose(fp);
-            // Send response based on success
-            if (total_bytes > 0) {
-                send(client_sock, "Stored successfully", 20, 0);
-                printf("S2: Stored %s (%zu bytes)\n", full_path, total_bytes);
-            } else {
-                send(client_sock, "Upload failed: No data received", 32, 0);
-            }
-        } else if (strcmp(command, "downlf") == 0) {
-            printf("S2: Received downlf command: %s\n", buffer);
-            // Open requested file
-            FILE *fp = fopen(param1, "rb");
-            if (!fp) {
-                uint64_t zero = 0;
-                send(client_sock, (char*)&zero, sizeof(zero), 0);
-                send(client_sock, "Download failed: File not found", 32, 0);
-                close(client_sock);
-                continue;
-            }
-
-            // Get file size
-            fseek(fp, 0, SEEK_END);
-            uint64_t file_size = ftell(fp);
-            rewind(fp);
-            uint64_t net_size = htobe64(file_size);
-            // Send file size to client
-            send(client_sock, (char*)&net_size, sizeof(net_size), 0);
-            printf("S2: Sending file %s (%lu bytes)\n", param1, file_size);
-
-            // Send file data
-            size_t bytes;
-            while ((bytes = fread(buffer, 1, BUFFER_SIZE, fp)) > 0) {
-                send(client_sock, buffer, bytes, 0);
-            }
-            fclose(fp);
-            // Signal end of data
-            shutdown(client_sock, SHUT_WR);
-            printf("S2: File transfer complete for %s\n", param1);
-        } else if (strcmp(command, "removef") == 0) {
-            printf("S2: Received removef command: %s\n", buffer);
-            char filepath[PATH_MAX];
-            sscanf(buffer, "%*s %s", filepath);
-
-            // Check if file exists
-            struct stat statbuf;
-            if (stat(filepath, &statbuf) == 0) {
-                if (S_ISREG(statbuf.st_mode)) {
-                    // Attempt to remove file
-                    if (remove(filepath) == 0) {
-                        send(client_sock, "File removed successfully", 25, 0);
-                        printf("S2: Removed %s\n", filepath);
-                    } else {
-                        send(client_sock, "Remove failed: Permission denied", 32, 0);
-                    }
-                } else {
-                    send(client_sock, "Remove failed: Not a regular file", 33, 0);
-                }
-            } else {
-                send(client_sock, "Remove failed: File not found", 29, 0);
-            }
-        } else if (strcmp(command, "downltar") == 0) {
-            printf("S2: Received downltar command: %s\n", buffer);
-            char filetype[16];
-            sscanf(buffer, "%*s %s", filetype);
-            // Validate file type
-            if (strcmp(filetype, ".pdf") != 0) {
-                send(client_sock, "Download failed: Invalid file type for this server", 50, 0);
-                close(client_sock);
-                continue;
-            }
-
-            // Construct tar file path
-            char tar_path[PATH_MAX];
-            char *home = getenv("HOME");
-            snprintf(tar_path, PATH_MAX, "%s/S2/temp/pdffiles.tar", home);
-            create_directories(dirname(strdup(tar_path)));
-
-            // Create tar of .pdf files
-            char cmd[BUFFER_SIZE];
-            snprintf(cmd, BUFFER_SIZE, "cd %s/S2 && find * -type f -name '*.pdf' | tar -cf %s -T -", home, tar_path);
-            int ret = system(cmd);
-            if (ret != 0) {
-                send(client_sock, "Download failed: No files found or tar creation failed", 54, 0);
-                remove(tar_path);
-                close(client_sock);
-                continue;
-            }
-
-            // Verify tar file
-            struct stat statbuf;
-            if (stat(tar_path, &statbuf) != 0) {
-                uint64_t zero = 0;
-                send(client_sock, (char*)&zero, sizeof(zero), 0);
-                send(client_sock, "Tar file not found", 18, 0);
-                remove(tar_path);
-                close(client_sock);
-                continue;
-            }
-            
-            // Send tar file size
-            uint64_t file_size = statbuf.st_size;
-            uint64_t net_size = htobe64(file_size);
-            send(client_sock, (char*)&net_size, sizeof(net_size), 0);
-            
-            // Open and send tar file
-            FILE *fp = fopen(tar_path, "rb");
-            if (!fp) {
-                uint64_t zero = 0;
-                send(client_sock, (char*)&zero, sizeof(zero), 0);
-                send(client_sock, "Cannot open tar file", 21, 0);
-                remove(tar_path);
-                close(client_sock);
-                continue;
-            }
-            
-            size_t bytes;
-            while ((bytes = fread(buffer, 1, BUFFER_SIZE, fp)) > 0) {
-                send(client_sock, buffer, bytes, 0);
-            }
-            fclose(fp);
-            // Clean up tar file
-            remove(tar_path);
-            printf("S2: Sent %s to S1\n", tar_path);
-        } else if (strcmp(command, "dispfnames") == 0) {
-            printf("S2: Received dispfnames command: %s\n", buffer);
-            char pathname[PATH_MAX], filetype[16];
-            sscanf(buffer, "%*s %s %s", pathname, filetype);
-            // Validate file type
-            if (strcmp(filetype, ".pdf") != 0) {
-                send(client_sock, "No files found", 14, 0);
-                close(client_sock);
-                continue;
-            }
-
-            // Verify directory exists
-            struct stat statbuf;
-            if (stat(pathname, &statbuf) != 0 || !S_ISDIR(statbuf.st_mode)) {
-                send(client_sock, "No files found", 14, 0);
-                close(client_sock);
-                continue;
-            }
-
-            // Collect file names
-            char file_list[BUFFER_SIZE] = {0};
-            char cmd[BUFFER_SIZE];
-            snprintf(cmd, BUFFER_SIZE, "find %s -type f -name '*%s' | sort", pathname, filetype);
-            FILE *fp = popen(cmd, "r");
-            if (fp) {
-                size_t pos = 0;
-                char line[256];
-                while (fgets(line, sizeof(line), fp) && pos < BUFFER_SIZE - 256) {
-                    line[strcspn(line, "\n")] = 0;
-                    char *filename = basename(line);
-                    pos += snprintf(file_list + pos, BUFFER_SIZE - pos, "%s\n", filename);
-                }
-                pclose(fp);
-            }
-
-            // Send file list to client
-            if (strlen(file_list) == 0) {
-                send(client_sock, "No files found", 14, 0);
-            } else {
-                send(client_sock, file_list, strlen(file_list), 0);
-            }
-        }
-        close(client_sock);
-    }
-    close(server_sock);
-    return 0;
-}
-
-// Create directories recursively
-void create_directories(const char *path) {
-    char tmp[PATH_MAX];
-    snprintf(tmp, PATH_MAX, "%s", path);
-    char *p;
-    for (p = tmp + 1; *p; p++) {
-        if (*p == '/') {
-            *p = '\0';
-            mkdir(tmp, S_IRWXU);
-            *p = '/';
-        }
-    }
-    mkdir(tmp, S_IRWXU);
-}
\ No newline at end of file
+#define _GNU_SOURCE  // For accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <dirent.h>  // For the DT_* entry types
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <zlib.h>
+#include <libgen.h>
+#include <signal.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <endian.h>
+#include <time.h>
+#include <sys/random.h>  // For getrandom
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // For the SHA extensions
+#endif
+
+#define BUFFER_SIZE 1024
+// Capacity of the ready-connection queue feeding the worker threads
+#define QUEUE_SIZE 1024
+// Maximum events handled per epoll_wait call
+#define MAX_EVENTS 256
+// Largest batch of dispfnames entries sent in one DATA frame
+#define LISTING_FRAME 16384
+// Most entries one dispfnames page may hold
+#define LISTING_MAX_PAGE 10000
+
+// Wire protocol shared with S1: every message starts with a frame header
+#define PROTO_MAGIC 0x5732
+#define PROTO_VERSION 1
+// Request opcodes; the payload carries the space-separated arguments
+#define OP_UPLOADF 1
+#define OP_DOWNLF 2
+#define OP_REMOVEF 3
+#define OP_DOWNLTAR 4
+#define OP_DISPFNAMES 5
+// Multipart upload: start an upload, send its parts in any order over any number of
+// connections, then complete or abort it
+#define OP_UPLOAD_INIT 6
+#define OP_UPLOAD_PART 7
+#define OP_UPLOAD_COMPLETE 8
+#define OP_UPLOAD_ABORT 9
+#define OP_UPLOAD_BATCH 10
+// Upload-skip probe: the arguments of an uploadf followed by the file's size and SHA-256.
+// An OK reply means the file is stored without its content being sent.
+#define OP_UPLOAD_PROBE 11
+// Every request gets one REPLY; file content follows it in DATA frames
+#define OP_REPLY 16
+#define OP_DATA 17
+// Frame flags
+#define FL_MORE 0x0001  // Another DATA frame follows this one
+// On a download request: the requester accepts a deflated body. On its reply and on
+// DATA frames: the body is deflated.
+#define FL_DEFLATE 0x0002
+// Reply status codes
+#define ST_OK 0
+#define ST_ERROR 1
+
+// Frame header, all fields in network byte order on the wire
+struct frame_hdr {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint16_t status;
+    uint32_t request_id;
+    uint64_t length;  // Payload bytes following the header
+} __attribute__((packed));
+
+// Multipart uploads are staged in a directory of their own: <id>.data is assembled in
+// place from the parts, <id>.parts lists the parts received, and <id>.dest names the
+// file it becomes. Uploads whose parts list has not changed for a day are removed.
+#define UPLOAD_ID_LEN 16
+#define UPLOAD_EXPIRY (24 * 60 * 60)
+static char upload_dir[PATH_MAX];
+
+// Small uploads S1 coalesces into one OP_UPLOAD_BATCH: the request carries the file
+// count, then a single DATA frame holds a record per file, each a batch_record followed
+// by the file's uploadf arguments and body. The reply holds one "<status> <message>"
+// line per file, in order.
+#define BATCH_MAX_FILES 64
+#define BATCH_MAX_BYTES (1024 * 1024)  // Body bytes gathered into one batch
+#define BATCH_FILE_MAX 65536           // Largest body that is coalesced
+#define BATCH_REPLY_LINE 160
+#define BATCH_MAX_FRAME (BATCH_MAX_BYTES + BATCH_MAX_FILES * (BATCH_FILE_MAX + PATH_MAX + 256 + 16))
+struct batch_record {
+    uint32_t args_len;
+    uint16_t flags;  // Of the body's DATA frame
+    uint16_t reserved;
+    uint64_t body_len;
+} __attribute__((packed));  // Network byte order
+
+// Durable uploads: a file is written under a temporary name in its destination directory,
+// flushed to disk together with the other uploads finishing at the same time, and only
+// then renamed into place, so a crash leaves either the old file or the new one
+struct staged_file {
+    FILE *fp;
+    char temp_path[PATH_MAX];
+    char path[PATH_MAX];  // Where it is published
+    int failed;           // Not written, or could not be published
+    int received;         // Counted in commit.received, see staged_file_received()
+};
+
+// Waiting to be flushed in the next commit group
+struct sync_request {
+    const int *fds;
+    int count;
+    int done, result;
+    struct sync_request *next;
+};
+
+// Group commit: the first thread to need a flush leads the next group, waiting up to the
+// commit window for uploads already received to join it, then flushes the whole group
+// with fdatasync() per file and one fsync() per directory
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct sync_request *queue;
+    int received;  // Staged files fully received that have not joined a group yet
+    int flushing;  // A leader owns the group being gathered or flushed
+} commit = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0};
+// Longest a flush waits for others to join, in milliseconds (-g); -1 flushes nothing
+static int commit_window_ms = 5;
+
+// Segment store: with -s segments, files of at most SEGMENT_SMALL bytes are appended as
+// records to large segment files in ~/.S2.segments instead of each taking an inode. An
+// index sorted by path, like the catalog, maps every file held in segments to its record.
+// It is rebuilt at startup by replaying the segments in order: a later record for a path
+// supersedes earlier ones, and a tombstone record removes the path. A compactor thread
+// rewrites sealed segments that are mostly superseded records.
+#define SEGMENT_SMALL 65536
+#define SEGMENT_SIZE (64 * 1024 * 1024)  // A segment is sealed once it grows past this
+#define SEGMENT_MAGIC 0x53324731
+#define SEGMENT_TOMBSTONE 0x0001
+#define SEGMENT_COMPACT_INTERVAL 30  // Seconds between compaction passes
+#define SEGMENT_DIR_MAX (PATH_MAX - 16)  // Longest segment directory, leaving room for "/<number>.seg"
+#define SEGMENT_SETTLE_TRIES 1000    // Milliseconds compaction waits for pending records
+
+// Record header, followed by the path relative to the server root and the content
+struct segment_record {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t path_len;
+    uint32_t crc;  // Of the path and content, so a torn record at the tail is found
+    uint64_t length;
+    int64_t mtime;
+} __attribute__((packed));
+
+// File held in a segment
+struct segment_entry {
+    char *path;       // Relative to the server root
+    const char *ext;  // Extension within path, "" if it has none
+    uint32_t segment;
+    uint64_t offset;  // Of the content within the segment
+    uint64_t length;
+    time_t mtime;
+    int removed;      // A tombstone, only while the segments are replayed
+};
+
+// Segment file, by number
+struct segment_file {
+    int fd;         // -1 for a number not in use
+    uint64_t size;
+    uint64_t live;  // Bytes of the records the index still points to
+};
+
+// File to store in segments, or with tombstone set, to remove from them
+struct segment_put {
+    const char *path;  // As in requests
+    const char *data;
+    uint64_t length;
+    int tombstone;
+    int failed;
+    char rel[PATH_MAX];
+    time_t mtime;
+    uint32_t segment;  // Where its record was written
+    uint64_t offset;
+};
+
+static struct {
+    pthread_rwlock_t lock;        // The index and the segment table
+    pthread_mutex_t append_lock;  // Appends; taken before lock
+    char dir[PATH_MAX];
+    struct segment_entry *entries;
+    size_t count, capacity;
+    struct segment_file *files;
+    uint32_t file_count;          // Highest segment number + 1
+    uint32_t active;              // Segment appended to
+    int pending;                  // Records written but not yet in the index
+    int enabled;                  // New small files go to segments (-s segments)
+} segments = {.lock = PTHREAD_RWLOCK_INITIALIZER, .append_lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Deduplicating store: with -s dedup, uploads are cut into content-defined chunks as they
+// arrive. Each distinct chunk is kept once in ~/.S2.dedup/chunks, named by its SHA-256,
+// and a recipe in ~/.S2.dedup/recipes lists the chunks of each stored file. Cut points
+// come from a gear rolling hash over the content, so an edit only changes the chunks
+// around it and the copies of a file share the rest. Reference counts are not written
+// anywhere: they are rebuilt from the recipes at startup, and chunks no recipe names
+// are deleted then.
+#define DEDUP_MIN_CHUNK (16 * 1024)
+#define DEDUP_AVG_CHUNK (64 * 1024)
+#define DEDUP_MAX_CHUNK (256 * 1024)
+// Cut-point masks on the top bits of the gear hash: harder to match before the average
+// size and easier after it, which keeps chunk sizes close to the average
+#define DEDUP_MASK_SMALL (~0ULL << (64 - 18))
+#define DEDUP_MASK_LARGE (~0ULL << (64 - 14))
+#define DEDUP_MAGIC 0x53324432
+#define DEDUP_MAGIC_V1 0x53324431  // Recipes written without a whole-file digest
+#define DEDUP_DIR_MAX (PATH_MAX - 76)  // Longest store directory, leaving room for "/chunks/xx/<64 hex digits>"
+#define DEDUP_SYNC_BATCH 128  // Chunk files an upload keeps open for its group commit before flushing them early
+#define SHA256_LEN 32
+
+// Recipe file header, followed by the path relative to the server root and the chunks
+struct dedup_recipe {
+    uint32_t magic;
+    uint32_t path_len;
+    uint32_t chunk_count;
+    uint32_t crc;  // Of the path, the chunk list and the digest
+    uint64_t size;
+    int64_t mtime;
+    unsigned char digest[SHA256_LEN];  // Of the whole file; absent from version 1 recipes
+} __attribute__((packed));
+
+// One chunk of a file, in order
+struct dedup_chunk_ref {
+    unsigned char hash[SHA256_LEN];
+    uint32_t length;
+} __attribute__((packed));
+
+// Slot of the chunk table, empty while refs is 0
+struct dedup_chunk {
+    unsigned char hash[SHA256_LEN];
+    uint32_t length;
+    uint32_t refs;  // Recipes naming it, and files being written that use it
+    int writing;    // Its file is being written, outside chunk_lock
+    int unsynced;   // Its file is written but no group commit has covered it yet
+};
+
+// File held as chunks
+struct dedup_entry {
+    char *path;       // Relative to the server root
+    const char *ext;  // Extension within path, "" if it has none
+    uint64_t size;
+    time_t mtime;
+    uint32_t chunk_count;
+    struct dedup_chunk_ref *chunks;
+    unsigned char digest[SHA256_LEN];
+    int digested;     // Version 1 recipes carry no digest
+};
+
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t fill;
+};
+
+// Upload being cut into chunks: content written to fp is chunked as it arrives, and the
+// file is stored once its recipe is published
+struct dedup_writer {
+    FILE *fp;
+    char path[PATH_MAX];  // As in requests, "" for none
+    char rel[PATH_MAX];
+    char temp_path[PATH_MAX];  // Recipe, until it is renamed into place
+    unsigned char *buf;   // Content not yet cut into chunks
+    size_t fill;
+    struct dedup_chunk_ref *chunks;
+    uint32_t count, capacity;
+    struct dedup_chunk_ref *replaced;  // Chunks of the copy it replaced, released once published
+    uint32_t replaced_count;
+    uint64_t size;
+    uint64_t new_bytes;   // Of chunks the store did not hold yet
+    time_t mtime;
+    struct sha256_ctx content;  // Of everything written
+    unsigned char digest[SHA256_LEN];
+    int cloned;           // Chunks and digest were taken from a file with the same content
+    int failed;
+    int sync_fds[DEDUP_SYNC_BATCH];  // Chunk files it uses that are not on disk yet
+    uint32_t sync_count;
+    unsigned char sync_dirs[32];     // Bit per chunk directory naming one of them
+    uint32_t synced;      // Chunks before this one are known to be on disk
+};
+
+static struct {
+    pthread_rwlock_t lock;       // The index
+    pthread_mutex_t chunk_lock;  // The chunk table; taken after lock
+    pthread_cond_t chunk_written;  // A chunk file being written was completed or given up
+    char dir[PATH_MAX];
+    struct dedup_entry *entries;
+    size_t count, capacity;
+    struct dedup_chunk *chunks;  // Open addressing on the hash, a power of two in size
+    size_t chunk_slots, chunk_count;
+    uint64_t logical_bytes;      // Sizes of the files held
+    uint64_t stored_bytes;       // Sizes of the distinct chunks
+    uint64_t gear[256];
+    int enabled;                 // New files are stored as chunks (-s dedup)
+} dedup = {.lock = PTHREAD_RWLOCK_INITIALIZER, .chunk_lock = PTHREAD_MUTEX_INITIALIZER, .chunk_written = PTHREAD_COND_INITIALIZER};
+
+// Upload-skip probes compare a client's digest with the stored file's. Digests of files in
+// the tree are cached by inode until the file changes, so probing a file again is free.
+#define DIGEST_CACHE_SLOTS 1024
+#define DIGEST_READ (1024 * 1024)  // Bytes read at a time while hashing a stored file
+
+struct digest_cache_entry {
+    dev_t dev;
+    ino_t ino;  // 0 while the slot is empty
+    off_t size;
+    struct timespec mtime, ctime;
+    unsigned char digest[SHA256_LEN];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct digest_cache_entry slots[DIGEST_CACHE_SLOTS];
+} digest_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// io_uring upload engine: upload bodies are received into a thread's registered buffers
+// and each full buffer is written at its file offset by the kernel while the next one
+// fills, so the network and the disk stay busy at once
+#define RING_ENTRIES 32
+#define RING_BUFFERS 8
+#define RING_BUFFER_SIZE (128 * 1024)
+#define RING_INPUT 16384  // Deflated input inflated into the buffers per recv()
+#define RING_RECV UINT64_MAX  // user_data of a receive; writes carry their buffer index
+
+// One thread's ring, mapped from the kernel, and the buffers its writes are made from
+struct io_ring {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+    char *buffers;
+    int registered;    // Buffers are registered, so writes use IORING_OP_WRITE_FIXED
+    unsigned pending;  // Queued submissions not yet passed to the kernel
+    unsigned inflight; // Queued operations whose completion has not been taken
+};
+
+// Upload body being written through a ring
+struct ring_writer {
+    struct io_ring *ring;
+    int fd;
+    uint64_t offset;     // File offset the buffer being filled goes to
+    int current;         // Buffer being filled, -1 for none
+    size_t fill;
+    unsigned idle;       // Bit mask of buffers neither filling nor being written
+    int error;           // A write failed; the rest of the body is only drained
+    struct {
+        uint64_t offset;
+        size_t length, done;
+    } writes[RING_BUFFERS];
+};
+
+// Write uploads through io_uring (-d uring) rather than stdio (-d stdio, the default)
+static int use_uring = 0;
+// Set once io_uring proved unavailable, so no thread tries it again
+static int ring_unavailable = 0;
+// The calling thread's ring, once set up
+static __thread struct io_ring *thread_ring = NULL;
+
+// Reply to a ranged downlf: the bytes that follow, the offset they start at, and the
+// size, mtime and version of the whole file
+#define RANGE_REPLY_SIZE (5 * sizeof(uint64_t))
+
+// Part of a file asked for by downlf; a length of 0 runs to the end of the file. With
+// if_version set, the range applies only while the file still has that version (see
+// file_version()), and the whole file is sent otherwise.
+struct byte_range {
+    int ranged;  // The request named a range, so its reply describes the range
+    uint64_t offset, length;
+    int has_version;  // if= was given
+    uint64_t if_version;
+};
+
+// Transfer compression: a compressible file travels as one raw deflate stream split
+// across DATA frames, at the fastest level so it never slows the link it saves
+#define TRANSFER_LEVEL 1
+#define TRANSFER_CHUNK 65536
+
+// ustar archive layout: 512-byte blocks, written in 10 KB records
+#define TAR_BLOCK 512
+#define TAR_RECORD 10240
+// Largest size the 11-digit octal header field holds; larger files need a pax header
+#define TAR_MAX_OCTAL 077777777777ULL
+// Room for a pax header, its records and the ustar header of one entry
+#define TAR_HEADER_MAX (PATH_MAX + 4 * TAR_BLOCK)
+
+// Regular file to archive, with its path relative to the archive root
+struct tar_entry {
+    char *path;
+    uint64_t size;
+    time_t mtime;
+    mode_t mode;
+    uint32_t segment;  // Segment holding the content at offset, 0 for a file of its own
+    uint64_t offset;
+    struct dedup_chunk_ref *chunks;  // For a file held as chunks, else NULL
+    uint32_t chunk_count;
+};
+
+// Most file types whose archives are cached at once
+#define TAR_CACHE_TYPES 4
+
+// Cached archive of one file type, valid while the catalog generation it was built at
+// is current
+struct tar_cache_entry {
+    char ext[16];
+    uint64_t generation;
+    char path[PATH_MAX];  // "" until first built
+    uint64_t size;
+    int building;
+};
+static struct tar_cache_entry tar_cache[TAR_CACHE_TYPES];
+static char tar_cache_dir[PATH_MAX];
+static pthread_mutex_t tar_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tar_cache_cond = PTHREAD_COND_INITIALIZER;
+
+// Parallel gzip: input is cut into blocks compressed independently on several threads,
+// each primed with the previous block's last 32 KB to keep the ratio of a single stream
+#define GZIP_BLOCK (128 * 1024)
+#define GZIP_WINDOW 32768
+#define GZIP_LEVEL 6
+// Room for a compressed block: zlib's worst case plus its flush marker
+#define GZIP_OUT_MAX (GZIP_BLOCK + GZIP_BLOCK / 1000 + 64)
+
+// One block of a parallel gzip stream
+struct gzip_block {
+    unsigned char *in, *out;
+    size_t in_len, out_len;
+    unsigned char dict[GZIP_WINDOW];
+    size_t dict_len;
+    uLong crc;
+    int done;
+};
+
+// Blocks of one stream in a ring: the sending thread reads them in, workers compress
+// them, and the sending thread sends them out in order
+struct gzip_job {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct gzip_block *blocks;
+    int slots;
+    uint64_t next_read, next_compress;
+    int stop;
+};
+
+// Compression threads per gzip stream; 0 uses one per core
+static int gzip_threads = 0;
+
+// Files collected for one archive
+struct tar_list {
+    struct tar_entry *entries;
+    size_t count, capacity;
+    int *segment_fds;  // By segment number, for the entries held in segments
+    uint32_t segment_fd_count;
+};
+
+// Size of the buffer each directory level reads entries into
+#define WALK_BUFFER 32768
+
+// Record returned by getdents64()
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Called for each file found by walk_files(), with its path relative to the walk root
+// and the directory descriptor and name to stat it by
+typedef void (*walk_fn)(const char *path, int dir_fd, const char *name, void *ctx);
+
+// One file of a listing page; size and mtime are only filled for long listings
+struct page_entry {
+    char *path;
+    uint64_t size;
+    time_t mtime;
+};
+
+// The first limit files after a cursor, held as a max-heap while the tree is walked
+struct listing_page {
+    const char *after;
+    int limit, want_long;
+    struct page_entry *entries;  // limit + 1 slots
+    int count;
+    int more;                    // Files remain beyond this page
+};
+
+// Snapshot file tag; snapshots without it are ignored and the tree is rescanned
+#define CATALOG_MAGIC 0x57324331
+// Least number of seconds between snapshot writes while the catalog changes
+#define CATALOG_SAVE_INTERVAL 60
+// Changes watched in every catalogued directory
+#define CATALOG_EVENTS (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | \
+                        IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+// Stored file, with its path relative to the server root
+struct catalog_entry {
+    char *path;
+    const char *ext;  // Extension within path, "" if it has none
+    uint64_t size;
+    time_t mtime;
+};
+
+// Directory below the server root and its inotify watch
+struct catalog_dir {
+    char *path;             // "" for the root itself
+    int wd;
+    struct timespec mtime;  // As of the last change applied, to validate a snapshot
+};
+
+// Every file stored under the server root, sorted by path, kept current by inotify.
+// Listings and archive lists are answered from it while ready is set.
+struct catalog {
+    pthread_rwlock_t lock;
+    char root[PATH_MAX];
+    char snapshot[PATH_MAX];
+    struct catalog_entry *entries;
+    size_t count, capacity;
+    struct catalog_dir *dirs;
+    size_t dir_count, dir_capacity;
+    int inotify_fd;
+    int ready;   // Cleared if a directory could not be watched
+    int dirty;   // Changed since the snapshot was written; accessed atomically, as catalog_save()
+                 // clears it under the read lock
+    uint64_t generation;  // Bumped on every change, to tag cached archives
+    time_t last_save;
+};
+static struct catalog catalog = {.lock = PTHREAD_RWLOCK_INITIALIZER, .inotify_fd = -1};
+
+// Global flag to control server shutdown
+static volatile sig_atomic_t keep_running = 1;
+// Server socket descriptor
+static int server_sock = -1;
+// epoll instance watching the listening socket and idle connections
+static int epoll_fd = -1;
+
+// Connections with a pending request, waiting for a worker thread
+static int conn_queue[QUEUE_SIZE];
+static int queue_head = 0, queue_count = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+
+// Signal handler for graceful shutdown
+void signal_handler(int sig) {
+    keep_running = 0;
+    if (server_sock != -1) close(server_sock);
+}
+
+// Function to create directories recursively
+void create_directories(const char *path);
+// Request handling and worker pool
+int handle_request(int client_sock);
+void *worker_thread(void *arg);
+// Framed protocol helpers
+int receive_full(int sock, char *buffer, size_t size);
+int send_all(int sock, const void *buffer, size_t size);
+int send_frame(int sock, uint8_t opcode, uint16_t flags, uint16_t status, uint32_t request_id, const void *payload, uint64_t length);
+int send_reply(int sock, uint32_t request_id, uint16_t status, const char *msg);
+int send_size_reply(int sock, uint32_t request_id, uint64_t size, uint16_t flags);
+long long send_file_body(int sock, int fd, uint64_t offset, uint64_t size);
+int send_file_frame(int sock, int fd, uint64_t offset, uint64_t size, uint32_t request_id);
+// Multipart uploads
+int upload_prepare(void);
+int upload_path(const char *upload_id, const char *suffix, char *path);
+int upload_start(const char *dest, char *upload_id);
+FILE *upload_open_part(const char *upload_id, uint64_t offset);
+int upload_record_part(const char *upload_id, uint64_t offset, uint64_t length);
+const char *upload_finish(const char *upload_id, uint64_t size, char *dest);
+int upload_abort(const char *upload_id);
+// Durable uploads
+int stage_file(struct staged_file *file, const char *path, const char *existing);
+int staged_name(const char *name);
+void sweep_staged(const char *path, int dir_fd, const char *name, void *ctx);
+size_t sweep_staged_tree(const char *root);
+void staged_file_received(struct staged_file *file);
+void discard_file(struct staged_file *file);
+int publish_files(struct staged_file *files, int count);
+int durable_sync(const int *fds, int count, int received);
+int flush_group(struct sync_request *group);
+// Segment store
+int segment_init(const char *dir);
+int segment_open(uint32_t number);
+uint64_t segment_read(int fd, uint64_t pos, uint64_t end, struct segment_record *hdr, char *path, char *content);
+int segment_append(const struct segment_record *hdr, const char *path, const char *data, uint32_t *number, uint64_t *offset);
+int segment_write(struct segment_put *puts, int count);
+int segment_store_staged(struct staged_file *file, uint64_t length);
+int small_body_pending(int client_sock);
+void segment_index(const struct segment_put *put);
+size_t segment_find(const char *path, int *found);
+int segment_lookup(const char *path, struct stat *statbuf, uint64_t *base);
+int segment_remove(const char *path);
+void segment_list_page(const char *dir, const char *ext, struct listing_page *page);
+void *segment_compactor(void *arg);
+int segment_compact(uint32_t number);
+int segment_lock_settled(void);
+// Deduplicating store
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t length);
+void sha256_final(struct sha256_ctx *ctx, unsigned char *digest);
+void sha256_blocks(uint32_t *state, const unsigned char *data, size_t count);
+void sha256_blocks_portable(uint32_t *state, const unsigned char *data, size_t count);
+void sha256_blocks_shani(uint32_t *state, const unsigned char *data, size_t count);
+void digest_hex(const unsigned char *digest, char *hex);
+int parse_digest(const char *hex, unsigned char *digest);
+int dedup_init(const char *dir);
+int dedup_load_recipe(const char *path);
+int dedup_start(struct dedup_writer *w, const char *path);
+size_t dedup_cut(const unsigned char *data, size_t length);
+int dedup_add_chunk(struct dedup_writer *w, const unsigned char *data, size_t length);
+void dedup_discard(struct dedup_writer *w);
+int dedup_publish(struct dedup_writer *writers, int count);
+int dedup_open_chunk_dirs(const unsigned char *dirs, int *fds);
+void dedup_mark_synced(struct dedup_writer *w);
+int dedup_sync_chunks(struct dedup_writer *w);
+int dedup_ingest(const char *path);
+struct dedup_chunk *dedup_chunk_probe(const unsigned char *hash);
+struct dedup_chunk *dedup_chunk_slot(const unsigned char *hash);
+int dedup_chunk_grow(void);
+void dedup_chunk_delete(struct dedup_chunk *slot);
+void dedup_chunk_path(const unsigned char *hash, char *path);
+void dedup_recipe_path(const char *rel, char *path);
+void dedup_release(const struct dedup_chunk_ref *chunks, uint32_t count);
+size_t dedup_find(const char *path, int *found);
+int dedup_lookup(const char *path, struct stat *statbuf, struct dedup_chunk_ref **chunks, uint32_t *count);
+long long dedup_send_body(int sock, const struct dedup_chunk_ref *chunks, uint32_t count, uint64_t offset, uint64_t size);
+int dedup_remove(const char *path);
+int dedup_content(const char *path, uint64_t *size, unsigned char *digest);
+int dedup_clone(const char *path, uint64_t size, const unsigned char *digest);
+void dedup_list_page(const char *dir, const char *ext, struct listing_page *page);
+// Upload-skip probes
+int content_matches(const char *path, uint64_t size, const unsigned char *digest);
+int digest_file(int fd, uint64_t offset, uint64_t size, unsigned char *digest);
+// io_uring upload engine
+struct io_ring *ring_get(void);
+int ring_setup(struct io_ring *ring);
+void ring_close(struct io_ring *ring);
+void ring_discard(struct io_ring *ring);
+void ring_queue(struct io_ring *ring, uint8_t opcode, int fd, void *addr, uint32_t len, uint64_t offset, uint32_t msg_flags, uint64_t user_data);
+int ring_wait(struct io_ring *ring, struct io_uring_cqe *cqe);
+int ring_writer_start(struct ring_writer *w, FILE *fp);
+char *ring_writer_space(struct ring_writer *w, size_t *space);
+void ring_writer_commit(struct ring_writer *w, size_t length);
+void ring_writer_flush(struct ring_writer *w);
+int ring_writer_reap(struct ring_writer *w, long long *recv_result);
+ssize_t ring_writer_recv(struct ring_writer *w, int sock, uint64_t max);
+int ring_writer_finish(struct ring_writer *w, FILE *fp);
+long long ring_recv_body(int sock, FILE *fp, int *write_error);
+// Coalesced small uploads
+const char *store_batch_file(const char *args, const char *body, uint64_t length, int deflated, struct staged_file *file, struct segment_put *put, struct dedup_writer *writer);
+long long inflate_to_file(FILE *fp, const char *data, uint64_t length);
+// Ranged downloads
+char *split_range_options(char *args);
+void parse_range_options(char *opts, struct byte_range *range);
+uint64_t file_version(const struct stat *statbuf);
+int resolve_range(struct byte_range *range, const struct stat *statbuf);
+int send_range_reply(int sock, uint32_t request_id, const struct byte_range *range, const struct stat *statbuf, uint16_t flags);
+// Transfer compression
+int compressible_type(const char *name);
+long long send_deflated_body(int sock, int fd, uint64_t offset, uint64_t size, uint32_t request_id);
+// Paged dispfnames listings
+void parse_listing_options(char *opts, char *after, size_t after_size, int *limit, int *want_long);
+int queue_listing_line(int sock, uint32_t request_id, char *buf, size_t *len, const char *line, size_t line_len);
+// Directory walking
+void walk_files(int dir_fd, const char *rel, const char *ext, int skip_hidden, walk_fn fn, void *ctx);
+void collect_listing_page(const char *dir, const char *ext, const char *after, int limit, int want_long, struct listing_page *page);
+void free_listing_page(struct listing_page *page);
+// In-memory file catalog
+void catalog_init(const char *root, const char *snapshot);
+size_t catalog_sweep_staged(void);
+void catalog_note(const char *path);
+int catalog_list_page(const char *dir, const char *ext, const char *after, int limit, int want_long, struct listing_page *page);
+int catalog_save(void);
+uint64_t catalog_generation(void);
+void *catalog_watcher(void *arg);
+void catalog_apply_event(const struct inotify_event *ev);
+int catalog_load(void);
+void catalog_rebuild(void);
+void catalog_scan(int dir_fd, const char *rel, int recursive);
+void catalog_refresh(const char *rel);
+void catalog_remove_tree(const char *rel);
+void catalog_drop_files(const char *rel);
+void catalog_append(const char *rel, const struct stat *statbuf);
+void catalog_sort(void);
+size_t catalog_find(const char *path, int *found);
+struct catalog_dir *catalog_add_dir(const char *rel);
+void catalog_remove_dir(struct catalog_dir *d);
+struct catalog_dir *catalog_dir_by_path(const char *rel);
+struct catalog_dir *catalog_dir_by_wd(int wd);
+int catalog_abspath(const char *rel, char *path);
+int catalog_relpath(const char *path, char *rel);
+// Streaming tar writer
+int catalog_tar_list(const char *root, const char *ext, struct tar_list *list);
+void build_tar_list(const char *root, const char *ext, struct tar_list *list);
+void free_tar_list(struct tar_list *list);
+int segment_tar_list(const char *root, const char *ext, struct tar_list *list);
+int dedup_tar_list(const char *root, const char *ext, struct tar_list *list);
+size_t tar_entry_header(char *out, const struct tar_entry *entry);
+uint64_t tar_archive_size(const struct tar_list *list);
+int tar_cache_open(const char *root, const char *ext, uint64_t *size);
+int tar_cache_prepare(void);
+int write_tar_archive(int sock, const char *root, const struct tar_list *list, uint64_t archive_size);
+int send_tar_gzip(int sock, const char *root, const char *ext, uint32_t request_id);
+int send_gzip_stream(int sock, int src_fd, uint32_t request_id);
+void *gzip_worker(void *arg);
+int send_tar_frame(int sock, const char *root, const struct tar_list *list, uint64_t archive_size, uint32_t request_id);
+int recv_frame(int sock, struct frame_hdr *hdr);
+int recv_payload(int sock, const struct frame_hdr *hdr, char *buffer, size_t size);
+long long recv_body(int sock, FILE *fp, int *write_error);
+
+int main(int argc, char *argv[]) {
+    // Parse options: -t sets the number of worker threads (default: twice the core count),
+    // -z the threads compressing each gzip archive (default: the core count), -d how
+    // uploads are written, -g their group-commit window in ms, -s how new files are stored
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = ncpu > 2 ? 2 * ncpu : 4, bad_opts = 0, opt_ch;
+    const char *store = "files";
+    while ((opt_ch = getopt(argc, argv, "t:z:d:g:s:")) != -1) {
+        if (opt_ch == 't' && atoi(optarg) > 0) threads = atoi(optarg);
+        else if (opt_ch == 'z' && atoi(optarg) > 0) gzip_threads = atoi(optarg);
+        else if (opt_ch == 'd' && strcmp(optarg, "uring") == 0) use_uring = 1;
+        else if (opt_ch == 'd' && strcmp(optarg, "stdio") == 0) use_uring = 0;
+        else if (opt_ch == 'g' && strcmp(optarg, "off") == 0) commit_window_ms = -1;
+        else if (opt_ch == 'g' && strspn(optarg, "0123456789") == strlen(optarg) && *optarg) commit_window_ms = atoi(optarg);
+        else if (opt_ch == 's' && (strcmp(optarg, "files") == 0 || strcmp(optarg, "segments") == 0 || strcmp(optarg, "dedup") == 0)) store = optarg;
+        else bad_opts = 1;
+    }
+    segments.enabled = strcmp(store, "segments") == 0;
+    dedup.enabled = strcmp(store, "dedup") == 0;
+
+    // Validate command-line arguments
+    if (bad_opts || argc - optind != 1) {
+        fprintf(stderr, "Usage: %s [-t threads] [-z threads] [-d uring|stdio] [-g ms|off] [-s files|segments|dedup] <S2_port>\n", argv[0]);
+        return 1;
+    }
+
+    // Parse and validate port number
+    int PORT_S2 = atoi(argv[optind]);
+    if (PORT_S2 < 1024 || PORT_S2 > 65535) {
+        fprintf(stderr, "Error: Port must be between 1024 and 65535\n");
+        return 1;
+    }
+
+    // Initialize server address structure
+    struct sockaddr_in server_addr;
+    // Set up signal handler for SIGINT
+    struct sigaction sa = {.sa_handler = signal_handler, .sa_flags = SA_RESTART};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    // A peer that disconnects mid-transfer must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Create server socket
+    server_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int opt = 1;
+    // Allow socket reuse
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(PORT_S2);
+
+    // Bind socket to address
+    if (bind(server_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Bind failed");
+        close(server_sock);
+        return 1;
+    }
+    // Listen for incoming connections with a deep backlog
+    listen(server_sock, SOMAXCONN);
+    printf("S2 listening on port %d with %d worker threads...\n", PORT_S2, threads);
+
+    // Catalog the stored files, so listings and archives need no directory walks
+    char *home = getenv("HOME");
+    if (home) {
+        char root[PATH_MAX], snapshot[PATH_MAX];
+        snprintf(root, PATH_MAX, "%s/S2", home);
+        snprintf(snapshot, PATH_MAX, "%s/.S2.catalog", home);
+        catalog_init(root, snapshot);
+    }
+    // Stage multipart uploads, dropping those abandoned while the server was down
+    upload_prepare();
+    // Load the files held in segments, which -s segments also stores new small files in
+    if (home) {
+        char segment_dir[PATH_MAX];
+        snprintf(segment_dir, PATH_MAX, "%s/.S2.segments", home);
+        if (segment_init(segment_dir) < 0 && segments.enabled) {
+            printf("S2: Segment store unavailable, storing small files as files\n");
+            segments.enabled = 0;
+        }
+    }
+    // Likewise the files held as chunks, which -s dedup stores every new file as
+    if (home) {
+        char dedup_dir[PATH_MAX];
+        snprintf(dedup_dir, PATH_MAX, "%s/.S2.dedup", home);
+        if (dedup_init(dedup_dir) < 0 && dedup.enabled) {
+            printf("S2: Deduplicating store unavailable, storing files as files\n");
+            dedup.enabled = 0;
+        }
+    }
+
+    // Start workers with SIGINT blocked so the main thread receives shutdown signals
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    for (int i = 0; i < threads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_thread, NULL) == 0) pthread_detach(tid);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    // Idle connections wait in epoll so persistent S1 connections never pin a worker
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = server_sock};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_sock, &ev);
+
+    // Main server loop: accept connections and queue those with a pending request
+    struct epoll_event events[MAX_EVENTS];
+    while (keep_running) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == server_sock) {
+                // Accept every pending connection
+                int client_sock;
+                while ((client_sock = accept4(server_sock, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+                    setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+                    // One-shot: a connection is reported again only after its request is served
+                    struct epoll_event cev = {.events = EPOLLIN | EPOLLONESHOT, .data.fd = client_sock};
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_sock, &cev) < 0) close(client_sock);
+                }
+                continue;
+            }
+
+            // Queue the connection, waiting while every slot is taken
+            pthread_mutex_lock(&queue_lock);
+            while (queue_count == QUEUE_SIZE) pthread_cond_wait(&queue_not_full, &queue_lock);
+            conn_queue[(queue_head + queue_count) % QUEUE_SIZE] = fd;
+            queue_count++;
+            pthread_cond_signal(&queue_not_empty);
+            pthread_mutex_unlock(&queue_lock);
+        }
+    }
+    close(epoll_fd);
+    close(server_sock);
+    // Save the catalog so the next start needs no full scan
+    if (catalog.inotify_fd >= 0) catalog_save();
+    return 0;
+}
+
+// Handle one request; returns 0 to keep the connection open, -1 to close it
+int handle_request(int client_sock) {
+    // Receive request frame and its arguments
+    struct frame_hdr hdr;
+    char args[PATH_MAX + 256];
+    if (recv_frame(client_sock, &hdr) < 0) return -1;
+    if (recv_payload(client_sock, &hdr, args, sizeof(args)) < 0) return -1;
+    uint32_t id = hdr.request_id;
+
+    if (hdr.opcode == OP_UPLOADF) {
+        printf("S2: Received uploadf command: %s\n", args);
+        char filename[256], dest_path[PATH_MAX];
+        if (sscanf(args, "%255s %4095s", filename, dest_path) != 2) {
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: Malformed request");
+            return -1;
+        }
+        // Construct full file path
+        char full_path[PATH_MAX];
+        if (dest_path[strlen(dest_path) - 1] == '/')
+            snprintf(full_path, PATH_MAX, "%s%s", dest_path, filename);
+        else
+            snprintf(full_path, PATH_MAX, "%s/%s", dest_path, filename);
+        printf("S2: Attempting to write to %s\n", full_path);
+
+        // With the segment store on, a body small enough for a segment is received into
+        // memory and stored as a coalesced upload is, without a staged file
+        if (segments.enabled && small_body_pending(client_sock)) {
+            struct frame_hdr data;
+            char *body = NULL;
+            if (recv_frame(client_sock, &data) < 0 || !(body = malloc(data.length ? data.length : 1)) ||
+                receive_full(client_sock, body, data.length) < 0) {
+                free(body);
+                return -1;
+            }
+            struct staged_file file;
+            struct segment_put put;
+            struct dedup_writer writer;
+            const char *error = store_batch_file(args, body, data.length, data.flags & FL_DEFLATE, &file, &put, &writer);
+            free(body);
+            // Content that inflates past SEGMENT_SMALL comes back staged as a file of its own
+            int in_segment = put.path != NULL;
+            if (!error && (in_segment ? segment_write(&put, 1) != 1 : publish_files(&file, 1) == 0))
+                error = "Upload failed: Error writing file";
+            uint64_t length = in_segment ? put.length : 0;
+            free((char *)put.data);
+            if (error) {
+                send_reply(client_sock, id, ST_ERROR, error);
+                return 0;
+            }
+            send_reply(client_sock, id, ST_OK, "Stored successfully");
+            if (in_segment) {
+                printf("S2: Stored %s in a segment (%lu bytes)\n", full_path, length);
+            } else {
+                printf("S2: Stored %s\n", full_path);
+                catalog_note(full_path);
+                segment_remove(full_path);
+                dedup_remove(full_path);
+            }
+            return 0;
+        }
+
+        // Create necessary directories
+        char *dir_path = strdup(full_path);
+        create_directories(dirname(dir_path));
+        free(dir_path);
+
+        if (dedup.enabled) {
+            // Cut into chunks as it arrives, so content the store already holds is not written again
+            struct dedup_writer w;
+            int write_error = dedup_start(&w, full_path) < 0;
+            long long total_bytes = recv_body(client_sock, write_error ? NULL : w.fp, &write_error);
+            if (total_bytes < 0 || write_error || total_bytes == 0) {
+                dedup_discard(&w);
+                if (total_bytes < 0) return -1;
+                send_reply(client_sock, id, ST_ERROR, total_bytes == 0 && !write_error ? "Upload failed: No data received" :
+                                                      "Upload failed: Error writing file");
+            } else if (dedup_publish(&w, 1) == 0) {
+                send_reply(client_sock, id, ST_ERROR, "Upload failed: Error writing file");
+            } else {
+                send_reply(client_sock, id, ST_OK, "Stored successfully");
+            }
+            return 0;
+        }
+
+        // Write to a temporary file, replacing any existing file only once stored
+        struct staged_file file;
+        if (stage_file(&file, full_path, NULL) < 0) {
+            char error_msg[BUFFER_SIZE];
+            snprintf(error_msg, BUFFER_SIZE, "Upload failed: Cannot write file (%s)", strerror(errno));
+            // Drain the file data so the connection stays usable
+            int ignored = 0;
+            if (recv_body(client_sock, NULL, &ignored) < 0) return -1;
+            send_reply(client_sock, id, ST_ERROR, error_msg);
+            return 0;
+        }
+
+        // Receive and write file data
+        int write_error = 0;
+        long long total_bytes = recv_body(client_sock, file.fp, &write_error);
+
+        // Check for receive errors
+        if (total_bytes < 0) {
+            discard_file(&file);
+            return -1;
+        }
+        if (write_error) {
+            discard_file(&file);
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: Error writing file");
+            return 0;
+        }
+        staged_file_received(&file);
+
+        // Send response based on success
+        if (total_bytes == 0) {
+            discard_file(&file);
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: No data received");
+        } else if (segments.enabled && total_bytes <= SEGMENT_SMALL) {
+            // Small content that arrived in several frames, or deflated to more than it
+            // holds, is moved into a segment rather than keeping an inode
+            if (segment_store_staged(&file, total_bytes) < 0) {
+                send_reply(client_sock, id, ST_ERROR, "Upload failed: Error writing file");
+            } else {
+                send_reply(client_sock, id, ST_OK, "Stored successfully");
+                printf("S2: Stored %s in a segment (%lld bytes)\n", full_path, total_bytes);
+            }
+        } else if (publish_files(&file, 1) == 0) {
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: Error writing file");
+        } else {
+            send_reply(client_sock, id, ST_OK, "Stored successfully");
+            printf("S2: Stored %s (%lld bytes)\n", full_path, total_bytes);
+            catalog_note(full_path);
+            segment_remove(full_path);
+            dedup_remove(full_path);
+        }
+    } else if (hdr.opcode == OP_DOWNLF) {
+        printf("S2: Received downlf command: %s\n", args);
+        // The path may be followed by range options
+        struct byte_range range;
+        parse_range_options(split_range_options(args), &range);
+
+        // Open requested file; a small file may be held in a segment, starting at base, and
+        // a file held as chunks is sent from a copy of its chunk list
+        struct stat statbuf;
+        uint64_t base = 0;
+        struct dedup_chunk_ref *chunks = NULL;
+        uint32_t chunk_count = 0;
+        int fd = segment_lookup(args, &statbuf, &base);
+        if (fd < 0 && dedup_lookup(args, &statbuf, &chunks, &chunk_count) < 0 &&
+            ((fd = open(args, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode))) {
+            if (fd >= 0) close(fd);
+            send_reply(client_sock, id, ST_ERROR, "Download failed: File not found");
+            return 0;
+        }
+        if (resolve_range(&range, &statbuf) < 0) {
+            if (fd >= 0) close(fd);
+            free(chunks);
+            send_reply(client_sock, id, ST_ERROR, "Download failed: Offset beyond end of file");
+            return 0;
+        }
+
+        // Send file size to client; a deflated body is sent only if the requester accepts
+        // one, and files held as chunks are always sent plain
+        int deflated = (hdr.flags & FL_DEFLATE) && compressible_type(args) && !chunks;
+        uint16_t flags = deflated ? FL_DEFLATE : 0;
+        if ((range.ranged ? send_range_reply(client_sock, id, &range, &statbuf, flags) :
+                            send_size_reply(client_sock, id, range.length, flags)) < 0) {
+            if (fd >= 0) close(fd);
+            free(chunks);
+            return -1;
+        }
+        printf("S2: Sending file %s (%lu bytes from %lu%s)\n", args, range.length, range.offset,
+               deflated ? ", deflated" : "");
+
+        if (deflated) {
+            long long sent = send_deflated_body(client_sock, fd, base + range.offset, range.length, id);
+            close(fd);
+            if (sent < 0) return -1;
+            printf("S2: File transfer complete for %s (%lld bytes deflated)\n", args, sent);
+            return 0;
+        }
+        if (chunks) {
+            // A chunk removed meanwhile leaves the frame incomplete, as a short file does
+            int rc = send_frame(client_sock, OP_DATA, 0, 0, id, NULL, range.length) < 0 ||
+                     dedup_send_body(client_sock, chunks, chunk_count, range.offset, range.length) != (long long)range.length ? -1 : 0;
+            free(chunks);
+            if (rc < 0) return -1;
+            printf("S2: File transfer complete for %s (%u chunks)\n", args, chunk_count);
+            return 0;
+        }
+        // Send file data as one DATA frame; a short file leaves the frame incomplete,
+        // so the connection cannot be reused
+        int rc = send_file_frame(client_sock, fd, base + range.offset, range.length, id);
+        close(fd);
+        if (rc < 0) return -1;
+        printf("S2: File transfer complete for %s\n", args);
+    } else if (hdr.opcode == OP_REMOVEF) {
+        printf("S2: Received removef command: %s\n", args);
+        char *filepath = args;
+
+        // Check if file exists; files held in segments are removed with a tombstone, and
+        // files held as chunks by deleting their recipe
+        struct stat statbuf;
+        if (segment_remove(filepath) == 0) {
+            send_reply(client_sock, id, ST_OK, "File removed successfully");
+            printf("S2: Removed %s from its segment\n", filepath);
+        } else if (dedup_remove(filepath) == 0) {
+            send_reply(client_sock, id, ST_OK, "File removed successfully");
+            printf("S2: Removed %s from the deduplicating store\n", filepath);
+        } else if (stat(filepath, &statbuf) == 0) {
+            if (S_ISREG(statbuf.st_mode)) {
+                // Attempt to remove file
+                if (remove(filepath) == 0) {
+                    send_reply(client_sock, id, ST_OK, "File removed successfully");
+                    printf("S2: Removed %s\n", filepath);
+                    catalog_note(filepath);
+                } else {
+                    send_reply(client_sock, id, ST_ERROR, "Remove failed: Permission denied");
+                }
+            } else {
+                send_reply(client_sock, id, ST_ERROR, "Remove failed: Not a regular file");
+            }
+        } else {
+            send_reply(client_sock, id, ST_ERROR, "Remove failed: File not found");
+        }
+    } else if (hdr.opcode == OP_DOWNLTAR) {
+        printf("S2: Received downltar command: %s\n", args);
+        // Arguments are the file type, then "gzip" for a compressed archive
+        char filetype[16] = {0}, option[16] = {0};
+        sscanf(args, "%15s %15s", filetype, option);
+        // Validate file type
+        if (strcmp(filetype, ".pdf") != 0) {
+            send_reply(client_sock, id, ST_ERROR, "Download failed: Invalid file type for this server");
+            return 0;
+        }
+
+        char root[PATH_MAX];
+        char *home = getenv("HOME");
+        snprintf(root, PATH_MAX, "%s/S2", home);
+
+        if (strcmp(option, "gzip") == 0) {
+            int rc = send_tar_gzip(client_sock, root, ".pdf", id);
+            if (rc == -2) send_reply(client_sock, id, ST_ERROR, "Download failed: No files found");
+            else printf("S2: Sent gzip archive to S1\n");
+            return rc == -1 ? -1 : 0;
+        }
+
+        // Serve the cached archive while the stored files are unchanged
+        uint64_t archive_size;
+        int cache_fd = tar_cache_open(root, ".pdf", &archive_size);
+        if (cache_fd == -2) {
+            send_reply(client_sock, id, ST_ERROR, "Download failed: No files found");
+            return 0;
+        }
+        if (cache_fd >= 0) {
+            int rc = send_size_reply(client_sock, id, archive_size, 0) < 0 ? -1 :
+                     send_file_frame(client_sock, cache_fd, 0, archive_size, id);
+            close(cache_fd);
+            printf("S2: Sent cached archive (%lu bytes) to S1\n", archive_size);
+            return rc;
+        }
+
+        // Otherwise list the .pdf files under the server root; the archive is generated while it is sent
+        struct tar_list list;
+        build_tar_list(root, ".pdf", &list);
+        if (list.count == 0) {
+            send_reply(client_sock, id, ST_ERROR, "Download failed: No files found");
+            free_tar_list(&list);
+            return 0;
+        }
+
+        // Send archive size, then the archive as one DATA frame
+        archive_size = tar_archive_size(&list);
+        int rc = send_size_reply(client_sock, id, archive_size, 0) < 0 ? -1 :
+                 send_tar_frame(client_sock, root, &list, archive_size, id);
+        printf("S2: Sent archive of %zu files (%lu bytes) to S1\n", list.count, archive_size);
+        free_tar_list(&list);
+        if (rc < 0) return -1;
+    } else if (hdr.opcode == OP_DISPFNAMES) {
+        printf("S2: Received dispfnames command: %s\n", args);
+        char pathname[PATH_MAX] = {0}, filetype[16] = {0}, after[PATH_MAX];
+        int consumed = 0, limit, want_long;
+        sscanf(args, "%4095s %15s %n", pathname, filetype, &consumed);
+        parse_listing_options(args + consumed, after, sizeof(after), &limit, &want_long);
+
+        // Every listing is the OK reply, DATA frames of entries, and a final DATA frame
+        // holding the cursor for the next page (empty once the listing is complete).
+        // Validate file type and verify directory exists; an empty listing means no files
+        struct stat statbuf;
+        struct listing_page page = {0};
+        if (limit == 0 || limit > LISTING_MAX_PAGE) limit = LISTING_MAX_PAGE;
+        if (strcmp(filetype, ".pdf") == 0 && stat(pathname, &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
+            // Paths are relative to the listed directory and sorted bytewise, matching the cursor
+            collect_listing_page(pathname, filetype, after, limit, want_long, &page);
+        }
+        if (send_reply(client_sock, id, ST_OK, "") < 0) {
+            free_listing_page(&page);
+            return -1;
+        }
+
+        // Stream the page; if more entries remain, the next page starts after its last one
+        char frame[LISTING_FRAME], cursor[PATH_MAX] = "";
+        size_t frame_len = 0;
+        int count = 0, rc = 0;
+        for (; rc == 0 && count < page.count; count++) {
+            struct page_entry *e = &page.entries[count];
+            char entry[PATH_MAX + 64];
+            int entry_len = want_long ? snprintf(entry, sizeof(entry), "%s\t%lu\t%lld\n", e->path, e->size, (long long)e->mtime)
+                                      : snprintf(entry, sizeof(entry), "%s\n", e->path);
+            if (entry_len >= (int)sizeof(entry)) continue;
+            rc = queue_listing_line(client_sock, id, frame, &frame_len, entry, entry_len);
+        }
+        if (page.more && page.count > 0) snprintf(cursor, sizeof(cursor), "%s", page.entries[page.count - 1].path);
+        free_listing_page(&page);
+        if (rc < 0 || (frame_len > 0 && send_frame(client_sock, OP_DATA, FL_MORE, 0, id, frame, frame_len) < 0) ||
+            send_frame(client_sock, OP_DATA, 0, 0, id, cursor, strlen(cursor)) < 0) return -1;
+        printf("S2: Listed %d entries of %s\n", count, pathname);
+    } else if (hdr.opcode == OP_UPLOAD_INIT) {
+        printf("S2: Received upload init command: %s\n", args);
+        char filename[256], dest_path[PATH_MAX], full_path[PATH_MAX], upload_id[UPLOAD_ID_LEN + 1];
+        if (sscanf(args, "%255s %4095s", filename, dest_path) != 2) {
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: Malformed request");
+            return 0;
+        }
+        if (snprintf(full_path, PATH_MAX, "%s%s%s", dest_path, dest_path[strlen(dest_path) - 1] == '/' ? "" : "/", filename) >= PATH_MAX) {
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: Path too long");
+            return 0;
+        }
+        if (upload_start(full_path, upload_id) < 0) {
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: Cannot stage upload");
+            return 0;
+        }
+        send_reply(client_sock, id, ST_OK, upload_id);
+        printf("S2: Started upload %s of %s\n", upload_id, full_path);
+    } else if (hdr.opcode == OP_UPLOAD_PART) {
+        // Each part is written where it belongs in the staged file, so parts may
+        // arrive in any order and over any connection
+        char upload_id[UPLOAD_ID_LEN + 1];
+        unsigned long offset;
+        FILE *fp = NULL;
+        if (sscanf(args, "%16s %lu", upload_id, &offset) == 2) fp = upload_open_part(upload_id, offset);
+        int write_error = 0;
+        long long total_bytes = recv_body(client_sock, fp, &write_error);
+        if (fp && fclose(fp) != 0) write_error = 1;
+        if (total_bytes < 0) return -1;
+        if (!fp) {
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: Unknown upload");
+        } else if (write_error || upload_record_part(upload_id, offset, total_bytes) < 0) {
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: Error writing file");
+        } else {
+            send_reply(client_sock, id, ST_OK, "Part stored");
+        }
+    } else if (hdr.opcode == OP_UPLOAD_COMPLETE) {
+        printf("S2: Received upload complete command: %s\n", args);
+        char upload_id[UPLOAD_ID_LEN + 1], full_path[PATH_MAX];
+        unsigned long size;
+        const char *error = "Upload failed: Malformed request";
+        if (sscanf(args, "%16s %lu", upload_id, &size) == 2) error = upload_finish(upload_id, size, full_path);
+        if (error) {
+            send_reply(client_sock, id, ST_ERROR, error);
+            return 0;
+        }
+        send_reply(client_sock, id, ST_OK, "Stored successfully");
+        printf("S2: Stored %s (%lu bytes)\n", full_path, size);
+        catalog_note(full_path);
+        // A copy held in a segment or as chunks would shadow the new file; with -s dedup
+        // the assembled file is cut into chunks in its place
+        segment_remove(full_path);
+        if (!dedup.enabled || dedup_ingest(full_path) < 0) dedup_remove(full_path);
+    } else if (hdr.opcode == OP_UPLOAD_ABORT) {
+        printf("S2: Received upload abort command: %s\n", args);
+        if (upload_abort(args) == 0)
+            send_reply(client_sock, id, ST_OK, "Upload aborted");
+        else
+            send_reply(client_sock, id, ST_ERROR, "Abort failed: Unknown upload");
+    } else if (hdr.opcode == OP_UPLOAD_BATCH) {
+        // Small uploads coalesced by S1, stored as a group and answered with a line per file
+        int count = atoi(args);
+        struct frame_hdr data;
+        if (recv_frame(client_sock, &data) < 0 || data.opcode != OP_DATA || data.length > BATCH_MAX_FRAME) return -1;
+        char *batch = malloc(data.length + 1);
+        if (!batch || receive_full(client_sock, batch, data.length) < 0) {
+            free(batch);
+            return -1;
+        }
+        if (count < 1 || count > BATCH_MAX_FILES) {
+            free(batch);
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: Malformed request");
+            return 0;
+        }
+        char results[BATCH_MAX_FILES * BATCH_REPLY_LINE + 1];
+        const char *errors[BATCH_MAX_FILES];
+        struct staged_file *files = malloc(count * sizeof(*files));
+        struct segment_put *puts = malloc(count * sizeof(*puts));
+        struct dedup_writer *writers = malloc(count * sizeof(*writers));
+        if (!files || !puts || !writers) {
+            free(files);
+            free(puts);
+            free(writers);
+            free(batch);
+            send_reply(client_sock, id, ST_ERROR, "Upload failed: Out of memory");
+            return 0;
+        }
+        size_t pos = 0, len = 0;
+        int stored = 0;
+        for (int i = 0; i < count; i++) {
+            const char *error = "Upload failed: Malformed request";
+            char file_args[PATH_MAX + 256];
+            struct batch_record rec;
+            files[i].fp = NULL;
+            files[i].failed = 1;
+            files[i].received = 0;
+            puts[i].path = NULL;
+            puts[i].data = NULL;
+            writers[i].path[0] = '\0';
+            if (pos + sizeof(rec) <= data.length) {
+                memcpy(&rec, batch + pos, sizeof(rec));
+                pos += sizeof(rec);
+                uint32_t args_len = ntohl(rec.args_len);
+                uint64_t body_len = be64toh(rec.body_len);
+                if (args_len < sizeof(file_args) && args_len <= data.length - pos &&
+                    body_len <= data.length - pos - args_len) {
+                    memcpy(file_args, batch + pos, args_len);
+                    file_args[args_len] = '\0';
+                    error = store_batch_file(file_args, batch + pos + args_len, body_len, ntohs(rec.flags) & FL_DEFLATE, &files[i], &puts[i], &writers[i]);
+                    pos += args_len + body_len;
+                } else {
+                    pos = data.length;
+                }
+            }
+            errors[i] = error;
+        }
+        free(batch);
+        // The whole batch is flushed to disk with one group commit, small files with the
+        // segment store on go into a segment together, and with -s dedup the recipes of
+        // the batch are published together
+        publish_files(files, count);
+        segment_write(puts, count);
+        dedup_publish(writers, count);
+        for (int i = 0; i < count; i++) {
+            const char *error = errors[i];
+            int in_segment = puts[i].path != NULL, in_chunks = writers[i].path[0] != '\0';
+            if (!error && (in_segment ? puts[i].failed : in_chunks ? writers[i].failed : files[i].failed))
+                error = "Upload failed: Error writing file";
+            if (!error) {
+                stored++;
+                if (!in_segment && !in_chunks) {
+                    catalog_note(files[i].path);
+                    segment_remove(files[i].path);
+                    dedup_remove(files[i].path);
+                }
+            }
+            free((char *)puts[i].data);
+            int n = snprintf(results + len, BATCH_REPLY_LINE, "%d %s\n", error ? ST_ERROR : ST_OK, error ? error : "Stored successfully");
+            len += n < BATCH_REPLY_LINE ? n : BATCH_REPLY_LINE - 1;
+        }
+        free(files);
+        free(puts);
+        free(writers);
+        send_reply(client_sock, id, ST_OK, results);
+        printf("S2: Stored %d of %d coalesced uploads\n", stored, count);
+    } else if (hdr.opcode == OP_UPLOAD_PROBE) {
+        printf("S2: Received upload probe: %s\n", args);
+        char filename[256], dest_path[PATH_MAX], hex[2 * SHA256_LEN + 1], full_path[PATH_MAX];
+        unsigned char digest[SHA256_LEN];
+        unsigned long size;
+        if (sscanf(args, "%255s %4095s %lu %64s", filename, dest_path, &size, hex) != 4 || parse_digest(hex, digest) < 0) {
+            send_reply(client_sock, id, ST_ERROR, "Probe failed: Malformed request");
+            return 0;
+        }
+        int n = dest_path[strlen(dest_path) - 1] == '/' ? snprintf(full_path, PATH_MAX, "%s%s", dest_path, filename) :
+                                                          snprintf(full_path, PATH_MAX, "%s/%s", dest_path, filename);
+        if (n >= PATH_MAX) {
+            send_reply(client_sock, id, ST_ERROR, "Probe failed: Path too long");
+            return 0;
+        }
+
+        // The file may already be stored with this content, or with -s dedup another file
+        // may hold it, whose chunks the new file then shares. Its directories are created
+        // only once a clone is published, so a miss leaves the tree as it was.
+        int held = size > 0 && content_matches(full_path, size, digest);
+        if (!held && size > 0 && dedup.enabled && dedup_clone(full_path, size, digest) > 0) {
+            char *dir_path = strdup(full_path);
+            create_directories(dirname(dir_path));
+            free(dir_path);
+            held = 1;
+        }
+        if (held) {
+            send_reply(client_sock, id, ST_OK, "Stored successfully (content already held, nothing sent)");
+            printf("S2: %s already holds the probed content (%lu bytes)\n", full_path, size);
+        } else {
+            send_reply(client_sock, id, ST_ERROR, "Content not held");
+        }
+    } else {
+        send_reply(client_sock, id, ST_ERROR, "Unsupported command");
+    }
+    return 0;
+}
+
+// Worker thread: serve one request per ready connection, then hand it back to epoll
+void *worker_thread(void *arg) {
+    while (1) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_count == 0) pthread_cond_wait(&queue_not_empty, &queue_lock);
+        int client_sock = conn_queue[queue_head];
+        queue_head = (queue_head + 1) % QUEUE_SIZE;
+        queue_count--;
+        pthread_cond_signal(&queue_not_full);
+        pthread_mutex_unlock(&queue_lock);
+
+        // Keep the connection open for the next request unless it failed or was closed
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLONESHOT, .data.fd = client_sock};
+        if (handle_request(client_sock) < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_sock, &ev) < 0)
+            close(client_sock);
+    }
+    return NULL;
+}
+
+// Create directories recursively
+void create_directories(const char *path) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, PATH_MAX, "%s", path);
+    char *p;
+    for (p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(tmp, S_IRWXU);
+            *p = '/';
+        }
+    }
+    mkdir(tmp, S_IRWXU);
+}
+
+// Receive exact number of bytes
+int receive_full(int sock, char *buffer, size_t size) {
+    size_t received = 0;
+    while (received < size) {
+        ssize_t bytes = recv(sock, buffer + received, size - received, 0);
+        if (bytes <= 0) return -1;  // Error or connection closed
+        received += bytes;
+    }
+    return 0;  // Success
+}
+
+// Send an entire buffer, retrying short writes
+int send_all(int sock, const void *buffer, size_t size) {
+    const char *p = buffer;
+    while (size > 0) {
+        ssize_t bytes = send(sock, p, size, MSG_NOSIGNAL);
+        // Archives are also written to cache files
+        if (bytes < 0 && errno == ENOTSOCK) bytes = write(sock, p, size);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += bytes;
+        size -= bytes;
+    }
+    return 0;
+}
+
+// Send a frame header and, if given, its in-memory payload. With no payload the caller
+// streams the length bytes itself, so the header is corked until they follow.
+int send_frame(int sock, uint8_t opcode, uint16_t flags, uint16_t status, uint32_t request_id, const void *payload, uint64_t length) {
+    struct frame_hdr hdr = {htons(PROTO_MAGIC), PROTO_VERSION, opcode, htons(flags), htons(status), htonl(request_id), htobe64(length)};
+    if (payload && length > 0) {
+        char frame[sizeof(hdr) + BUFFER_SIZE];
+        if (length <= BUFFER_SIZE) {
+            // Small payloads go out in the same segment as their header
+            memcpy(frame, &hdr, sizeof(hdr));
+            memcpy(frame + sizeof(hdr), payload, length);
+            return send_all(sock, frame, sizeof(hdr) + length);
+        }
+        if (send(sock, &hdr, sizeof(hdr), MSG_NOSIGNAL | MSG_MORE) != sizeof(hdr)) return -1;
+        return send_all(sock, payload, length);
+    }
+    if (send(sock, &hdr, sizeof(hdr), MSG_NOSIGNAL | (length > 0 ? MSG_MORE : 0)) != sizeof(hdr)) return -1;
+    return 0;
+}
+
+// Send a REPLY frame carrying a status code and text message
+int send_reply(int sock, uint32_t request_id, uint16_t status, const char *msg) {
+    return send_frame(sock, OP_REPLY, 0, status, request_id, msg, strlen(msg));
+}
+
+// Send the OK reply that precedes file content, carrying the content size; FL_DEFLATE
+// in flags announces a deflated body
+int send_size_reply(int sock, uint32_t request_id, uint64_t size, uint16_t flags) {
+    uint64_t net_size = htobe64(size);
+    return send_frame(sock, OP_REPLY, flags, ST_OK, request_id, &net_size, sizeof(net_size));
+}
+
+// Send up to size bytes of fd from offset. sendfile() moves the file to the socket
+// inside the kernel; if it is not supported for fd, a read/send loop takes over.
+// Returns the bytes sent, short only if the file shrank, or -1 on a socket error.
+long long send_file_body(int sock, int fd, uint64_t offset, uint64_t size) {
+    off_t pos = offset;
+    uint64_t end = offset + size;
+    while ((uint64_t)pos < end) {
+        ssize_t sent = sendfile(sock, fd, &pos, end - pos);
+        if (sent > 0 || (sent < 0 && errno == EINTR)) continue;
+        if (sent == 0) return pos - offset;
+        if (errno == EINVAL || errno == ENOSYS) break;
+        return -1;
+    }
+    char buffer[BUFFER_SIZE];
+    while ((uint64_t)pos < end) {
+        size_t to_read = end - pos < BUFFER_SIZE ? end - pos : BUFFER_SIZE;
+        ssize_t bytes = pread(fd, buffer, to_read, pos);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return pos - offset;
+        if (send_all(sock, buffer, bytes) < 0) return -1;
+        pos += bytes;
+    }
+    return pos - offset;
+}
+
+// Send size bytes of fd from offset as one DATA frame. Returns -1 if the frame could not
+// be completed and the connection is unusable.
+int send_file_frame(int sock, int fd, uint64_t offset, uint64_t size, uint32_t request_id) {
+    if (send_frame(sock, OP_DATA, 0, 0, request_id, NULL, size) < 0) return -1;
+    return send_file_body(sock, fd, offset, size) == (long long)size ? 0 : -1;
+}
+
+// Split the range options ("offset=<n>", "length=<n>", "if=<mtime>") off the end of a
+// downlf request, leaving the path in args. Returns the options, "" if there are none.
+char *split_range_options(char *args) {
+    char *opts = NULL, *space;
+    while ((space = strrchr(args, ' ')) != NULL &&
+           (strncmp(space + 1, "offset=", 7) == 0 || strncmp(space + 1, "length=", 7) == 0 ||
+            strncmp(space + 1, "if=", 3) == 0)) {
+        // Rejoin the options split off so far
+        if (opts) opts[-1] = ' ';
+        *space = '\0';
+        opts = space + 1;
+    }
+    return opts ? opts : args + strlen(args);
+}
+
+// Parse the range options of a downlf request. Unknown tokens are ignored.
+void parse_range_options(char *opts, struct byte_range *range) {
+    range->ranged = 0;
+    range->offset = range->length = 0;
+    range->has_version = 0;
+    range->if_version = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(opts, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+        if (strncmp(tok, "offset=", 7) == 0) range->offset = strtoull(tok + 7, NULL, 10);
+        else if (strncmp(tok, "length=", 7) == 0) range->length = strtoull(tok + 7, NULL, 10);
+        else if (strncmp(tok, "if=", 3) == 0) {
+            range->has_version = 1;
+            range->if_version = strtoull(tok + 3, NULL, 10);
+        }
+        else continue;
+        range->ranged = 1;
+    }
+}
+
+// Version of a file for validating resumed ranges: a mix of its inode, size and
+// nanosecond mtime, so a rewrite within the same second or a replacement by rename
+// still changes it
+uint64_t file_version(const struct stat *statbuf) {
+    uint64_t v = (uint64_t)statbuf->st_ino;
+    v = v * 0x9e3779b97f4a7c15ULL ^ (uint64_t)statbuf->st_size;
+    v = v * 0x9e3779b97f4a7c15ULL ^ ((uint64_t)statbuf->st_mtim.tv_sec * 1000000000ULL + (uint64_t)statbuf->st_mtim.tv_nsec);
+    return v * 0x9e3779b97f4a7c15ULL;
+}
+
+// Fit a requested range to the file. Returns -1 if it starts past the end of the file.
+int resolve_range(struct byte_range *range, const struct stat *statbuf) {
+    uint64_t size = statbuf->st_size;
+    if (range->has_version && range->if_version != file_version(statbuf)) {
+        // The file changed since the part the requester holds was sent
+        range->offset = 0;
+        range->length = 0;
+    }
+    if (range->offset > size) return -1;
+    if (range->length == 0 || range->length > size - range->offset) range->length = size - range->offset;
+    return 0;
+}
+
+// Send the OK reply to a ranged download, describing the range and the whole file so
+// the requester can resume it later; FL_DEFLATE in flags announces a deflated body
+int send_range_reply(int sock, uint32_t request_id, const struct byte_range *range, const struct stat *statbuf, uint16_t flags) {
+    uint64_t fields[5] = {htobe64(range->length), htobe64(range->offset),
+                          htobe64(statbuf->st_size), htobe64(statbuf->st_mtime), htobe64(file_version(statbuf))};
+    return send_frame(sock, OP_REPLY, flags, ST_OK, request_id, fields, RANGE_REPLY_SIZE);
+}
+
+// walk_files() callback removing the files of an upload whose parts list has not
+// changed since the cutoff in ctx
+static void upload_expire(const char *path, int dir_fd, const char *name, void *ctx) {
+    struct stat statbuf;
+    if (fstatat(dir_fd, name, &statbuf, 0) != 0 || statbuf.st_mtime >= *(time_t *)ctx) return;
+    char sibling[NAME_MAX + 1];
+    size_t id_len = strlen(name) - strlen(".parts");
+    snprintf(sibling, sizeof(sibling), "%.*s.data", (int)id_len, name);
+    unlinkat(dir_fd, sibling, 0);
+    snprintf(sibling, sizeof(sibling), "%.*s.dest", (int)id_len, name);
+    unlinkat(dir_fd, sibling, 0);
+    unlinkat(dir_fd, name, 0);
+    printf("S2: Expired unfinished upload %.*s\n", (int)id_len, name);
+}
+
+// Create the staging directory for multipart uploads and remove uploads abandoned
+// for UPLOAD_EXPIRY seconds. Returns -1 if uploads cannot be staged.
+int upload_prepare(void) {
+    char *home = getenv("HOME");
+    if (!home) return -1;
+    if (!upload_dir[0]) {
+        snprintf(upload_dir, PATH_MAX, "%s/.S2.uploads", home);
+        create_directories(upload_dir);
+    }
+    int dir_fd = open(upload_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return -1;
+    time_t cutoff = time(NULL) - UPLOAD_EXPIRY;
+    walk_files(dir_fd, "", ".parts", 0, upload_expire, &cutoff);
+    close(dir_fd);
+    return 0;
+}
+
+// Build the path of one of an upload's staging files. Returns -1 for a malformed id,
+// so no request can reach outside the staging directory, or for a path too long to build.
+int upload_path(const char *upload_id, const char *suffix, char *path) {
+    if (strlen(upload_id) != UPLOAD_ID_LEN || strspn(upload_id, "0123456789abcdef") != UPLOAD_ID_LEN) return -1;
+    int len = snprintf(path, PATH_MAX, "%s/%.*s%s", upload_dir, UPLOAD_ID_LEN, upload_id, suffix);
+    return len < 0 || len >= PATH_MAX ? -1 : 0;
+}
+
+// Start a multipart upload that will become dest, writing its id to upload_id
+int upload_start(const char *dest, char *upload_id) {
+    if (upload_prepare() < 0) return -1;
+    unsigned char raw[UPLOAD_ID_LEN / 2];
+    if (getrandom(raw, sizeof(raw), 0) != (ssize_t)sizeof(raw)) return -1;
+    for (size_t i = 0; i < sizeof(raw); i++) sprintf(upload_id + 2 * i, "%02x", raw[i]);
+
+    char path[PATH_MAX];
+    if (upload_path(upload_id, ".dest", path) < 0) return -1;
+    FILE *fp = fopen(path, "w");
+    if (!fp) return -1;
+    int ok = fprintf(fp, "%s\n", dest) > 0;
+    if (fclose(fp) != 0 || !ok) return -1;
+    const char *suffixes[] = {".data", ".parts"};
+    for (int i = 0; i < 2; i++) {
+        if (upload_path(upload_id, suffixes[i], path) < 0) return -1;
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) return -1;
+        close(fd);
+    }
+    return 0;
+}
+
+// Open an upload's data file to write a part at offset, or NULL for an unknown upload
+FILE *upload_open_part(const char *upload_id, uint64_t offset) {
+    char path[PATH_MAX];
+    if (upload_path(upload_id, ".data", path) < 0) return NULL;
+    FILE *fp = fopen(path, "r+b");
+    if (fp && fseeko(fp, offset, SEEK_SET) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+// Record a part once all of it is written; a part cut short is never listed, so it
+// has to be sent again
+int upload_record_part(const char *upload_id, uint64_t offset, uint64_t length) {
+    char path[PATH_MAX], line[64];
+    if (upload_path(upload_id, ".parts", path) < 0) return -1;
+    int fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0) return -1;
+    // One short append per part, so parts recorded concurrently never interleave
+    int len = snprintf(line, sizeof(line), "%lu %lu\n", offset, length);
+    int rc = write(fd, line, len) == len ? 0 : -1;
+    close(fd);
+    return rc;
+}
+
+static int compare_upload_parts(const void *a, const void *b) {
+    const uint64_t *pa = a, *pb = b;
+    return pa[0] < pb[0] ? -1 : pa[0] > pb[0];
+}
+
+// Complete an upload of size bytes: check its parts cover the file exactly, then move
+// the assembled data file into place, writing its path to dest. Returns NULL on
+// success, or the message to reply with.
+const char *upload_finish(const char *upload_id, uint64_t size, char *dest) {
+    char data[PATH_MAX], parts[PATH_MAX], dest_file[PATH_MAX];
+    if (upload_path(upload_id, ".dest", dest_file) < 0 || upload_path(upload_id, ".data", data) < 0 ||
+        upload_path(upload_id, ".parts", parts) < 0) return "Upload failed: Unknown upload";
+    FILE *fp = fopen(dest_file, "r");
+    if (!fp) return "Upload failed: Unknown upload";
+    int have_dest = fgets(dest, PATH_MAX, fp) != NULL;
+    fclose(fp);
+    if (!have_dest) return "Upload failed: Unknown upload";
+    dest[strcspn(dest, "\n")] = '\0';
+    if (size == 0) return "Upload failed: No data received";
+
+    // Load the recorded parts as offset/length pairs, sorted by offset
+    fp = fopen(parts, "r");
+    if (!fp) return "Upload failed: Unknown upload";
+    uint64_t *ranges = NULL, offset, length;
+    size_t count = 0, capacity = 0;
+    while (fscanf(fp, "%lu %lu", &offset, &length) == 2) {
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            uint64_t *grown = realloc(ranges, capacity * 2 * sizeof(uint64_t));
+            if (!grown) break;
+            ranges = grown;
+        }
+        ranges[2 * count] = offset;
+        ranges[2 * count + 1] = length;
+        count++;
+    }
+    fclose(fp);
+    if (count > 0) qsort(ranges, count, 2 * sizeof(uint64_t), compare_upload_parts);
+    // Parts may overlap when one was sent again, but must leave no gap
+    uint64_t covered = 0;
+    for (size_t i = 0; i < count && ranges[2 * i] <= covered; i++)
+        if (ranges[2 * i] + ranges[2 * i + 1] > covered) covered = ranges[2 * i] + ranges[2 * i + 1];
+    free(ranges);
+    if (covered < size) return "Upload failed: Missing parts";
+    if (covered > size) return "Upload failed: Parts beyond the end of the file";
+
+    char *dir_path = strdup(dest);
+    create_directories(dirname(dir_path));
+    free(dir_path);
+    struct staged_file file;
+    if (stage_file(&file, dest, data) < 0) return "Upload failed: Cannot move file into place";
+    if (ftruncate(fileno(file.fp), size) != 0) {
+        discard_file(&file);
+        return "Upload failed: Cannot move file into place";
+    }
+    staged_file_received(&file);
+    if (publish_files(&file, 1) == 0) return "Upload failed: Cannot move file into place";
+    unlink(parts);
+    unlink(dest_file);
+    return NULL;
+}
+
+// Abort an upload, removing everything staged for it. Returns -1 for an unknown upload.
+int upload_abort(const char *upload_id) {
+    char path[PATH_MAX];
+    if (upload_path(upload_id, ".dest", path) < 0 || unlink(path) != 0) return -1;
+    if (upload_path(upload_id, ".data", path) == 0) unlink(path);
+    if (upload_path(upload_id, ".parts", path) == 0) unlink(path);
+    return 0;
+}
+
+// Stage an upload that will replace path. A new temporary file is opened next to path,
+// or with existing given, the file already holding the content is staged instead.
+// Returns -1, with the file marked failed, if it cannot be opened.
+int stage_file(struct staged_file *file, const char *path, const char *existing) {
+    memset(file, 0, sizeof(*file));
+    snprintf(file->path, PATH_MAX, "%s", path);
+    if (existing) {
+        snprintf(file->temp_path, PATH_MAX, "%s", existing);
+        file->fp = fopen(existing, "r+b");
+    } else {
+        // A hidden name with a random suffix, so listings never match it
+        char *copy = strdup(path);
+        const char *name = copy ? basename(copy) : "";
+        for (int tries = 0; copy && tries < 8; tries++) {
+            uint32_t suffix = 0;
+            if (getrandom(&suffix, sizeof(suffix), 0) != sizeof(suffix)) suffix ^= (uint32_t)time(NULL) + tries;
+            int len = snprintf(file->temp_path, PATH_MAX, "%.*s.%s.%08x", (int)(name - copy), path, name, suffix);
+            if (len >= PATH_MAX) {
+                errno = ENAMETOOLONG;
+                break;
+            }
+            int fd = open(file->temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (fd < 0 && errno == EEXIST) continue;
+            if (fd >= 0 && !(file->fp = fdopen(fd, "wb"))) {
+                close(fd);
+                unlink(file->temp_path);
+            }
+            break;
+        }
+        free(copy);
+    }
+    if (!file->fp) {
+        file->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Whether name is that of a file stage_file() opened: ".<name>.<8 hex digits>". No
+// upload is stored under such a name, as it does not end in an accepted extension.
+int staged_name(const char *name) {
+    size_t len = strlen(name);
+    return len >= 11 && name[0] == '.' && name[len - 9] == '.' && strspn(name + len - 8, "0123456789abcdef") == 8;
+}
+
+// walk_files() callback removing a staged file an interrupted upload left behind,
+// counting it in ctx
+void sweep_staged(const char *path, int dir_fd, const char *name, void *ctx) {
+    if (staged_name(name) && unlinkat(dir_fd, name, 0) == 0) (*(size_t *)ctx)++;
+}
+
+// Remove the staged files of uploads a crash interrupted from the tree below root, when
+// there is no catalog to find them in. Called at startup, before any upload is staged.
+// Returns how many were removed.
+size_t sweep_staged_tree(const char *root) {
+    size_t swept = 0;
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    walk_files(fd, "", "", 0, sweep_staged, &swept);
+    close(fd);
+    return swept;
+}
+
+// Note that a staged file holds its whole content and is about to be published, so a
+// commit group being gathered waits for it. Uploads still arriving are not waited for.
+void staged_file_received(struct staged_file *file) {
+    if (commit_window_ms < 0 || !file->fp || file->received) return;
+    file->received = 1;
+    pthread_mutex_lock(&commit.lock);
+    commit.received++;
+    pthread_mutex_unlock(&commit.lock);
+}
+
+// Give up on a staged file, removing it
+void discard_file(struct staged_file *file) {
+    if (!file->fp) return;
+    fclose(file->fp);
+    file->fp = NULL;
+    unlink(file->temp_path);
+    file->failed = 1;
+    if (!file->received) return;
+    file->received = 0;
+    pthread_mutex_lock(&commit.lock);
+    commit.received--;
+    pthread_cond_broadcast(&commit.cond);
+    pthread_mutex_unlock(&commit.lock);
+}
+
+// Publish staged files: flush their content with one group commit, rename each over
+// its path, then flush the renames with another. Files already failed are skipped, and
+// any that fail now are removed and marked. Returns the number published.
+int publish_files(struct staged_file *files, int count) {
+    int *fds = malloc(2 * count * sizeof(int)), n = 0, received = 0, published = 0;
+    for (int i = 0; i < count; i++) {
+        if (!files[i].fp) continue;
+        if (!fds || fflush(files[i].fp) != 0 || ferror(files[i].fp)) {
+            discard_file(&files[i]);
+            continue;
+        }
+        fds[n++] = fileno(files[i].fp);
+        received += files[i].received;
+        files[i].received = 0;
+    }
+    int synced = fds ? durable_sync(fds, n, received) : -1;
+    if (!fds && received > 0) {
+        pthread_mutex_lock(&commit.lock);
+        commit.received -= received;
+        pthread_cond_broadcast(&commit.cond);
+        pthread_mutex_unlock(&commit.lock);
+    }
+
+    // Only content known to be on disk replaces the old file
+    int dirs = 0;
+    for (int i = 0; i < count; i++) {
+        if (!files[i].fp) continue;
+        int ok = fclose(files[i].fp) == 0 && synced == 0 && rename(files[i].temp_path, files[i].path) == 0;
+        files[i].fp = NULL;
+        if (!ok) {
+            unlink(files[i].temp_path);
+            files[i].failed = 1;
+            continue;
+        }
+        published++;
+        if (commit_window_ms < 0) continue;
+        // The renames are durable once each destination directory is flushed
+        char *copy = strdup(files[i].path);
+        int dir_fd = copy ? open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+        free(copy);
+        if (dir_fd >= 0) fds[n + dirs++] = dir_fd;
+    }
+    if (dirs > 0 && durable_sync(fds + n, dirs, 0) < 0) printf("S2: Cannot flush published uploads: %s\n", strerror(errno));
+    for (int i = 0; i < dirs; i++) close(fds[n + i]);
+    free(fds);
+    return published;
+}
+
+// Bring the files behind fds to disk as part of a commit group. received is how many of
+// them staged_file_received() counted; they stop being waited for once queued. Returns
+// -1 if the flush failed, which fails every file of the group.
+int durable_sync(const int *fds, int count, int received) {
+    if (commit_window_ms < 0 || count == 0) return 0;
+    struct sync_request request = {fds, count, 0, 0, NULL};
+    pthread_mutex_lock(&commit.lock);
+    request.next = commit.queue;
+    commit.queue = &request;
+    commit.received -= received;
+    pthread_cond_broadcast(&commit.cond);
+    while (!request.done) {
+        if (commit.flushing) {
+            pthread_cond_wait(&commit.cond, &commit.lock);
+            continue;
+        }
+        // Lead the next group: wait for received uploads to join, up to the window
+        commit.flushing = 1;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += commit_window_ms / 1000;
+        deadline.tv_nsec += (commit_window_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (commit.received > 0)
+            if (pthread_cond_timedwait(&commit.cond, &commit.lock, &deadline) == ETIMEDOUT) break;
+        struct sync_request *group = commit.queue;
+        commit.queue = NULL;
+        pthread_mutex_unlock(&commit.lock);
+        int result = flush_group(group);
+        pthread_mutex_lock(&commit.lock);
+        for (struct sync_request *r = group; r; r = r->next) {
+            r->result = result;
+            r->done = 1;
+        }
+        commit.flushing = 0;
+        pthread_cond_broadcast(&commit.cond);
+    }
+    pthread_mutex_unlock(&commit.lock);
+    return request.result;
+}
+
+// Flush a commit group: fdatasync() for each file and fsync() for each directory,
+// flushing a file or directory named by several requests only once
+int flush_group(struct sync_request *group) {
+    struct {
+        dev_t dev;
+        ino_t ino;
+    } synced[64];
+    int nsynced = 0, result = 0;
+    for (struct sync_request *r = group; r; r = r->next) {
+        for (int i = 0; i < r->count; i++) {
+            struct stat statbuf;
+            if (fstat(r->fds[i], &statbuf) != 0) {
+                result = -1;
+                continue;
+            }
+            int seen = 0;
+            for (int j = 0; j < nsynced && !seen; j++) seen = synced[j].dev == statbuf.st_dev && synced[j].ino == statbuf.st_ino;
+            if (seen) continue;
+            if (nsynced < 64) {
+                synced[nsynced].dev = statbuf.st_dev;
+                synced[nsynced++].ino = statbuf.st_ino;
+            }
+            if ((S_ISDIR(statbuf.st_mode) ? fsync(r->fds[i]) : fdatasync(r->fds[i])) != 0) result = -1;
+        }
+    }
+    return result;
+}
+
+// Write one file of a coalesced batch from memory, as uploadf writes one from the socket.
+// Returns NULL once it is staged in file, or with the segment store on, prepared in put
+// (whose data the caller frees), or with -s dedup, cut into chunks by writer, to be stored
+// with the rest of the batch. Otherwise returns the message to reply with.
+const char *store_batch_file(const char *args, const char *body, uint64_t length, int deflated, struct staged_file *file, struct segment_put *put, struct dedup_writer *writer) {
+    char filename[256], dest_path[PATH_MAX], full_path[PATH_MAX];
+    file->failed = 1;
+    file->fp = NULL;
+    put->path = NULL;
+    put->data = NULL;
+    writer->path[0] = '\0';
+    if (sscanf(args, "%255s %4095s", filename, dest_path) != 2) return "Upload failed: Malformed request";
+    if (snprintf(full_path, PATH_MAX, "%s%s%s", dest_path, dest_path[strlen(dest_path) - 1] == '/' ? "" : "/", filename) >= PATH_MAX)
+        return "Upload failed: Path too long";
+    // The directory is made even for a file held in a segment or as chunks, so that it can be listed
+    char *dir_path = strdup(full_path);
+    create_directories(dirname(dir_path));
+    free(dir_path);
+
+    if (dedup.enabled) {
+        if (dedup_start(writer, full_path) < 0) return "Upload failed: Cannot write file";
+        long long written = deflated ? inflate_to_file(writer->fp, body, length) :
+                            fwrite(body, 1, length, writer->fp) == length ? (long long)length : -1;
+        if (written <= 0) {
+            dedup_discard(writer);
+            return written == 0 ? "Upload failed: No data received" : "Upload failed: Error writing file";
+        }
+        return NULL;
+    }
+
+    char *plain = NULL;
+    if (segments.enabled) {
+        size_t plain_len = length;
+        if (deflated) {
+            FILE *mem = open_memstream(&plain, &plain_len);
+            long long inflated = mem ? inflate_to_file(mem, body, length) : -1;
+            if (!mem || fclose(mem) != 0) inflated = -1;
+            if (inflated < 0) {
+                free(plain);
+                return "Upload failed: Error writing file";
+            }
+        } else if ((plain = malloc(length ? length : 1))) {
+            memcpy(plain, body, length);
+        }
+        if (plain && plain_len == 0) {
+            free(plain);
+            return "Upload failed: No data received";
+        }
+        // Small files are written to a segment with the rest of the batch
+        if (plain && plain_len <= SEGMENT_SMALL) {
+            snprintf(file->path, PATH_MAX, "%s", full_path);
+            put->path = file->path;
+            put->data = plain;
+            put->length = plain_len;
+            put->tombstone = 0;
+            return NULL;
+        }
+        // Larger once inflated: stored as a file of its own
+        if (plain) {
+            body = plain;
+            length = plain_len;
+            deflated = 0;
+        }
+    }
+    const char *error = NULL;
+    if (stage_file(file, full_path, NULL) < 0) {
+        error = "Upload failed: Cannot write file";
+    } else {
+        long long written = deflated ? inflate_to_file(file->fp, body, length) :
+                            fwrite(body, 1, length, file->fp) == length ? (long long)length : -1;
+        if (written <= 0) {
+            discard_file(file);
+            error = written == 0 ? "Upload failed: No data received" : "Upload failed: Error writing file";
+        } else {
+            staged_file_received(file);
+        }
+    }
+    free(plain);
+    return error;
+}
+
+// Inflate a raw deflate stream held in memory into fp. Returns the bytes written, or -1
+// if the stream is corrupt, ends early or cannot be written.
+long long inflate_to_file(FILE *fp, const char *data, uint64_t length) {
+    unsigned char plain[4 * BUFFER_SIZE];
+    z_stream strm = {0};
+    if (inflateInit2(&strm, -15) != Z_OK) return -1;
+    strm.next_in = (unsigned char *)data;
+    strm.avail_in = length;
+    long long total = 0;
+    int ret;
+    do {
+        strm.next_out = plain;
+        strm.avail_out = sizeof(plain);
+        ret = inflate(&strm, Z_NO_FLUSH);
+        size_t len = sizeof(plain) - strm.avail_out;
+        if ((ret != Z_OK && ret != Z_STREAM_END) || fwrite(plain, 1, len, fp) != len) {
+            total = -1;
+            break;
+        }
+        total += len;
+    } while (ret != Z_STREAM_END);
+    inflateEnd(&strm);
+    return total;
+}
+
+// Whether a file is worth compressing in transit; types stored compressed would
+// only cost CPU on both ends
+int compressible_type(const char *name) {
+    static const char *const stored_compressed[] = {".zip", ".pdf", ".gz", ".tgz", ".bz2", ".xz", ".7z", ".jpg", ".png", NULL};
+    const char *ext = strrchr(name, '.');
+    if (!ext) return 1;
+    for (int i = 0; stored_compressed[i]; i++)
+        if (strcmp(ext, stored_compressed[i]) == 0) return 0;
+    return 1;
+}
+
+// Send size bytes of fd from offset as a deflated body: one raw deflate stream, sent in
+// DATA frames as each TRANSFER_CHUNK of output fills, so neither side holds more than a
+// chunk of it. Returns the compressed bytes sent, or -1 if the file or the connection
+// failed mid-stream and the connection is unusable.
+long long send_deflated_body(int sock, int fd, uint64_t offset, uint64_t size, uint32_t request_id) {
+    unsigned char *in = malloc(TRANSFER_CHUNK), *out = malloc(TRANSFER_CHUNK);
+    z_stream strm = {0};
+    if (!in || !out || deflateInit2(&strm, TRANSFER_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(in);
+        free(out);
+        return -1;
+    }
+    long long sent = 0;
+    int flush = Z_NO_FLUSH;
+    strm.next_out = out;
+    strm.avail_out = TRANSFER_CHUNK;
+    uint64_t end = offset + size;
+    while (sent >= 0 && flush != Z_FINISH) {
+        size_t to_read = end - offset < TRANSFER_CHUNK ? end - offset : TRANSFER_CHUNK;
+        ssize_t bytes = to_read > 0 ? pread(fd, in, to_read, offset) : 0;
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes < 0) {
+            sent = -1;
+            break;
+        }
+        offset += bytes;
+        // A file that shrank ends the stream early; the receiver sees a short body
+        flush = bytes == 0 ? Z_FINISH : Z_NO_FLUSH;
+        strm.next_in = in;
+        strm.avail_in = bytes;
+        int ret;
+        do {
+            ret = deflate(&strm, flush);
+            // A full buffer goes out with more to follow; the stream's end goes out last
+            if (strm.avail_out == 0 || ret == Z_STREAM_END) {
+                size_t len = TRANSFER_CHUNK - strm.avail_out;
+                uint16_t flags = FL_DEFLATE | (ret == Z_STREAM_END ? 0 : FL_MORE);
+                if (send_frame(sock, OP_DATA, flags, 0, request_id, out, len) < 0) {
+                    sent = -1;
+                    break;
+                }
+                sent += len;
+                strm.next_out = out;
+                strm.avail_out = TRANSFER_CHUNK;
+            }
+        } while (strm.avail_in > 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+    }
+    deflateEnd(&strm);
+    free(in);
+    free(out);
+    return sent;
+}
+
+// Walk the tree below dir_fd with getdents64(), calling fn for every regular file whose
+// name ends in ext. Directory entry types come from the kernel, so only entries of
+// unknown type are stat'ed. Symlinks are not followed; with skip_hidden, hidden entries
+// at the top level are ignored. dir_fd stays open.
+void walk_files(int dir_fd, const char *rel, const char *ext, int skip_hidden, walk_fn fn, void *ctx) {
+    char *buf = malloc(WALK_BUFFER);
+    size_t ext_len = strlen(ext);
+    long n;
+    while (buf && (n = syscall(SYS_getdents64, dir_fd, buf, WALK_BUFFER)) > 0) {
+        for (long pos = 0; pos < n; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + pos);
+            pos += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            if (skip_hidden && rel[0] == '\0' && name[0] == '.') continue;
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat statbuf;
+                if (fstatat(dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                type = S_ISDIR(statbuf.st_mode) ? DT_DIR : S_ISREG(statbuf.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type == DT_REG) {
+                size_t name_len = strlen(name);
+                if (name_len < ext_len || memcmp(name + name_len - ext_len, ext, ext_len) != 0) continue;
+            } else if (type != DT_DIR) {
+                continue;
+            }
+            char path[PATH_MAX];
+            if (snprintf(path, PATH_MAX, "%s%s%s", rel, rel[0] ? "/" : "", name) >= PATH_MAX) continue;
+            if (type == DT_REG) {
+                fn(path, dir_fd, name, ctx);
+                continue;
+            }
+            int sub_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (sub_fd < 0) continue;
+            walk_files(sub_fd, path, ext, skip_hidden, fn, ctx);
+            close(sub_fd);
+        }
+    }
+    free(buf);
+}
+
+// Restore the max-heap order of a listing page after slot i grew or shrank
+static void page_sift_down(struct listing_page *page, int i) {
+    while (1) {
+        int largest = i, left = 2 * i + 1, right = left + 1;
+        if (left < page->count && strcmp(page->entries[left].path, page->entries[largest].path) > 0) largest = left;
+        if (right < page->count && strcmp(page->entries[right].path, page->entries[largest].path) > 0) largest = right;
+        if (largest == i) return;
+        struct page_entry tmp = page->entries[i];
+        page->entries[i] = page->entries[largest];
+        page->entries[largest] = tmp;
+        i = largest;
+    }
+}
+
+// walk_files() callback: keep the limit + 1 smallest paths after the cursor. The
+// heap's root is the largest path kept, so a later file either replaces it or is dropped.
+static void page_add_file(const char *path, int dir_fd, const char *name, void *ctx) {
+    struct listing_page *page = ctx;
+    if (page->after[0] && strcmp(path, page->after) <= 0) return;
+    int full = page->count == page->limit + 1;
+    if (full && strcmp(path, page->entries[0].path) >= 0) return;
+    struct page_entry entry = {NULL, 0, 0};
+    if (page->want_long) {
+        struct stat statbuf;
+        if (fstatat(dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) return;
+        entry.size = statbuf.st_size;
+        entry.mtime = statbuf.st_mtime;
+    }
+    entry.path = strdup(path);
+    if (full) {
+        free(page->entries[0].path);
+        page->entries[0] = entry;
+        page_sift_down(page, 0);
+        return;
+    }
+    // Sift the new entry up from the bottom
+    int i = page->count++;
+    while (i > 0 && strcmp(page->entries[(i - 1) / 2].path, entry.path) < 0) {
+        page->entries[i] = page->entries[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    page->entries[i] = entry;
+}
+
+static int compare_page_entries(const void *a, const void *b) {
+    return strcmp(((const struct page_entry *)a)->path, ((const struct page_entry *)b)->path);
+}
+
+// Collect one page of a listing: the first limit files of type ext under dir whose
+// relative paths sort bytewise after the cursor. Memory stays bounded by the page size
+// however large the tree is; page->more tells whether files remain beyond it.
+void collect_listing_page(const char *dir, const char *ext, const char *after, int limit, int want_long, struct listing_page *page) {
+    // The catalog answers without walking the tree when it covers dir
+    if (catalog_list_page(dir, ext, after, limit, want_long, page) != 0) {
+        memset(page, 0, sizeof(*page));
+        page->after = after;
+        page->limit = limit;
+        page->want_long = want_long;
+        page->entries = malloc((limit + 1) * sizeof(*page->entries));
+        int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd >= 0) {
+            walk_files(dir_fd, "", ext, 0, page_add_file, page);
+            close(dir_fd);
+        }
+        if (page->count == limit + 1) {
+            // The largest kept path only shows that the listing continues
+            free(page->entries[0].path);
+            page->entries[0] = page->entries[--page->count];
+            page->more = 1;
+        }
+        qsort(page->entries, page->count, sizeof(*page->entries), compare_page_entries);
+    }
+    // Small files held in segments and files held as chunks are listed with the rest
+    segment_list_page(dir, ext, page);
+    dedup_list_page(dir, ext, page);
+}
+
+void free_listing_page(struct listing_page *page) {
+    for (int i = 0; i < page->count; i++) free(page->entries[i].path);
+    free(page->entries);
+    memset(page, 0, sizeof(*page));
+}
+
+static int compare_segment_entries(const void *a, const void *b) {
+    const struct segment_entry *ea = a, *eb = b;
+    int cmp = strcmp(ea->path, eb->path);
+    if (cmp) return cmp;
+    // Records of one path in the order they were written
+    if (ea->segment != eb->segment) return ea->segment < eb->segment ? -1 : 1;
+    return ea->offset < eb->offset ? -1 : ea->offset > eb->offset;
+}
+
+// Load the segments in dir, rebuilding the index from their records, and start the
+// compactor. A torn record at the end of a segment, left by a crash, is cut off.
+int segment_init(const char *dir) {
+    if (strlen(dir) > SEGMENT_DIR_MAX) return -1;
+    snprintf(segments.dir, PATH_MAX, "%s", dir);
+    create_directories(dir);
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    uint32_t *numbers = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        unsigned number;
+        char suffix[8];
+        if (sscanf(de->d_name, "%u.%7s", &number, suffix) != 2 || strcmp(suffix, "seg") != 0 || number == 0) continue;
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            numbers = realloc(numbers, capacity * sizeof(*numbers));
+        }
+        numbers[count++] = number;
+    }
+    closedir(d);
+
+    // Replay in segment order, collecting every record, then keep the last per path
+    char *path = malloc(PATH_MAX), *content = malloc(SEGMENT_SMALL);
+    for (size_t i = 0; i < count; i++)
+        for (size_t j = i + 1; j < count; j++)
+            if (numbers[j] < numbers[i]) {
+                uint32_t tmp = numbers[i];
+                numbers[i] = numbers[j];
+                numbers[j] = tmp;
+            }
+    for (size_t i = 0; path && content && i < count; i++) {
+        if (segment_open(numbers[i]) < 0) continue;
+        struct segment_file *f = &segments.files[numbers[i]];
+        struct segment_record hdr;
+        uint64_t pos = 0, len;
+        while ((len = segment_read(f->fd, pos, f->size, &hdr, path, content)) > 0) {
+            if (segments.count == segments.capacity) {
+                segments.capacity = segments.capacity ? 2 * segments.capacity : 1024;
+                segments.entries = realloc(segments.entries, segments.capacity * sizeof(*segments.entries));
+            }
+            struct segment_entry *e = &segments.entries[segments.count++];
+            e->path = strdup(path);
+            e->segment = numbers[i];
+            e->offset = pos + sizeof(hdr) + hdr.path_len;
+            e->length = hdr.length;
+            e->mtime = hdr.mtime;
+            e->removed = (hdr.flags & SEGMENT_TOMBSTONE) != 0;
+            pos += len;
+        }
+        if (pos < f->size) {
+            printf("S2: Segment %u has a torn record at %lu, cut off\n", numbers[i], pos);
+            if (ftruncate(f->fd, pos) == 0) f->size = pos;
+        }
+    }
+    free(path);
+    free(content);
+    qsort(segments.entries, segments.count, sizeof(*segments.entries), compare_segment_entries);
+    size_t out = 0;
+    for (size_t i = 0; i < segments.count; i++) {
+        struct segment_entry *e = &segments.entries[i];
+        if ((i + 1 < segments.count && strcmp(e->path, segments.entries[i + 1].path) == 0) || e->removed) {
+            free(e->path);
+            continue;
+        }
+        const char *base = strrchr(e->path, '/');
+        base = base ? base + 1 : e->path;
+        e->ext = strrchr(base, '.') ? strrchr(base, '.') : base + strlen(base);
+        segments.files[e->segment].live += sizeof(struct segment_record) + strlen(e->path) + e->length;
+        segments.entries[out++] = *e;
+    }
+    segments.count = out;
+
+    // Append to the last segment unless it is full
+    uint32_t last = count > 0 ? numbers[count - 1] : 0;
+    free(numbers);
+    if (last > 0 && last < segments.file_count && segments.files[last].fd >= 0 && segments.files[last].size < SEGMENT_SIZE)
+        segments.active = last;
+    else if (segment_open(last + 1) == 0) segments.active = last + 1;
+    else return -1;
+    printf("S2: Segment store holds %zu files in %zu segments\n", segments.count, count);
+
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, segment_compactor, NULL) == 0) pthread_detach(tid);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return 0;
+}
+
+// Open segment number, creating it if needed, and enter it in the segment table.
+// Callers other than segment_init() hold append_lock.
+int segment_open(uint32_t number) {
+    char path[PATH_MAX];
+    struct stat statbuf;
+    snprintf(path, PATH_MAX, "%.*s/%08u.seg", SEGMENT_DIR_MAX, segments.dir, number);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || fstat(fd, &statbuf) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&segments.lock);
+    if (number >= segments.file_count) {
+        uint32_t grown = number + 64;
+        struct segment_file *files = realloc(segments.files, grown * sizeof(*files));
+        if (!files) {
+            pthread_rwlock_unlock(&segments.lock);
+            close(fd);
+            return -1;
+        }
+        for (uint32_t i = segments.file_count; i < grown; i++) files[i] = (struct segment_file){-1, 0, 0};
+        segments.files = files;
+        segments.file_count = grown;
+    }
+    segments.files[number] = (struct segment_file){fd, statbuf.st_size, 0};
+    pthread_rwlock_unlock(&segments.lock);
+    return 0;
+}
+
+// Read the record at pos of a segment ending at end into hdr, path (NUL-terminated) and
+// content. Returns the size of the record, or 0 if no complete, intact record is there.
+uint64_t segment_read(int fd, uint64_t pos, uint64_t end, struct segment_record *hdr, char *path, char *content) {
+    if (end - pos < sizeof(*hdr) || pread(fd, hdr, sizeof(*hdr), pos) != sizeof(*hdr)) return 0;
+    if (hdr->magic != SEGMENT_MAGIC || hdr->path_len == 0 || hdr->path_len >= PATH_MAX || hdr->length > SEGMENT_SMALL) return 0;
+    uint64_t size = sizeof(*hdr) + hdr->path_len + hdr->length;
+    if (end - pos < size) return 0;
+    if (pread(fd, path, hdr->path_len, pos + sizeof(*hdr)) != hdr->path_len) return 0;
+    path[hdr->path_len] = '\0';
+    if (hdr->length > 0 && pread(fd, content, hdr->length, pos + sizeof(*hdr) + hdr->path_len) != (ssize_t)hdr->length) return 0;
+    uint32_t crc = crc32(crc32(0, (const Bytef *)path, hdr->path_len), (const Bytef *)content, hdr->length);
+    return crc == hdr->crc ? size : 0;
+}
+
+// Append one record to the active segment, sealing it and starting the next once it is
+// full. Caller holds append_lock. Returns -1 if the record could not be written.
+int segment_append(const struct segment_record *hdr, const char *path, const char *data, uint32_t *number, uint64_t *offset) {
+    if (segments.files[segments.active].size >= SEGMENT_SIZE && segment_open(segments.active + 1) == 0) segments.active++;
+    struct segment_file *f = &segments.files[segments.active];
+    struct iovec iov[3] = {{(void *)hdr, sizeof(*hdr)}, {(void *)path, hdr->path_len}, {(void *)data, hdr->length}};
+    size_t size = sizeof(*hdr) + hdr->path_len + hdr->length;
+    // A failed write leaves the size alone, so the next record overwrites it
+    if (pwritev(f->fd, iov, hdr->length > 0 ? 3 : 2, f->size) != (ssize_t)size) return -1;
+    *number = segments.active;
+    *offset = f->size + sizeof(*hdr) + hdr->path_len;
+    f->size += size;
+    return 0;
+}
+
+// Store files in segments, or remove them with tombstones: the records are appended,
+// brought to disk with one group commit, and only then entered in the index. A file
+// stored in a segment replaces any copy of it kept as a file. Puts without a path are
+// skipped. Returns the number stored; each put that failed or was skipped is marked.
+int segment_write(struct segment_put *puts, int count) {
+    int *fds = malloc(count * sizeof(int)), nfds = 0, appended = 0, stored = 0;
+    uint32_t *synced = malloc(count * sizeof(uint32_t));
+    pthread_mutex_lock(&segments.append_lock);
+    for (int i = 0; i < count; i++) {
+        struct segment_put *put = &puts[i];
+        put->failed = 1;
+        if (!put->path || !fds || !synced || !segments.files || catalog_relpath(put->path, put->rel) < 0 || !put->rel[0] ||
+            put->length > SEGMENT_SMALL) continue;
+        put->mtime = time(NULL);
+        struct segment_record hdr = {SEGMENT_MAGIC, put->tombstone ? SEGMENT_TOMBSTONE : 0, strlen(put->rel), 0,
+                                     put->tombstone ? 0 : put->length, put->mtime};
+        // zlib treats a NULL buffer as a request for the initial value
+        hdr.crc = crc32(crc32(0, (const Bytef *)put->rel, hdr.path_len), (const Bytef *)(put->data ? put->data : ""), hdr.length);
+        if (segment_append(&hdr, put->rel, put->data, &put->segment, &put->offset) < 0) continue;
+        put->failed = 0;
+        appended++;
+        __atomic_add_fetch(&segments.pending, 1, __ATOMIC_ACQ_REL);
+        int seen = 0;
+        for (int j = 0; j < nfds && !seen; j++) seen = synced[j] == put->segment;
+        if (!seen && (fds[nfds] = dup(segments.files[put->segment].fd)) >= 0) synced[nfds++] = put->segment;
+    }
+    pthread_mutex_unlock(&segments.append_lock);
+    if (!appended) {
+        free(fds);
+        free(synced);
+        return 0;
+    }
+    int rc = durable_sync(fds, nfds, 0);
+    for (int i = 0; i < nfds; i++) close(fds[i]);
+    free(fds);
+    free(synced);
+
+    // Records that failed to reach the disk are still indexed, as a restart would find
+    // them, but reported as failed
+    pthread_rwlock_wrlock(&segments.lock);
+    for (int i = 0; i < count; i++) {
+        if (puts[i].failed) continue;
+        segment_index(&puts[i]);
+        __atomic_sub_fetch(&segments.pending, 1, __ATOMIC_ACQ_REL);
+        if (rc < 0) puts[i].failed = 1;
+        else stored++;
+    }
+    pthread_rwlock_unlock(&segments.lock);
+    for (int i = 0; i < count; i++) {
+        if (puts[i].failed || puts[i].tombstone) continue;
+        if (unlink(puts[i].path) == 0) catalog_note(puts[i].path);
+        dedup_remove(puts[i].path);
+    }
+    // Cached archives hold the old contents
+    pthread_rwlock_wrlock(&catalog.lock);
+    catalog.generation++;
+    pthread_rwlock_unlock(&catalog.lock);
+    return stored;
+}
+
+// Whether the body of the uploadf being handled is one DATA frame small enough for a segment
+int small_body_pending(int client_sock) {
+    struct frame_hdr data;
+    if (recv(client_sock, &data, sizeof(data), MSG_PEEK | MSG_WAITALL) != sizeof(data)) return 0;
+    return data.opcode == OP_DATA && !(ntohs(data.flags) & FL_MORE) && be64toh(data.length) <= SEGMENT_SMALL;
+}
+
+// Move a small upload received into a staged file into a segment, removing the staged
+// file. Returns -1 if it could not be stored.
+int segment_store_staged(struct staged_file *file, uint64_t length) {
+    char *data = malloc(length ? length : 1);
+    int ok = data && fflush(file->fp) == 0 && pread(fileno(file->fp), data, length, 0) == (ssize_t)length;
+    discard_file(file);
+    struct segment_put put = {.path = file->path, .data = data, .length = length};
+    ok = ok && segment_write(&put, 1) == 1;
+    free(data);
+    return ok ? 0 : -1;
+}
+
+// Enter a written record in the index, unless a later record of the path is already
+// there. Caller holds the write lock.
+void segment_index(const struct segment_put *put) {
+    int found;
+    size_t i = segment_find(put->rel, &found);
+    struct segment_entry *e = &segments.entries[i];
+    if (found && (e->segment > put->segment || (e->segment == put->segment && e->offset > put->offset))) return;
+    uint64_t overhead = sizeof(struct segment_record) + strlen(put->rel);
+    if (found) segments.files[e->segment].live -= overhead + e->length;
+    if (put->tombstone) {
+        if (!found) return;
+        free(e->path);
+        memmove(e, e + 1, (segments.count - i - 1) * sizeof(*e));
+        segments.count--;
+        return;
+    }
+    segments.files[put->segment].live += overhead + put->length;
+    if (!found) {
+        if (segments.count == segments.capacity) {
+            segments.capacity = segments.capacity ? 2 * segments.capacity : 1024;
+            segments.entries = realloc(segments.entries, segments.capacity * sizeof(*segments.entries));
+        }
+        e = &segments.entries[i];
+        memmove(e + 1, e, (segments.count - i) * sizeof(*e));
+        segments.count++;
+        e->path = strdup(put->rel);
+        const char *base = strrchr(e->path, '/');
+        base = base ? base + 1 : e->path;
+        e->ext = strrchr(base, '.') ? strrchr(base, '.') : base + strlen(base);
+        e->removed = 0;
+    }
+    e->segment = put->segment;
+    e->offset = put->offset;
+    e->length = put->length;
+    e->mtime = put->mtime;
+}
+
+// Index of the first entry whose path is not less than path; found tells whether it matches
+size_t segment_find(const char *path, int *found) {
+    size_t lo = 0, hi = segments.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(segments.entries[mid].path, path) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    *found = lo < segments.count && strcmp(segments.entries[lo].path, path) == 0;
+    return lo;
+}
+
+// Find a file held in a segment. Returns a descriptor of the segment for the caller to
+// close, with the file's content at *base and its size and mtime in statbuf, or -1 if
+// the file is not in a segment.
+int segment_lookup(const char *path, struct stat *statbuf, uint64_t *base) {
+    char rel[PATH_MAX];
+    int found, fd = -1;
+    if (catalog_relpath(path, rel) < 0) return -1;
+    pthread_rwlock_rdlock(&segments.lock);
+    size_t i = segment_find(rel, &found);
+    if (found) {
+        const struct segment_entry *e = &segments.entries[i];
+        // A duplicate keeps the segment readable should compaction delete it meanwhile
+        fd = dup(segments.files[e->segment].fd);
+        memset(statbuf, 0, sizeof(*statbuf));
+        statbuf->st_mode = S_IFREG | 0644;
+        statbuf->st_size = e->length;
+        statbuf->st_mtime = e->mtime;
+        // Each write of a file lands at a new place in the segments
+        statbuf->st_ino = ((uint64_t)e->segment << 40 | e->offset) + 1;
+        *base = e->offset;
+    }
+    pthread_rwlock_unlock(&segments.lock);
+    return fd;
+}
+
+// Remove a file held in a segment. Returns -1 if there is no such file.
+int segment_remove(const char *path) {
+    char rel[PATH_MAX];
+    int found = 0;
+    if (catalog_relpath(path, rel) < 0) return -1;
+    pthread_rwlock_rdlock(&segments.lock);
+    if (segments.count > 0) segment_find(rel, &found);
+    pthread_rwlock_unlock(&segments.lock);
+    if (!found) return -1;
+    struct segment_put put = {.path = path, .tombstone = 1};
+    return segment_write(&put, 1) == 1 ? 0 : -1;
+}
+
+// Add the type ext files under dir held in segments to a listing page, keeping the first
+// limit paths after its cursor
+void segment_list_page(const char *dir, const char *ext, struct listing_page *page) {
+    char rel[PATH_MAX], key[2 * PATH_MAX];
+    if (catalog_relpath(dir, rel) < 0 || !page->entries) return;
+    size_t prefix_len = snprintf(key, sizeof(key), "%s%s", rel, rel[0] ? "/" : "");
+    snprintf(key + prefix_len, sizeof(key) - prefix_len, "%s", page->after);
+    int found, added = 0;
+    pthread_rwlock_rdlock(&segments.lock);
+    size_t i = segment_find(key, &found);
+    if (found && page->after[0]) i++;
+    for (; i < segments.count && strncmp(segments.entries[i].path, key, prefix_len) == 0; i++) {
+        const struct segment_entry *e = &segments.entries[i];
+        if (strcmp(e->ext, ext) != 0) continue;
+        // Only the first limit can reach the page
+        if (added == page->limit) {
+            page->more = 1;
+            break;
+        }
+        struct page_entry *grown = realloc(page->entries, (page->count + 1) * sizeof(*grown));
+        if (!grown) break;
+        page->entries = grown;
+        page->entries[page->count++] = (struct page_entry){strdup(e->path + prefix_len), e->length, e->mtime};
+        added++;
+    }
+    pthread_rwlock_unlock(&segments.lock);
+    if (!added) return;
+    qsort(page->entries, page->count, sizeof(*page->entries), compare_page_entries);
+    while (page->count > page->limit) {
+        free(page->entries[--page->count].path);
+        page->more = 1;
+    }
+}
+
+// Compactor thread: rewrite sealed segments whose live records fill less than half of them
+void *segment_compactor(void *arg) {
+    (void)arg;
+    while (keep_running) {
+        sleep(SEGMENT_COMPACT_INTERVAL);
+        pthread_mutex_lock(&segments.append_lock);
+        uint32_t active = segments.active;
+        pthread_mutex_unlock(&segments.append_lock);
+        for (uint32_t n = 1; n < active; n++) {
+            pthread_rwlock_rdlock(&segments.lock);
+            const struct segment_file *f = &segments.files[n];
+            int sparse = f->fd >= 0 && f->live * 2 < f->size;
+            pthread_rwlock_unlock(&segments.lock);
+            if (sparse && segment_compact(n) < 0) break;
+        }
+    }
+    return NULL;
+}
+
+// Take append_lock once every record appended so far is in the index, so the index
+// shows the latest record of each path. Returns -1, without the lock, if writers keep
+// records pending for SEGMENT_SETTLE_TRIES milliseconds.
+int segment_lock_settled(void) {
+    for (int tries = 0; tries < SEGMENT_SETTLE_TRIES; tries++) {
+        pthread_mutex_lock(&segments.append_lock);
+        if (__atomic_load_n(&segments.pending, __ATOMIC_ACQUIRE) == 0) return 0;
+        pthread_mutex_unlock(&segments.append_lock);
+        usleep(1000);
+    }
+    return -1;
+}
+
+// Copy the live records of a sealed segment to the active one, then delete it once the
+// copies are on disk. Tombstones are copied too while older segments remain, since they
+// still hide records there. The segment is read without append_lock, which is taken
+// only for each copy, so uploads are not held up behind the whole compaction.
+int segment_compact(uint32_t number) {
+    struct moved_record {
+        char *path;
+        uint64_t from;
+        uint32_t segment;
+        uint64_t offset;
+    } *moved = NULL;
+    size_t moved_count = 0, moved_capacity = 0;
+    int older = 0, ok = 1;
+    uint64_t pos = 0, len;
+    uint32_t first = UINT32_MAX, last = 0;
+    // Records of the segment not yet in the index would look dead
+    if (segment_lock_settled() < 0) return -1;
+    pthread_mutex_unlock(&segments.append_lock);
+    // The segment is sealed, so its size no longer changes
+    pthread_rwlock_rdlock(&segments.lock);
+    int fd = segments.files[number].fd;
+    uint64_t size = segments.files[number].size;
+    for (uint32_t n = 1; n < number && !older; n++) older = segments.files[n].fd >= 0;
+    pthread_rwlock_unlock(&segments.lock);
+    char *path = malloc(PATH_MAX), *content = malloc(SEGMENT_SMALL);
+    struct segment_record hdr;
+    while (path && content && (len = segment_read(fd, pos, size, &hdr, path, content)) > 0) {
+        uint64_t offset = pos + sizeof(hdr) + hdr.path_len;
+        pos += len;
+        int tombstone = (hdr.flags & SEGMENT_TOMBSTONE) != 0;
+        if (tombstone && !older) continue;
+        // Nothing new is written to a sealed segment, so a record that is dead now stays
+        // dead and needs no append_lock to be skipped
+        int keep = 1, found;
+        pthread_rwlock_rdlock(&segments.lock);
+        size_t i = segment_find(path, &found);
+        if (!tombstone) keep = found && segments.entries[i].segment == number && segments.entries[i].offset == offset;
+        pthread_rwlock_unlock(&segments.lock);
+        if (!keep) continue;
+
+        // A newer record of the path may still be on its way to the index; copied after
+        // it, this one would win when the segments are replayed
+        if (segment_lock_settled() < 0) {
+            ok = 0;
+            break;
+        }
+        pthread_rwlock_rdlock(&segments.lock);
+        i = segment_find(path, &found);
+        // A tombstone of a path stored again since would remove it on replay
+        keep = tombstone ? !found : found && segments.entries[i].segment == number && segments.entries[i].offset == offset;
+        pthread_rwlock_unlock(&segments.lock);
+        uint32_t to;
+        uint64_t to_offset;
+        if (keep && segment_append(&hdr, path, content, &to, &to_offset) < 0) ok = 0;
+        pthread_mutex_unlock(&segments.append_lock);
+        if (!ok) break;
+        if (!keep) continue;
+        if (to < first) first = to;
+        if (to > last) last = to;
+        if (tombstone) continue;
+        if (moved_count == moved_capacity) {
+            moved_capacity = moved_capacity ? 2 * moved_capacity : 256;
+            moved = realloc(moved, moved_capacity * sizeof(*moved));
+        }
+        moved[moved_count++] = (struct moved_record){strdup(path), offset, to, to_offset};
+    }
+    if (!path || !content) ok = 0;
+    free(path);
+    free(content);
+    // The copies must be on disk before the originals go
+    int *fds = first <= last ? malloc((last - first + 1) * sizeof(int)) : NULL, nfds = 0;
+    if (fds) {
+        pthread_rwlock_rdlock(&segments.lock);
+        for (uint32_t n = first; n <= last; n++)
+            if ((fds[nfds] = dup(segments.files[n].fd)) >= 0) nfds++;
+        pthread_rwlock_unlock(&segments.lock);
+    } else if (first <= last) {
+        ok = 0;
+    }
+    if (!ok || durable_sync(fds, nfds, 0) < 0) ok = 0;
+    for (int i = 0; i < nfds; i++) close(fds[i]);
+    free(fds);
+
+    pthread_rwlock_wrlock(&segments.lock);
+    for (size_t m = 0; m < moved_count; m++) {
+        int found;
+        size_t i = segment_find(moved[m].path, &found);
+        struct segment_entry *e = &segments.entries[i];
+        if (ok && found && e->segment == number && e->offset == moved[m].from) {
+            uint64_t record = sizeof(struct segment_record) + strlen(e->path) + e->length;
+            segments.files[number].live -= record;
+            segments.files[moved[m].segment].live += record;
+            e->segment = moved[m].segment;
+            e->offset = moved[m].offset;
+        }
+        free(moved[m].path);
+    }
+    free(moved);
+    if (ok) {
+        char seg_path[PATH_MAX];
+        snprintf(seg_path, PATH_MAX, "%.*s/%08u.seg", SEGMENT_DIR_MAX, segments.dir, number);
+        unlink(seg_path);
+        close(fd);
+        segments.files[number] = (struct segment_file){-1, 0, 0};
+    }
+    pthread_rwlock_unlock(&segments.lock);
+    if (ok) printf("S2: Compacted segment %u, moving %zu live files\n", number, moved_count);
+    return ok ? 0 : -1;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+void sha256_init(struct sha256_ctx *ctx) {
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->fill = 0;
+}
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// Run the SHA-256 compression function over count 64-byte blocks, with the SHA extensions
+// where the CPU has them
+void sha256_blocks(uint32_t *state, const unsigned char *data, size_t count) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+        sha256_blocks_shani(state, data, count);
+        return;
+    }
+#endif
+    sha256_blocks_portable(state, data, count);
+}
+
+void sha256_blocks_portable(uint32_t *state, const unsigned char *data, size_t count) {
+    for (; count > 0; count--, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 | (uint32_t)data[4 * i + 2] << 8 | data[4 * i + 3];
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// SHA-256 compression with the x86 SHA extensions: each sha256rnds2 runs two rounds, and
+// sha256msg1/sha256msg2 extend the message schedule four words at a time. The state is
+// held as the ABEF and CDGH halves the instructions work on.
+__attribute__((target("sha,sse4.1")))
+void sha256_blocks_shani(uint32_t *state, const unsigned char *data, size_t count) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);  // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);  // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);  // CDGH
+    for (; count > 0; count--, data += 64) {
+        __m128i abef = state0, cdgh = state1, msg[4];
+        // Unrolled, so that msg stays in registers
+#pragma GCC unroll 16
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), byte_swap);
+            __m128i words = _mm_add_epi32(msg[i % 4], _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, words);
+            // The words four groups ahead are due once this group's are known
+            if (i >= 3 && i < 15) {
+                __m128i next = _mm_add_epi32(msg[(i + 1) % 4], _mm_alignr_epi8(msg[i % 4], msg[(i + 3) % 4], 4));
+                msg[(i + 1) % 4] = _mm_sha256msg2_epu32(next, msg[i % 4]);
+            }
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(words, 0x0e));
+            if (i >= 1 && i < 13) msg[(i + 3) % 4] = _mm_sha256msg1_epu32(msg[(i + 3) % 4], msg[i % 4]);
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+    tmp = _mm_shuffle_epi32(state0, 0x1b);  // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1);  // DCHG
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));  // DCBA
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));  // HGFE
+}
+#endif
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t length) {
+    const unsigned char *p = data;
+    ctx->length += length;
+    if (ctx->fill > 0) {
+        size_t take = 64 - ctx->fill < length ? 64 - ctx->fill : length;
+        memcpy(ctx->block + ctx->fill, p, take);
+        ctx->fill += take;
+        p += take;
+        length -= take;
+        if (ctx->fill < 64) return;
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->fill = 0;
+    }
+    if (length >= 64) {
+        sha256_blocks(ctx->state, p, length / 64);
+        p += length / 64 * 64;
+        length %= 64;
+    }
+    memcpy(ctx->block, p, length);
+    ctx->fill = length;
+}
+
+void sha256_final(struct sha256_ctx *ctx, unsigned char *digest) {
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad[64] = {0x80};
+    sha256_update(ctx, pad, (ctx->fill < 56 ? 56 : 120) - ctx->fill);
+    for (int i = 0; i < 8; i++) pad[i] = bits >> (56 - 8 * i);
+    sha256_update(ctx, pad, 8);
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = ctx->state[i] >> 24;
+        digest[4 * i + 1] = ctx->state[i] >> 16;
+        digest[4 * i + 2] = ctx->state[i] >> 8;
+        digest[4 * i + 3] = ctx->state[i];
+    }
+}
+
+// Write a digest as lowercase hex, NUL-terminated
+void digest_hex(const unsigned char *digest, char *hex) {
+    for (int i = 0; i < SHA256_LEN; i++) sprintf(hex + 2 * i, "%02x", digest[i]);
+}
+
+// Parse a digest written by digest_hex(). Returns -1 if hex is not one.
+int parse_digest(const char *hex, unsigned char *digest) {
+    if (strlen(hex) != 2 * SHA256_LEN || strspn(hex, "0123456789abcdef") != 2 * SHA256_LEN) return -1;
+    for (int i = 0; i < SHA256_LEN; i++) sscanf(hex + 2 * i, "%2hhx", &digest[i]);
+    return 0;
+}
+
+static int compare_dedup_entries(const void *a, const void *b) {
+    return strcmp(((const struct dedup_entry *)a)->path, ((const struct dedup_entry *)b)->path);
+}
+
+// Load the recipes in dir, rebuilding the index and the chunk reference counts from them,
+// then delete the chunks no recipe names, left by uploads a crash cut short
+int dedup_init(const char *dir) {
+    // Gear values from a fixed seed, so every run cuts the same content at the same points
+    uint64_t seed = 0;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        dedup.gear[i] = z ^ (z >> 31);
+    }
+    if (strlen(dir) > DEDUP_DIR_MAX) return -1;
+    char path[PATH_MAX], recipe[2 * PATH_MAX];
+    for (int i = 0; i < 256; i++) {
+        snprintf(path, PATH_MAX, "%s/chunks/%02x", dir, i);
+        create_directories(path);
+    }
+    snprintf(path, PATH_MAX, "%s/recipes", dir);
+    create_directories(path);
+    DIR *d = opendir(path);
+    if (!d) return -1;
+    snprintf(dedup.dir, PATH_MAX, "%s", dir);
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        // Hidden names are recipes a crash left unpublished
+        if (de->d_name[0] == '.') {
+            unlinkat(dirfd(d), de->d_name, 0);
+            continue;
+        }
+        snprintf(recipe, sizeof(recipe), "%s/%s", path, de->d_name);
+        if (dedup_load_recipe(recipe) < 0) printf("S2: Recipe %s is damaged, ignored\n", de->d_name);
+    }
+    closedir(d);
+    qsort(dedup.entries, dedup.count, sizeof(*dedup.entries), compare_dedup_entries);
+
+    size_t unused = 0;
+    for (int i = 0; i < 256; i++) {
+        snprintf(path, PATH_MAX, "%s/chunks/%02x", dir, i);
+        DIR *cd = opendir(path);
+        if (!cd) continue;
+        while ((de = readdir(cd))) {
+            unsigned char hash[SHA256_LEN];
+            if (parse_digest(de->d_name, hash) < 0) continue;
+            struct dedup_chunk *slot = dedup_chunk_slot(hash);
+            if ((!slot || !slot->refs) && unlinkat(dirfd(cd), de->d_name, 0) == 0) unused++;
+        }
+        closedir(cd);
+    }
+    printf("S2: Deduplicating store holds %zu files (%lu bytes) in %zu chunks (%lu bytes), dedup ratio %.2f; removed %zu unused chunks\n",
+           dedup.count, dedup.logical_bytes, dedup.chunk_count, dedup.stored_bytes,
+           dedup.stored_bytes ? (double)dedup.logical_bytes / dedup.stored_bytes : 1.0, unused);
+    return 0;
+}
+
+// Enter the recipe at path in the index, taking a reference to each of its chunks.
+// Returns -1 if it is damaged.
+int dedup_load_recipe(const char *path) {
+    struct dedup_recipe hdr;
+    struct stat statbuf;
+    char *data = NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int ok = fstat(fd, &statbuf) == 0 && (size_t)statbuf.st_size >= sizeof(hdr) && (data = malloc(statbuf.st_size)) &&
+             pread(fd, data, statbuf.st_size, 0) == statbuf.st_size;
+    close(fd);
+    // A version 1 header is the same without the digest
+    size_t hdr_size = sizeof(hdr);
+    if (ok) {
+        memcpy(&hdr, data, sizeof(hdr));
+        if (hdr.magic == DEDUP_MAGIC_V1) hdr_size -= SHA256_LEN;
+        ok = (hdr.magic == DEDUP_MAGIC || hdr.magic == DEDUP_MAGIC_V1) && hdr.path_len > 0 && hdr.path_len < PATH_MAX && hdr.chunk_count > 0 &&
+             (uint64_t)statbuf.st_size == hdr_size + hdr.path_len + (uint64_t)hdr.chunk_count * sizeof(struct dedup_chunk_ref);
+    }
+    struct dedup_chunk_ref *chunks = NULL;
+    if (ok) {
+        const char *rel = data + hdr_size;
+        size_t list_size = (size_t)hdr.chunk_count * sizeof(*chunks);
+        uLong crc = crc32(crc32(0, (const Bytef *)rel, hdr.path_len), (const Bytef *)rel + hdr.path_len, list_size);
+        if (hdr.magic == DEDUP_MAGIC) crc = crc32(crc, hdr.digest, SHA256_LEN);
+        ok = crc == hdr.crc && (chunks = malloc(list_size)) != NULL;
+        if (ok) memcpy(chunks, rel + hdr.path_len, list_size);
+        uint64_t total = 0;
+        for (uint32_t i = 0; ok && i < hdr.chunk_count; i++) total += chunks[i].length;
+        ok = ok && total == hdr.size;
+    }
+    if (ok && dedup.count == dedup.capacity) {
+        size_t capacity = dedup.capacity ? 2 * dedup.capacity : 1024;
+        struct dedup_entry *grown = realloc(dedup.entries, capacity * sizeof(*grown));
+        if (grown) {
+            dedup.entries = grown;
+            dedup.capacity = capacity;
+        } else {
+            ok = 0;
+        }
+    }
+    if (!ok) {
+        free(data);
+        free(chunks);
+        return -1;
+    }
+    for (uint32_t i = 0; i < hdr.chunk_count; i++) {
+        struct dedup_chunk *slot = dedup_chunk_slot(chunks[i].hash);
+        if (!slot) continue;
+        if (!slot->refs) {
+            memcpy(slot->hash, chunks[i].hash, SHA256_LEN);
+            slot->length = chunks[i].length;
+            slot->writing = slot->unsynced = 0;
+            dedup.chunk_count++;
+            dedup.stored_bytes += slot->length;
+        }
+        slot->refs++;
+    }
+    struct dedup_entry *e = &dedup.entries[dedup.count++];
+    e->path = strndup(data + hdr_size, hdr.path_len);
+    const char *base = strrchr(e->path, '/');
+    base = base ? base + 1 : e->path;
+    e->ext = strrchr(base, '.') ? strrchr(base, '.') : base + strlen(base);
+    e->size = hdr.size;
+    e->mtime = hdr.mtime;
+    e->chunk_count = hdr.chunk_count;
+    e->chunks = chunks;
+    memcpy(e->digest, hdr.digest, SHA256_LEN);
+    e->digested = hdr.magic == DEDUP_MAGIC;
+    dedup.logical_bytes += hdr.size;
+    free(data);
+    return 0;
+}
+
+// Length of the chunk starting at data, which holds length bytes: the first cut point
+// past DEDUP_MIN_CHUNK, or the end of data or DEDUP_MAX_CHUNK if none comes first
+size_t dedup_cut(const unsigned char *data, size_t length) {
+    if (length <= DEDUP_MIN_CHUNK) return length;
+    size_t end = length < DEDUP_MAX_CHUNK ? length : DEDUP_MAX_CHUNK;
+    size_t normal = end < DEDUP_AVG_CHUNK ? end : DEDUP_AVG_CHUNK;
+    uint64_t hash = 0;
+    size_t i = DEDUP_MIN_CHUNK;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + dedup.gear[data[i]];
+        if (!(hash & DEDUP_MASK_SMALL)) return i + 1;
+    }
+    for (; i < end; i++) {
+        hash = (hash << 1) + dedup.gear[data[i]];
+        if (!(hash & DEDUP_MASK_LARGE)) return i + 1;
+    }
+    return end;
+}
+
+// Cut chunks off the front of a writer's buffer: while it is full, or with final set,
+// until it is empty. Returns -1 if a chunk could not be stored.
+static int dedup_drain(struct dedup_writer *w, int final) {
+    while (w->fill > 0 && (final || w->fill == DEDUP_MAX_CHUNK)) {
+        size_t length = dedup_cut(w->buf, w->fill);
+        if (dedup_add_chunk(w, w->buf, length) < 0) return -1;
+        memmove(w->buf, w->buf + length, w->fill - length);
+        w->fill -= length;
+    }
+    return 0;
+}
+
+// Write function of a writer's stream: content is buffered until a whole chunk of the
+// longest size is held, since only then is the first cut point settled
+static ssize_t dedup_stream_write(void *cookie, const char *data, size_t size) {
+    struct dedup_writer *w = cookie;
+    if (w->failed) return -1;
+    for (size_t done = 0; done < size; ) {
+        size_t take = DEDUP_MAX_CHUNK - w->fill < size - done ? DEDUP_MAX_CHUNK - w->fill : size - done;
+        memcpy(w->buf + w->fill, data + done, take);
+        w->fill += take;
+        done += take;
+        if (dedup_drain(w, 0) < 0) {
+            w->failed = 1;
+            return -1;
+        }
+    }
+    sha256_update(&w->content, data, size);
+    w->size += size;
+    return size;
+}
+
+// Start cutting the file to be stored at path into chunks, as content is written to
+// w->fp. Returns -1 if it cannot be; dedup_discard() still finishes with w.
+int dedup_start(struct dedup_writer *w, const char *path) {
+    static const cookie_io_functions_t stream = {.write = dedup_stream_write};
+    memset(w, 0, sizeof(*w));
+    w->failed = 1;
+    snprintf(w->path, PATH_MAX, "%s", path);
+    if (!dedup.dir[0] || catalog_relpath(path, w->rel) < 0 || !w->rel[0] || !(w->buf = malloc(DEDUP_MAX_CHUNK))) return -1;
+    if (!(w->fp = fopencookie(w, "w", stream))) return -1;
+    sha256_init(&w->content);
+    w->failed = 0;
+    return 0;
+}
+
+// Store one chunk of a writer's file, writing it only if the store does not hold it yet.
+// Returns -1 if it could not be written.
+int dedup_add_chunk(struct dedup_writer *w, const unsigned char *data, size_t length) {
+    if (w->count == w->capacity) {
+        uint32_t capacity = w->capacity ? 2 * w->capacity : 64;
+        struct dedup_chunk_ref *grown = realloc(w->chunks, capacity * sizeof(*grown));
+        if (!grown) return -1;
+        w->chunks = grown;
+        w->capacity = capacity;
+    }
+    // A large file does not keep a descriptor per chunk: its chunks go to disk in batches
+    if (w->sync_count == DEDUP_SYNC_BATCH && dedup_sync_chunks(w) < 0) return -1;
+    struct dedup_chunk_ref *ref = &w->chunks[w->count];
+    struct sha256_ctx ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, length);
+    sha256_final(&ctx, ref->hash);
+    ref->length = length;
+    char path[PATH_MAX];
+    dedup_chunk_path(ref->hash, path);
+
+    // New content takes its slot before the file is written outside the lock; others
+    // storing the same content wait until the file is complete
+    pthread_mutex_lock(&dedup.chunk_lock);
+    struct dedup_chunk *slot;
+    while ((slot = dedup_chunk_slot(ref->hash)) && slot->refs && slot->writing)
+        pthread_cond_wait(&dedup.chunk_written, &dedup.chunk_lock);
+    if (!slot) {
+        pthread_mutex_unlock(&dedup.chunk_lock);
+        return -1;
+    }
+    int reserved = !slot->refs, unsynced = reserved || slot->unsynced;
+    if (reserved) {
+        memcpy(slot->hash, ref->hash, SHA256_LEN);
+        slot->length = length;
+        slot->writing = slot->unsynced = 1;
+        dedup.chunk_count++;
+    }
+    slot->refs++;
+    pthread_mutex_unlock(&dedup.chunk_lock);
+
+    int fd = -1;
+    if (reserved) {
+        // It reaches the disk with the group commit of the recipe naming it, and a crash
+        // before then leaves it unused, to be deleted at startup
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        int ok = fd >= 0 && pwrite(fd, data, length, 0) == (ssize_t)length;
+        if (!ok) {
+            if (fd >= 0) close(fd);
+            unlink(path);
+        }
+        // The table may have been rearranged meanwhile
+        pthread_mutex_lock(&dedup.chunk_lock);
+        slot = dedup_chunk_probe(ref->hash);
+        slot->writing = 0;
+        if (ok) {
+            dedup.stored_bytes += length;
+            w->new_bytes += length;
+        } else {
+            dedup_chunk_delete(slot);
+        }
+        pthread_cond_broadcast(&dedup.chunk_written);
+        pthread_mutex_unlock(&dedup.chunk_lock);
+        if (!ok) return -1;
+    } else if (unsynced && (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        // Written by an upload whose group commit has not covered it yet, so this one's must
+        dedup_release(ref, 1);
+        return -1;
+    }
+    if (fd >= 0) {
+        w->sync_fds[w->sync_count++] = fd;
+        w->sync_dirs[ref->hash[0] / 8] |= 1 << (ref->hash[0] % 8);
+    }
+    w->count++;
+    return 0;
+}
+
+// Open the chunk directories marked in dirs into fds. Returns how many, or -1 if one
+// cannot be opened.
+int dedup_open_chunk_dirs(const unsigned char *dirs, int *fds) {
+    int n = 0;
+    for (int i = 0; i < 256; i++) {
+        if (!(dirs[i / 8] & (1 << (i % 8)))) continue;
+        char path[PATH_MAX];
+        snprintf(path, PATH_MAX, "%.*s/chunks/%02x", DEDUP_DIR_MAX, dedup.dir, i);
+        if ((fds[n] = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+            while (n > 0) close(fds[--n]);
+            return -1;
+        }
+        n++;
+    }
+    return n;
+}
+
+// Note that the chunks a writer uses so far are on disk, once a flush covered its chunk files
+void dedup_mark_synced(struct dedup_writer *w) {
+    pthread_mutex_lock(&dedup.chunk_lock);
+    for (uint32_t i = w->synced; i < w->count; i++) dedup_chunk_probe(w->chunks[i].hash)->unsynced = 0;
+    w->synced = w->count;
+    pthread_mutex_unlock(&dedup.chunk_lock);
+}
+
+// Bring the chunk files a writer holds open to disk ahead of its recipe, with their
+// directories, and close them. Returns -1 if the flush failed.
+int dedup_sync_chunks(struct dedup_writer *w) {
+    int fds[DEDUP_SYNC_BATCH + 256], n = w->sync_count;
+    memcpy(fds, w->sync_fds, n * sizeof(int));
+    int dirs = dedup_open_chunk_dirs(w->sync_dirs, fds + n);
+    int rc = dirs < 0 ? -1 : durable_sync(fds, n + dirs, 0);
+    if (dirs > 0) n += dirs;
+    for (int i = 0; i < n; i++) close(fds[i]);
+    w->sync_count = 0;
+    memset(w->sync_dirs, 0, sizeof(w->sync_dirs));
+    if (rc == 0) dedup_mark_synced(w);
+    return rc;
+}
+
+// Give up on a file being cut into chunks, dropping the chunks it took
+void dedup_discard(struct dedup_writer *w) {
+    w->failed = 1;
+    if (w->fp) fclose(w->fp);
+    w->fp = NULL;
+    while (w->sync_count > 0) close(w->sync_fds[--w->sync_count]);
+    if (w->temp_path[0]) unlink(w->temp_path);
+    w->temp_path[0] = '\0';
+    dedup_release(w->chunks, w->count);
+    free(w->chunks);
+    free(w->buf);
+    w->chunks = NULL;
+    w->buf = NULL;
+    w->count = w->capacity = 0;
+}
+
+// Write the recipe of a file cut into chunks under a hidden temporary name. Returns its
+// descriptor, to be flushed, or -1.
+static int dedup_write_recipe(struct dedup_writer *w) {
+    int fd = -1;
+    for (int tries = 0; fd < 0 && tries < 8; tries++) {
+        uint32_t suffix = 0;
+        if (getrandom(&suffix, sizeof(suffix), 0) != sizeof(suffix)) suffix ^= (uint32_t)time(NULL) + tries;
+        snprintf(w->temp_path, PATH_MAX, "%.*s/recipes/.%08x", DEDUP_DIR_MAX, dedup.dir, suffix);
+        fd = open(w->temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0 && errno != EEXIST) break;
+    }
+    if (fd < 0) {
+        w->temp_path[0] = '\0';
+        return -1;
+    }
+    w->mtime = time(NULL);
+    size_t list_size = (size_t)w->count * sizeof(*w->chunks);
+    struct dedup_recipe hdr = {DEDUP_MAGIC, strlen(w->rel), w->count, 0, w->size, w->mtime, {0}};
+    if (!w->cloned) sha256_final(&w->content, w->digest);
+    memcpy(hdr.digest, w->digest, SHA256_LEN);
+    hdr.crc = crc32(crc32(0, (const Bytef *)w->rel, hdr.path_len), (const Bytef *)w->chunks, list_size);
+    hdr.crc = crc32(hdr.crc, hdr.digest, SHA256_LEN);
+    struct iovec iov[3] = {{&hdr, sizeof(hdr)}, {w->rel, hdr.path_len}, {w->chunks, list_size}};
+    if (pwritev(fd, iov, 3, 0) != (ssize_t)(sizeof(hdr) + hdr.path_len + list_size)) {
+        close(fd);
+        unlink(w->temp_path);
+        w->temp_path[0] = '\0';
+        return -1;
+    }
+    return fd;
+}
+
+// Enter a published file in the index, keeping the chunks of the copy it replaces in the
+// writer for release. Caller holds the write lock.
+static void dedup_index(struct dedup_writer *w) {
+    int found;
+    size_t i = dedup_find(w->rel, &found);
+    struct dedup_entry *e = &dedup.entries[i];
+    if (found) {
+        dedup.logical_bytes -= e->size;
+        w->replaced = e->chunks;
+        w->replaced_count = e->chunk_count;
+    } else {
+        if (dedup.count == dedup.capacity) {
+            dedup.capacity = dedup.capacity ? 2 * dedup.capacity : 1024;
+            dedup.entries = realloc(dedup.entries, dedup.capacity * sizeof(*dedup.entries));
+        }
+        e = &dedup.entries[i];
+        memmove(e + 1, e, (dedup.count - i) * sizeof(*e));
+        dedup.count++;
+        e->path = strdup(w->rel);
+        const char *base = strrchr(e->path, '/');
+        base = base ? base + 1 : e->path;
+        e->ext = strrchr(base, '.') ? strrchr(base, '.') : base + strlen(base);
+    }
+    e->size = w->size;
+    e->mtime = w->mtime;
+    e->chunks = w->chunks;
+    e->chunk_count = w->count;
+    memcpy(e->digest, w->digest, SHA256_LEN);
+    e->digested = 1;
+    dedup.logical_bytes += w->size;
+    w->chunks = NULL;
+}
+
+// Store files cut into chunks: cut their last chunks, write their recipes, bring chunks
+// and recipes to disk with one group commit, then rename the recipes into place and enter
+// them in the index. A file stored as chunks replaces any copy of it kept as a file or in
+// a segment. Writers without a path, or whose stream is gone, are skipped. Every writer is
+// finished with; those that failed are marked. Returns the number stored.
+int dedup_publish(struct dedup_writer *writers, int count) {
+    // Each recipe, the chunk files it holds open, and the chunk directories
+    int *fds = malloc(((size_t)count * (1 + DEDUP_SYNC_BATCH) + 256) * sizeof(int)), n = 0, published = 0;
+    unsigned char dirs[32] = {0};
+    for (int i = 0; i < count; i++) {
+        struct dedup_writer *w = &writers[i];
+        if (!w->path[0] || !w->fp) continue;
+        // Closing the stream hands over what it still buffers
+        int ok = fclose(w->fp) == 0;
+        w->fp = NULL;
+        int fd = ok && fds && !w->failed && w->size > 0 && dedup_drain(w, 1) == 0 ? dedup_write_recipe(w) : -1;
+        if (fd < 0) {
+            dedup_discard(w);
+            continue;
+        }
+        // The recipe goes to disk with the chunk files it names that are not there yet,
+        // and their directories, before it is renamed into place
+        fds[n++] = fd;
+        memcpy(fds + n, w->sync_fds, w->sync_count * sizeof(int));
+        n += w->sync_count;
+        w->sync_count = 0;
+        for (int d = 0; d < 32; d++) dirs[d] |= w->sync_dirs[d];
+    }
+    int opened = fds ? dedup_open_chunk_dirs(dirs, fds + n) : 0;
+    if (opened > 0) n += opened;
+    int synced = opened < 0 ? -1 : n > 0 ? durable_sync(fds, n, 0) : 0;
+    for (int i = 0; i < n; i++) close(fds[i]);
+    for (int i = 0; i < count && synced == 0; i++)
+        if (writers[i].path[0] && writers[i].temp_path[0]) dedup_mark_synced(&writers[i]);
+
+    pthread_rwlock_wrlock(&dedup.lock);
+    for (int i = 0; i < count; i++) {
+        struct dedup_writer *w = &writers[i];
+        char recipe[PATH_MAX];
+        if (!w->path[0] || !w->temp_path[0]) continue;
+        dedup_recipe_path(w->rel, recipe);
+        if (synced < 0 || rename(w->temp_path, recipe) != 0) continue;
+        w->temp_path[0] = '\0';
+        w->failed = 0;
+        dedup_index(w);
+        published++;
+    }
+    uint64_t logical = dedup.logical_bytes;
+    pthread_rwlock_unlock(&dedup.lock);
+
+    // The renames are durable once the recipes directory is flushed; only then may the
+    // chunks of replaced copies go
+    char dir[PATH_MAX];
+    snprintf(dir, PATH_MAX, "%.*s/recipes", DEDUP_DIR_MAX, dedup.dir);
+    int dir_fd = published > 0 && fds ? open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    if (dir_fd >= 0) {
+        fds[0] = dir_fd;
+        if (durable_sync(fds, 1, 0) < 0) printf("S2: Cannot flush published recipes: %s\n", strerror(errno));
+        close(dir_fd);
+    }
+    free(fds);
+    for (int i = 0; i < count; i++) {
+        struct dedup_writer *w = &writers[i];
+        if (!w->path[0]) continue;
+        if (w->temp_path[0]) dedup_discard(w);
+        if (w->failed) continue;
+        dedup_release(w->replaced, w->replaced_count);
+        free(w->replaced);
+        free(w->buf);
+        w->replaced = NULL;
+        w->buf = NULL;
+        if (unlink(w->path) == 0) catalog_note(w->path);
+        segment_remove(w->path);
+    }
+    if (published == 0) return 0;
+    pthread_mutex_lock(&dedup.chunk_lock);
+    uint64_t stored = dedup.stored_bytes;
+    pthread_mutex_unlock(&dedup.chunk_lock);
+    for (int i = 0; i < count; i++) {
+        const struct dedup_writer *w = &writers[i];
+        if (w->path[0] && !w->failed)
+            printf("S2: Stored %s as %u chunks, %lu of %lu bytes new; store holds %lu bytes in %lu bytes of chunks, dedup ratio %.2f\n",
+                   w->path, w->count, w->new_bytes, w->size, logical, stored, stored ? (double)logical / stored : 1.0);
+    }
+    // Cached archives hold the old contents
+    pthread_rwlock_wrlock(&catalog.lock);
+    catalog.generation++;
+    pthread_rwlock_unlock(&catalog.lock);
+    return published;
+}
+
+// Cut a file already stored in the tree into chunks, replacing it. Returns -1, leaving
+// the file in place, if it could not be stored.
+int dedup_ingest(const char *path) {
+    struct dedup_writer w;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    char *buf = malloc(DEDUP_MAX_CHUNK);
+    int ok = dedup_start(&w, path) == 0 && buf;
+    ssize_t bytes;
+    while (ok && (bytes = read(fd, buf, DEDUP_MAX_CHUNK)) != 0) {
+        if (bytes < 0 && errno == EINTR) continue;
+        ok = bytes > 0 && fwrite(buf, 1, bytes, w.fp) == (size_t)bytes;
+    }
+    free(buf);
+    close(fd);
+    if (!ok) {
+        dedup_discard(&w);
+        return -1;
+    }
+    return dedup_publish(&w, 1) == 1 ? 0 : -1;
+}
+
+static size_t dedup_chunk_home(const unsigned char *hash) {
+    uint64_t h;
+    memcpy(&h, hash, sizeof(h));
+    return h & (dedup.chunk_slots - 1);
+}
+
+// Slot holding hash, or the empty slot ending its probe run. Caller holds chunk_lock.
+struct dedup_chunk *dedup_chunk_probe(const unsigned char *hash) {
+    size_t mask = dedup.chunk_slots - 1;
+    for (size_t i = dedup_chunk_home(hash);; i = (i + 1) & mask)
+        if (!dedup.chunks[i].refs || memcmp(dedup.chunks[i].hash, hash, SHA256_LEN) == 0) return &dedup.chunks[i];
+}
+
+// Slot of the chunk table holding hash, or the empty slot it would take, growing the
+// table first once it is three quarters full. Returns NULL if it cannot grow. Caller
+// holds chunk_lock.
+struct dedup_chunk *dedup_chunk_slot(const unsigned char *hash) {
+    if ((dedup.chunk_count + 1) * 4 > dedup.chunk_slots * 3 && dedup_chunk_grow() < 0) return NULL;
+    return dedup_chunk_probe(hash);
+}
+
+// Double the chunk table, placing every chunk again. Caller holds chunk_lock.
+int dedup_chunk_grow(void) {
+    size_t slots = dedup.chunk_slots ? 2 * dedup.chunk_slots : 4096, old_slots = dedup.chunk_slots;
+    struct dedup_chunk *chunks = calloc(slots, sizeof(*chunks)), *old = dedup.chunks;
+    if (!chunks) return -1;
+    dedup.chunks = chunks;
+    dedup.chunk_slots = slots;
+    for (size_t i = 0; i < old_slots; i++)
+        if (old[i].refs) *dedup_chunk_probe(old[i].hash) = old[i];
+    free(old);
+    return 0;
+}
+
+// Empty a slot of the chunk table, moving later chunks of its probe run back so that none
+// is cut off from its home slot. Caller holds chunk_lock.
+void dedup_chunk_delete(struct dedup_chunk *slot) {
+    size_t mask = dedup.chunk_slots - 1, hole = slot - dedup.chunks;
+    for (size_t i = (hole + 1) & mask; dedup.chunks[i].refs; i = (i + 1) & mask) {
+        // A chunk may fill the hole unless its home lies between the hole and it
+        size_t home = dedup_chunk_home(dedup.chunks[i].hash);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            dedup.chunks[hole] = dedup.chunks[i];
+            hole = i;
+        }
+    }
+    dedup.chunks[hole].refs = 0;
+    dedup.chunk_count--;
+}
+
+// Path of the chunk with hash: chunks are spread over 256 directories by their first byte
+void dedup_chunk_path(const unsigned char *hash, char *path) {
+    char hex[2 * SHA256_LEN + 1];
+    digest_hex(hash, hex);
+    snprintf(path, PATH_MAX, "%.*s/chunks/%.2s/%s", DEDUP_DIR_MAX, dedup.dir, hex, hex);
+}
+
+// Path of the recipe of the file at rel, named by the SHA-256 of rel
+void dedup_recipe_path(const char *rel, char *path) {
+    struct sha256_ctx ctx;
+    unsigned char digest[SHA256_LEN];
+    char hex[2 * SHA256_LEN + 1];
+    sha256_init(&ctx);
+    sha256_update(&ctx, rel, strlen(rel));
+    sha256_final(&ctx, digest);
+    digest_hex(digest, hex);
+    snprintf(path, PATH_MAX, "%.*s/recipes/%s", DEDUP_DIR_MAX, dedup.dir, hex);
+}
+
+// Drop a reference to each of chunks, deleting those no longer used. Any recipe naming
+// them must already be gone from the disk.
+void dedup_release(const struct dedup_chunk_ref *chunks, uint32_t count) {
+    if (count == 0) return;
+    pthread_mutex_lock(&dedup.chunk_lock);
+    for (uint32_t i = 0; i < count && dedup.chunk_slots > 0; i++) {
+        struct dedup_chunk *slot = dedup_chunk_probe(chunks[i].hash);
+        if (!slot->refs || --slot->refs > 0) continue;
+        char path[PATH_MAX];
+        dedup_chunk_path(chunks[i].hash, path);
+        unlink(path);
+        dedup.stored_bytes -= slot->length;
+        dedup_chunk_delete(slot);
+    }
+    pthread_mutex_unlock(&dedup.chunk_lock);
+}
+
+// Index of the first entry whose path is not less than path; found tells whether it matches
+size_t dedup_find(const char *path, int *found) {
+    size_t lo = 0, hi = dedup.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(dedup.entries[mid].path, path) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    *found = lo < dedup.count && strcmp(dedup.entries[lo].path, path) == 0;
+    return lo;
+}
+
+// Find a file held as chunks. Returns 0 with a copy of its chunk list for the caller to
+// free and its size and mtime in statbuf, or -1 if the file is not held as chunks.
+int dedup_lookup(const char *path, struct stat *statbuf, struct dedup_chunk_ref **chunks, uint32_t *count) {
+    char rel[PATH_MAX];
+    int found = 0;
+    if (catalog_relpath(path, rel) < 0) return -1;
+    pthread_rwlock_rdlock(&dedup.lock);
+    size_t i = dedup_find(rel, &found);
+    if (found) {
+        const struct dedup_entry *e = &dedup.entries[i];
+        *chunks = malloc(e->chunk_count * sizeof(**chunks));
+        if (*chunks) {
+            memcpy(*chunks, e->chunks, e->chunk_count * sizeof(**chunks));
+            *count = e->chunk_count;
+            memset(statbuf, 0, sizeof(*statbuf));
+            statbuf->st_mode = S_IFREG | 0644;
+            statbuf->st_size = e->size;
+            statbuf->st_mtime = e->mtime;
+            // The content digest identifies the file's version; version 1 recipes
+            // carry none, so their chunk list stands in for it
+            uint64_t id = crc32(0, (const Bytef *)e->chunks, e->chunk_count * sizeof(*e->chunks));
+            if (e->digested) memcpy(&id, e->digest, sizeof(id));
+            statbuf->st_ino = id;
+        } else {
+            found = 0;
+        }
+    }
+    pthread_rwlock_unlock(&dedup.lock);
+    return found ? 0 : -1;
+}
+
+// Find the size and digest of a file held as chunks. Returns 1 if it is held with its
+// digest, 0 if it is held without one, or -1 if it is not held as chunks.
+int dedup_content(const char *path, uint64_t *size, unsigned char *digest) {
+    char rel[PATH_MAX];
+    int found = 0, rc = -1;
+    if (catalog_relpath(path, rel) < 0) return -1;
+    pthread_rwlock_rdlock(&dedup.lock);
+    size_t i = dedup_find(rel, &found);
+    if (found) {
+        const struct dedup_entry *e = &dedup.entries[i];
+        *size = e->size;
+        memcpy(digest, e->digest, SHA256_LEN);
+        rc = e->digested;
+    }
+    pthread_rwlock_unlock(&dedup.lock);
+    return rc;
+}
+
+// Store the file at path as a copy of a file held as chunks whose content has size bytes
+// and the SHA-256 digest, sharing its chunks. Returns 1 if it was stored, 0 if the store
+// holds no such content, or -1 if it could not be stored.
+int dedup_clone(const char *path, uint64_t size, const unsigned char *digest) {
+    struct dedup_writer w;
+    if (dedup_start(&w, path) < 0) {
+        dedup_discard(&w);
+        return -1;
+    }
+    pthread_rwlock_rdlock(&dedup.lock);
+    // Probes are rare next to the bytes a match saves, so a scan of the index will do
+    const struct dedup_entry *source = NULL;
+    for (size_t i = 0; i < dedup.count && !source; i++) {
+        const struct dedup_entry *e = &dedup.entries[i];
+        if (e->digested && e->size == size && memcmp(e->digest, digest, SHA256_LEN) == 0) source = e;
+    }
+    if (source && (w.chunks = malloc(source->chunk_count * sizeof(*w.chunks)))) {
+        memcpy(w.chunks, source->chunks, source->chunk_count * sizeof(*w.chunks));
+        w.count = w.capacity = source->chunk_count;
+        // The source holds a reference to each chunk while it is in the index
+        pthread_mutex_lock(&dedup.chunk_lock);
+        for (uint32_t i = 0; i < w.count; i++) dedup_chunk_probe(w.chunks[i].hash)->refs++;
+        pthread_mutex_unlock(&dedup.chunk_lock);
+    }
+    pthread_rwlock_unlock(&dedup.lock);
+    if (!w.chunks) {
+        dedup_discard(&w);
+        return source ? -1 : 0;
+    }
+    w.size = size;
+    memcpy(w.digest, digest, SHA256_LEN);
+    w.cloned = 1;
+    return dedup_publish(&w, 1) == 1 ? 1 : -1;
+}
+
+// Send size bytes from offset of a file held as chunks, each chunk with sendfile().
+// Returns the bytes sent, short if a chunk was deleted meanwhile, or -1 on a socket error.
+long long dedup_send_body(int sock, const struct dedup_chunk_ref *chunks, uint32_t count, uint64_t offset, uint64_t size) {
+    uint64_t pos = 0, sent = 0;
+    for (uint32_t i = 0; i < count && sent < size; pos += chunks[i++].length) {
+        if (pos + chunks[i].length <= offset) continue;
+        uint64_t from = offset > pos ? offset - pos : 0;
+        uint64_t want = chunks[i].length - from < size - sent ? chunks[i].length - from : size - sent;
+        char path[PATH_MAX];
+        dedup_chunk_path(chunks[i].hash, path);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) break;
+        long long bytes = send_file_body(sock, fd, from, want);
+        close(fd);
+        if (bytes < 0) return -1;
+        sent += bytes;
+        if ((uint64_t)bytes < want) break;
+    }
+    return sent;
+}
+
+// Remove a file held as chunks: its recipe is deleted, and once that is on disk, the
+// chunks only it used. Returns -1 if there is no such file.
+int dedup_remove(const char *path) {
+    char rel[PATH_MAX], recipe[PATH_MAX];
+    int found = 0;
+    struct dedup_entry removed;
+    if (catalog_relpath(path, rel) < 0) return -1;
+    pthread_rwlock_wrlock(&dedup.lock);
+    size_t i = dedup.count > 0 ? dedup_find(rel, &found) : 0;
+    if (found) {
+        dedup_recipe_path(rel, recipe);
+        found = unlink(recipe) == 0 || errno == ENOENT;
+    }
+    if (found) {
+        removed = dedup.entries[i];
+        memmove(&dedup.entries[i], &dedup.entries[i + 1], (dedup.count - i - 1) * sizeof(removed));
+        dedup.count--;
+        dedup.logical_bytes -= removed.size;
+    }
+    pthread_rwlock_unlock(&dedup.lock);
+    if (!found) return -1;
+
+    snprintf(recipe, PATH_MAX, "%.*s/recipes", DEDUP_DIR_MAX, dedup.dir);
+    int dir_fd = open(recipe, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        durable_sync(&dir_fd, 1, 0);
+        close(dir_fd);
+    }
+    dedup_release(removed.chunks, removed.chunk_count);
+    free(removed.chunks);
+    free(removed.path);
+    pthread_rwlock_wrlock(&catalog.lock);
+    catalog.generation++;
+    pthread_rwlock_unlock(&catalog.lock);
+    return 0;
+}
+
+// Add the type ext files under dir held as chunks to a listing page, keeping the first
+// limit paths after its cursor
+void dedup_list_page(const char *dir, const char *ext, struct listing_page *page) {
+    char rel[PATH_MAX], key[2 * PATH_MAX];
+    if (catalog_relpath(dir, rel) < 0 || !page->entries) return;
+    size_t prefix_len = snprintf(key, sizeof(key), "%s%s", rel, rel[0] ? "/" : "");
+    snprintf(key + prefix_len, sizeof(key) - prefix_len, "%s", page->after);
+    int found, added = 0;
+    pthread_rwlock_rdlock(&dedup.lock);
+    size_t i = dedup_find(key, &found);
+    if (found && page->after[0]) i++;
+    for (; i < dedup.count && strncmp(dedup.entries[i].path, key, prefix_len) == 0; i++) {
+        const struct dedup_entry *e = &dedup.entries[i];
+        if (strcmp(e->ext, ext) != 0) continue;
+        // Only the first limit can reach the page
+        if (added == page->limit) {
+            page->more = 1;
+            break;
+        }
+        struct page_entry *grown = realloc(page->entries, (page->count + 1) * sizeof(*grown));
+        if (!grown) break;
+        page->entries = grown;
+        page->entries[page->count++] = (struct page_entry){strdup(e->path + prefix_len), e->size, e->mtime};
+        added++;
+    }
+    pthread_rwlock_unlock(&dedup.lock);
+    if (!added) return;
+    qsort(page->entries, page->count, sizeof(*page->entries), compare_page_entries);
+    while (page->count > page->limit) {
+        free(page->entries[--page->count].path);
+        page->more = 1;
+    }
+}
+
+// Whether the file downlf would send for path has size bytes with the SHA-256 digest
+int content_matches(const char *path, uint64_t size, const unsigned char *digest) {
+    unsigned char stored[SHA256_LEN];
+    struct stat statbuf;
+    uint64_t base = 0, stored_size = 0;
+    int fd = segment_lookup(path, &statbuf, &base);
+    if (fd >= 0) {
+        int ok = (uint64_t)statbuf.st_size == size && digest_file(fd, base, size, stored) == 0;
+        close(fd);
+        return ok && memcmp(stored, digest, SHA256_LEN) == 0;
+    }
+    int held = dedup_content(path, &stored_size, stored);
+    if (held >= 0) return held && stored_size == size && memcmp(stored, digest, SHA256_LEN) == 0;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return 0;
+    if (fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode) || (uint64_t)statbuf.st_size != size) {
+        close(fd);
+        return 0;
+    }
+    // Uploads replace files by renaming over them, so a new copy has a new inode
+    struct digest_cache_entry *slot = &digest_cache.slots[statbuf.st_ino % DIGEST_CACHE_SLOTS];
+    pthread_mutex_lock(&digest_cache.lock);
+    int cached = slot->ino == statbuf.st_ino && slot->dev == statbuf.st_dev && slot->size == statbuf.st_size &&
+                 slot->mtime.tv_sec == statbuf.st_mtim.tv_sec && slot->mtime.tv_nsec == statbuf.st_mtim.tv_nsec &&
+                 slot->ctime.tv_sec == statbuf.st_ctim.tv_sec && slot->ctime.tv_nsec == statbuf.st_ctim.tv_nsec;
+    if (cached) memcpy(stored, slot->digest, SHA256_LEN);
+    pthread_mutex_unlock(&digest_cache.lock);
+    if (!cached) {
+        if (digest_file(fd, 0, size, stored) < 0) {
+            close(fd);
+            return 0;
+        }
+        pthread_mutex_lock(&digest_cache.lock);
+        *slot = (struct digest_cache_entry){statbuf.st_dev, statbuf.st_ino, statbuf.st_size, statbuf.st_mtim, statbuf.st_ctim, {0}};
+        memcpy(slot->digest, stored, SHA256_LEN);
+        pthread_mutex_unlock(&digest_cache.lock);
+    }
+    close(fd);
+    return memcmp(stored, digest, SHA256_LEN) == 0;
+}
+
+// SHA-256 of size bytes of fd from offset. Returns -1 if they cannot all be read.
+int digest_file(int fd, uint64_t offset, uint64_t size, unsigned char *digest) {
+    struct sha256_ctx ctx;
+    unsigned char *buf = malloc(DIGEST_READ);
+    uint64_t done = 0;
+    if (!buf) return -1;
+    sha256_init(&ctx);
+    while (done < size) {
+        size_t want = size - done < DIGEST_READ ? size - done : DIGEST_READ;
+        ssize_t bytes = pread(fd, buf, want, offset + done);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) break;
+        sha256_update(&ctx, buf, bytes);
+        done += bytes;
+    }
+    free(buf);
+    if (done < size) return -1;
+    sha256_final(&ctx, digest);
+    return 0;
+}
+
+// Start the catalog of root: load its snapshot, or scan the tree if there is no usable
+// one, then keep it current from inotify events in a background thread
+void catalog_init(const char *root, const char *snapshot) {
+    snprintf(catalog.root, PATH_MAX, "%s", root);
+    snprintf(catalog.snapshot, PATH_MAX, "%s", snapshot);
+    create_directories(root);
+    catalog.inotify_fd = inotify_init1(IN_CLOEXEC);
+    size_t swept;
+    if (catalog.inotify_fd < 0) {
+        perror("inotify_init1 failed");
+        if ((swept = sweep_staged_tree(root)) > 0) printf("S2: Removed %zu staged files of interrupted uploads\n", swept);
+        return;
+    }
+    catalog.ready = 1;
+    int loaded = catalog_load();
+    if (!loaded) catalog_rebuild();
+    if ((swept = catalog_sweep_staged()) > 0) printf("S2: Removed %zu staged files of interrupted uploads\n", swept);
+    if (!loaded) catalog_save();
+    catalog.last_save = time(NULL);
+    printf("S2: Catalog of %s holds %zu files in %zu directories (%s)\n", root, catalog.count,
+           catalog.dir_count, loaded ? "from snapshot" : "scanned");
+
+    // The watcher must not take the shutdown signal meant for the main thread
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, catalog_watcher, NULL) == 0) pthread_detach(tid);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+// Remove the staged files of uploads a crash interrupted. Each is either in the snapshot
+// or in a directory rescanned since, so the catalog holds every one left on disk. Called
+// from catalog_init(), before any upload is staged. Returns how many were removed.
+size_t catalog_sweep_staged(void) {
+    char path[PATH_MAX];
+    size_t kept = 0, swept = 0;
+    for (size_t i = 0; i < catalog.count; i++) {
+        struct catalog_entry *e = &catalog.entries[i];
+        const char *slash = strrchr(e->path, '/');
+        if (staged_name(slash ? slash + 1 : e->path)) {
+            int removed = catalog_abspath(e->path, path) == 0 && unlink(path) == 0;
+            if (removed || errno == ENOENT) {
+                swept += removed;
+                free(e->path);
+                continue;
+            }
+        }
+        catalog.entries[kept++] = *e;
+    }
+    if (kept < catalog.count) __atomic_store_n(&catalog.dirty, 1, __ATOMIC_RELAXED);
+    catalog.count = kept;
+    return swept;
+}
+
+// Bring the entry for path up to date after this server changed the file, so the next
+// request sees the change without waiting for its inotify event
+void catalog_note(const char *path) {
+    char rel[PATH_MAX];
+    if (catalog.inotify_fd < 0 || catalog_relpath(path, rel) < 0 || rel[0] == '\0') return;
+    pthread_rwlock_wrlock(&catalog.lock);
+    catalog_refresh(rel);
+    __atomic_store_n(&catalog.dirty, 1, __ATOMIC_RELAXED);
+    catalog.generation++;
+    pthread_rwlock_unlock(&catalog.lock);
+}
+
+// Generation of the catalog, bumped on every change to the stored files
+uint64_t catalog_generation(void) {
+    pthread_rwlock_rdlock(&catalog.lock);
+    uint64_t generation = catalog.generation;
+    pthread_rwlock_unlock(&catalog.lock);
+    return generation;
+}
+
+// Answer a listing page from the catalog, as collect_listing_page() would by walking dir.
+// Returns -1 if the catalog cannot answer for dir, which must then be walked.
+int catalog_list_page(const char *dir, const char *ext, const char *after, int limit, int want_long, struct listing_page *page) {
+    char rel[PATH_MAX];
+    if (catalog.inotify_fd < 0 || catalog_relpath(dir, rel) < 0) return -1;
+    pthread_rwlock_rdlock(&catalog.lock);
+    if (!catalog.ready || !catalog_dir_by_path(rel)) {
+        pthread_rwlock_unlock(&catalog.lock);
+        return -1;
+    }
+    memset(page, 0, sizeof(*page));
+    page->after = after;
+    page->limit = limit;
+    page->want_long = want_long;
+    page->entries = malloc((limit + 1) * sizeof(*page->entries));
+
+    // Files below dir share the prefix "rel/", so they sit in one run of the sorted
+    // catalog, in the same order as their paths relative to dir
+    char key[2 * PATH_MAX];
+    size_t prefix_len = snprintf(key, sizeof(key), "%s%s", rel, rel[0] ? "/" : "");
+    snprintf(key + prefix_len, sizeof(key) - prefix_len, "%s", after);
+    int found;
+    size_t i = catalog_find(key, &found);
+    if (found && after[0]) i++;
+    for (; i < catalog.count && strncmp(catalog.entries[i].path, key, prefix_len) == 0; i++) {
+        const struct catalog_entry *e = &catalog.entries[i];
+        if (strcmp(e->ext, ext) != 0) continue;
+        if (page->count == limit) {
+            page->more = 1;
+            break;
+        }
+        struct page_entry *entry = &page->entries[page->count++];
+        entry->path = strdup(e->path + prefix_len);
+        entry->size = e->size;
+        entry->mtime = e->mtime;
+    }
+    pthread_rwlock_unlock(&catalog.lock);
+    return 0;
+}
+
+// Write the catalog to its snapshot file, replacing the previous snapshot atomically
+int catalog_save(void) {
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", catalog.snapshot);
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp) return -1;
+    pthread_rwlock_rdlock(&catalog.lock);
+    __atomic_store_n(&catalog.dirty, 0, __ATOMIC_RELAXED);
+    uint32_t header[2] = {CATALOG_MAGIC, strlen(catalog.root)};
+    uint64_t counts[2] = {catalog.dir_count, catalog.count};
+    fwrite(header, sizeof(header), 1, fp);
+    fwrite(catalog.root, 1, header[1], fp);
+    fwrite(counts, sizeof(counts), 1, fp);
+    for (size_t i = 0; i < catalog.dir_count; i++) {
+        const struct catalog_dir *d = &catalog.dirs[i];
+        uint16_t len = strlen(d->path);
+        int64_t mtime[2] = {d->mtime.tv_sec, d->mtime.tv_nsec};
+        fwrite(&len, sizeof(len), 1, fp);
+        fwrite(d->path, 1, len, fp);
+        fwrite(mtime, sizeof(mtime), 1, fp);
+    }
+    for (size_t i = 0; i < catalog.count; i++) {
+        const struct catalog_entry *e = &catalog.entries[i];
+        uint16_t len = strlen(e->path);
+        int64_t fields[2] = {e->size, e->mtime};
+        fwrite(&len, sizeof(len), 1, fp);
+        fwrite(e->path, 1, len, fp);
+        fwrite(fields, sizeof(fields), 1, fp);
+    }
+    pthread_rwlock_unlock(&catalog.lock);
+    int ok = !ferror(fp);
+    if (fclose(fp) != 0) ok = 0;
+    if (!ok || rename(tmp_path, catalog.snapshot) != 0) {
+        remove(tmp_path);
+        __atomic_store_n(&catalog.dirty, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+// Apply inotify events to the catalog as they arrive and write the snapshot at most
+// every CATALOG_SAVE_INTERVAL seconds while it changes
+void *catalog_watcher(void *arg) {
+    char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = {.fd = catalog.inotify_fd, .events = POLLIN};
+    while (1) {
+        if (poll(&pfd, 1, CATALOG_SAVE_INTERVAL * 1000) > 0) {
+            ssize_t len = read(catalog.inotify_fd, buf, sizeof(buf));
+            pthread_rwlock_wrlock(&catalog.lock);
+            for (ssize_t pos = 0; pos < len; ) {
+                const struct inotify_event *ev = (const struct inotify_event *)(buf + pos);
+                catalog_apply_event(ev);
+                pos += sizeof(*ev) + ev->len;
+            }
+            if (len > 0) {
+                __atomic_store_n(&catalog.dirty, 1, __ATOMIC_RELAXED);
+                catalog.generation++;
+            }
+            pthread_rwlock_unlock(&catalog.lock);
+        }
+        if (__atomic_load_n(&catalog.dirty, __ATOMIC_RELAXED) && time(NULL) - catalog.last_save >= CATALOG_SAVE_INTERVAL) {
+            catalog_save();
+            catalog.last_save = time(NULL);
+        }
+    }
+    return NULL;
+}
+
+// Update the catalog for one event. Called with the catalog write-locked.
+void catalog_apply_event(const struct inotify_event *ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        printf("S2: Catalog missed events; rescanning %s\n", catalog.root);
+        catalog_rebuild();
+        return;
+    }
+    struct catalog_dir *dir = catalog_dir_by_wd(ev->wd);
+    if (!dir) return;
+    if (ev->mask & IN_IGNORED) {
+        // The directory is gone; its parent's event drops its files
+        dir->wd = -1;
+        return;
+    }
+    if (ev->len == 0) return;
+    char rel[PATH_MAX], path[PATH_MAX];
+    if (snprintf(rel, PATH_MAX, "%s%s%s", dir->path, dir->path[0] ? "/" : "", ev->name) >= PATH_MAX) return;
+    if (!(ev->mask & IN_ISDIR)) {
+        catalog_refresh(rel);
+    } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        catalog_remove_tree(rel);
+    } else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        // Files may have appeared in the new directory before its watch was added
+        int fd = catalog_abspath(rel, path) == 0 ? open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+        if (fd >= 0) {
+            catalog_scan(fd, rel, 1);
+            close(fd);
+            catalog_sort();
+        }
+    }
+    // Record the directory's new mtime, so a snapshot shows it needs no rescan
+    struct stat statbuf;
+    dir = catalog_dir_by_wd(ev->wd);
+    if (dir && catalog_abspath(dir->path, path) == 0 && stat(path, &statbuf) == 0) dir->mtime = statbuf.st_mtim;
+}
+
+// Load the snapshot and bring it up to date: directories whose mtime changed since it was
+// written are rescanned one level deep, vanished ones dropped and new ones scanned in full.
+// Files rewritten in place while the server was down keep their recorded size and mtime.
+// Returns 0 if there is no usable snapshot.
+int catalog_load(void) {
+    FILE *fp = fopen(catalog.snapshot, "rb");
+    if (!fp) return 0;
+    uint32_t header[2];
+    uint64_t counts[2] = {0, 0};
+    char path[PATH_MAX];
+    int ok = fread(header, sizeof(header), 1, fp) == 1 && header[0] == CATALOG_MAGIC && header[1] < PATH_MAX &&
+             fread(path, 1, header[1], fp) == header[1];
+    if (ok) {
+        path[header[1]] = '\0';
+        ok = strcmp(path, catalog.root) == 0 && fread(counts, sizeof(counts), 1, fp) == 1;
+    }
+    for (uint64_t i = 0; ok && i < counts[0]; i++) {
+        uint16_t len;
+        int64_t mtime[2];
+        ok = fread(&len, sizeof(len), 1, fp) == 1 && len < PATH_MAX && fread(path, 1, len, fp) == len &&
+             fread(mtime, sizeof(mtime), 1, fp) == 1;
+        if (!ok) break;
+        path[len] = '\0';
+        struct catalog_dir *d = catalog_add_dir(path);
+        d->mtime.tv_sec = mtime[0];
+        d->mtime.tv_nsec = mtime[1];
+    }
+    for (uint64_t i = 0; ok && i < counts[1]; i++) {
+        uint16_t len;
+        int64_t fields[2];
+        ok = fread(&len, sizeof(len), 1, fp) == 1 && len < PATH_MAX && fread(path, 1, len, fp) == len &&
+             fread(fields, sizeof(fields), 1, fp) == 1;
+        if (!ok) break;
+        path[len] = '\0';
+        struct stat statbuf = {.st_size = fields[0]};
+        statbuf.st_mtime = fields[1];
+        catalog_append(path, &statbuf);
+    }
+    fclose(fp);
+    if (!ok || !catalog_dir_by_path("")) return 0;
+    catalog_sort();
+
+    // Check every directory with one stat; drop what vanished before rescanning what changed,
+    // since dropping relies on the catalog being sorted
+    size_t dir_count = catalog.dir_count;
+    char **paths = malloc(dir_count * sizeof(*paths));
+    int *changed = calloc(dir_count, sizeof(*changed));
+    for (size_t i = 0; i < dir_count; i++) paths[i] = strdup(catalog.dirs[i].path);
+    for (size_t i = 0; i < dir_count; i++) {
+        struct catalog_dir *d = catalog_dir_by_path(paths[i]);
+        if (!d) continue;
+        struct stat statbuf;
+        if (catalog_abspath(paths[i], path) < 0 || lstat(path, &statbuf) != 0 || !S_ISDIR(statbuf.st_mode)) {
+            // A vanished root means the snapshot is of no use
+            if (paths[i][0] == '\0') ok = 0;
+            else catalog_remove_tree(paths[i]);
+        } else if (statbuf.st_mtim.tv_sec != d->mtime.tv_sec || statbuf.st_mtim.tv_nsec != d->mtime.tv_nsec) {
+            catalog_drop_files(paths[i]);
+            changed[i] = 1;
+        } else {
+            d->wd = inotify_add_watch(catalog.inotify_fd, path, CATALOG_EVENTS);
+            if (d->wd < 0) catalog.ready = 0;
+        }
+    }
+    for (size_t i = 0; i < dir_count; i++) {
+        if (changed[i]) {
+            int fd = catalog_abspath(paths[i], path) == 0 ? open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+            if (fd >= 0) {
+                catalog_scan(fd, paths[i], 0);
+                close(fd);
+            }
+        }
+        free(paths[i]);
+    }
+    free(paths);
+    free(changed);
+    catalog_sort();
+    return ok;
+}
+
+// Forget everything and scan the whole tree again. Called with the catalog write-locked
+// (or before it is shared).
+void catalog_rebuild(void) {
+    for (size_t i = 0; i < catalog.count; i++) free(catalog.entries[i].path);
+    for (size_t i = 0; i < catalog.dir_count; i++) free(catalog.dirs[i].path);
+    catalog.count = catalog.dir_count = 0;
+    int fd = open(catalog.root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        catalog_scan(fd, "", 1);
+        close(fd);
+    }
+    catalog_sort();
+}
+
+// Watch directory rel (open as dir_fd) and append its files to the catalog. Subdirectories
+// are scanned as well if recursive is set or they are not catalogued yet. Entries are
+// appended unsorted, so the caller must run catalog_sort() afterwards.
+void catalog_scan(int dir_fd, const char *rel, int recursive) {
+    char path[PATH_MAX];
+    if (catalog_abspath(rel, path) < 0) return;
+    struct catalog_dir *dir = catalog_dir_by_path(rel);
+    if (!dir) dir = catalog_add_dir(rel);
+    // Watch before reading, so files created meanwhile are reported rather than missed
+    dir->wd = inotify_add_watch(catalog.inotify_fd, path, CATALOG_EVENTS);
+    if (dir->wd < 0 && catalog.ready) {
+        fprintf(stderr, "S2: Cannot watch %s (%s); listings will walk the tree\n", path, strerror(errno));
+        catalog.ready = 0;
+    }
+    struct stat statbuf;
+    if (fstat(dir_fd, &statbuf) == 0) dir->mtime = statbuf.st_mtim;
+
+    char *buf = malloc(WALK_BUFFER);
+    long n;
+    while (buf && (n = syscall(SYS_getdents64, dir_fd, buf, WALK_BUFFER)) > 0) {
+        for (long pos = 0; pos < n; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + pos);
+            pos += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            char child[PATH_MAX];
+            if (snprintf(child, PATH_MAX, "%s%s%s", rel, rel[0] ? "/" : "", name) >= PATH_MAX) continue;
+            if (d->d_type == DT_DIR || d->d_type == DT_UNKNOWN) {
+                if (!recursive && catalog_dir_by_path(child)) continue;
+                int sub_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (sub_fd >= 0) {
+                    catalog_scan(sub_fd, child, 1);
+                    close(sub_fd);
+                    continue;
+                }
+            }
+            if ((d->d_type == DT_REG || d->d_type == DT_UNKNOWN) &&
+                fstatat(dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(statbuf.st_mode))
+                catalog_append(child, &statbuf);
+        }
+    }
+    free(buf);
+}
+
+// Re-read one file's status: update its entry, add it, or drop it if it is no longer a
+// regular file. Called with the catalog write-locked.
+void catalog_refresh(const char *rel) {
+    char path[PATH_MAX];
+    struct stat statbuf;
+    int found;
+    int exists = catalog_abspath(rel, path) == 0 && lstat(path, &statbuf) == 0 && S_ISREG(statbuf.st_mode);
+    size_t i = catalog_find(rel, &found);
+    if (found && !exists) {
+        free(catalog.entries[i].path);
+        memmove(&catalog.entries[i], &catalog.entries[i + 1], (catalog.count - i - 1) * sizeof(*catalog.entries));
+        catalog.count--;
+    } else if (found) {
+        catalog.entries[i].size = statbuf.st_size;
+        catalog.entries[i].mtime = statbuf.st_mtime;
+    } else if (exists) {
+        // Insert in place to keep the catalog sorted
+        catalog_append(rel, &statbuf);
+        struct catalog_entry entry = catalog.entries[catalog.count - 1];
+        memmove(&catalog.entries[i + 1], &catalog.entries[i], (catalog.count - 1 - i) * sizeof(*catalog.entries));
+        catalog.entries[i] = entry;
+    }
+}
+
+// Drop every file and directory below rel, and the directory itself
+void catalog_remove_tree(const char *rel) {
+    char prefix[PATH_MAX + 1];
+    size_t prefix_len = snprintf(prefix, sizeof(prefix), "%s/", rel);
+    int found;
+    size_t start = catalog_find(prefix, &found), end = start;
+    while (end < catalog.count && strncmp(catalog.entries[end].path, prefix, prefix_len) == 0) free(catalog.entries[end++].path);
+    memmove(&catalog.entries[start], &catalog.entries[end], (catalog.count - end) * sizeof(*catalog.entries));
+    catalog.count -= end - start;
+    for (size_t i = 0; i < catalog.dir_count; ) {
+        struct catalog_dir *d = &catalog.dirs[i];
+        if (strcmp(d->path, rel) == 0 || strncmp(d->path, prefix, prefix_len) == 0) {
+            // A directory moved elsewhere keeps its watch unless it is removed
+            if (d->wd >= 0) inotify_rm_watch(catalog.inotify_fd, d->wd);
+            catalog_remove_dir(d);
+        } else {
+            i++;
+        }
+    }
+}
+
+// Drop the files directly in directory rel, keeping those in its subdirectories
+void catalog_drop_files(const char *rel) {
+    char prefix[PATH_MAX + 1];
+    size_t prefix_len = snprintf(prefix, sizeof(prefix), "%s%s", rel, rel[0] ? "/" : "");
+    int found;
+    size_t start = catalog_find(prefix, &found), out = start, i = start;
+    for (; i < catalog.count && strncmp(catalog.entries[i].path, prefix, prefix_len) == 0; i++) {
+        if (strchr(catalog.entries[i].path + prefix_len, '/')) catalog.entries[out++] = catalog.entries[i];
+        else free(catalog.entries[i].path);
+    }
+    memmove(&catalog.entries[out], &catalog.entries[i], (catalog.count - i) * sizeof(*catalog.entries));
+    catalog.count -= i - out;
+}
+
+// Append an entry without keeping the catalog sorted
+void catalog_append(const char *rel, const struct stat *statbuf) {
+    if (catalog.count == catalog.capacity) {
+        catalog.capacity = catalog.capacity ? 2 * catalog.capacity : 1024;
+        catalog.entries = realloc(catalog.entries, catalog.capacity * sizeof(*catalog.entries));
+    }
+    struct catalog_entry *e = &catalog.entries[catalog.count++];
+    e->path = strdup(rel);
+    const char *base = strrchr(e->path, '/');
+    base = base ? base + 1 : e->path;
+    e->ext = strrchr(base, '.') ? strrchr(base, '.') : base + strlen(base);
+    e->size = statbuf->st_size;
+    e->mtime = statbuf->st_mtime;
+}
+
+static int compare_catalog_entries(const void *a, const void *b) {
+    return strcmp(((const struct catalog_entry *)a)->path, ((const struct catalog_entry *)b)->path);
+}
+
+// Sort appended entries into place, dropping duplicates a rescan may have added
+void catalog_sort(void) {
+    qsort(catalog.entries, catalog.count, sizeof(*catalog.entries), compare_catalog_entries);
+    size_t out = 0;
+    for (size_t i = 0; i < catalog.count; i++) {
+        if (out > 0 && strcmp(catalog.entries[out - 1].path, catalog.entries[i].path) == 0) {
+            free(catalog.entries[out - 1].path);
+            out--;
+        }
+        catalog.entries[out++] = catalog.entries[i];
+    }
+    catalog.count = out;
+}
+
+// Index of the first entry whose path is not less than path; found tells whether it matches
+size_t catalog_find(const char *path, int *found) {
+    size_t lo = 0, hi = catalog.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(catalog.entries[mid].path, path) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    *found = lo < catalog.count && strcmp(catalog.entries[lo].path, path) == 0;
+    return lo;
+}
+
+struct catalog_dir *catalog_add_dir(const char *rel) {
+    if (catalog.dir_count == catalog.dir_capacity) {
+        catalog.dir_capacity = catalog.dir_capacity ? 2 * catalog.dir_capacity : 64;
+        catalog.dirs = realloc(catalog.dirs, catalog.dir_capacity * sizeof(*catalog.dirs));
+    }
+    struct catalog_dir *d = &catalog.dirs[catalog.dir_count++];
+    d->path = strdup(rel);
+    d->wd = -1;
+    d->mtime.tv_sec = d->mtime.tv_nsec = 0;
+    return d;
+}
+
+void catalog_remove_dir(struct catalog_dir *d) {
+    free(d->path);
+    *d = catalog.dirs[--catalog.dir_count];
+}
+
+struct catalog_dir *catalog_dir_by_path(const char *rel) {
+    for (size_t i = 0; i < catalog.dir_count; i++)
+        if (strcmp(catalog.dirs[i].path, rel) == 0) return &catalog.dirs[i];
+    return NULL;
+}
+
+struct catalog_dir *catalog_dir_by_wd(int wd) {
+    for (size_t i = 0; i < catalog.dir_count; i++)
+        if (catalog.dirs[i].wd == wd) return &catalog.dirs[i];
+    return NULL;
+}
+
+// Absolute path of rel, which is relative to the catalog root. Returns -1 with errno
+// ENAMETOOLONG if it does not fit in PATH_MAX.
+int catalog_abspath(const char *rel, char *path) {
+    if (snprintf(path, PATH_MAX, "%s%s%s", catalog.root, rel[0] ? "/" : "", rel) < PATH_MAX) return 0;
+    errno = ENAMETOOLONG;
+    return -1;
+}
+
+// Path of path relative to the catalog root, with trailing slashes removed. Only paths in
+// canonical form (no empty, "." or ".." components) can be looked up; others return -1.
+int catalog_relpath(const char *path, char *rel) {
+    size_t root_len = strlen(catalog.root);
+    if (strncmp(path, catalog.root, root_len) != 0 || (path[root_len] != '\0' && path[root_len] != '/')) return -1;
+    const char *p = path + root_len;
+    while (*p == '/') p++;
+    if (snprintf(rel, PATH_MAX, "%s", p) >= PATH_MAX) return -1;
+    size_t len = strlen(rel);
+    while (len > 0 && rel[len - 1] == '/') rel[--len] = '\0';
+    for (char *c = rel; *c; ) {
+        size_t n = strcspn(c, "/");
+        if (n == 0 || (n == 1 && c[0] == '.') || (n == 2 && c[0] == '.' && c[1] == '.')) return -1;
+        c += n;
+        if (*c) c++;
+    }
+    return 0;
+}
+
+// walk_files() callback recording one archive member
+static void tar_add_file(const char *path, int dir_fd, const char *name, void *ctx) {
+    struct tar_list *list = ctx;
+    struct stat statbuf;
+    if (fstatat(dir_fd, name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(statbuf.st_mode)) return;
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? 2 * list->capacity : 64;
+        list->entries = realloc(list->entries, list->capacity * sizeof(*list->entries));
+    }
+    struct tar_entry *entry = &list->entries[list->count++];
+    entry->path = strdup(path);
+    entry->size = statbuf.st_size;
+    entry->mtime = statbuf.st_mtime;
+    entry->mode = statbuf.st_mode;
+    entry->segment = 0;
+    entry->offset = 0;
+    entry->chunks = NULL;
+    entry->chunk_count = 0;
+}
+
+static int compare_tar_entries(const void *a, const void *b) {
+    return strcmp(((const struct tar_entry *)a)->path, ((const struct tar_entry *)b)->path);
+}
+
+// Build the archive listing from the catalog rather than walking root. Sizes and modes
+// are read from the files themselves, since the archive must match their contents.
+// Returns -1 if the catalog cannot answer for root.
+int catalog_tar_list(const char *root, const char *ext, struct tar_list *list) {
+    if (catalog.inotify_fd < 0 || strcmp(root, catalog.root) != 0) return -1;
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) return -1;
+    pthread_rwlock_rdlock(&catalog.lock);
+    int ready = catalog.ready;
+    for (size_t i = 0; ready && i < catalog.count; i++) {
+        const struct catalog_entry *e = &catalog.entries[i];
+        // Hidden top-level entries are left out, as when walking
+        if (e->path[0] == '.' || strcmp(e->ext, ext) != 0) continue;
+        tar_add_file(e->path, root_fd, e->path, list);
+    }
+    pthread_rwlock_unlock(&catalog.lock);
+    close(root_fd);
+    return ready ? 0 : -1;
+}
+
+// Open the cached archive of the type ext files under root, building it first if the
+// catalog changed since it was cached; concurrent requests wait for a single build.
+// Returns a descriptor positioned at the start and sets *size, -2 if there are no such
+// files, or -1 if the archive cannot be cached and must be streamed.
+int tar_cache_open(const char *root, const char *ext, uint64_t *size) {
+    if (catalog.inotify_fd < 0 || !catalog.ready || strcmp(root, catalog.root) != 0) return -1;
+    pthread_mutex_lock(&tar_cache_lock);
+    if (!tar_cache_dir[0] && tar_cache_prepare() < 0) {
+        pthread_mutex_unlock(&tar_cache_lock);
+        return -1;
+    }
+    struct tar_cache_entry *c = NULL;
+    for (int i = 0; i < TAR_CACHE_TYPES && !c; i++) {
+        if (!tar_cache[i].ext[0]) snprintf(tar_cache[i].ext, sizeof(tar_cache[i].ext), "%s", ext);
+        if (strcmp(tar_cache[i].ext, ext) == 0) c = &tar_cache[i];
+    }
+    if (!c) {
+        pthread_mutex_unlock(&tar_cache_lock);
+        return -1;
+    }
+    while (1) {
+        if (c->path[0] && c->generation == catalog_generation()) {
+            int fd = open(c->path, O_RDONLY | O_CLOEXEC);
+            *size = c->size;
+            pthread_mutex_unlock(&tar_cache_lock);
+            return fd;
+        }
+        if (!c->building) break;
+        pthread_cond_wait(&tar_cache_cond, &tar_cache_lock);
+    }
+    c->building = 1;
+    pthread_mutex_unlock(&tar_cache_lock);
+
+    // Build outside the lock. The archive is tagged with the generation it started from,
+    // so a change made while it is written makes the next request rebuild it.
+    uint64_t generation = catalog_generation();
+    // An archive path too long for PATH_MAX is streamed instead
+    char path[PATH_MAX];
+    int path_ok = snprintf(path, PATH_MAX, "%s/%s.%lu.tar", tar_cache_dir, ext[0] == '.' ? ext + 1 : ext, generation) < PATH_MAX;
+    struct tar_list list;
+    build_tar_list(root, ext, &list);
+    uint64_t archive_size = tar_archive_size(&list);
+    int fd = path_ok && list.count > 0 ? open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+    if (fd >= 0 && write_tar_archive(fd, root, &list, archive_size) < 0) {
+        close(fd);
+        unlink(path);
+        fd = -1;
+    }
+    size_t count = list.count;
+    free_tar_list(&list);
+
+    pthread_mutex_lock(&tar_cache_lock);
+    c->building = 0;
+    if (fd >= 0) {
+        // Senders of the previous archive keep it open, so it can go at once
+        if (c->path[0] && strcmp(c->path, path) != 0) unlink(c->path);
+        snprintf(c->path, PATH_MAX, "%s", path);
+        c->generation = generation;
+        c->size = archive_size;
+        printf("S2: Cached %s archive of %zu files (%lu bytes) at generation %lu\n", ext, count, archive_size, generation);
+    }
+    pthread_cond_broadcast(&tar_cache_cond);
+    pthread_mutex_unlock(&tar_cache_lock);
+    if (fd < 0) return count == 0 ? -2 : -1;
+    *size = archive_size;
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+// walk_files() callback removing an archive left by a previous run
+static void tar_cache_unlink(const char *path, int dir_fd, const char *name, void *ctx) {
+    unlinkat(dir_fd, name, 0);
+}
+
+// Create the archive cache directory, emptied of archives from earlier runs since their
+// generations no longer mean anything. Called with tar_cache_lock held.
+int tar_cache_prepare(void) {
+    char *home = getenv("HOME");
+    if (!home) return -1;
+    char dir[PATH_MAX];
+    snprintf(dir, PATH_MAX, "%s/.S2.tarcache", home);
+    create_directories(dir);
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return -1;
+    walk_files(dir_fd, "", ".tar", 0, tar_cache_unlink, NULL);
+    close(dir_fd);
+    snprintf(tar_cache_dir, PATH_MAX, "%s", dir);
+    return 0;
+}
+
+// Compress one block as raw deflate ending on a byte boundary, primed with the tail of
+// the block before it, so concatenated blocks form a single deflate stream
+static void gzip_compress_block(z_stream *strm, struct gzip_block *b) {
+    deflateReset(strm);
+    if (b->dict_len > 0) deflateSetDictionary(strm, b->dict, b->dict_len);
+    strm->next_in = b->in;
+    strm->avail_in = b->in_len;
+    strm->next_out = b->out;
+    strm->avail_out = GZIP_OUT_MAX;
+    deflate(strm, Z_SYNC_FLUSH);
+    b->out_len = GZIP_OUT_MAX - strm->avail_out;
+    b->crc = crc32(0, b->in, b->in_len);
+}
+
+// Compression thread: take the oldest block waiting for compression until the job stops
+void *gzip_worker(void *arg) {
+    struct gzip_job *job = arg;
+    z_stream strm = {0};
+    if (deflateInit2(&strm, GZIP_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+    pthread_mutex_lock(&job->lock);
+    while (1) {
+        while (!job->stop && job->next_compress == job->next_read) pthread_cond_wait(&job->cond, &job->lock);
+        if (job->next_compress == job->next_read) break;
+        struct gzip_block *b = &job->blocks[job->next_compress++ % job->slots];
+        pthread_mutex_unlock(&job->lock);
+        gzip_compress_block(&strm, b);
+        pthread_mutex_lock(&job->lock);
+        b->done = 1;
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+    deflateEnd(&strm);
+    return NULL;
+}
+
+// Read up to size bytes, stopping short only at end of input. Returns -1 on error.
+static ssize_t read_full(int fd, unsigned char *buf, size_t size) {
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(fd, buf + got, size - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        got += n;
+    }
+    return got;
+}
+
+// Send everything read from src_fd as a gzip stream in DATA frames, the last without
+// FL_MORE. Blocks of GZIP_BLOCK bytes are compressed in parallel by gzip_threads threads
+// while earlier blocks are sent, so output starts long before the input is consumed.
+// Returns -1 if the stream could not be completed.
+int send_gzip_stream(int sock, int src_fd, uint32_t request_id) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = gzip_threads > 0 ? gzip_threads : ncpu > 0 ? ncpu : 1;
+    struct gzip_job job = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+    job.slots = 2 * threads + 2;
+    job.blocks = calloc(job.slots, sizeof(*job.blocks));
+    for (int i = 0; i < job.slots; i++) {
+        job.blocks[i].in = malloc(GZIP_BLOCK);
+        job.blocks[i].out = malloc(GZIP_OUT_MAX);
+    }
+    pthread_t *tids = malloc(threads * sizeof(*tids));
+    int started = 0;
+    while (started < threads && pthread_create(&tids[started], NULL, gzip_worker, &job) == 0) started++;
+
+    // gzip header: deflate, no name, unknown OS
+    static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255};
+    int ok = started > 0 && send_frame(sock, OP_DATA, FL_MORE, 0, request_id, header, sizeof(header)) == 0;
+    uint64_t next_send = 0, total = 0;
+    uLong crc = crc32(0, NULL, 0);
+    int eof = 0;
+    while (ok) {
+        // Keep every slot busy with input
+        while (!eof && job.next_read - next_send < (uint64_t)job.slots) {
+            struct gzip_block *b = &job.blocks[job.next_read % job.slots];
+            ssize_t n = read_full(src_fd, b->in, GZIP_BLOCK);
+            if (n < 0) ok = 0;
+            if (n <= 0) {
+                eof = 1;
+                break;
+            }
+            if (n < GZIP_BLOCK) eof = 1;
+            b->in_len = n;
+            b->dict_len = 0;
+            if (job.next_read > 0) {
+                // The previous block stays in its slot until this one has been sent
+                const struct gzip_block *prev = &job.blocks[(job.next_read - 1) % job.slots];
+                b->dict_len = prev->in_len < GZIP_WINDOW ? prev->in_len : GZIP_WINDOW;
+                memcpy(b->dict, prev->in + prev->in_len - b->dict_len, b->dict_len);
+            }
+            pthread_mutex_lock(&job.lock);
+            b->done = 0;
+            job.next_read++;
+            pthread_cond_broadcast(&job.cond);
+            pthread_mutex_unlock(&job.lock);
+        }
+        if (!ok || next_send == job.next_read) break;
+
+        // Send the oldest block once it is compressed
+        struct gzip_block *b = &job.blocks[next_send % job.slots];
+        pthread_mutex_lock(&job.lock);
+        while (!b->done) pthread_cond_wait(&job.cond, &job.lock);
+        pthread_mutex_unlock(&job.lock);
+        if (send_frame(sock, OP_DATA, FL_MORE, 0, request_id, b->out, b->out_len) < 0) ok = 0;
+        crc = crc32_combine(crc, b->crc, b->in_len);
+        total += b->in_len;
+        next_send++;
+    }
+
+    pthread_mutex_lock(&job.lock);
+    job.stop = 1;
+    pthread_cond_broadcast(&job.cond);
+    pthread_mutex_unlock(&job.lock);
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    for (int i = 0; i < job.slots; i++) {
+        free(job.blocks[i].in);
+        free(job.blocks[i].out);
+    }
+    free(job.blocks);
+    free(tids);
+    if (!ok) return -1;
+
+    // An empty final deflate block, then the CRC and length of the input
+    unsigned char trailer[10] = {0x03, 0x00};
+    for (int i = 0; i < 4; i++) {
+        trailer[2 + i] = crc >> (8 * i);
+        trailer[6 + i] = total >> (8 * i);
+    }
+    return send_frame(sock, OP_DATA, 0, 0, request_id, trailer, sizeof(trailer));
+}
+
+// Archive writer thread feeding a pipe, for archives that are not cached
+struct tar_pipe {
+    int fd;
+    const char *root;
+    const struct tar_list *list;
+    uint64_t archive_size;
+};
+
+static void *tar_pipe_writer(void *arg) {
+    struct tar_pipe *tp = arg;
+    // A reader that gives up must only end the write, not raise SIGPIPE
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    write_tar_archive(tp->fd, tp->root, tp->list, tp->archive_size);
+    close(tp->fd);
+    return NULL;
+}
+
+// Send the archive of the type ext files under root gzip-compressed: an OK reply with the
+// uncompressed archive size, then the gzip stream. The cached archive is compressed when
+// there is one; otherwise the archive is generated into a pipe as it is compressed.
+// Returns -2 before sending anything if there are no such files, -1 if the stream broke.
+int send_tar_gzip(int sock, const char *root, const char *ext, uint32_t request_id) {
+    uint64_t archive_size;
+    int src_fd = tar_cache_open(root, ext, &archive_size);
+    if (src_fd == -2) return -2;
+    struct tar_list list = {0};
+    struct tar_pipe tp;
+    pthread_t writer;
+    int piped = 0;
+    if (src_fd < 0) {
+        int fds[2];
+        build_tar_list(root, ext, &list);
+        if (list.count == 0 || pipe2(fds, O_CLOEXEC) < 0) {
+            free_tar_list(&list);
+            return -2;
+        }
+        archive_size = tar_archive_size(&list);
+        tp = (struct tar_pipe){fds[1], root, &list, archive_size};
+        if (pthread_create(&writer, NULL, tar_pipe_writer, &tp) != 0) {
+            close(fds[0]);
+            close(fds[1]);
+            free_tar_list(&list);
+            return -2;
+        }
+        src_fd = fds[0];
+        piped = 1;
+    }
+    int rc = send_size_reply(sock, request_id, archive_size, 0) < 0 ? -1 : send_gzip_stream(sock, src_fd, request_id);
+    close(src_fd);
+    if (piped) pthread_join(writer, NULL);
+    free_tar_list(&list);
+    return rc;
+}
+
+// Build the archive listing for every file of type ext under root, sorted by path.
+// Hidden top-level entries are skipped, as the shell glob in the old "find * | tar"
+// pipeline did.
+void build_tar_list(const char *root, const char *ext, struct tar_list *list) {
+    memset(list, 0, sizeof(*list));
+    int sorted = catalog_tar_list(root, ext, list) == 0;
+    if (!sorted) {
+        int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (root_fd >= 0) {
+            walk_files(root_fd, "", ext, 1, tar_add_file, list);
+            close(root_fd);
+        }
+    }
+    int added = segment_tar_list(root, ext, list);
+    added += dedup_tar_list(root, ext, list);
+    if (added > 0 || !sorted)
+        qsort(list->entries, list->count, sizeof(*list->entries), compare_tar_entries);
+}
+
+void free_tar_list(struct tar_list *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->entries[i].path);
+        free(list->entries[i].chunks);
+    }
+    free(list->entries);
+    for (uint32_t i = 0; i < list->segment_fd_count; i++)
+        if (list->segment_fds[i] >= 0) close(list->segment_fds[i]);
+    free(list->segment_fds);
+    memset(list, 0, sizeof(*list));
+}
+
+// Add the type ext files held in segments to an archive listing, with a descriptor of
+// each segment they are in. Returns the number added.
+int segment_tar_list(const char *root, const char *ext, struct tar_list *list) {
+    if (strcmp(root, catalog.root) != 0) return 0;
+    int added = 0;
+    pthread_rwlock_rdlock(&segments.lock);
+    if (segments.count > 0 && !list->segment_fds) {
+        list->segment_fds = malloc(segments.file_count * sizeof(int));
+        if (list->segment_fds) list->segment_fd_count = segments.file_count;
+        for (uint32_t i = 0; i < list->segment_fd_count; i++) list->segment_fds[i] = -1;
+    }
+    for (size_t i = 0; i < segments.count && list->segment_fds; i++) {
+        const struct segment_entry *e = &segments.entries[i];
+        // Hidden top-level entries are left out, as when walking
+        if (e->path[0] == '.' || strcmp(e->ext, ext) != 0 || e->segment >= list->segment_fd_count) continue;
+        if (list->segment_fds[e->segment] < 0 && (list->segment_fds[e->segment] = dup(segments.files[e->segment].fd)) < 0) continue;
+        if (list->count == list->capacity) {
+            list->capacity = list->capacity ? 2 * list->capacity : 64;
+            list->entries = realloc(list->entries, list->capacity * sizeof(*list->entries));
+        }
+        list->entries[list->count++] = (struct tar_entry){strdup(e->path), e->length, e->mtime, S_IFREG | 0644, e->segment, e->offset, NULL, 0};
+        added++;
+    }
+    pthread_rwlock_unlock(&segments.lock);
+    return added;
+}
+
+// Add the type ext files held as chunks to an archive listing, each with a copy of its
+// chunk list. Returns the number added.
+int dedup_tar_list(const char *root, const char *ext, struct tar_list *list) {
+    if (strcmp(root, catalog.root) != 0) return 0;
+    int added = 0;
+    pthread_rwlock_rdlock(&dedup.lock);
+    for (size_t i = 0; i < dedup.count; i++) {
+        const struct dedup_entry *e = &dedup.entries[i];
+        // Hidden top-level entries are left out, as when walking
+        if (e->path[0] == '.' || strcmp(e->ext, ext) != 0) continue;
+        struct dedup_chunk_ref *chunks = malloc(e->chunk_count * sizeof(*chunks));
+        if (!chunks) continue;
+        memcpy(chunks, e->chunks, e->chunk_count * sizeof(*chunks));
+        if (list->count == list->capacity) {
+            list->capacity = list->capacity ? 2 * list->capacity : 64;
+            list->entries = realloc(list->entries, list->capacity * sizeof(*list->entries));
+        }
+        list->entries[list->count++] = (struct tar_entry){strdup(e->path), e->size, e->mtime, S_IFREG | 0644, 0, 0, chunks, e->chunk_count};
+        added++;
+    }
+    pthread_rwlock_unlock(&dedup.lock);
+    return added;
+}
+
+// Fill one ustar header block, including its checksum
+static void tar_fill_block(char *block, const char *name, const char *prefix, uint64_t size, time_t mtime, mode_t mode, char type) {
+    memset(block, 0, TAR_BLOCK);
+    memcpy(block, name, strnlen(name, 100));
+    snprintf(block + 100, 8, "%07o", (unsigned)(mode & 07777));
+    snprintf(block + 108, 8, "%07o", 0);
+    snprintf(block + 116, 8, "%07o", 0);
+    snprintf(block + 124, 12, "%011llo", (unsigned long long)(size <= TAR_MAX_OCTAL ? size : 0));
+    // Times beyond the 11 octal digits of the field are clamped to its largest value
+    snprintf(block + 136, 12, "%011llo", (unsigned long long)(mtime <= 0 ? 0 : (uint64_t)mtime > TAR_MAX_OCTAL ? TAR_MAX_OCTAL : (uint64_t)mtime));
+    memset(block + 148, ' ', 8);
+    block[156] = type;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    memcpy(block + 345, prefix, strnlen(prefix, 155));
+    unsigned sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) sum += (unsigned char)block[i];
+    snprintf(block + 148, 8, "%06o", sum);
+    block[155] = ' ';
+}
+
+// Format one pax extended header record, "<len> <key>=<value>\n", where len counts itself
+static size_t pax_record(char *out, const char *key, const char *value) {
+    size_t body = strlen(key) + strlen(value) + 3;
+    size_t len = body + 1;
+    while (len != body + snprintf(NULL, 0, "%zu", len)) len = body + snprintf(NULL, 0, "%zu", len);
+    return sprintf(out, "%zu %s=%s\n", len, key, value);
+}
+
+// Write the header blocks for one entry into out (at least TAR_HEADER_MAX bytes) and
+// return their length. Paths that fit neither the ustar name field nor a prefix/name
+// split, and sizes beyond the octal size field, are carried in a pax extended header.
+size_t tar_entry_header(char *out, const struct tar_entry *entry) {
+    const char *path = entry->path;
+    size_t len = strlen(path);
+    char prefix[156] = "";
+    const char *name = path;
+    int long_path = 0;
+    if (len > 100) {
+        long_path = 1;
+        for (const char *slash = strchr(path, '/'); slash && slash - path <= 155; slash = strchr(slash + 1, '/')) {
+            if (len - (slash - path) - 1 <= 100) {
+                memcpy(prefix, path, slash - path);
+                prefix[slash - path] = '\0';
+                name = slash + 1;
+                long_path = 0;
+                break;
+            }
+        }
+        // Readers without pax support still get the final path component
+        if (long_path) name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    }
+
+    size_t offset = 0;
+    if (long_path || entry->size > TAR_MAX_OCTAL) {
+        char records[PATH_MAX + 64];
+        size_t records_len = 0;
+        if (long_path) records_len += pax_record(records, "path", path);
+        if (entry->size > TAR_MAX_OCTAL) {
+            char size_str[24];
+            snprintf(size_str, sizeof(size_str), "%llu", (unsigned long long)entry->size);
+            records_len += pax_record(records + records_len, "size", size_str);
+        }
+        tar_fill_block(out, "PaxHeader", "", records_len, entry->mtime, 0644, 'x');
+        size_t padded = (records_len + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        memset(out + TAR_BLOCK, 0, padded);
+        memcpy(out + TAR_BLOCK, records, records_len);
+        offset = TAR_BLOCK + padded;
+    }
+    tar_fill_block(out + offset, name, prefix, entry->size, entry->mtime, entry->mode, '0');
+    return offset + TAR_BLOCK;
+}
+
+// Exact size of the archive for list: headers, padded contents, the two zero blocks
+// that end it, and padding to a whole 10 KB record as tar itself writes
+uint64_t tar_archive_size(const struct tar_list *list) {
+    char header[TAR_HEADER_MAX];
+    uint64_t size = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        size += tar_entry_header(header, &list->entries[i]);
+        size += (list->entries[i].size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    }
+    size += 2 * TAR_BLOCK;
+    return (size + TAR_RECORD - 1) / TAR_RECORD * TAR_RECORD;
+}
+
+// Send count zero bytes
+static int send_zeros(int sock, uint64_t count) {
+    static const char zeros[TAR_BLOCK];
+    while (count > 0) {
+        size_t chunk = count < TAR_BLOCK ? count : TAR_BLOCK;
+        if (send_all(sock, zeros, chunk) < 0) return -1;
+        count -= chunk;
+    }
+    return 0;
+}
+
+// Write the archive for list, archive_size bytes, to a socket or file, generating the
+// headers in memory and copying file contents with sendfile(). A file that shrank or
+// vanished since it was listed is padded with zeros so the archive keeps its size.
+int write_tar_archive(int sock, const char *root, const struct tar_list *list, uint64_t archive_size) {
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char header[TAR_HEADER_MAX];
+    uint64_t sent = 0;
+    int ok = 1;
+    for (size_t i = 0; ok && i < list->count; i++) {
+        const struct tar_entry *entry = &list->entries[i];
+        size_t header_len = tar_entry_header(header, entry);
+        if (send_all(sock, header, header_len) < 0) {
+            ok = 0;
+            break;
+        }
+        // Files held in segments are read from the list's descriptor of their segment, and
+        // files held as chunks from their chunks
+        int fd = entry->chunks ? -1 : entry->segment ? list->segment_fds[entry->segment] :
+                 root_fd >= 0 ? openat(root_fd, entry->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC) : -1;
+        long long body = entry->chunks ? dedup_send_body(sock, entry->chunks, entry->chunk_count, 0, entry->size) :
+                         fd >= 0 ? send_file_body(sock, fd, entry->offset, entry->size) : 0;
+        if (fd >= 0 && !entry->segment) close(fd);
+        uint64_t padded = (entry->size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        if (body < 0 || send_zeros(sock, padded - body) < 0) {
+            ok = 0;
+            break;
+        }
+        if ((uint64_t)body < entry->size) printf("Tar: %s changed while archiving, padded with zeros\n", entry->path);
+        sent += header_len + padded;
+    }
+    if (root_fd >= 0) close(root_fd);
+    // End-of-archive blocks and record padding; an incomplete frame makes the connection unusable
+    if (!ok || send_zeros(sock, archive_size - sent) < 0) return -1;
+    return 0;
+}
+
+// Stream the archive for list as one DATA frame of archive_size bytes
+int send_tar_frame(int sock, const char *root, const struct tar_list *list, uint64_t archive_size, uint32_t request_id) {
+    if (send_frame(sock, OP_DATA, 0, 0, request_id, NULL, archive_size) < 0) return -1;
+    return write_tar_archive(sock, root, list, archive_size);
+}
+
+// Receive a frame header and convert it to host byte order
+int recv_frame(int sock, struct frame_hdr *hdr) {
+    if (receive_full(sock, (char*)hdr, sizeof(*hdr)) < 0) return -1;
+    if (ntohs(hdr->magic) != PROTO_MAGIC || hdr->version != PROTO_VERSION) return -1;
+    hdr->magic = PROTO_MAGIC;
+    hdr->flags = ntohs(hdr->flags);
+    hdr->status = ntohs(hdr->status);
+    hdr->request_id = ntohl(hdr->request_id);
+    hdr->length = be64toh(hdr->length);
+    return 0;
+}
+
+// Receive a frame payload as a NUL-terminated string; oversized payloads are rejected
+int recv_payload(int sock, const struct frame_hdr *hdr, char *buffer, size_t size) {
+    if (hdr->length >= size) return -1;
+    if (receive_full(sock, buffer, hdr->length) < 0) return -1;
+    buffer[hdr->length] = '\0';
+    return 0;
+}
+
+// Receive DATA frames up to the last one, writing their content to fp (NULL discards it).
+// Deflated frames are inflated as they arrive. Returns the byte count of the content, or
+// -1 if the connection failed; write errors, like a deflate stream that does not inflate,
+// only set *write_error.
+long long recv_body(int sock, FILE *fp, int *write_error) {
+    // The io_uring engine, when enabled, takes bodies bound for a file
+    if (fp && !*write_error) {
+        long long total = ring_recv_body(sock, fp, write_error);
+        if (total != -2) return total;
+    }
+    char buffer[BUFFER_SIZE];
+    unsigned char plain[4 * BUFFER_SIZE];
+    long long total_bytes = 0;
+    z_stream strm = {0};
+    int inflating = 0;
+    struct frame_hdr hdr;
+    do {
+        if (recv_frame(sock, &hdr) < 0 || hdr.opcode != OP_DATA) {
+            if (inflating) inflateEnd(&strm);
+            return -1;
+        }
+        if ((hdr.flags & FL_DEFLATE) && !inflating) {
+            if (inflateInit2(&strm, -15) == Z_OK) inflating = 1;
+            else *write_error = 1;
+        }
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) {
+            size_t to_receive = remaining < BUFFER_SIZE ? remaining : BUFFER_SIZE;
+            ssize_t bytes = recv(sock, buffer, to_receive, 0);
+            if (bytes <= 0) {
+                if (inflating) inflateEnd(&strm);
+                return -1;
+            }
+            remaining -= bytes;
+            if (!(hdr.flags & FL_DEFLATE)) {
+                if (fp && !*write_error && fwrite(buffer, 1, bytes, fp) != (size_t)bytes) *write_error = 1;
+                total_bytes += bytes;
+                continue;
+            }
+            // Discarded or failed bodies are only drained
+            if (!inflating || !fp || *write_error) continue;
+            strm.next_in = (unsigned char *)buffer;
+            strm.avail_in = bytes;
+            do {
+                strm.next_out = plain;
+                strm.avail_out = sizeof(plain);
+                int ret = inflate(&strm, Z_NO_FLUSH);
+                size_t len = sizeof(plain) - strm.avail_out;
+                if ((ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
+                    fwrite(plain, 1, len, fp) != len) {
+                    *write_error = 1;
+                    break;
+                }
+                total_bytes += len;
+            } while (strm.avail_out == 0);
+        }
+    } while (hdr.flags & FL_MORE);
+    if (inflating) {
+        // A deflated body must end with the end of its stream
+        strm.next_out = plain;
+        strm.avail_out = sizeof(plain);
+        if (fp && !*write_error && inflate(&strm, Z_FINISH) != Z_STREAM_END) *write_error = 1;
+        inflateEnd(&strm);
+    }
+    return total_bytes;
+}
+
+// The calling thread's ring, set up on first use; NULL once io_uring has proved
+// unavailable, so uploads fall back to stdio writes
+struct io_ring *ring_get(void) {
+    if (thread_ring || ring_unavailable) return thread_ring;
+    struct io_ring *ring = calloc(1, sizeof(*ring));
+    if (ring && ring_setup(ring) == 0) return thread_ring = ring;
+    int err = errno;
+    free(ring);
+    if (!__atomic_exchange_n(&ring_unavailable, 1, __ATOMIC_RELAXED))
+        printf("S2: io_uring unavailable (%s), using stdio writes\n", strerror(err));
+    return NULL;
+}
+
+// Create a ring with raw system calls and map its queues. Buffers that cannot be
+// registered, for instance past RLIMIT_MEMLOCK, are written with plain IORING_OP_WRITE.
+int ring_setup(struct io_ring *ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring->fd < 0) return -1;
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    ring->buffers = mmap(NULL, RING_BUFFERS * RING_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED || ring->buffers == MAP_FAILED) {
+        int err = errno;
+        ring_close(ring);
+        errno = err;
+        return -1;
+    }
+    char *sq = ring->sq_map, *cq = ring->cq_map;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    struct iovec iov[RING_BUFFERS];
+    for (int i = 0; i < RING_BUFFERS; i++) {
+        iov[i].iov_base = ring->buffers + (size_t)i * RING_BUFFER_SIZE;
+        iov[i].iov_len = RING_BUFFER_SIZE;
+    }
+    ring->registered = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, RING_BUFFERS) == 0;
+    return 0;
+}
+
+// Unmap and close a ring, which may be only partly set up
+void ring_close(struct io_ring *ring) {
+    if (ring->sq_map && ring->sq_map != MAP_FAILED) munmap(ring->sq_map, ring->sq_map_size);
+    if (ring->cq_map && ring->cq_map != MAP_FAILED) munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->buffers && ring->buffers != MAP_FAILED) munmap(ring->buffers, RING_BUFFERS * RING_BUFFER_SIZE);
+    close(ring->fd);
+}
+
+// Give up on a ring that failed: queued operations the kernel has not taken are
+// dropped, and those it has are waited for, as they use the ring's buffers, before the
+// ring is closed and freed. A ring whose completions cannot be waited for stays mapped.
+void ring_discard(struct io_ring *ring) {
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail - ring->pending, __ATOMIC_RELEASE);
+    ring->inflight -= ring->pending;
+    ring->pending = 0;
+    while (ring->inflight > 0) {
+        unsigned head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            ring->inflight--;
+            continue;
+        }
+        // EBUSY only asks for completions to be taken first
+        if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR && errno != EBUSY) return;
+    }
+    ring_close(ring);
+    free(ring);
+}
+
+// Queue one operation; it reaches the kernel with the next ring_wait(). Callers keep
+// fewer than RING_ENTRIES operations outstanding, so the queue never overflows.
+void ring_queue(struct io_ring *ring, uint8_t opcode, int fd, void *addr, uint32_t len, uint64_t offset, uint32_t msg_flags, uint64_t user_data) {
+    unsigned tail = *ring->sq_tail, index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->msg_flags = msg_flags;
+    sqe->user_data = user_data;
+    // Writes from a registered buffer name it by index
+    if (opcode == IORING_OP_WRITE_FIXED) sqe->buf_index = ((char *)addr - ring->buffers) / RING_BUFFER_SIZE;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    ring->inflight++;
+}
+
+// Submit queued operations and take the next completion, waiting for one if needed
+int ring_wait(struct io_ring *ring, struct io_uring_cqe *cqe) {
+    for (;;) {
+        unsigned head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            *cqe = ring->cqes[head & *ring->cq_mask];
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            ring->inflight--;
+            return 0;
+        }
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        ring->pending -= submitted;
+    }
+}
+
+// Start writing an upload body to fp through the calling thread's ring, after whatever
+// fp already holds. Returns -1 if there is no ring to use.
+int ring_writer_start(struct ring_writer *w, FILE *fp) {
+    memset(w, 0, sizeof(*w));
+    w->ring = use_uring ? ring_get() : NULL;
+    // Streams with no descriptor, like the chunker of -s dedup, are written with stdio
+    if (!w->ring || fileno(fp) < 0) return -1;
+    off_t offset;
+    if (fflush(fp) != 0 || (offset = ftello(fp)) < 0) return -1;
+    w->fd = fileno(fp);
+    w->offset = offset;
+    w->current = -1;
+    w->idle = (1u << RING_BUFFERS) - 1;
+    return 0;
+}
+
+// Free space in the buffer being filled, taking an idle buffer first if needed and
+// waiting for a write to finish while none is idle. Returns NULL if the ring failed.
+char *ring_writer_space(struct ring_writer *w, size_t *space) {
+    if (w->current < 0) {
+        while (!w->idle)
+            if (ring_writer_reap(w, NULL) < 0) return NULL;
+        w->current = __builtin_ctz(w->idle);
+        w->idle &= ~(1u << w->current);
+        w->fill = 0;
+    }
+    *space = RING_BUFFER_SIZE - w->fill;
+    return w->ring->buffers + (size_t)w->current * RING_BUFFER_SIZE + w->fill;
+}
+
+// Account for length bytes placed at ring_writer_space(), writing the buffer out once
+// it is full. After a write error the bytes are dropped.
+void ring_writer_commit(struct ring_writer *w, size_t length) {
+    if (w->error) {
+        w->fill = 0;
+        return;
+    }
+    w->fill += length;
+    if (w->fill == RING_BUFFER_SIZE) ring_writer_flush(w);
+}
+
+// Queue the write of the buffer being filled, or return it to the idle set if empty
+void ring_writer_flush(struct ring_writer *w) {
+    int b = w->current;
+    if (b < 0) return;
+    w->current = -1;
+    if (w->fill == 0 || w->error) {
+        w->idle |= 1u << b;
+        return;
+    }
+    w->writes[b].offset = w->offset;
+    w->writes[b].length = w->fill;
+    w->writes[b].done = 0;
+    w->offset += w->fill;
+    ring_queue(w->ring, w->ring->registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, w->fd,
+               w->ring->buffers + (size_t)b * RING_BUFFER_SIZE, w->fill, w->writes[b].offset, 0, b);
+}
+
+// Take one completion. A finished write frees its buffer; a short one is queued again
+// for the rest. A receive stores its result in *recv_result.
+int ring_writer_reap(struct ring_writer *w, long long *recv_result) {
+    struct io_uring_cqe cqe;
+    if (ring_wait(w->ring, &cqe) < 0) return -1;
+    if (cqe.user_data == RING_RECV) {
+        if (recv_result) *recv_result = cqe.res;
+        return 0;
+    }
+    int b = cqe.user_data;
+    if (cqe.res <= 0) {
+        w->error = 1;
+    } else if ((w->writes[b].done += cqe.res) < w->writes[b].length) {
+        size_t done = w->writes[b].done;
+        ring_queue(w->ring, w->ring->registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, w->fd,
+                   w->ring->buffers + (size_t)b * RING_BUFFER_SIZE + done, w->writes[b].length - done,
+                   w->writes[b].offset + done, 0, b);
+        return 0;
+    }
+    w->idle |= 1u << b;
+    return 0;
+}
+
+// Receive up to max bytes of the body straight into the buffer being filled, reaping
+// write completions while the receive is outstanding. Returns what recv() would.
+ssize_t ring_writer_recv(struct ring_writer *w, int sock, uint64_t max) {
+    size_t space;
+    char *buf = ring_writer_space(w, &space);
+    if (!buf) return -1;
+    if (max < space) space = max;
+    // MSG_WAITALL fills the buffer in one receive rather than one per segment
+    ring_queue(w->ring, IORING_OP_RECV, sock, buf, space, 0, MSG_WAITALL, RING_RECV);
+    long long result = LLONG_MIN;
+    while (result == LLONG_MIN)
+        if (ring_writer_reap(w, &result) < 0) return -1;
+    return result < 0 ? -1 : result;
+}
+
+// Write out the last buffer and wait for every write, then leave fp positioned after
+// the body. Returns -1 if any write failed.
+int ring_writer_finish(struct ring_writer *w, FILE *fp) {
+    ring_writer_flush(w);
+    while (w->idle != (1u << RING_BUFFERS) - 1)
+        if (ring_writer_reap(w, NULL) < 0) {
+            // The ring is unusable: stop using it for good, and release this thread's
+            ring_unavailable = 1;
+            thread_ring = NULL;
+            ring_discard(w->ring);
+            return -1;
+        }
+    if (fseeko(fp, w->offset, SEEK_SET) != 0) return -1;
+    return w->error ? -1 : 0;
+}
+
+// recv_body() through the io_uring engine. Plain content is received into the ring's
+// buffers; deflated content is received in small pieces and inflated into them.
+// Returns -2, having read nothing, if the engine is off or unavailable.
+long long ring_recv_body(int sock, FILE *fp, int *write_error) {
+    struct ring_writer w;
+    if (ring_writer_start(&w, fp) < 0) return -2;
+    unsigned char input[RING_INPUT];
+    long long total_bytes = 0;
+    z_stream strm = {0};
+    int inflating = 0, failed = 0;
+    struct frame_hdr hdr;
+    do {
+        if (recv_frame(sock, &hdr) < 0 || hdr.opcode != OP_DATA) {
+            failed = 1;
+            break;
+        }
+        if ((hdr.flags & FL_DEFLATE) && !inflating) {
+            if (inflateInit2(&strm, -15) == Z_OK) inflating = 1;
+            else w.error = 1;
+        }
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) {
+            if (!(hdr.flags & FL_DEFLATE)) {
+                ssize_t bytes = ring_writer_recv(&w, sock, remaining);
+                if (bytes <= 0) {
+                    failed = 1;
+                    break;
+                }
+                remaining -= bytes;
+                total_bytes += bytes;
+                ring_writer_commit(&w, bytes);
+                continue;
+            }
+            size_t to_receive = remaining < sizeof(input) ? remaining : sizeof(input);
+            ssize_t bytes = recv(sock, input, to_receive, 0);
+            if (bytes <= 0) {
+                failed = 1;
+                break;
+            }
+            remaining -= bytes;
+            // Failed bodies are only drained
+            if (!inflating || w.error) continue;
+            strm.next_in = input;
+            strm.avail_in = bytes;
+            do {
+                size_t space;
+                char *out = ring_writer_space(&w, &space);
+                if (!out) {
+                    w.error = 1;
+                    break;
+                }
+                strm.next_out = (unsigned char *)out;
+                strm.avail_out = space;
+                int ret = inflate(&strm, Z_NO_FLUSH);
+                size_t len = space - strm.avail_out;
+                total_bytes += len;
+                ring_writer_commit(&w, len);
+                if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                    w.error = 1;
+                    break;
+                }
+            } while (strm.avail_out == 0);
+        }
+    } while (!failed && (hdr.flags & FL_MORE));
+    if (inflating) {
+        // A deflated body must end with the end of its stream
+        strm.next_out = input;
+        strm.avail_out = sizeof(input);
+        if (!failed && !w.error && inflate(&strm, Z_FINISH) != Z_STREAM_END) w.error = 1;
+        inflateEnd(&strm);
+    }
+    // Buffers still being written must come back before the thread uses them again
+    if (ring_writer_finish(&w, fp) < 0) *write_error = 1;
+    return failed ? -1 : total_bytes;
+}
+
+// Parse the paging options of a dispfnames request: "after=<cursor>", "limit=<n>"
+// and "long" (include size and mtime). Unknown tokens are ignored.
+void parse_listing_options(char *opts, char *after, size_t after_size, int *limit, int *want_long) {
+    after[0] = '\0';
+    *limit = 0;
+    *want_long = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(opts, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+        if (strncmp(tok, "after=", 6) == 0) snprintf(after, after_size, "%s", tok + 6);
+        else if (strncmp(tok, "limit=", 6) == 0) *limit = atoi(tok + 6);
+        else if (strcmp(tok, "long") == 0) *want_long = 1;
+    }
+    if (*limit < 0) *limit = 0;
+}
+
+// Add one listing line to the pending DATA frame in buf, first sending the frame
+// if the line does not fit. Lines are never split across frames.
+int queue_listing_line(int sock, uint32_t request_id, char *buf, size_t *len, const char *line, size_t line_len) {
+    if (*len + line_len > LISTING_FRAME && *len > 0) {
+        if (send_frame(sock, OP_DATA, FL_MORE, 0, request_id, buf, *len) < 0) return -1;
+        *len = 0;
+    }
+    if (line_len > LISTING_FRAME) return send_frame(sock, OP_DATA, FL_MORE, 0, request_id, line, line_len);
+    memcpy(buf + *len, line, line_len);
+    *len += line_len;
+    return 0;
+}
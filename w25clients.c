@@ -1,386 +1,1585 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <libgen.h>
-#include <limits.h>
-#include <stdint.h>  // For uint64_t
-#include <endian.h>  // For be64toh
-#include <sys/time.h> // For timeout
-
-#define BUFFER_SIZE 8192
-
-// Function to receive exact number of bytes from socket
-int receive_full(int sock, char *buffer, size_t size);
-
-int main(int argc, char *argv[]) {
-    // Validate command-line arguments
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <S1_port>\n", argv[0]);
-        return 1;
-    }
-
-    // Parse and validate port number
-    int PORT_S1 = atoi(argv[1]);
-    if (PORT_S1 < 1024 || PORT_S1 > 65535) {
-        fprintf(stderr, "Error: Port must be between 1024 and 65535\n");
-        return 1;
-    }
-
-    // Create client socket
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("Socket creation failed");
-        return 1;
-    }
-
-    // Configure server address
-    struct sockaddr_in server_addr = {
-        .sin_family = AF_INET,
-        .sin_addr.s_addr = inet_addr("127.0.0.1"),
-        .sin_port = htons(PORT_S1)
-    };
-
-    // Connect to server
-    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Failed to connect to S1");
-        close(sock);
-        return 1;
-    }
-    printf("Connected to S1 on port %d. Enter commands:\n", PORT_S1);
-
-    char buffer[BUFFER_SIZE];
-    // Main client loop
-    while (1) {
-        // Prompt for user input
-        printf("w25clients$ ");
-        fgets(buffer, BUFFER_SIZE, stdin);
-        buffer[strcspn(buffer, "\n")] = 0;
-
-        // Parse command and parameters
-        char command[20], param1[256] = {0};
-        sscanf(buffer, "%s %[^\n]", command, param1);
-
-        if (strcmp(command, "uploadf") == 0) {
-            printf("Client: Sending uploadf command: %s\n", buffer);
-            char param2[256] = {0};
-            sscanf(buffer, "%*s %s %s", param1, param2);
-
-            // Validate destination path
-            if (strncmp(param2, "~S1/", 4) != 0) {
-                printf("Error: Destination path must start with ~S1/\n");
-                continue;
-            }
-
-            // Construct full source file path
-            char full_path[PATH_MAX];
-            if (param1[0] != '/') {
-                char cwd[PATH_MAX];
-                getcwd(cwd, PATH_MAX);
-                snprintf(full_path, PATH_MAX, "%s/%s", cwd, param1);
-            } else {
-                strncpy(full_path, param1, PATH_MAX);
-            }
-            printf("Client: Source file path: %s\n", full_path);
-            printf("Client: Destination path: %s\n", param2);
-
-            // Open source file
-            FILE *fp = fopen(full_path, "rb");
-            if (!fp) {
-                printf("Error: File %s not found\n", full_path);
-                continue;
-            }
-
-            // Send upload command
-            char updated_command[BUFFER_SIZE];
-            snprintf(updated_command, BUFFER_SIZE, "uploadf %s %s", param1, param2);
-            send(sock, updated_command, strlen(updated_command), 0);
-
-            // Send file data
-            size_t bytes;
-            while ((bytes = fread(buffer, 1, BUFFER_SIZE, fp)) > 0) {
-                send(sock, buffer, bytes, 0);
-            }
-            fclose(fp);
-            // Signal end of data
-            shutdown(sock, SHUT_WR);
-
-            // Receive server response
-            memset(buffer, 0, BUFFER_SIZE);
-            ssize_t received = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-            if (received > 0) {
-                buffer[received] = '\0';
-                printf("%s\n", buffer);
-            } else {
-                printf("Error: No response from S1\n");
-                break;
-            }
-
-            // Reconnect for next command
-            int new_sock = socket(AF_INET, SOCK_STREAM, 0);
-            if (connect(new_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-                perror("Failed to reconnect to S1");
-                close(sock);
-                sock = new_sock;
-                continue;
-            }
-            close(sock);
-            sock = new_sock;
-        } else if (strcmp(command, "downlf") == 0) {
-            printf("Client: Sending downlf command: %s\n", buffer);
-            // Validate file path
-            if (strlen(param1) == 0) {
-                printf("Error: Please provide a file path (e.g., ~S1/folder1/sample.txt)\n");
-                continue;
-            }
-
-            // Send download command
-            char updated_command[BUFFER_SIZE];
-            snprintf(updated_command, BUFFER_SIZE, "downlf %s", param1);
-            if (send(sock, updated_command, strlen(updated_command), 0) < 0) {
-                printf("Error: Failed to send command\n");
-                continue;
-            }
-
-            // Set receive timeout (5 seconds)
-            struct timeval tv;
-            tv.tv_sec = 5;
-            tv.tv_usec = 0;
-            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-
-            // Receive file size
-            uint64_t net_file_size;
-            if (receive_full(sock, (char*)&net_file_size, sizeof(net_file_size)) < 0) {
-                printf("Error: Failed to receive file size\n");
-                // Reset timeout
-                tv.tv_sec = 0;
-                tv.tv_usec = 0;
-                setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-                continue;
-            }
-            uint64_t file_size = be64toh(net_file_size);
-            printf("Client: Received file size: %lu bytes\n", file_size);
-
-            // Reset timeout for data transfer
-            tv.tv_sec = 0;
-            tv.tv_usec = 0;
-            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-
-            if (file_size > 0) {
-                // Prepare output file
-                char filename[256];
-                strcpy(filename, basename(param1));
-                FILE *fp = fopen(filename, "wb");
-                if (!fp) {
-                    printf("Error: Cannot create file %s in PWD\n", filename);
-                    // Consume data to keep connection alive
-                    size_t total_received = 0;
-                    while (total_received < file_size) {
-                        size_t to_receive = file_size - total_received;
-                        if (to_receive > BUFFER_SIZE) to_receive = BUFFER_SIZE;
-                        ssize_t bytes = recv(sock, buffer, to_receive, 0);
-                        if (bytes <= 0) break;
-                        total_received += bytes;
-                    }
-                    continue;
-                }
-                // Receive and write file data
-                size_t total_received = 0;
-                while (total_received < file_size) {
-                    size_t to_receive = file_size - total_received;
-                    if (to_receive > BUFFER_SIZE) to_receive = BUFFER_SIZE;
-                    ssize_t bytes = recv(sock, buffer, to_receive, 0);
-                    if (bytes <= 0) {
-                        printf("Client: Receive error after %zu bytes\n", total_received);
-                        break;
-                    }
-                    fwrite(buffer, 1, bytes, fp);
-                    total_received += bytes;
-                    printf("Client: Received %zd bytes, total %zu/%lu\n", bytes, total_received, file_size);
-                }
-                fclose(fp);
-                // Report download status
-                if (total_received == file_size) {
-                    printf("Download of %s completed successfully\n", filename);
-                } else {
-                    printf("Error: Download incomplete, received %zu/%lu bytes\n", total_received, file_size);
-                }
-            } else {
-                // Handle server error
-                memset(buffer, 0, BUFFER_SIZE);
-                ssize_t received = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-                if (received > 0) {
-                    buffer[received] = '\0';
-                    printf("Server error: %s\n", buffer);
-                } else {
-                    printf("Error: No response from S1\n");
-                }
-            }
-        } else if (strcmp(command, "removef") == 0) {
-            printf("Client: Sending removef command: %s\n", buffer);
-            // Validate file path
-            if (strlen(param1) == 0) {
-                printf("Error: Please provide a file path (e.g., ~S1/folder1/sample.txt)\n");
-                continue;
-            }
-
-            // Send remove command
-            char updated_command[BUFFER_SIZE];
-            snprintf(updated_command, BUFFER_SIZE, "removef %s", param1);
-            send(sock, updated_command, strlen(updated_command), 0);
-
-            // Receive server response
-            memset(buffer, 0, BUFFER_SIZE);
-            ssize_t received = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-            if (received > 0) {
-                buffer[received] = '\0';
-                printf("%s\n", buffer);
-            } else {
-                printf("Error: No response from S1\n");
-            }
-        } else if (strcmp(command, "downltar") == 0) {
-            printf("Client: Sending downltar command: %s\n", buffer);
-            // Validate file type
-            if (strlen(param1) == 0) {
-                printf("Error: Please provide a file type (.c, .pdf, or .txt)\n");
-                continue;
-            }
-            if (strcmp(param1, ".c") != 0 && strcmp(param1, ".pdf") != 0 && strcmp(param1, ".txt") != 0) {
-                printf("Error: File type must be .c, .pdf, or .txt\n");
-                continue;
-            }
-
-            // Send download tar command
-            char updated_command[BUFFER_SIZE];
-            snprintf(updated_command, BUFFER_SIZE, "downltar %s", param1);
-            send(sock, updated_command, strlen(updated_command), 0);
-
-            // Set receive timeout (5 seconds)
-            struct timeval tv;
-            tv.tv_sec = 5;
-            tv.tv_usec = 0;
-            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-
-            // Receive tar file size
-            uint64_t net_file_size;
-            if (receive_full(sock, (char*)&net_file_size, sizeof(net_file_size)) < 0) {
-                printf("Error: Failed to receive file size\n");
-                // Reset timeout
-                tv.tv_sec = 0;
-                tv.tv_usec = 0;
-                setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-                continue;
-            }
-            uint64_t file_size = be64toh(net_file_size);
-            printf("Client: Received file size: %lu bytes\n", file_size);
-
-            // Reset timeout for data transfer
-            tv.tv_sec = 0;
-            tv.tv_usec = 0;
-            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-
-            if (file_size > 0) {
-                // Prepare tar file name
-                char filename[256];
-                snprintf(filename, 256, "%s.tar", 
-                         strcmp(param1, ".c") == 0 ? "cfiles" : 
-                         strcmp(param1, ".pdf") == 0 ? "pdffiles" : "textfiles");
-                FILE *fp = fopen(filename, "wb");
-                if (!fp) {
-                    printf("Error: Cannot create file %s in PWD\n", filename);
-                    // Consume data to keep connection alive
-                    size_t total_received = 0;
-                    while (total_received < file_size) {
-                        size_t to_receive = file_size - total_received;
-                        if (to_receive > BUFFER_SIZE) to_receive = BUFFER_SIZE;
-                        ssize_t bytes = recv(sock, buffer, to_receive, 0);
-                        if (bytes <= 0) break;
-                        total_received += bytes;
-                    }
-                    continue;
-                }
-                // Receive and write tar file
-                size_t total_received = 0;
-                while (total_received < file_size) {
-                    size_t to_receive = file_size - total_received;
-                    if (to_receive > BUFFER_SIZE) to_receive = BUFFER_SIZE;
-                    ssize_t bytes = recv(sock, buffer, to_receive, 0);
-                    if (bytes <= 0) {
-                        printf("Client: Receive error after %zu bytes\n", total_received);
-                        break;
-                    }
-                    fwrite(buffer, 1, bytes, fp);
-                    total_received += bytes;
-                    printf("Client: Received %zd bytes, total %zu/%lu\n", bytes, total_received, file_size);
-                }
-                fclose(fp);
-                // Report download status
-                if (total_received == file_size) {
-                    printf("Download of %s completed successfully\n", filename);
-                } else {
-                    printf("Error: Download incomplete, received %zu/%lu bytes\n", total_received, file_size);
-                }
-            } else {
-                // Handle server error
-                memset(buffer, 0, BUFFER_SIZE);
-                ssize_t received = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-                if (received > 0) {
-                    buffer[received] = '\0';
-                    printf("Server error: %s\n", buffer);
-                } else {
-                    printf("Error: No response from S1\n");
-                }
-            }
-        } else if (strcmp(command, "dispfnames") == 0) {
-            printf("Client: Sending dispfnames command: %s\n", buffer);
-            // Validate path
-            if (strlen(param1) == 0) {
-                printf("Error: Please provide a pathname (e.g., ~S1/folder1)\n");
-                continue;
-            }
-
-            // Send display names command
-            char updated_command[BUFFER_SIZE];
-            snprintf(updated_command, BUFFER_SIZE, "dispfnames %s", param1);
-            send(sock, updated_command, strlen(updated_command), 0);
-
-            // Receive server response
-            memset(buffer, 0, BUFFER_SIZE);
-            ssize_t received = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-            if (received <= 0) {
-                printf("Error: No response from S1\n");
-                continue;
-            }
-            buffer[received] = '\0';
-
-            // Display file list
-            if (strcmp(buffer, "No files found") == 0) {
-                printf("No files found in %s\n", param1);
-            } else {
-                printf("Files in %s:\n%s", param1, buffer);
-            }
-        } else if (strcmp(command, "exit") == 0) {
-            printf("Client: Sending exit command\n");
-            close(sock);
-            return 0;
-        } else {
-            printf("Client: Unknown command: %s\n", command);
-        }
-    }
-    close(sock);
-    return 0;
-}
-
-// Receive exact number of bytes
-int receive_full(int sock, char *buffer, size_t size) {
-    size_t received = 0;
-    while (received < size) {
-        ssize_t bytes = recv(sock, buffer + received, size - received, 0);
-        if (bytes <= 0) return -1;  // Error or connection closed
-        received += bytes;
-    }
-    return 0;  // Success
-}
\ No newline at end of file
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdint.h>  // For uint64_t
+#include <endian.h>  // For be64toh
+#include <sys/time.h> // For timeout
+#include <sys/stat.h>
+#include <fcntl.h>  // For AT_FDCWD
+#include <errno.h>
+#include <time.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/xattr.h>  // For the version of a part file
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>  // For the SHA extensions
+#endif
+
+#define BUFFER_SIZE 8192
+// Entries requested per dispfnames page, and the largest listing frame accepted
+#define LISTING_PAGE 1000
+#define LISTING_MAX_FRAME (16384 + 2 * PATH_MAX)
+// Times a lost download is resumed on a new connection, and the seconds a transfer may
+// stall before the connection is given up
+#define RESUME_ATTEMPTS 5
+#define STALL_TIMEOUT 30
+// Bytes read from the socket at a time while receiving a file
+#define RECV_CHUNK 65536
+// Most streams of a parallel download, and the smallest range worth a stream of its own
+#define MAX_STREAMS 32
+#define MIN_STREAM_RANGE (1024 * 1024)
+// Size of each part of a parallel upload; smaller files are sent in one piece
+#define UPLOAD_PART_SIZE (8 * 1024 * 1024)
+// Requests kept in flight on each connection of a directory transfer
+#define PIPELINE_DEPTH 32
+// Bytes read at a time while hashing a file for an upload probe
+#define HASH_READ (1024 * 1024)
+#define SHA256_LEN 32
+
+// Wire protocol spoken with S1: every message starts with a frame header
+#define PROTO_MAGIC 0x5732
+#define PROTO_VERSION 1
+// Request opcodes; the payload carries the space-separated arguments
+#define OP_UPLOADF 1
+#define OP_DOWNLF 2
+#define OP_REMOVEF 3
+#define OP_DOWNLTAR 4
+#define OP_DISPFNAMES 5
+// Multipart upload: start an upload, send its parts in any order over any number of
+// connections, then complete or abort it
+#define OP_UPLOAD_INIT 6
+#define OP_UPLOAD_PART 7
+#define OP_UPLOAD_COMPLETE 8
+#define OP_UPLOAD_ABORT 9
+// Upload-skip probe: the arguments of an uploadf followed by the file's size and SHA-256.
+// An OK reply means the file is stored without its content being sent.
+#define OP_UPLOAD_PROBE 11
+// Every request gets one REPLY; file content follows it in DATA frames
+#define OP_REPLY 16
+#define OP_DATA 17
+// Frame flags
+#define FL_MORE 0x0001  // Another DATA frame follows this one
+// On a download request: a deflated body is accepted. On its reply and on DATA frames:
+// the body is deflated.
+#define FL_DEFLATE 0x0002
+// Reply status codes
+#define ST_OK 0
+#define ST_ERROR 1
+
+// Reply to a ranged downlf: the bytes that follow, the offset they start at, and the
+// size, mtime and version of the whole file
+#define RANGE_REPLY_SIZE (5 * sizeof(uint64_t))
+// Extended attribute recording the version of the server's copy a part file came from
+#define PART_VERSION_XATTR "user.w25clients.version"
+
+// Transfer compression: compressible files travel as one raw deflate stream split across
+// DATA frames, at the fastest level
+#define TRANSFER_LEVEL 1
+#define TRANSFER_CHUNK 65536
+
+// Frame header, all fields in network byte order on the wire
+struct frame_hdr {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint16_t flags;
+    uint16_t status;
+    uint32_t request_id;
+    uint64_t length;  // Payload bytes following the header
+} __attribute__((packed));
+
+// One byte range of a parallel download, fetched over its own connection to S1
+struct range_job {
+    int port;
+    const char *path;
+    int fd;  // Output file, written with pwrite()
+    uint64_t offset, length;
+    uint64_t done;  // Bytes of the range written so far
+    uint64_t version;  // Of the server's copy; a range of any other version is refused
+    int ok;
+};
+
+// A parallel upload, shared by the workers sending its parts
+struct upload_job {
+    int port;
+    const char *path;  // Local file
+    char upload_id[64];
+    uint64_t file_size, parts;
+    uint64_t next_part;  // Next part for a worker to take
+    int deflated;
+    int failed;  // Set once a part could not be stored
+};
+
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t fill;
+};
+
+// Relative paths of the files in a directory transfer
+struct file_list {
+    char **paths;
+    size_t count, capacity;
+};
+
+// A directory transfer, shared by the workers moving its files
+struct bulk_job {
+    int port;
+    int upload;  // Direction of the transfer
+    const char *local_dir, *remote_dir;
+    struct file_list *files;
+    size_t next;  // Next file for a worker to take
+    long stored, failed;
+    uint64_t bytes;
+};
+
+// A request of a directory transfer waiting for its answer
+struct bulk_slot {
+    size_t index;
+    uint32_t id;
+    uint64_t size;
+};
+
+// Id of the most recent request; replies are matched against it. Parallel downloads
+// and uploads take ids from it on several threads.
+static uint32_t last_request_id = 0;
+// Probe before each uploadf whether the server already holds the file's content (-s)
+static int probe_uploads = 0;
+
+int connect_to_s1(int port);
+int download_file(int *sock, int port, const char *path);
+int download_parallel(int sock, int port, const char *path, int streams);
+void *range_worker(void *arg);
+int upload_parallel(int sock, int port, const char *path, const char *args, uint64_t file_size, int streams);
+void *upload_worker(void *arg);
+int send_part(int sock, FILE *fp, const struct upload_job *job, uint64_t offset, uint64_t length);
+int send_file_data(int sock, FILE *fp, uint64_t length, int deflated, uint32_t request_id);
+int probe_upload(int sock, FILE *fp, const char *args, uint64_t file_size);
+// SHA-256 for upload probes
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t length);
+void sha256_final(struct sha256_ctx *ctx, unsigned char *digest);
+void sha256_blocks(uint32_t *state, const unsigned char *data, size_t count);
+void sha256_blocks_portable(uint32_t *state, const unsigned char *data, size_t count);
+void sha256_blocks_shani(uint32_t *state, const unsigned char *data, size_t count);
+void digest_hex(const unsigned char *digest, char *hex);
+// Directory transfers
+int transfer_directory(int sock, int port, int upload, const char *local_dir, const char *remote_dir, int streams);
+void *bulk_worker(void *arg);
+int send_bulk_request(int sock, struct bulk_job *job, struct bulk_slot *slot);
+int finish_bulk_request(int sock, struct bulk_job *job, const struct bulk_slot *slot);
+void collect_local_files(const char *dir, const char *rel, struct file_list *list);
+int list_remote_files(int sock, const char *dir, struct file_list *list);
+void file_list_add(struct file_list *list, const char *path);
+void free_file_list(struct file_list *list);
+int stored_type(const char *name);
+void create_directories(const char *path);
+// Function to receive exact number of bytes from socket
+int receive_full(int sock, char *buffer, size_t size);
+int send_all(int sock, const void *buffer, size_t size);
+int send_frame(int sock, uint8_t opcode, uint16_t flags, uint32_t request_id, const void *payload, uint64_t length);
+int recv_frame(int sock, struct frame_hdr *hdr);
+int recv_reply(int sock, uint32_t request_id, struct frame_hdr *hdr, char *buffer, size_t size);
+long long recv_body(int sock, int fd, uint64_t offset, uint64_t file_size, uint64_t *done);
+int compressible_type(const char *name);
+long long send_deflated_body(int sock, FILE *fp, uint64_t size, uint32_t request_id);
+
+int main(int argc, char *argv[]) {
+    // Parse options: -s skips sending files whose content the servers already hold
+    int bad_opts = 0, opt_ch;
+    while ((opt_ch = getopt(argc, argv, "s")) != -1) {
+        if (opt_ch == 's') probe_uploads = 1;
+        else bad_opts = 1;
+    }
+
+    // Validate command-line arguments
+    if (bad_opts || argc - optind != 1) {
+        fprintf(stderr, "Usage: %s [-s] <S1_port>\n", argv[0]);
+        return 1;
+    }
+
+    // Parse and validate port number
+    int PORT_S1 = atoi(argv[optind]);
+    if (PORT_S1 < 1024 || PORT_S1 > 65535) {
+        fprintf(stderr, "Error: Port must be between 1024 and 65535\n");
+        return 1;
+    }
+
+    // Connect to server
+    int sock = connect_to_s1(PORT_S1);
+    if (sock < 0) return 1;
+    printf("Connected to S1 on port %d. Enter commands:\n", PORT_S1);
+
+    char buffer[BUFFER_SIZE];
+    // Main client loop
+    while (1) {
+        // Prompt for user input
+        printf("w25clients$ ");
+        fgets(buffer, BUFFER_SIZE, stdin);
+        buffer[strcspn(buffer, "\n")] = 0;
+
+        // Parse command and parameters
+        char command[20], param1[256] = {0};
+        sscanf(buffer, "%s %[^\n]", command, param1);
+
+        if (strcmp(command, "uploadf") == 0) {
+            printf("Client: Sending uploadf command: %s\n", buffer);
+            // "-p <n>" after the destination sends a large file in parts over n connections
+            char param2[256] = {0}, option[8] = {0};
+            int streams = 1;
+            sscanf(buffer, "%*s %s %s %7s %d", param1, param2, option, &streams);
+            if (option[0] && (strcmp(option, "-p") != 0 || streams < 1 || streams > MAX_STREAMS)) {
+                printf("Error: Streams must be between 1 and %d\n", MAX_STREAMS);
+                continue;
+            }
+
+            // Validate destination path
+            if (strncmp(param2, "~S1/", 4) != 0) {
+                printf("Error: Destination path must start with ~S1/\n");
+                continue;
+            }
+
+            // Construct full source file path
+            char full_path[PATH_MAX];
+            if (param1[0] != '/') {
+                char cwd[PATH_MAX];
+                getcwd(cwd, PATH_MAX);
+                snprintf(full_path, PATH_MAX, "%s/%s", cwd, param1);
+            } else {
+                strncpy(full_path, param1, PATH_MAX);
+            }
+            printf("Client: Source file path: %s\n", full_path);
+            printf("Client: Destination path: %s\n", param2);
+
+            // Open source file and get its size
+            struct stat statbuf;
+            FILE *fp = fopen(full_path, "rb");
+            if (!fp || fstat(fileno(fp), &statbuf) != 0) {
+                if (fp) fclose(fp);
+                printf("Error: File %s not found\n", full_path);
+                continue;
+            }
+
+            char args[BUFFER_SIZE];
+            snprintf(args, BUFFER_SIZE, "%s %s", param1, param2);
+            uint64_t file_size = statbuf.st_size;
+            if (probe_uploads) {
+                int probed = probe_upload(sock, fp, args, file_size);
+                if (probed != 0) fclose(fp);
+                if (probed < 0) break;
+                if (probed > 0) continue;
+            }
+            if (streams > 1 && file_size >= 2 * UPLOAD_PART_SIZE) {
+                fclose(fp);
+                if (upload_parallel(sock, PORT_S1, full_path, args, file_size, streams) < 0) break;
+                continue;
+            }
+
+            // Send upload request followed by the file as one DATA frame, or deflated
+            // if its type compresses
+            uint32_t id = ++last_request_id;
+            int deflated = compressible_type(param1);
+            if (send_frame(sock, OP_UPLOADF, deflated ? FL_DEFLATE : 0, id, args, strlen(args)) < 0 ||
+                (!deflated && send_frame(sock, OP_DATA, 0, id, NULL, file_size) < 0)) {
+                printf("Error: Failed to send command\n");
+                fclose(fp);
+                break;
+            }
+            if (deflated) {
+                long long sent = send_deflated_body(sock, fp, file_size, id);
+                fclose(fp);
+                if (sent < 0) {
+                    // The stream is incomplete, so this connection cannot carry further requests
+                    printf("Error: Upload interrupted\n");
+                    break;
+                }
+                printf("Client: Sent %lu bytes as %lld deflated\n", file_size, sent);
+            } else {
+                size_t bytes;
+                uint64_t total_sent = 0;
+                while (total_sent < file_size && (bytes = fread(buffer, 1, BUFFER_SIZE, fp)) > 0) {
+                    if (send_all(sock, buffer, bytes) < 0) break;
+                    total_sent += bytes;
+                }
+                fclose(fp);
+                if (total_sent != file_size) {
+                    // The frame is incomplete, so this connection cannot carry further requests
+                    printf("Error: Upload interrupted after %lu/%lu bytes\n", total_sent, file_size);
+                    break;
+                }
+            }
+
+            // Receive server response
+            struct frame_hdr reply;
+            if (recv_reply(sock, id, &reply, buffer, BUFFER_SIZE) < 0) {
+                printf("Error: No response from S1\n");
+                break;
+            }
+            printf("%s\n", buffer);
+        } else if (strcmp(command, "downlf") == 0) {
+            printf("Client: Sending downlf command: %s\n", buffer);
+            // "-p <n>" after the path fetches the file over n parallel connections
+            int streams = 1;
+            char *option = strstr(param1, " -p ");
+            if (option) {
+                streams = atoi(option + 4);
+                *option = '\0';
+                if (streams < 1 || streams > MAX_STREAMS) {
+                    printf("Error: Streams must be between 1 and %d\n", MAX_STREAMS);
+                    continue;
+                }
+            }
+            // Validate file path
+            if (strlen(param1) == 0) {
+                printf("Error: Please provide a file path (e.g., ~S1/folder1/sample.txt)\n");
+                continue;
+            }
+            if (streams > 1) {
+                if (download_parallel(sock, PORT_S1, param1, streams) < 0) break;
+            } else if (download_file(&sock, PORT_S1, param1) < 0) {
+                break;
+            }
+        } else if (strcmp(command, "downltar") == 0) {
+            printf("Client: Sending downltar command: %s\n", buffer);
+            // Validate file type; -z asks for a gzip-compressed archive
+            char filename[256], args[256];
+            char filetype[16] = {0}, option[8] = {0};
+            sscanf(param1, "%15s %7s", filetype, option);
+            if (strlen(filetype) == 0) {
+                printf("Error: Please provide a file type (.c, .pdf, or .txt)\n");
+                continue;
+            }
+            if (strcmp(filetype, ".c") != 0 && strcmp(filetype, ".pdf") != 0 && strcmp(filetype, ".txt") != 0) {
+                printf("Error: File type must be .c, .pdf, or .txt\n");
+                continue;
+            }
+            int compressed = strcmp(option, "-z") == 0;
+            snprintf(filename, 256, "%s.tar%s",
+                     strcmp(filetype, ".c") == 0 ? "cfiles" :
+                     strcmp(filetype, ".pdf") == 0 ? "pdffiles" : "textfiles", compressed ? ".gz" : "");
+            snprintf(args, sizeof(args), "%s%s", filetype, compressed ? " gzip" : "");
+
+            // Send download request
+            uint32_t id = ++last_request_id;
+            if (send_frame(sock, OP_DOWNLTAR, 0, id, args, strlen(args)) < 0) {
+                printf("Error: Failed to send command\n");
+                break;
+            }
+
+            // Set receive timeout (5 seconds)
+            struct timeval tv;
+            tv.tv_sec = 5;
+            tv.tv_usec = 0;
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+            // Receive file size, or the server's error message
+            struct frame_hdr reply;
+            int rc = recv_reply(sock, id, &reply, buffer, BUFFER_SIZE);
+
+            // Reset timeout for data transfer
+            tv.tv_sec = 0;
+            tv.tv_usec = 0;
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+            if (rc < 0) {
+                // A late reply is skipped by its request id when the next command reads its own
+                printf("Error: Failed to receive file size\n");
+                continue;
+            }
+            if (reply.status != ST_OK || reply.length != sizeof(uint64_t)) {
+                printf("Server error: %s\n", buffer);
+                continue;
+            }
+            uint64_t net_file_size;
+            memcpy(&net_file_size, buffer, sizeof(net_file_size));
+            uint64_t file_size = be64toh(net_file_size);
+            printf("Client: Received file size: %lu bytes%s\n", file_size, compressed ? " before compression" : "");
+
+            // Prepare output file; without one the data is still consumed to keep the connection usable
+            int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0) printf("Error: Cannot create file %s in PWD\n", filename);
+            long long total_received = recv_body(sock, fd, 0, file_size, NULL);
+            if (fd < 0) {
+                if (total_received < 0) break;
+                continue;
+            }
+            close(fd);
+            // Report download status; a compressed stream is complete once its last frame arrives
+            if (total_received == (long long)file_size || (compressed && total_received > 0)) {
+                printf("Download of %s completed successfully\n", filename);
+            } else {
+                printf("Error: Download incomplete, received %lld/%lu bytes\n", total_received < 0 ? 0 : total_received, file_size);
+                break;
+            }
+        } else if (strcmp(command, "removef") == 0) {
+            printf("Client: Sending removef command: %s\n", buffer);
+            // Validate file path
+            if (strlen(param1) == 0) {
+                printf("Error: Please provide a file path (e.g., ~S1/folder1/sample.txt)\n");
+                continue;
+            }
+
+            // Send remove request
+            uint32_t id = ++last_request_id;
+            send_frame(sock, OP_REMOVEF, 0, id, param1, strlen(param1));
+
+            // Receive server response
+            struct frame_hdr reply;
+            if (recv_reply(sock, id, &reply, buffer, BUFFER_SIZE) == 0) {
+                printf("%s\n", buffer);
+            } else {
+                printf("Error: No response from S1\n");
+            }
+        } else if (strcmp(command, "dispfnames") == 0) {
+            printf("Client: Sending dispfnames command: %s\n", buffer);
+            // Validate path; -l adds each file's size and modification time
+            char path[256] = {0}, option[8] = {0};
+            sscanf(param1, "%255s %7s", path, option);
+            if (strlen(path) == 0) {
+                printf("Error: Please provide a pathname (e.g., ~S1/folder1)\n");
+                continue;
+            }
+            int want_long = strcmp(option, "-l") == 0;
+
+            // Fetch the listing a page at a time, printing each page as it arrives
+            char cursor[PATH_MAX + 16] = "";
+            long total = 0;
+            int ok = 1;
+            do {
+                char args[2 * PATH_MAX];
+                snprintf(args, sizeof(args), "%s limit=%d%s%s%s", path, LISTING_PAGE,
+                         want_long ? " long" : "", cursor[0] ? " after=" : "", cursor);
+                uint32_t id = ++last_request_id;
+                struct frame_hdr reply;
+                if (send_frame(sock, OP_DISPFNAMES, 0, id, args, strlen(args)) < 0 ||
+                    recv_reply(sock, id, &reply, buffer, BUFFER_SIZE) < 0) {
+                    printf("Error: No response from S1\n");
+                    ok = 0;
+                    break;
+                }
+                if (reply.status != ST_OK) {
+                    printf("Server error: %s\n", buffer);
+                    ok = 0;
+                    break;
+                }
+                // Entry frames, then a final frame with the cursor for the next page
+                cursor[0] = '\0';
+                while (1) {
+                    struct frame_hdr data;
+                    if (recv_frame(sock, &data) < 0 || data.opcode != OP_DATA || data.length > LISTING_MAX_FRAME) {
+                        printf("Error: Listing interrupted\n");
+                        ok = 0;
+                        break;
+                    }
+                    char *payload = malloc(data.length + 1);
+                    if (receive_full(sock, payload, data.length) < 0) {
+                        free(payload);
+                        printf("Error: Listing interrupted\n");
+                        ok = 0;
+                        break;
+                    }
+                    payload[data.length] = '\0';
+                    if (!(data.flags & FL_MORE)) {
+                        snprintf(cursor, sizeof(cursor), "%s", payload);
+                        free(payload);
+                        break;
+                    }
+                    if (total == 0 && data.length > 0) printf("Files in %s:\n", path);
+                    // Print each "name[<TAB>size<TAB>mtime]" entry
+                    char *save = NULL;
+                    for (char *entry = strtok_r(payload, "\n", &save); entry; entry = strtok_r(NULL, "\n", &save)) {
+                        char *size_field = strchr(entry, '\t');
+                        if (size_field) {
+                            *size_field++ = '\0';
+                            char *mtime_field = strchr(size_field, '\t');
+                            time_t mtime = mtime_field ? (time_t)strtoll(mtime_field + 1, NULL, 10) : 0;
+                            if (mtime_field) *mtime_field = '\0';
+                            char date[32];
+                            strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&mtime));
+                            printf("%12s  %s  %s\n", size_field, date, entry);
+                        } else {
+                            printf("%s\n", entry);
+                        }
+                        total++;
+                    }
+                    free(payload);
+                }
+            } while (ok && cursor[0]);
+            if (ok && total == 0) printf("No files found in %s\n", path);
+        } else if (strcmp(command, "uploaddir") == 0 || strcmp(command, "downldir") == 0) {
+            printf("Client: Sending %s command: %s\n", command, buffer);
+            // uploaddir <dir> <~S1/dest> and downldir <~S1/dir> move a whole tree; "-p <n>"
+            // spreads its files over n connections
+            int upload = strcmp(command, "uploaddir") == 0, streams = 1;
+            char local_dir[256] = {0}, remote_dir[256] = {0}, option[8] = {0};
+            if (upload) sscanf(param1, "%255s %255s %7s %d", local_dir, remote_dir, option, &streams);
+            else sscanf(param1, "%255s %7s %d", remote_dir, option, &streams);
+            if (strncmp(remote_dir, "~S1/", 4) != 0 || (upload && !local_dir[0])) {
+                printf("Error: Usage: uploaddir <dir> <~S1/dest> or downldir <~S1/dir>, optionally followed by -p <n>\n");
+                continue;
+            }
+            if (option[0] && (strcmp(option, "-p") != 0 || streams < 1 || streams > MAX_STREAMS)) {
+                printf("Error: Streams must be between 1 and %d\n", MAX_STREAMS);
+                continue;
+            }
+            size_t len = strlen(remote_dir);
+            while (len > 4 && remote_dir[len - 1] == '/') remote_dir[--len] = '\0';
+            // A download goes to a directory of the same name in PWD
+            if (!upload) {
+                const char *name = strrchr(remote_dir, '/') + 1;
+                snprintf(local_dir, sizeof(local_dir), "%s", name[0] ? name : "S1");
+            }
+            if (transfer_directory(sock, PORT_S1, upload, local_dir, remote_dir, streams) < 0) break;
+        } else if (strcmp(command, "exit") == 0) {
+            printf("Client: Sending exit command\n");
+            close(sock);
+            return 0;
+        } else {
+            printf("Client: Unknown command: %s\n", command);
+        }
+    }
+    close(sock);
+    return 0;
+}
+
+// Connect to S1 on the local host. Returns the socket, or -1 after reporting the error.
+int connect_to_s1(int port) {
+    // Create client socket
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    // Configure server address
+    struct sockaddr_in server_addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = inet_addr("127.0.0.1"),
+        .sin_port = htons(port)
+    };
+    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Failed to connect to S1");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Download a file into the working directory. It is received into "<name>.part" and
+// renamed once complete; a part left by an earlier attempt is resumed where it stopped,
+// unless the file changed on the server since. When the connection fails mid-transfer,
+// S1 is reconnected and the download resumed, up to RESUME_ATTEMPTS times, replacing
+// *sock. Returns 0 when the download completed or was refused, or -1 if the connection
+// to S1 was lost.
+int download_file(int *sock, int port, const char *path) {
+    char buffer[BUFFER_SIZE], filename[256], part[300], path_copy[256];
+    snprintf(path_copy, sizeof(path_copy), "%s", path);
+    snprintf(filename, sizeof(filename), "%s", basename(path_copy));
+    snprintf(part, sizeof(part), "%s.part", filename);
+    // Version of the server's copy last received, for resuming should the part file
+    // not keep it
+    uint64_t version = 0;
+    int have_version = 0;
+
+    for (int attempt = 0; ; attempt++) {
+        if (attempt > 0) {
+            if (attempt > RESUME_ATTEMPTS) {
+                printf("Error: Giving up on %s after %d attempts; run downlf again to resume\n", filename, attempt);
+                return -1;
+            }
+            printf("Client: Reconnecting to resume %s (attempt %d of %d)\n", filename, attempt, RESUME_ATTEMPTS);
+            close(*sock);
+            sleep(1);
+            if ((*sock = connect_to_s1(port)) < 0) continue;
+        }
+
+        // A part file carries the version of the server's copy it came from; one without
+        // it is fetched again from the start
+        struct stat partbuf;
+        char args[BUFFER_SIZE];
+        uint64_t part_version = version;
+        if (stat(part, &partbuf) == 0 &&
+            (getxattr(part, PART_VERSION_XATTR, &part_version, sizeof(part_version)) == sizeof(part_version) || have_version))
+            snprintf(args, sizeof(args), "%s offset=%lld if=%lu", path, (long long)partbuf.st_size, part_version);
+        else
+            snprintf(args, sizeof(args), "%s offset=0", path);
+
+        // Send download request, accepting a deflated body for files whose type compresses
+        uint32_t id = __atomic_add_fetch(&last_request_id, 1, __ATOMIC_RELAXED);
+        if (send_frame(*sock, OP_DOWNLF, compressible_type(filename) ? FL_DEFLATE : 0, id, args, strlen(args)) < 0) continue;
+
+        // Receive the range that follows, or the server's error message, waiting up to 5 seconds
+        struct timeval tv = {.tv_sec = 5, .tv_usec = 0};
+        setsockopt(*sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        struct frame_hdr reply;
+        errno = 0;
+        int rc = recv_reply(*sock, id, &reply, buffer, BUFFER_SIZE);
+        // Only a timeout leaves the connection in use; a lost one is reconnected
+        if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK) continue;
+        if (rc < 0) {
+            // A late reply is skipped by its request id when the next command reads its own
+            printf("Error: Failed to receive file size\n");
+            return 0;
+        }
+        if (reply.status != ST_OK || reply.length != RANGE_REPLY_SIZE) {
+            printf("Server error: %s\n", buffer);
+            return 0;
+        }
+        uint64_t fields[5];
+        memcpy(fields, buffer, sizeof(fields));
+        uint64_t length = be64toh(fields[0]), offset = be64toh(fields[1]), file_size = be64toh(fields[2]);
+        time_t mtime = (time_t)be64toh(fields[3]);
+        version = be64toh(fields[4]);
+        have_version = 1;
+        if (offset > 0)
+            printf("Client: Received file size: %lu bytes, resuming at %lu%s\n", file_size, offset,
+                   (reply.flags & FL_DEFLATE) ? ", sent deflated" : "");
+        else
+            printf("Client: Received file size: %lu bytes%s\n", file_size, (reply.flags & FL_DEFLATE) ? ", sent deflated" : "");
+
+        // Continue the part file where the range starts; the whole file replaces a stale one.
+        // Without a part file the data is still consumed to keep the connection usable.
+        int fd = open(part, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0 && ftruncate(fd, offset) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd < 0) printf("Error: Cannot create file %s in PWD\n", part);
+        // Recorded before any data, so a part cut off at any point can be resumed
+        else fsetxattr(fd, PART_VERSION_XATTR, &version, sizeof(version), 0);
+
+        // A transfer that stalls counts as a lost connection
+        tv.tv_sec = STALL_TIMEOUT;
+        setsockopt(*sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        long long received = recv_body(*sock, fd, offset, length, NULL);
+        tv.tv_sec = 0;
+        setsockopt(*sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (fd < 0) return received < 0 ? -1 : 0;
+        close(fd);
+        // The part keeps the server copy's mtime, as the completed file will
+        struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = mtime}};
+        utimensat(AT_FDCWD, part, times, 0);
+
+        // Report download status
+        if (received == (long long)length) {
+            if (rename(part, filename) != 0) {
+                printf("Error: Cannot rename %s to %s\n", part, filename);
+                return 0;
+            }
+            printf("Download of %s completed successfully\n", filename);
+            return 0;
+        }
+        printf("Error: Download incomplete, received %lld/%lu bytes\n",
+               stat(part, &partbuf) == 0 ? (long long)partbuf.st_size : 0, file_size);
+    }
+}
+
+// Download a file over several connections at once: its size is asked for on sock, then
+// streams workers fetch one byte range each into a preallocated "<name>.part" file,
+// which is renamed once every range is complete. A worker whose connection fails
+// resumes its range on a new one. Small files are fetched on sock alone. Returns -1 if
+// sock was lost, 0 otherwise.
+int download_parallel(int sock, int port, const char *path, int streams) {
+    char buffer[BUFFER_SIZE], args[BUFFER_SIZE], filename[256], part[300], path_copy[256];
+    snprintf(path_copy, sizeof(path_copy), "%s", path);
+    snprintf(filename, sizeof(filename), "%s", basename(path_copy));
+    snprintf(part, sizeof(part), "%s.part", filename);
+
+    // Ask for the first byte to learn the file's size, mtime and version
+    snprintf(args, sizeof(args), "%s offset=0 length=1", path);
+    uint32_t id = __atomic_add_fetch(&last_request_id, 1, __ATOMIC_RELAXED);
+    struct frame_hdr reply;
+    if (send_frame(sock, OP_DOWNLF, 0, id, args, strlen(args)) < 0 ||
+        recv_reply(sock, id, &reply, buffer, BUFFER_SIZE) < 0) {
+        printf("Error: No response from S1\n");
+        return -1;
+    }
+    if (reply.status != ST_OK || reply.length != RANGE_REPLY_SIZE) {
+        printf("Server error: %s\n", buffer);
+        return 0;
+    }
+    uint64_t fields[5];
+    memcpy(fields, buffer, sizeof(fields));
+    uint64_t file_size = be64toh(fields[2]), version = be64toh(fields[4]);
+    time_t mtime = (time_t)be64toh(fields[3]);
+    if (recv_body(sock, -1, 0, 1, NULL) < 0) return -1;
+
+    // Every stream gets at least MIN_STREAM_RANGE bytes
+    if ((uint64_t)streams > file_size / MIN_STREAM_RANGE) streams = file_size / MIN_STREAM_RANGE;
+    if (streams < 2) return download_file(&sock, port, path);
+    printf("Client: Received file size: %lu bytes, fetching in %d streams\n", file_size, streams);
+
+    // Reserve the whole file up front so the ranges are written into place
+    int fd = open(part, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || (posix_fallocate(fd, 0, file_size) != 0 && ftruncate(fd, file_size) != 0)) {
+        printf("Error: Cannot create file %s in PWD\n", part);
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct range_job jobs[MAX_STREAMS];
+    pthread_t threads[MAX_STREAMS];
+    uint64_t range = (file_size + streams - 1) / streams;
+    for (int i = 0; i < streams; i++) {
+        uint64_t offset = i * range;
+        jobs[i] = (struct range_job){.port = port, .path = path, .fd = fd, .offset = offset,
+                                     .length = offset + range > file_size ? file_size - offset : range,
+                                     .version = version};
+        if (pthread_create(&threads[i], NULL, range_worker, &jobs[i]) != 0) {
+            // Fetch this range on the calling thread instead
+            threads[i] = 0;
+            range_worker(&jobs[i]);
+        }
+    }
+    int ok = 1;
+    for (int i = 0; i < streams; i++) {
+        if (threads[i]) pthread_join(threads[i], NULL);
+        ok &= jobs[i].ok;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(fd);
+
+    if (!ok) {
+        // A part with holes cannot be resumed, so it is not kept
+        unlink(part);
+        printf("Error: Parallel download of %s failed\n", filename);
+        return 0;
+    }
+    struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = mtime}};
+    utimensat(AT_FDCWD, part, times, 0);
+    if (rename(part, filename) != 0) {
+        printf("Error: Cannot rename %s to %s\n", part, filename);
+        return 0;
+    }
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Download of %s completed successfully (%d streams, %.1f MB/s)\n", filename, streams,
+           elapsed > 0 ? file_size / elapsed / 1e6 : 0.0);
+    return 0;
+}
+
+// Fetch one range of a parallel download on a connection of its own, resuming from the
+// bytes already written when the connection fails, up to RESUME_ATTEMPTS times
+void *range_worker(void *arg) {
+    struct range_job *job = arg;
+    char buffer[BUFFER_SIZE], args[BUFFER_SIZE];
+    for (int attempt = 0; attempt <= RESUME_ATTEMPTS && job->done < job->length; attempt++) {
+        if (attempt > 0) sleep(1);
+        int sock = connect_to_s1(job->port);
+        if (sock < 0) continue;
+
+        // The range is served only while the file is unchanged, otherwise S1 offers the
+        // whole file at offset 0, which is refused below
+        uint64_t offset = job->offset + job->done, length = job->length - job->done;
+        snprintf(args, sizeof(args), "%s offset=%lu length=%lu if=%lu", job->path, offset, length, job->version);
+        uint32_t id = __atomic_add_fetch(&last_request_id, 1, __ATOMIC_RELAXED);
+        uint16_t flags = compressible_type(job->path) ? FL_DEFLATE : 0;
+        struct frame_hdr reply;
+        struct timeval tv = {.tv_sec = STALL_TIMEOUT, .tv_usec = 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (send_frame(sock, OP_DOWNLF, flags, id, args, strlen(args)) < 0 ||
+            recv_reply(sock, id, &reply, buffer, BUFFER_SIZE) < 0) {
+            close(sock);
+            continue;
+        }
+        uint64_t fields[5];
+        memcpy(fields, buffer, sizeof(fields));
+        if (reply.status != ST_OK || reply.length != RANGE_REPLY_SIZE ||
+            be64toh(fields[0]) != length || be64toh(fields[1]) != offset) {
+            printf("Client: Range at %lu refused: %s\n", offset,
+                   reply.status != ST_OK ? buffer : "file changed during download");
+            close(sock);
+            return NULL;
+        }
+        uint64_t received = 0;
+        recv_body(sock, job->fd, offset, length, &received);
+        job->done += received;
+        close(sock);
+    }
+    job->ok = job->done == job->length;
+    return NULL;
+}
+
+// Upload a large file over several connections at once: a multipart upload is started on
+// sock, streams workers send its UPLOAD_PART_SIZE parts over connections of their own,
+// and once every part is stored the upload is completed on sock, or aborted if a part
+// could not be. Returns -1 if sock was lost, 0 otherwise.
+int upload_parallel(int sock, int port, const char *path, const char *args, uint64_t file_size, int streams) {
+    char buffer[BUFFER_SIZE], request[BUFFER_SIZE];
+    uint32_t id = __atomic_add_fetch(&last_request_id, 1, __ATOMIC_RELAXED);
+    struct frame_hdr reply;
+    if (send_frame(sock, OP_UPLOAD_INIT, 0, id, args, strlen(args)) < 0 ||
+        recv_reply(sock, id, &reply, buffer, BUFFER_SIZE) < 0) {
+        printf("Error: No response from S1\n");
+        return -1;
+    }
+    if (reply.status != ST_OK) {
+        printf("%s\n", buffer);
+        return 0;
+    }
+
+    struct upload_job job = {.port = port, .path = path, .file_size = file_size,
+                             .parts = (file_size + UPLOAD_PART_SIZE - 1) / UPLOAD_PART_SIZE,
+                             .deflated = compressible_type(path)};
+    // The reply is the upload id; anything longer than one is not an id
+    if (strlen(buffer) >= sizeof(job.upload_id)) {
+        printf("Error: Unexpected reply from S1: %s\n", buffer);
+        return 0;
+    }
+    snprintf(job.upload_id, sizeof(job.upload_id), "%.*s", (int)sizeof(job.upload_id) - 1, buffer);
+    if ((uint64_t)streams > job.parts) streams = job.parts;
+    printf("Client: Started upload %s, sending %lu parts in %d streams\n", job.upload_id, job.parts, streams);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t threads[MAX_STREAMS];
+    int started = 0;
+    for (int i = 0; i < streams; i++)
+        if (pthread_create(&threads[started], NULL, upload_worker, &job) == 0) started++;
+    // Without any thread the parts are sent from the calling thread
+    if (started == 0) upload_worker(&job);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Complete the upload, or have the server drop the parts already stored
+    id = __atomic_add_fetch(&last_request_id, 1, __ATOMIC_RELAXED);
+    if (job.failed) {
+        if (send_frame(sock, OP_UPLOAD_ABORT, 0, id, job.upload_id, strlen(job.upload_id)) < 0 ||
+            recv_reply(sock, id, &reply, buffer, BUFFER_SIZE) < 0) {
+            printf("Error: Parallel upload failed and could not be aborted\n");
+            return -1;
+        }
+        printf("Error: Parallel upload failed (%s)\n", buffer);
+        return 0;
+    }
+    snprintf(request, sizeof(request), "%s %lu", job.upload_id, file_size);
+    if (send_frame(sock, OP_UPLOAD_COMPLETE, 0, id, request, strlen(request)) < 0 ||
+        recv_reply(sock, id, &reply, buffer, BUFFER_SIZE) < 0) {
+        printf("Error: No response from S1\n");
+        return -1;
+    }
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (reply.status == ST_OK)
+        printf("%s (%d streams, %.1f MB/s)\n", buffer, streams, elapsed > 0 ? file_size / elapsed / 1e6 : 0.0);
+    else
+        printf("%s\n", buffer);
+    return 0;
+}
+
+// Ask S1 whether the server that would store a file already holds its content, by its
+// size and SHA-256; if so the file is stored without being sent. Returns 1 if it was,
+// 0 if it must be sent, or -1 if sock was lost. fp is left at the start of the file.
+int probe_upload(int sock, FILE *fp, const char *args, uint64_t file_size) {
+    char request[BUFFER_SIZE + 128], buffer[BUFFER_SIZE], hex[2 * SHA256_LEN + 1];
+    unsigned char digest[SHA256_LEN], *data = malloc(HASH_READ);
+    if (!data || file_size == 0) {
+        free(data);
+        return 0;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct sha256_ctx ctx;
+    sha256_init(&ctx);
+    uint64_t total = 0;
+    size_t bytes;
+    while ((bytes = fread(data, 1, HASH_READ, fp)) > 0) {
+        sha256_update(&ctx, data, bytes);
+        total += bytes;
+    }
+    free(data);
+    int read_ok = !ferror(fp) && total == file_size;
+    rewind(fp);
+    if (!read_ok) return 0;
+    sha256_final(&ctx, digest);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Client: Hashed %lu bytes in %.1f ms\n", file_size, elapsed * 1e3);
+
+    digest_hex(digest, hex);
+    snprintf(request, sizeof(request), "%s %lu %s", args, file_size, hex);
+    uint32_t id = __atomic_add_fetch(&last_request_id, 1, __ATOMIC_RELAXED);
+    struct frame_hdr reply;
+    if (send_frame(sock, OP_UPLOAD_PROBE, 0, id, request, strlen(request)) < 0 ||
+        recv_reply(sock, id, &reply, buffer, BUFFER_SIZE) < 0) {
+        printf("Error: No response from S1\n");
+        return -1;
+    }
+    // Any other answer, including one from a server without probes, means sending the file
+    if (reply.status != ST_OK) return 0;
+    printf("%s\n", buffer);
+    return 1;
+}
+
+// Send parts of a parallel upload on a connection of its own until none are left. A part
+// whose connection fails is sent again on a new one, up to RESUME_ATTEMPTS times.
+void *upload_worker(void *arg) {
+    struct upload_job *job = arg;
+    FILE *fp = fopen(job->path, "rb");
+    if (!fp) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    int sock = -1;
+    while (!__atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+        uint64_t part = __atomic_fetch_add(&job->next_part, 1, __ATOMIC_RELAXED);
+        if (part >= job->parts) break;
+        uint64_t offset = part * UPLOAD_PART_SIZE;
+        uint64_t length = offset + UPLOAD_PART_SIZE > job->file_size ? job->file_size - offset : UPLOAD_PART_SIZE;
+        int rc = -1;
+        for (int attempt = 0; attempt <= RESUME_ATTEMPTS && rc == -1; attempt++) {
+            if (sock < 0) {
+                if (attempt > 0) sleep(1);
+                if ((sock = connect_to_s1(job->port)) < 0) continue;
+                struct timeval tv = {.tv_sec = STALL_TIMEOUT, .tv_usec = 0};
+                setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            }
+            if ((rc = send_part(sock, fp, job, offset, length)) == -1) {
+                close(sock);
+                sock = -1;
+            }
+        }
+        if (rc != 0) __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+    }
+    if (sock >= 0) close(sock);
+    fclose(fp);
+    return NULL;
+}
+
+// Send one part of a parallel upload, deflated if the file's type compresses, and wait
+// until it is stored. Returns 0 once it is, -2 if it was refused, or -1 if the
+// connection failed.
+int send_part(int sock, FILE *fp, const struct upload_job *job, uint64_t offset, uint64_t length) {
+    char args[BUFFER_SIZE], buffer[BUFFER_SIZE];
+    snprintf(args, sizeof(args), "%s %lu", job->upload_id, offset);
+    uint32_t id = __atomic_add_fetch(&last_request_id, 1, __ATOMIC_RELAXED);
+    if (fseeko(fp, offset, SEEK_SET) != 0) return -2;
+    if (send_frame(sock, OP_UPLOAD_PART, 0, id, args, strlen(args)) < 0 ||
+        send_file_data(sock, fp, length, job->deflated, id) < 0) return -1;
+    struct frame_hdr reply;
+    if (recv_reply(sock, id, &reply, buffer, BUFFER_SIZE) < 0) return -1;
+    if (reply.status != ST_OK) {
+        printf("Client: Part at %lu refused: %s\n", offset, buffer);
+        return -2;
+    }
+    return 0;
+}
+
+// Send the next length bytes of fp as the body of a request, as one DATA frame or
+// deflated. Returns -1 if the body could not be sent in full, leaving the connection
+// unusable.
+int send_file_data(int sock, FILE *fp, uint64_t length, int deflated, uint32_t request_id) {
+    char buffer[BUFFER_SIZE];
+    if (deflated) return send_deflated_body(sock, fp, length, request_id) < 0 ? -1 : 0;
+    if (send_frame(sock, OP_DATA, 0, request_id, NULL, length) < 0) return -1;
+    uint64_t sent = 0;
+    size_t bytes;
+    while (sent < length && (bytes = fread(buffer, 1, length - sent < BUFFER_SIZE ? length - sent : BUFFER_SIZE, fp)) > 0) {
+        if (send_all(sock, buffer, bytes) < 0) return -1;
+        sent += bytes;
+    }
+    // A file that shrank leaves the frame incomplete
+    return sent == length ? 0 : -1;
+}
+
+// Upload or download a whole directory tree. Its files are spread over streams
+// connections, each keeping up to PIPELINE_DEPTH requests in flight, so a small file
+// costs a few bytes of framing rather than a round trip. Downloads are listed on sock.
+// Returns -1 if sock was lost, 0 otherwise.
+int transfer_directory(int sock, int port, int upload, const char *local_dir, const char *remote_dir, int streams) {
+    struct file_list list = {0};
+    if (upload) {
+        collect_local_files(local_dir, "", &list);
+    } else if (list_remote_files(sock, remote_dir, &list) < 0) {
+        free_file_list(&list);
+        printf("Error: No response from S1\n");
+        return -1;
+    }
+    if (list.count == 0) {
+        printf("No files found in %s\n", upload ? local_dir : remote_dir);
+        free_file_list(&list);
+        return 0;
+    }
+    if ((size_t)streams > list.count) streams = list.count;
+    printf("Client: %s %zu files in %d streams\n", upload ? "Uploading" : "Downloading", list.count, streams);
+
+    struct bulk_job job = {.port = port, .upload = upload, .local_dir = local_dir, .remote_dir = remote_dir, .files = &list};
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t threads[MAX_STREAMS];
+    int started = 0;
+    for (int i = 0; i < streams; i++)
+        if (pthread_create(&threads[started], NULL, bulk_worker, &job) == 0) started++;
+    // Without any thread the files are moved from the calling thread
+    if (started == 0) bulk_worker(&job);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s %ld of %zu files (%.1f MB) in %.2f s, %.0f files/s\n", upload ? "Uploaded" : "Downloaded",
+           job.stored, list.count, job.bytes / 1e6, elapsed, elapsed > 0 ? job.stored / elapsed : 0.0);
+    if (job.failed > 0) printf("Error: %ld files failed\n", job.failed);
+    free_file_list(&list);
+    return 0;
+}
+
+// Move files of a directory transfer over a connection of its own until none are left,
+// sending requests ahead while the answers to earlier ones are still arriving
+void *bulk_worker(void *arg) {
+    struct bulk_job *job = arg;
+    struct bulk_slot ring[PIPELINE_DEPTH];
+    int head = 0, inflight = 0, lost = 0;
+    long stored = 0, failed = 0;
+    int sock = connect_to_s1(job->port);
+    if (sock < 0) return NULL;
+    struct timeval tv = {.tv_sec = STALL_TIMEOUT, .tv_usec = 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    while (!lost) {
+        // Fill the pipeline; the few bytes of each answer never back up the connection
+        while (inflight < PIPELINE_DEPTH) {
+            struct bulk_slot *slot = &ring[(head + inflight) % PIPELINE_DEPTH];
+            slot->index = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+            if (slot->index >= job->files->count) break;
+            int rc = send_bulk_request(sock, job, slot);
+            if (rc == -1) lost = 1;
+            if (rc == -2) failed++;
+            else inflight++;
+            if (lost) break;
+        }
+        if (inflight == 0) break;
+        // Take the answer to the oldest request
+        int rc = lost ? -1 : finish_bulk_request(sock, job, &ring[head]);
+        if (rc == -1) break;
+        if (rc == 0) stored++;
+        else failed++;
+        head = (head + 1) % PIPELINE_DEPTH;
+        inflight--;
+    }
+    // Requests whose answers were lost with the connection
+    if (inflight > 0) {
+        printf("Client: Connection lost with %d requests in flight\n", inflight);
+        failed += inflight;
+    }
+    close(sock);
+    __atomic_add_fetch(&job->stored, stored, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&job->failed, failed, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// Send the request moving one file of a directory transfer; an upload carries the file
+// with it. Returns 0 once sent, -2 if the file was skipped, or -1 if the connection failed.
+int send_bulk_request(int sock, struct bulk_job *job, struct bulk_slot *slot) {
+    const char *rel = job->files->paths[slot->index];
+    char path[PATH_MAX], args[2 * PATH_MAX];
+    slot->id = __atomic_add_fetch(&last_request_id, 1, __ATOMIC_RELAXED);
+    int deflated = compressible_type(rel);
+    if (!job->upload) {
+        snprintf(args, sizeof(args), "%s/%s", job->remote_dir, rel);
+        return send_frame(sock, OP_DOWNLF, deflated ? FL_DEFLATE : 0, slot->id, args, strlen(args));
+    }
+
+    // Uploads name the local file and the directory it goes to, as uploadf does
+    snprintf(path, sizeof(path), "%s/%s", job->local_dir, rel);
+    struct stat statbuf;
+    FILE *fp = fopen(path, "rb");
+    if (!fp || fstat(fileno(fp), &statbuf) != 0) {
+        if (fp) fclose(fp);
+        printf("Client: Cannot read %s\n", path);
+        return -2;
+    }
+    const char *slash = strrchr(rel, '/');
+    snprintf(args, sizeof(args), "%s %s/%.*s", path, job->remote_dir, slash ? (int)(slash - rel + 1) : 0, rel);
+    slot->size = statbuf.st_size;
+    int rc = send_frame(sock, OP_UPLOADF, deflated ? FL_DEFLATE : 0, slot->id, args, strlen(args)) < 0 ||
+             send_file_data(sock, fp, slot->size, deflated, slot->id) < 0 ? -1 : 0;
+    fclose(fp);
+    return rc;
+}
+
+// Read the answer to one request of a directory transfer, saving a downloaded file below
+// the local directory. Returns 0 once the file is moved, -2 if it was refused or could
+// not be saved, or -1 if the connection failed.
+int finish_bulk_request(int sock, struct bulk_job *job, const struct bulk_slot *slot) {
+    const char *rel = job->files->paths[slot->index];
+    char buffer[BUFFER_SIZE], path[PATH_MAX];
+    struct frame_hdr reply;
+    if (recv_reply(sock, slot->id, &reply, buffer, BUFFER_SIZE) < 0) return -1;
+    if (job->upload || reply.status != ST_OK) {
+        if (reply.status != ST_OK) {
+            printf("Client: %s: %s\n", rel, buffer);
+            return -2;
+        }
+        __atomic_add_fetch(&job->bytes, slot->size, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (reply.length != sizeof(uint64_t)) return -1;
+    uint64_t net_file_size;
+    memcpy(&net_file_size, buffer, sizeof(net_file_size));
+    uint64_t file_size = be64toh(net_file_size);
+
+    // Without an output file the data is still consumed to keep the connection usable
+    snprintf(path, sizeof(path), "%s/%s", job->local_dir, rel);
+    char *dir_path = strdup(path);
+    create_directories(dirname(dir_path));
+    free(dir_path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) printf("Client: Cannot create %s\n", path);
+    uint64_t received = 0;
+    long long total = recv_body(sock, fd, 0, file_size, &received);
+    if (fd < 0) return total < 0 ? -1 : -2;
+    close(fd);
+    if (total != (long long)file_size) {
+        unlink(path);
+        return total < 0 ? -1 : -2;
+    }
+    __atomic_add_fetch(&job->bytes, file_size, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Collect the regular files below dir that S1 stores, as paths relative to dir. Hidden
+// entries and symlinks are skipped.
+void collect_local_files(const char *dir, const char *rel, struct file_list *list) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s%s", dir, rel[0] ? "/" : "", rel);
+    DIR *d = opendir(path);
+    if (!d) return;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        char child[PATH_MAX], full[2 * PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s%s%s", rel, rel[0] ? "/" : "", entry->d_name) >= PATH_MAX) continue;
+        snprintf(full, sizeof(full), "%s/%s", dir, child);
+        struct stat statbuf;
+        if (lstat(full, &statbuf) != 0) continue;
+        if (S_ISDIR(statbuf.st_mode)) collect_local_files(dir, child, list);
+        else if (S_ISREG(statbuf.st_mode) && stored_type(entry->d_name)) file_list_add(list, child);
+    }
+    closedir(d);
+}
+
+// Collect the paths of the files below a directory on S1, a listing page at a time.
+// Returns -1 if the connection failed; a listing S1 refuses leaves the list empty.
+int list_remote_files(int sock, const char *dir, struct file_list *list) {
+    char buffer[BUFFER_SIZE], cursor[PATH_MAX + 16] = "";
+    do {
+        char args[2 * PATH_MAX + 64];
+        snprintf(args, sizeof(args), "%s limit=%d paths%s%s", dir, LISTING_PAGE, cursor[0] ? " after=" : "", cursor);
+        uint32_t id = __atomic_add_fetch(&last_request_id, 1, __ATOMIC_RELAXED);
+        struct frame_hdr reply;
+        if (send_frame(sock, OP_DISPFNAMES, 0, id, args, strlen(args)) < 0 ||
+            recv_reply(sock, id, &reply, buffer, BUFFER_SIZE) < 0) return -1;
+        if (reply.status != ST_OK) {
+            printf("Server error: %s\n", buffer);
+            return 0;
+        }
+        // Entry frames, then a final frame with the cursor for the next page
+        while (1) {
+            struct frame_hdr data;
+            if (recv_frame(sock, &data) < 0 || data.opcode != OP_DATA || data.length > LISTING_MAX_FRAME) return -1;
+            char *payload = malloc(data.length + 1);
+            if (!payload || receive_full(sock, payload, data.length) < 0) {
+                free(payload);
+                return -1;
+            }
+            payload[data.length] = '\0';
+            if (!(data.flags & FL_MORE)) {
+                snprintf(cursor, sizeof(cursor), "%s", payload);
+                free(payload);
+                break;
+            }
+            char *save = NULL;
+            for (char *entry = strtok_r(payload, "\n", &save); entry; entry = strtok_r(NULL, "\n", &save))
+                file_list_add(list, entry);
+            free(payload);
+        }
+    } while (cursor[0]);
+    return 0;
+}
+
+void file_list_add(struct file_list *list, const char *path) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? 2 * list->capacity : 256;
+        char **grown = realloc(list->paths, capacity * sizeof(char *));
+        if (!grown) return;
+        list->paths = grown;
+        list->capacity = capacity;
+    }
+    char *copy = strdup(path);
+    if (copy) list->paths[list->count++] = copy;
+}
+
+void free_file_list(struct file_list *list) {
+    for (size_t i = 0; i < list->count; i++) free(list->paths[i]);
+    free(list->paths);
+    list->paths = NULL;
+    list->count = list->capacity = 0;
+}
+
+// Whether S1 stores files of this type
+int stored_type(const char *name) {
+    const char *ext = strrchr(name, '.');
+    return ext && (strcmp(ext, ".c") == 0 || strcmp(ext, ".pdf") == 0 || strcmp(ext, ".txt") == 0 || strcmp(ext, ".zip") == 0);
+}
+
+// Create directories recursively
+void create_directories(const char *path) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, PATH_MAX, "%s", path);
+    char *p;
+    for (p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(tmp, 0755);
+            *p = '/';
+        }
+    }
+    mkdir(tmp, 0755);
+}
+
+// Receive exact number of bytes
+int receive_full(int sock, char *buffer, size_t size) {
+    size_t received = 0;
+    while (received < size) {
+        ssize_t bytes = recv(sock, buffer + received, size - received, 0);
+        if (bytes <= 0) return -1;  // Error or connection closed
+        received += bytes;
+    }
+    return 0;  // Success
+}
+// Send an entire buffer, retrying short writes
+int send_all(int sock, const void *buffer, size_t size) {
+    const char *p = buffer;
+    while (size > 0) {
+        ssize_t bytes = send(sock, p, size, MSG_NOSIGNAL);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += bytes;
+        size -= bytes;
+    }
+    return 0;
+}
+
+// Send a frame header and, if given, its in-memory payload. With no payload the caller
+// streams the length bytes itself, so the header is corked until they follow.
+int send_frame(int sock, uint8_t opcode, uint16_t flags, uint32_t request_id, const void *payload, uint64_t length) {
+    struct frame_hdr hdr = {htons(PROTO_MAGIC), PROTO_VERSION, opcode, htons(flags), 0, htonl(request_id), htobe64(length)};
+    if (payload && length > 0) {
+        char frame[sizeof(hdr) + BUFFER_SIZE];
+        if (length > BUFFER_SIZE) return -1;
+        // Requests are small, so they go out in the same segment as their header
+        memcpy(frame, &hdr, sizeof(hdr));
+        memcpy(frame + sizeof(hdr), payload, length);
+        return send_all(sock, frame, sizeof(hdr) + length);
+    }
+    if (send(sock, &hdr, sizeof(hdr), MSG_NOSIGNAL | (length > 0 ? MSG_MORE : 0)) != sizeof(hdr)) return -1;
+    return 0;
+}
+
+// Receive a frame header and convert it to host byte order
+int recv_frame(int sock, struct frame_hdr *hdr) {
+    if (receive_full(sock, (char*)hdr, sizeof(*hdr)) < 0) return -1;
+    if (ntohs(hdr->magic) != PROTO_MAGIC || hdr->version != PROTO_VERSION) return -1;
+    hdr->magic = PROTO_MAGIC;
+    hdr->flags = ntohs(hdr->flags);
+    hdr->status = ntohs(hdr->status);
+    hdr->request_id = ntohl(hdr->request_id);
+    hdr->length = be64toh(hdr->length);
+    return 0;
+}
+
+// Receive the REPLY to a request and its payload as a NUL-terminated string. Frames left
+// over from an earlier request that timed out are recognised by their id and skipped.
+int recv_reply(int sock, uint32_t request_id, struct frame_hdr *hdr, char *buffer, size_t size) {
+    while (1) {
+        if (recv_frame(sock, hdr) < 0) return -1;
+        if (hdr->request_id == request_id) break;
+        uint64_t remaining = hdr->length;
+        while (remaining > 0) {
+            size_t to_receive = remaining < size ? remaining : size;
+            ssize_t bytes = recv(sock, buffer, to_receive, 0);
+            if (bytes <= 0) return -1;
+            remaining -= bytes;
+        }
+    }
+    if (hdr->opcode != OP_REPLY || hdr->length >= size) return -1;
+    if (receive_full(sock, buffer, hdr->length) < 0) return -1;
+    buffer[hdr->length] = '\0';
+    return 0;
+}
+
+// Receive DATA frames up to the last one, writing their content to fd from offset with
+// pwrite() (fd -1 discards it). Deflated frames are inflated as they arrive. Progress is
+// printed as it goes, or with done, only counted there. Returns the byte count of the
+// content, or -1 if the connection failed; a deflate stream that does not inflate stops
+// the count.
+long long recv_body(int sock, int fd, uint64_t offset, uint64_t file_size, uint64_t *done) {
+    char buffer[RECV_CHUNK];
+    unsigned char plain[2 * RECV_CHUNK];
+    long long total_received = 0;
+    z_stream strm = {0};
+    int inflating = 0, corrupt = 0;
+    struct frame_hdr hdr;
+    do {
+        if (recv_frame(sock, &hdr) < 0 || hdr.opcode != OP_DATA) {
+            if (inflating) inflateEnd(&strm);
+            return -1;
+        }
+        if ((hdr.flags & FL_DEFLATE) && !inflating) {
+            if (inflateInit2(&strm, -15) == Z_OK) inflating = 1;
+            else corrupt = 1;
+        }
+        uint64_t remaining = hdr.length;
+        while (remaining > 0) {
+            size_t to_receive = remaining < RECV_CHUNK ? remaining : RECV_CHUNK;
+            ssize_t bytes = recv(sock, buffer, to_receive, 0);
+            if (bytes <= 0) {
+                if (!done) printf("Client: Receive error after %lld bytes\n", total_received);
+                if (inflating) inflateEnd(&strm);
+                return -1;
+            }
+            remaining -= bytes;
+            if (!(hdr.flags & FL_DEFLATE)) {
+                if (fd >= 0 && pwrite(fd, buffer, bytes, offset + total_received) != bytes) corrupt = 1;
+                if (!corrupt) total_received += bytes;
+            } else if (!corrupt) {
+                strm.next_in = (unsigned char *)buffer;
+                strm.avail_in = bytes;
+                do {
+                    strm.next_out = plain;
+                    strm.avail_out = sizeof(plain);
+                    int ret = inflate(&strm, Z_NO_FLUSH);
+                    size_t len = sizeof(plain) - strm.avail_out;
+                    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                        printf("Client: Corrupt compressed data after %lld bytes\n", total_received);
+                        corrupt = 1;
+                        break;
+                    }
+                    if (fd >= 0 && pwrite(fd, plain, len, offset + total_received) != (ssize_t)len) {
+                        corrupt = 1;
+                        break;
+                    }
+                    total_received += len;
+                } while (strm.avail_out == 0);
+            }
+            if (done) *done = total_received;
+            else if (fd >= 0) printf("Client: Received %zd bytes, total %lld/%lu\n", bytes, total_received, file_size);
+        }
+    } while (hdr.flags & FL_MORE);
+    if (inflating) inflateEnd(&strm);
+    return total_received;
+}
+
+// Whether a file is worth compressing in transit; types stored compressed would
+// only cost CPU on both ends
+int compressible_type(const char *name) {
+    static const char *const stored_compressed[] = {".zip", ".pdf", ".gz", ".tgz", ".bz2", ".xz", ".7z", ".jpg", ".png", NULL};
+    const char *ext = strrchr(name, '.');
+    if (!ext) return 1;
+    for (int i = 0; stored_compressed[i]; i++)
+        if (strcmp(ext, stored_compressed[i]) == 0) return 0;
+    return 1;
+}
+
+// Send the next size bytes of fp (fewer if it ends first) as a deflated body: one raw
+// deflate stream, sent in DATA frames as each TRANSFER_CHUNK of output fills. Returns the
+// compressed bytes sent, or -1 if the file or the connection failed mid-stream and the
+// connection is unusable.
+long long send_deflated_body(int sock, FILE *fp, uint64_t size, uint32_t request_id) {
+    unsigned char *in = malloc(TRANSFER_CHUNK), *out = malloc(TRANSFER_CHUNK);
+    z_stream strm = {0};
+    if (!in || !out || deflateInit2(&strm, TRANSFER_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(in);
+        free(out);
+        return -1;
+    }
+    long long sent = 0;
+    int flush = Z_NO_FLUSH;
+    strm.next_out = out;
+    strm.avail_out = TRANSFER_CHUNK;
+    while (sent >= 0 && flush != Z_FINISH) {
+        size_t bytes = fread(in, 1, size < TRANSFER_CHUNK ? size : TRANSFER_CHUNK, fp);
+        size -= bytes;
+        if (bytes == 0 && ferror(fp)) {
+            sent = -1;
+            break;
+        }
+        flush = bytes == 0 ? Z_FINISH : Z_NO_FLUSH;
+        strm.next_in = in;
+        strm.avail_in = bytes;
+        int ret;
+        do {
+            ret = deflate(&strm, flush);
+            // A full buffer goes out with more to follow; the stream's end goes out last
+            if (strm.avail_out == 0 || ret == Z_STREAM_END) {
+                size_t len = TRANSFER_CHUNK - strm.avail_out;
+                uint16_t flags = FL_DEFLATE | (ret == Z_STREAM_END ? 0 : FL_MORE);
+                if (send_frame(sock, OP_DATA, flags, request_id, NULL, len) < 0 || send_all(sock, out, len) < 0) {
+                    sent = -1;
+                    break;
+                }
+                sent += len;
+                strm.next_out = out;
+                strm.avail_out = TRANSFER_CHUNK;
+            }
+        } while (strm.avail_in > 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+    }
+    deflateEnd(&strm);
+    free(in);
+    free(out);
+    return sent;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+void sha256_init(struct sha256_ctx *ctx) {
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->fill = 0;
+}
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// Run the SHA-256 compression function over count 64-byte blocks, with the SHA extensions
+// where the CPU has them
+void sha256_blocks(uint32_t *state, const unsigned char *data, size_t count) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+        sha256_blocks_shani(state, data, count);
+        return;
+    }
+#endif
+    sha256_blocks_portable(state, data, count);
+}
+
+void sha256_blocks_portable(uint32_t *state, const unsigned char *data, size_t count) {
+    for (; count > 0; count--, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)data[4 * i] << 24 | (uint32_t)data[4 * i + 1] << 16 | (uint32_t)data[4 * i + 2] << 8 | data[4 * i + 3];
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+            uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// SHA-256 compression with the x86 SHA extensions: each sha256rnds2 runs two rounds, and
+// sha256msg1/sha256msg2 extend the message schedule four words at a time. The state is
+// held as the ABEF and CDGH halves the instructions work on.
+__attribute__((target("sha,sse4.1")))
+void sha256_blocks_shani(uint32_t *state, const unsigned char *data, size_t count) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);  // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);  // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);  // CDGH
+    for (; count > 0; count--, data += 64) {
+        __m128i abef = state0, cdgh = state1, msg[4];
+        // Unrolled, so that msg stays in registers
+#pragma GCC unroll 16
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * i)), byte_swap);
+            __m128i words = _mm_add_epi32(msg[i % 4], _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, words);
+            // The words four groups ahead are due once this group's are known
+            if (i >= 3 && i < 15) {
+                __m128i next = _mm_add_epi32(msg[(i + 1) % 4], _mm_alignr_epi8(msg[i % 4], msg[(i + 3) % 4], 4));
+                msg[(i + 1) % 4] = _mm_sha256msg2_epu32(next, msg[i % 4]);
+            }
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(words, 0x0e));
+            if (i >= 1 && i < 13) msg[(i + 3) % 4] = _mm_sha256msg1_epu32(msg[(i + 3) % 4], msg[i % 4]);
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+    tmp = _mm_shuffle_epi32(state0, 0x1b);  // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1);  // DCHG
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));  // DCBA
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));  // HGFE
+}
+#endif
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t length) {
+    const unsigned char *p = data;
+    ctx->length += length;
+    if (ctx->fill > 0) {
+        size_t take = 64 - ctx->fill < length ? 64 - ctx->fill : length;
+        memcpy(ctx->block + ctx->fill, p, take);
+        ctx->fill += take;
+        p += take;
+        length -= take;
+        if (ctx->fill < 64) return;
+        sha256_blocks(ctx->state, ctx->block, 1);
+        ctx->fill = 0;
+    }
+    if (length >= 64) {
+        sha256_blocks(ctx->state, p, length / 64);
+        p += length / 64 * 64;
+        length %= 64;
+    }
+    memcpy(ctx->block, p, length);
+    ctx->fill = length;
+}
+
+void sha256_final(struct sha256_ctx *ctx, unsigned char *digest) {
+    uint64_t bits = ctx->length * 8;
+    unsigned char pad[64] = {0x80};
+    sha256_update(ctx, pad, (ctx->fill < 56 ? 56 : 120) - ctx->fill);
+    for (int i = 0; i < 8; i++) pad[i] = bits >> (56 - 8 * i);
+    sha256_update(ctx, pad, 8);
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = ctx->state[i] >> 24;
+        digest[4 * i + 1] = ctx->state[i] >> 16;
+        digest[4 * i + 2] = ctx->state[i] >> 8;
+        digest[4 * i + 3] = ctx->state[i];
+    }
+}
+
+// Write a digest as lowercase hex, NUL-terminated
+void digest_hex(const unsigned char *digest, char *hex) {
+    for (int i = 0; i < SHA256_LEN; i++) sprintf(hex + 2 * i, "%02x", digest[i]);
+}